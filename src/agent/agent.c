@@ -31,6 +31,7 @@
 /* agent communication */
 #include "agent_private.h"
 #include "request.h"
+#include "daemon.h"
 
 /* libotp header */
 #include "ppp.h"
@@ -206,6 +207,78 @@ int do_verify_config(const char *agent_bin)
 }
 
 
+/* Convert global text database into the indexed format.
+ * Like the config checks it's available only to root. */
+int do_convert_db(void)
+{
+	int ret;
+	cfg_t *cfg = NULL;
+
+	printf(_("Converting global state database into indexed format\n"));
+
+	ret = ppp_init(PRINT_STDOUT, NULL);
+	if (ret != 0) {
+		printf(_("ERROR: ppp_init: %s\n"), ppp_get_error_desc(ret));
+		ppp_fini();
+		return 1;
+	}
+	print_config(PRINT_STDOUT | PRINT_NOTICE);
+
+	/* Will succeed, as ppp_init suceeded */
+	cfg = cfg_get();
+
+	ret = ppp_db_convert();
+	if (ret != 0) {
+		printf(_("ERROR: Conversion failed: %s\n"), ppp_get_error_desc(ret));
+		ppp_fini();
+		return 2;
+	}
+
+	printf(_("Database converted. Previous one was saved as %s.old\n"),
+	       cfg->global_db_path);
+
+	ppp_fini();
+	return 0;
+}
+
+/* Initialize libotp with agent logging */
+static int agent_ppp_init(void)
+{
+	int ret;
+#if DEBUG
+#warning OTPasswd Agent compiled with DEBUG option. Will leave DEBUG info in /tmp/OTPAGENT_TESTLOG
+	ret = ppp_init(0, "/tmp/OTPAGENT_TESTLOG");
+	/* Notices of a session are written together */
+	if (ret == 0 && print_buffer(4096) != 0)
+		print(PRINT_WARN, "Unable to allocate log buffer\n");
+#else
+	ret = ppp_init(PRINT_SYSLOG, NULL);
+#endif
+	if (ret == 0)
+		print_config(PRINT_NOTICE);
+	return ret;
+}
+
+/* Run agent as a daemon serving clients through unix socket.
+ * Config is read only once, each client is served by a fork. */
+int do_daemon(const char *socket_path)
+{
+	int ret;
+
+	ret = agent_ppp_init();
+	if (ret != 0) {
+		printf(_("ERROR: ppp_init: %s\n"), ppp_get_error_desc(ret));
+		ppp_fini();
+		return 1;
+	}
+
+	printf(_("Starting agent daemon on %s\n"), socket_path);
+	ret = daemon_run(socket_path);
+
+	ppp_fini();
+	return ret;
+}
+
 /* Testcase function should be run only if we're not 
  * a SUID program or when we are run by root.
  * Also we should be connected to the terminal and
@@ -254,6 +327,11 @@ int do_testcase(int fast)
 	if (tmp)
 		printf("******\n*** %d config testcases failed\n******\n", tmp);
 
+	tmp = print_testcase();
+	failed += tmp;
+	if (tmp)
+		printf("******\n*** %d logging testcases failed\n******\n", tmp);
+
 	tmp = spass_testcase();
 	failed += tmp;
 	if (tmp)
@@ -265,6 +343,51 @@ int do_testcase(int fast)
 	if (tmp)
 		printf("******\n*** %d state testcases failed\n******\n", tmp);
 
+	tmp = db_entry_testcase(fast);
+	failed += tmp;
+	if (tmp)
+		printf("******\n*** %d db entry testcases failed\n******\n", tmp);
+
+	tmp = db_index_testcase();
+	failed += tmp;
+	if (tmp)
+		printf("******\n*** %d indexed db testcases failed\n******\n", tmp);
+
+	tmp = wal_testcase();
+	failed += tmp;
+	if (tmp)
+		printf("******\n*** %d write-ahead log testcases failed\n******\n", tmp);
+
+	tmp = sync_testcase();
+	failed += tmp;
+	if (tmp)
+		printf("******\n*** %d database flush testcases failed\n******\n", tmp);
+
+	tmp = bulk_testcase();
+	failed += tmp;
+	if (tmp)
+		printf("******\n*** %d bulk transfer testcases failed\n******\n", tmp);
+
+	tmp = trace_testcase();
+	failed += tmp;
+	if (tmp)
+		printf("******\n*** %d tracing testcases failed\n******\n", tmp);
+
+	tmp = agent_frame_testcase();
+	failed += tmp;
+	if (tmp)
+		printf("******\n*** %d agent frame testcases failed\n******\n", tmp);
+
+	tmp = daemon_testcase();
+	failed += tmp;
+	if (tmp)
+		printf("******\n*** %d agent daemon testcases failed\n******\n", tmp);
+
+	tmp = commit_testcase();
+	failed += tmp;
+	if (tmp)
+		printf("******\n*** %d group commit testcases failed\n******\n", tmp);
+
 	tmp = crypto_testcase();
 	failed += tmp;
 	if (tmp)
@@ -351,75 +474,15 @@ end:
 	return ret;
 }
 
-int main(int argc, char **argv)
+/* Serve a client connected either through pipes (agent started by the
+ * client) or through a daemon socket. Initializes user, privileges
+ * and, if requested, libotp */
+int agent_session(agent *a, int init)
 {
 	int ret, error_desc = 0;
 	char *username = NULL;
-	agent *a = NULL;
 	cfg_t *cfg = NULL;
 
-	/* 1) Init safe environment, store current uids, etc. */
-	security_init();
-
-	if (security_is_tty_detached() == 0 || argc > 1) {
-		/* We have stdout */
-		/* Check if we should run testcases. */
-		if (argc >= 2 && strcmp(argv[1], "--testcase") == 0) {
-			if (security_is_suid() == 0 || security_is_privileged()) {
-				int fast = 0;
-				/* Support --fast for valgrind.
-				 * Statistical tests will fail then, but will get run
-				 */
-				if (argc == 3 && strcmp(argv[2], "--fast") == 0) {
-					fast = 1;
-				}
-
-				/* We're not suid or we are root already */
-				return do_testcase(fast);
-			}
-		}
-
-		if (argc == 2 && strcmp(argv[1], "--check-config") == 0) {
-			if (!security_is_suid() || security_is_privileged()) {
-				/* We're not suid or we are root already */
-				return do_verify_config(argv[0]);
-			}
-		}
-
-		printf("FATAL: This program should not be used like this.\n"
-		       "Use appropriate interface instead (like otpasswd).\n\n");
-
-		if (!security_is_suid()) {
-			printf("Since this program is not SUID you can run\n"
-			       "a set of testcases with --testcase option and check\n"
-			       "config file propriety with --check-config\n");
-		} else {
-			if (security_is_privileged()) {
-				printf("Since you're running this program as root you can\n"
-				       "run a set of testcases with --check option and check\n"
-				       "config file propriety with --check-config\n");
-
-			} else {
-				printf("Since this program is SUID-root only root can run it's\n"
-				       "internal testcases or validate configuration file.\n");
-			}
-		}
-		exit(EXIT_FAILURE);
-	}
-
-	/* After this point we:
-	 * a) Have no controlling terminal. 
-	 * b) Can be SUID root (run by root or normal user)
-	 */
-
-	/* Initialize agent struct so we can sent information
-	 * about initialization errors */
-	ret = agent_server(&a);
-	if (ret != AGENT_OK) {
-		print(PRINT_ERROR, "Unable to start agent server: %s\n", agent_strerror(ret));
-		return 1;
-	}
-
 	/* This will allocate username */
 	username = security_get_calling_user();
 	if (!username) {
@@ -442,23 +505,20 @@ int main(int argc, char **argv)
 	/***
 	 * Initialization
 	 * Now, try to read config file, init printing, ppp etc.
+	 * Daemon has done it already.
 	 ***/
-#if DEBUG
-#warning OTPasswd Agent compiled with DEBUG option. Will leave DEBUG info in /tmp/OTPAGENT_TESTLOG
-	ret = ppp_init(0, "/tmp/OTPAGENT_TESTLOG");
-#else
-	ret = ppp_init(PRINT_SYSLOG, NULL);
-#endif
-	if (ret != 0) {
-		print(PRINT_ERROR, ppp_get_error_desc(ret));
-		print(PRINT_ERROR, "OTPasswd not correctly installed.\n");
-		print(PRINT_ERROR, "Consult installation manual for detailed information.\n");
+	if (init) {
+		ret = agent_ppp_init();
+		if (ret != 0) {
+			print(PRINT_ERROR, ppp_get_error_desc(ret));
+			print(PRINT_ERROR, "OTPasswd not correctly installed.\n");
+			print(PRINT_ERROR, "Consult installation manual for detailed information.\n");
 
-		error_desc = ret;
-		ret = AGENT_ERR_INIT_CONFIGURATION;
-		goto init_error;
+			error_desc = ret;
+			ret = AGENT_ERR_INIT_CONFIGURATION;
+			goto init_error;
+		}
 	}
-	print_config(PRINT_NOTICE);
 
 	/* Will succeed, as ppp_init suceeded */
 	cfg = cfg_get();
@@ -504,7 +564,11 @@ int main(int argc, char **argv)
 	}
 
 	/* Agent loop */
-	return main_loop(a);
+	ret = main_loop(a);
+
+	/* Session ends with exit */
+	print_flush();
+	return ret;
 
 
 init_error:
@@ -522,3 +586,93 @@ init_error:
 	ppp_fini();
 	return 1;
 }
+
+int main(int argc, char **argv)
+{
+	int ret;
+	agent *a = NULL;
+
+	/* 1) Init safe environment, store current uids, etc. */
+	security_init();
+
+	if (security_is_tty_detached() == 0 || argc > 1) {
+		/* We have stdout */
+		/* Check if we should run testcases. */
+		if (argc >= 2 && strcmp(argv[1], "--testcase") == 0) {
+			if (security_is_suid() == 0 || security_is_privileged()) {
+				int fast = 0;
+				/* Support --fast for valgrind.
+				 * Statistical tests will fail then, but will get run
+				 */
+				if (argc == 3 && strcmp(argv[2], "--fast") == 0) {
+					fast = 1;
+				}
+
+				/* We're not suid or we are root already */
+				return do_testcase(fast);
+			}
+		}
+
+		if (argc == 2 && strcmp(argv[1], "--check-config") == 0) {
+			if (!security_is_suid() || security_is_privileged()) {
+				/* We're not suid or we are root already */
+				return do_verify_config(argv[0]);
+			}
+		}
+
+		if (argc >= 2 && argc <= 3 && strcmp(argv[1], "--daemon") == 0) {
+			if (security_is_privileged()) {
+				/* Daemon serves all users, must be run by root */
+				return do_daemon(argc == 3 ? argv[2] : AGENT_SOCKET_PATH);
+			}
+		}
+
+		if (argc == 2 && strcmp(argv[1], "--convert-db") == 0) {
+			if (security_is_privileged()) {
+				/* Only root can touch the global database */
+				return do_convert_db();
+			}
+		}
+
+		printf("FATAL: This program should not be used like this.\n"
+		       "Use appropriate interface instead (like otpasswd).\n\n");
+
+		if (!security_is_suid()) {
+			printf("Since this program is not SUID you can run\n"
+			       "a set of testcases with --testcase option and check\n"
+			       "config file propriety with --check-config\n"
+			       "Root can convert global database into indexed\n"
+			       "format with --convert-db and run agent as a daemon\n"
+			       "with --daemon [socket]\n");
+		} else {
+			if (security_is_privileged()) {
+				printf("Since you're running this program as root you can\n"
+				       "run a set of testcases with --check option and check\n"
+				       "config file propriety with --check-config\n"
+				       "Global database can be converted into indexed\n"
+				       "format with --convert-db and agent can be run\n"
+				       "as a daemon with --daemon [socket]\n");
+
+			} else {
+				printf("Since this program is SUID-root only root can run it's\n"
+				       "internal testcases or validate configuration file.\n");
+			}
+		}
+		exit(EXIT_FAILURE);
+	}
+
+	/* After this point we:
+	 * a) Have no controlling terminal. 
+	 * b) Can be SUID root (run by root or normal user)
+	 */
+
+	/* Initialize agent struct so we can sent information
+	 * about initialization errors */
+	ret = agent_server(&a);
+	if (ret != AGENT_OK) {
+		print(PRINT_ERROR, "Unable to start agent server: %s\n", agent_strerror(ret));
+		return 1;
+	}
+
+	return agent_session(a, 1);
+}
@@ -22,6 +22,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "ppp.h" /* Error handling mostly */
@@ -95,6 +97,157 @@ static int _get_agent_executable(const char *agent, const char **agent_path)
 	return AGENT_ERR_INIT_EXECUTABLE;
 }
 
+/* Read message sent by server to indicate correct initialization
+ * or any initialization problems. */
+static int _agent_handshake(agent *a, const char *agent_executable)
+{
+	int ret;
+
+	ret = agent_wait(a);
+	if (ret == 2) {
+		ret = AGENT_ERR_SERVER_INIT;
+		print(PRINT_MESSAGE, _("Error while waiting for agent intitial frame.\n"));
+		return ret;
+	} else if (ret != 0) {
+		ret = AGENT_ERR_SERVER_INIT;
+		print(PRINT_MESSAGE, _("Timeout while waiting for agent initialization frame.\n"));
+		print(PRINT_MESSAGE, _("Possible cause of this problem involves wrong agent executable passed in configuration file.\n"));
+		print(PRINT_MESSAGE, _("Try manually running agent executable to see where's the problem.\n"));		
+		print(PRINT_MESSAGE, _("If you would want to send a bug report remember about gdb backtrace\n"));		
+		print(PRINT_MESSAGE, _("and log created with strace: strace -f -o otpasswd_log <command you've tried>\n"));
+		return ret;
+	} else {
+		ret = agent_hdr_recv(a);
+		if (ret != 0) {
+			/* This is an error visible when agent dies without being able
+			 * to send any information back. Wrong executable etc.
+			 */
+			int status = 0;
+			print(PRINT_ERROR, _("Error while reading initial data from agent: %s\n"), agent_strerror(ret));
+
+			if (a->pid > 0 && waitpid(a->pid, &status, WNOHANG) == a->pid) {
+				print(PRINT_ERROR, _("Unable to start agent executable: %s\n"), agent_executable);
+				if (WIFEXITED(status)) {
+					int stat = WEXITSTATUS(status);
+					print(PRINT_ERROR, _("Agent return value is: %d\n"), stat);
+				}
+			}
+
+			print(PRINT_MESSAGE, _("Agent started but didn't sent any valid information back..\n"));
+			print(PRINT_MESSAGE, _("Possible cause of this problem involves use of the wrong agent executable.\n"));
+			print(PRINT_MESSAGE, _("Try manually running agent executable to see where's the problem.\n"));		
+			print(PRINT_MESSAGE, _("If you would want to send a bug report remember about gdb backtrace\n"));		
+			print(PRINT_MESSAGE, _("and log created with strace: strace -f -o otpasswd_log <command you've tried>\n"));
+			return ret;
+		}
+
+		
+		if (a->rhdr.type != AGENT_REQ_INIT) {
+			print(PRINT_ERROR, _("Agent: Initial frame parsing error.\n"));
+			print(PRINT_NOTICE, _("Agent: Header type equals %d instead of %d.\n"), a->rhdr.type, AGENT_REQ_INIT);
+			ret = AGENT_ERR_SERVER_INIT;
+			return ret;
+		}
+
+		ret = a->rhdr.status;
+		if (ret == AGENT_ERR_INIT_EMERGENCY) {
+			/* execl failed, we can show errno */
+			print(PRINT_MESSAGE, _("There was an error when trying to run agent executable (%s)\n"), agent_executable);
+			print(PRINT_MESSAGE, _("Check your installation and configuration.\n"));
+			print(PRINT_MESSAGE, _("Probable cause: %s\n"), strerror(a->rhdr.int_arg));
+			ret = AGENT_ERR_SERVER_INIT;
+			return ret;
+		} else if (ret == AGENT_ERR_INIT_CONFIGURATION) {
+			print(PRINT_MESSAGE, _("Agent detected configuration problem: %s\n"), 
+			      agent_strerror(a->rhdr.int_arg));
+			print(PRINT_MESSAGE, _("Try running agent (agent_otp) with --check-config option to get more details\n"));
+			return ret;
+		} else if (ret == AGENT_ERR_INIT_PRIVILEGES) {
+			print(PRINT_MESSAGE, _("Configuration problem was detected:\n"));
+			print(PRINT_MESSAGE, _("DB=global option is set in config file but agent executable (agent_otp)\n"));
+			print(PRINT_MESSAGE, _("doesn't have necessary SUID-root permissions.\n"));
+			return ret;
+		} else if (ret != 0) {
+			print(PRINT_ERROR, _("Agent failed to initialize correctly: %s\n"), agent_strerror(ret));
+			return ret;
+		}
+	}
+
+	return AGENT_OK;
+}
+
+int agent_connect_socket(agent **a_out, const char *socket_path)
+{
+	struct sockaddr_un addr;
+	uid_t peer_uid;
+	gid_t peer_gid;
+	int fd;
+	int ret;
+	agent *a;
+	*a_out = NULL;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		return AGENT_ERR_REQ_ARG;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		print_perror(PRINT_NOTICE, "Unable to create agent socket");
+		return AGENT_ERR_NO_DAEMON;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		print(PRINT_NOTICE, "No agent daemon at %s\n", socket_path);
+		close(fd);
+		return AGENT_ERR_NO_DAEMON;
+	}
+
+	/* Anyone able to create the socket could pretend to be agent */
+	if (agent_peer_cred(fd, &peer_uid, &peer_gid) != 0 || peer_uid != 0) {
+		print(PRINT_ERROR, _("Agent daemon at %s is not run by root.\n"), socket_path);
+		close(fd);
+		return AGENT_ERR_SERVER_INIT;
+	}
+
+	a = malloc(sizeof(*a));
+	if (!a) {
+		close(fd);
+		return AGENT_ERR_MEMORY;
+	}
+	memset(a, 0, sizeof(*a));
+
+	a->error = 0;
+	a->shdr.protocol_version = AGENT_PROTOCOL_VERSION;
+	a->s = NULL;
+	a->new_state = 0;
+
+	/* No child process to look after */
+	a->pid = 0;
+
+	/* Both directions use the socket; each end is closed separately */
+	a->in = fd;
+	a->out = dup(fd);
+	if (a->out == -1) {
+		close(fd);
+		free(a);
+		return AGENT_ERR_MEMORY;
+	}
+
+	ret = _agent_handshake(a, socket_path);
+	if (ret != AGENT_OK) {
+		close(a->in);
+		close(a->out);
+		free(a);
+		return ret;
+	}
+
+	*a_out = a;
+	return AGENT_OK;
+}
+
 int agent_connect(agent **a_out, const char *agent_executable)
 {
 	int ret = 1;
@@ -107,6 +260,13 @@ int agent_connect(agent **a_out, const char *agent_executable)
 	agent *a;
 	*a_out = NULL;
 
+	/* Running daemon saves us from starting a new agent */
+	if (agent_executable == NULL) {
+		ret = agent_connect_socket(a_out, AGENT_SOCKET_PATH);
+		if (ret != AGENT_ERR_NO_DAEMON)
+			return ret;
+	}
+
 	/* Allocate memory */
 	a = malloc(sizeof(*a));
 	if (!a)
@@ -216,77 +376,9 @@ int agent_connect(agent **a_out, const char *agent_executable)
 	 * Generally we should be able to die on SIGPIPE safely.
 	 */
 
-	/* Read message sent by server to indicate correct initialization
-	 * or any initialization problems */
-	ret = agent_wait(a);
-	if (ret == 2) {
-		ret = AGENT_ERR_SERVER_INIT;
-		print(PRINT_MESSAGE, _("Error while waiting for agent intitial frame.\n"));
-		goto cleanup1;
-	} else if (ret != 0) {
-		ret = AGENT_ERR_SERVER_INIT;
-		print(PRINT_MESSAGE, _("Timeout while waiting for agent initialization frame.\n"));
-		print(PRINT_MESSAGE, _("Possible cause of this problem involves wrong agent executable passed in configuration file.\n"));
-		print(PRINT_MESSAGE, _("Try manually running agent executable to see where's the problem.\n"));		
-		print(PRINT_MESSAGE, _("If you would want to send a bug report remember about gdb backtrace\n"));		
-		print(PRINT_MESSAGE, _("and log created with strace: strace -f -o otpasswd_log <command you've tried>\n"));
+	ret = _agent_handshake(a, agent_executable);
+	if (ret != AGENT_OK)
 		goto cleanup1;
-	} else {
-		ret = agent_hdr_recv(a);
-		if (ret != 0) {
-			/* This is an error visible when agent dies without being able
-			 * to send any information back. Wrong executable etc.
-			 */
-			int status = 0;
-			print(PRINT_ERROR, _("Error while reading initial data from agent: %s\n"), agent_strerror(ret));
-
-			if (waitpid(a->pid, &status, WNOHANG) == a->pid) {
-				print(PRINT_ERROR, _("Unable to start agent executable: %s\n"), agent_executable);
-				if (WIFEXITED(status)) {
-					int stat = WEXITSTATUS(status);
-					print(PRINT_ERROR, _("Agent return value is: %d\n"), stat);
-				}
-			}
-
-			print(PRINT_MESSAGE, _("Agent started but didn't sent any valid information back..\n"));
-			print(PRINT_MESSAGE, _("Possible cause of this problem involves use of the wrong agent executable.\n"));
-			print(PRINT_MESSAGE, _("Try manually running agent executable to see where's the problem.\n"));		
-			print(PRINT_MESSAGE, _("If you would want to send a bug report remember about gdb backtrace\n"));		
-			print(PRINT_MESSAGE, _("and log created with strace: strace -f -o otpasswd_log <command you've tried>\n"));
-			goto cleanup1;
-		}
-
-		
-		if (a->rhdr.type != AGENT_REQ_INIT) {
-			print(PRINT_ERROR, _("Agent: Initial frame parsing error.\n"));
-			print(PRINT_NOTICE, _("Agent: Header type equals %d instead of %d.\n"), a->rhdr.type, AGENT_REQ_INIT);
-			ret = AGENT_ERR_SERVER_INIT;
-			goto cleanup1;
-		}
-
-		ret = a->rhdr.status;
-		if (ret == AGENT_ERR_INIT_EMERGENCY) {
-			/* execl failed, we can show errno */
-			print(PRINT_MESSAGE, _("There was an error when trying to run agent executable (%s)\n"), agent_executable);
-			print(PRINT_MESSAGE, _("Check your installation and configuration.\n"));
-			print(PRINT_MESSAGE, _("Probable cause: %s\n"), strerror(a->rhdr.int_arg));
-			ret = AGENT_ERR_SERVER_INIT;
-			goto cleanup1;
-		} else if (ret == AGENT_ERR_INIT_CONFIGURATION) {
-			print(PRINT_MESSAGE, _("Agent detected configuration problem: %s\n"), 
-			      agent_strerror(a->rhdr.int_arg));
-			print(PRINT_MESSAGE, _("Try running agent (agent_otp) with --check-config option to get more details\n"));
-			goto cleanup1;
-		} else if (ret == AGENT_ERR_INIT_PRIVILEGES) {
-			print(PRINT_MESSAGE, _("Configuration problem was detected:\n"));
-			print(PRINT_MESSAGE, _("DB=global option is set in config file but agent executable (agent_otp)\n"));
-			print(PRINT_MESSAGE, _("doesn't have necessary SUID-root permissions.\n"));
-			goto cleanup1;
-		} else if (ret != 0) {
-			print(PRINT_ERROR, _("Agent failed to initialize correctly: %s\n"), agent_strerror(ret));
-			goto cleanup1;
-		}
-	}
 
 	*a_out = a;
 	return AGENT_OK;
@@ -318,6 +410,7 @@ int agent_server(agent **a_out)
 	a->shdr.protocol_version = AGENT_PROTOCOL_VERSION;
 	a->s = NULL;
 	a->new_state = 0;
+	a->import = NULL;
 
 	a->in = 0;
 	a->out = 1;
@@ -385,10 +478,20 @@ int agent_disconnect(agent *a)
 	if (a->username)
 		free(a->username);
 
+	if (a->data_buff) {
+		memset(a->data_buff, 0, a->data_buff_size);
+		free(a->data_buff);
+	}
+
 	if (a->s) {
 		ppp_state_fini(a->s);
 	}
 
+	/* Unfinished import leaves database untouched */
+	if (a->import) {
+		ppp_db_import_abort(a->import);
+	}
+
 	/* Free memory */
 	memset(a, 0, sizeof(*a));
 	free(a);
@@ -449,6 +552,9 @@ const char *agent_strerror(int error)
 	case AGENT_ERR_NO_STATE:
 		return _("Coding error: Action requires created/read state.");
 
+	case AGENT_ERR_NO_DAEMON:
+		return _("Agent daemon is not running.");
+
 	default:
 		if (agent_is_agent_error(error))
 			return _( ppp_get_error_desc(error) );
@@ -772,6 +878,135 @@ int agent_get_passcode(agent *a, const num_t counter, char *reply)
 	return ret;
 }
 
+int agent_get_passcodes(agent *a, const num_t counter, int count, char *reply)
+{
+	int ret;
+	int code_length, i;
+	size_t length;
+	const char *data = NULL;
+	assert(reply != NULL);
+
+	agent_hdr_init(a, 0);
+	agent_hdr_set_num(a, &counter);
+	agent_hdr_set_int(a, count, 0);
+
+	ret = agent_query(a, AGENT_REQ_GET_PASSCODES);
+	if (ret != AGENT_OK)
+		return ret;
+
+	code_length = agent_hdr_get_arg_int2(a);
+	data = agent_hdr_get_arg_data(a, &length);
+	if (agent_hdr_get_arg_int(a) != count ||
+	    code_length <= 0 || code_length > 16 ||
+	    length != (size_t)count * code_length) {
+		print(PRINT_ERROR, "Illegal passcodes reply received from agent\n");
+		return AGENT_ERR;
+	}
+
+	for (i = 0; i < count; i++) {
+		char *passcode = reply + i * 17;
+		memcpy(passcode, data + i * code_length, code_length);
+		passcode[code_length] = '\0';
+	}
+
+	agent_hdr_sanitize(a);
+	memset(&a->rhdr, 0, sizeof(a->rhdr));
+	return AGENT_OK;
+}
+
+int agent_state_export(agent *a, int all, FILE *out, unsigned long *entries)
+{
+	int ret;
+	int write_error = 0;
+	const char *data;
+	size_t length;
+	assert(out != NULL && entries != NULL);
+
+	*entries = 0;
+
+	agent_hdr_init(a, 0);
+	agent_hdr_set_int(a, all ? AGENT_BULK_ALL : 0, 0);
+
+	ret = agent_query(a, AGENT_REQ_STATE_EXPORT);
+
+	/* Whole database comes in a series of replies; all of them
+	 * are read even if output fails */
+	while (ret == AGENT_OK) {
+		data = agent_hdr_get_arg_data(a, &length);
+		if (!write_error && length > 0 &&
+		    fwrite(data, 1, length, out) != length) {
+			print_perror(PRINT_ERROR, _("Error while writing exported state"));
+			write_error = 1;
+		}
+		*entries += agent_hdr_get_arg_int(a);
+
+		if (!agent_hdr_get_arg_int2(a))
+			break;
+
+		ret = agent_hdr_recv(a);
+		if (ret != 0) {
+			a->error = 1;
+			break;
+		}
+		ret = a->rhdr.status;
+	}
+
+	agent_hdr_sanitize(a);
+	memset(&a->rhdr, 0, sizeof(a->rhdr));
+
+	if (ret == AGENT_OK && write_error)
+		ret = AGENT_ERR;
+	return ret;
+}
+
+int agent_state_import(agent *a, int all, FILE *in, unsigned long *entries)
+{
+	int ret;
+	int more;
+	char *buff;
+	size_t length;
+	assert(in != NULL && entries != NULL);
+
+	*entries = 0;
+
+	buff = malloc(AGENT_BULK_CHUNK);
+	if (!buff)
+		return AGENT_ERR_MEMORY;
+
+	do {
+		length = fread(buff, 1, AGENT_BULK_CHUNK, in);
+		if (ferror(in)) {
+			/* Agent drops unfinished import on disconnect */
+			print_perror(PRINT_ERROR, _("Error while reading imported state"));
+			ret = AGENT_ERR;
+			break;
+		}
+		more = !feof(in);
+
+		if (!all && more) {
+			print(PRINT_ERROR, _("Imported state is too long\n"));
+			ret = AGENT_ERR_REQ_ARG;
+			break;
+		}
+
+		agent_hdr_init(a, 0);
+		agent_hdr_set_int(a, all ? AGENT_BULK_ALL : 0, more);
+		ret = agent_hdr_set_data(a, buff, length);
+		assert(ret == AGENT_OK);
+
+		ret = agent_query(a, AGENT_REQ_STATE_IMPORT);
+	} while (ret == AGENT_OK && more);
+
+	if (ret == AGENT_OK)
+		*entries = agent_hdr_get_arg_int(a);
+
+	memset(buff, 0, AGENT_BULK_CHUNK);
+	free(buff);
+	agent_hdr_sanitize(a);
+	memset(&a->rhdr, 0, sizeof(a->rhdr));
+	return ret;
+}
+
 int agent_get_prompt(agent *a, const num_t counter, char **reply)
 {
 	int ret;
@@ -23,6 +23,8 @@
 #ifndef _AGENT_INTERFACE_H_
 #define _AGENT_INTERFACE_H_
 
+#include <stdio.h> /* FILE */
+
 #include "num.h"
 
 #ifndef AGENT_INTERNAL
@@ -72,6 +74,10 @@ enum AGENT_ERROR {
 	AGENT_ERR_MUST_CREATE_STATE,
 	AGENT_ERR_MUST_DROP_STATE,
 	AGENT_ERR_NO_STATE,
+
+	/*** Connection ***/
+	/* No agent daemon listens on the socket */
+	AGENT_ERR_NO_DAEMON,
 };
 
 /** Check if given number is an STATE/PPP/AGENT error
@@ -94,7 +100,8 @@ static inline int agent_is_agent_error(int error)
 
 /** Connect to agent through the given executable.
  *
- * @param agent_executable can be NULL, defaults will be checked
+ * @param agent_executable can be NULL, then running agent daemon
+ * is used if there is one and defaults are checked otherwise.
  */
 extern int agent_connect(agent **a_out, const char *agent_executable);
 
@@ -187,6 +194,11 @@ extern int agent_get_prompt(agent *a, const num_t counter, char **reply);
 /** Query for single passcode */
 extern int agent_get_passcode(agent *a, num_t counter, char *reply); 
 
+/** Query for 'count' consecutive passcodes with a single request.
+ * Reply must have place for count * 17 bytes; i-th passcode is
+ * stored as a string at reply + i * 17. */
+extern int agent_get_passcodes(agent *a, num_t counter, int count, char *reply);
+
 /** Try to authenticate */
 extern int agent_authenticate(agent *a, const char *passcode); 
 
@@ -198,4 +210,15 @@ extern int agent_update_latest_card(agent *a, const num_t latest_card);
 
 /** Clear recent failures from state */
 extern int agent_clear_recent_failures(agent *a);
+
+/*** State transfer ***/
+/** Write state as a line of the text database into 'out'. With 'all'
+ * set whole global database is exported instead (administrator only).
+ * Number of written entries is stored in 'entries'. */
+extern int agent_state_export(agent *a, int all, FILE *out, unsigned long *entries);
+
+/** Import state exported with agent_state_export from 'in'. Without
+ * 'all' input must hold a single entry of the current user. With 'all'
+ * whole global database is replaced; nothing is changed on error. */
+extern int agent_state_import(agent *a, int all, FILE *in, unsigned long *entries);
 #endif
@@ -1,7 +1,33 @@
+#if OS_LINUX
+/* for struct ucred */
+#define _GNU_SOURCE
+#endif
+
 #include "agent_private.h"
 
+#include <errno.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+
+int agent_peer_cred(int fd, uid_t *uid, gid_t *gid)
+{
+#if OS_LINUX
+	struct ucred cred;
+	socklen_t length = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0 ||
+	    length != sizeof(cred))
+		return AGENT_ERR;
+	*uid = cred.uid;
+	*gid = cred.gid;
+	return AGENT_OK;
+#else
+	if (getpeereid(fd, uid, gid) != 0)
+		return AGENT_ERR;
+	return AGENT_OK;
+#endif
+}
 
 int agent_wait(agent *a)
 {
@@ -56,6 +82,16 @@ static int agent_read(const int fd, void *data, size_t len)
 			return AGENT_OK;
 		}
 
+		/* Large arguments are read directly */
+		if (len >= sizeof(buff)) {
+			const ssize_t ret = read(fd, data_pos, len);
+			if (ret <= 0)
+				return AGENT_ERR_DISCONNECT;
+			len -= ret;
+			data_pos += ret;
+			continue;
+		}
+
 		/* Need some more; buffered is empty now */
 		buff_pos = buff;
 		buffered = read(fd, buff, sizeof(buff));
@@ -64,46 +100,67 @@ static int agent_read(const int fd, void *data, size_t len)
 		}
 
 		if (buffered < 0) {
+			buffered = 0;
 			return AGENT_ERR_DISCONNECT;
 		}
 	}
 }
 
 /* Will either fail or complete successfully returning 0 */
-static int agent_write(const int fd, const void *buf, const size_t len)
+static int agent_write(const int fd, const void *buf, size_t len)
 {
+	const char *pos = buf;
 	ssize_t ret;
-	ret = write(fd, buf, len);
-	if (ret == -1) {
-		/* Probably errno == EPIPE. That is - second
-		 * end disconnected */
-		return AGENT_ERR_DISCONNECT;
+
+	/* Large arguments might not fit into pipe at once */
+	while (len > 0) {
+		ret = write(fd, pos, len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			/* Probably errno == EPIPE. That is - second
+			 * end disconnected */
+			return AGENT_ERR_DISCONNECT;
+		}
+		pos += ret;
+		len -= ret;
 	}
-	assert((size_t)ret == len);
-	if ((size_t)ret != len)
-		return 1;
 	return AGENT_OK;
 }
 
-#define _send(field)	  \
+/* Size of frame without the argument */
+#define FRAME_MAX (sizeof(uint32_t) + 2 * sizeof(uint8_t) + 3 * sizeof(int32_t) \
+                   + sizeof(num_t) + sizeof(uint32_t))
+
+#define _put(value)	  \
 	do { \
-		ret = agent_write(fd, &a->shdr.field, sizeof(a->shdr.field)); \
-		if (ret != AGENT_OK) \
-			return ret; \
-	} while (0);
+		memcpy(pos, &(value), sizeof(value)); \
+		pos += sizeof(value); \
+	} while (0)
 
-#define _recv(field)	  \
+#define _get(value)	  \
 	do { \
-		ret = agent_read(fd, &a->rhdr.field, sizeof(a->rhdr.field)); \
-		if (ret != AGENT_OK) \
-			return ret; \
-	} while (0);
+		memcpy(&(value), pos, sizeof(value)); \
+		pos += sizeof(value); \
+	} while (0)
 
 int agent_hdr_send(const agent *a) 
 {
 	const int fd = a->out;
 	int ret = 1;
 
+	const struct agent_header *hdr = &a->shdr;
+	char frame[FRAME_MAX + AGENT_ARG_MAX];
+	char *pos = frame;
+	const char *arg;
+	uint8_t flags = 0;
+	const uint32_t version = hdr->protocol_version;
+	const uint8_t type = hdr->type;
+	const int32_t status = hdr->status;
+	const int32_t int_arg = hdr->int_arg;
+	const int32_t int_arg2 = hdr->int_arg2;
+	const uint32_t arg_len = hdr->arg_len;
+
 	/* Make sure we haven't locked state when using pipes */
 	if (a->s && ppp_is_locked(a->s)) {
 		print(PRINT_ERROR, "It's locked!\n");
@@ -111,19 +168,67 @@ int agent_hdr_send(const agent *a)
 	}
 	assert(!a->s || !ppp_is_locked(a->s));
 
+	assert(hdr->type >= 0 && hdr->type <= UINT8_MAX);
+	assert(hdr->arg_len <= AGENT_DATA_MAX);
+
+	if (hdr->status)
+		flags |= AGENT_FRAME_STATUS;
+	if (hdr->int_arg)
+		flags |= AGENT_FRAME_INT;
+	if (hdr->int_arg2)
+		flags |= AGENT_FRAME_INT2;
+	if (hdr->num_arg.hi || hdr->num_arg.lo)
+		flags |= AGENT_FRAME_NUM;
+	if (hdr->arg_len)
+		flags |= AGENT_FRAME_ARG;
+
+	_put(version);
+	_put(type);
+	_put(flags);
+	if (flags & AGENT_FRAME_STATUS)
+		_put(status);
+	if (flags & AGENT_FRAME_INT)
+		_put(int_arg);
+	if (flags & AGENT_FRAME_INT2)
+		_put(int_arg2);
+	if (flags & AGENT_FRAME_NUM)
+		_put(hdr->num_arg);
+	if (flags & AGENT_FRAME_ARG)
+		_put(arg_len);
+
+	arg = hdr->data ? hdr->data : hdr->str_arg;
+	if (hdr->arg_len < AGENT_ARG_MAX) {
+		/* Whole frame written at once */
+		memcpy(pos, arg, hdr->arg_len);
+		pos += hdr->arg_len;
+		ret = agent_write(fd, frame, pos - frame);
+	} else {
+		ret = agent_write(fd, frame, pos - frame);
+		if (ret == AGENT_OK)
+			ret = agent_write(fd, arg, hdr->arg_len);
+	}
 
-	_send(protocol_version);
-	_send(type);
-	_send(status);
-	_send(int_arg);
-	_send(int_arg2);
-	_send(num_arg);
+	memset(frame, 0, sizeof(frame));
+	return ret;
+}
 
-	ret = agent_write(fd, a->shdr.str_arg, sizeof(a->shdr.str_arg));
-	if (ret != 0) {
-		return ret;
-	}
+/* Make sure data buffer can hold a received argument */
+static int _data_buff_reserve(agent *a, size_t length)
+{
+	char *buff;
+	if (length <= a->data_buff_size)
+		return AGENT_OK;
 
+	buff = malloc(length);
+	if (!buff)
+		return AGENT_ERR_MEMORY;
+
+	if (a->data_buff) {
+		memset(a->data_buff, 0, a->data_buff_size);
+		free(a->data_buff);
+	}
+	a->data_buff = buff;
+	a->data_buff_size = length;
 	return AGENT_OK;
 }
 
@@ -132,6 +237,15 @@ int agent_hdr_recv(agent *a)
 	const int fd = a->in;
 	int ret = 1;
 
+	struct agent_header *hdr = &a->rhdr;
+	char frame[FRAME_MAX];
+	const char *pos = frame;
+	size_t length;
+	uint32_t version;
+	uint8_t type, flags;
+	int32_t value;
+	uint32_t arg_len = 0;
+
 	/* Make sure we haven't locked state when using pipes */
 	if (a->s && ppp_is_locked(a->s)) {
 		print(PRINT_ERROR, "It's locked!\n");
@@ -140,26 +254,82 @@ int agent_hdr_recv(agent *a)
 
 	assert(!a->s || !ppp_is_locked(a->s));
 
-	_recv(protocol_version);
-	_recv(type);
-	_recv(status);
-	_recv(int_arg);
-	_recv(int_arg2);
-	_recv(num_arg);
+	length = sizeof(version) + sizeof(type) + sizeof(flags);
+	ret = agent_read(fd, frame, length);
+	if (ret != AGENT_OK)
+		return ret;
 
-	ret = agent_read(fd, a->rhdr.str_arg, sizeof(a->rhdr.str_arg));
-	if (ret != AGENT_OK) {
+	_get(version);
+	_get(type);
+	_get(flags);
+
+	if (version != AGENT_PROTOCOL_VERSION) {
+		print(PRINT_ERROR, "Protocol mismatch detected (%u != %u)\n", 
+		      version, AGENT_PROTOCOL_VERSION);
+		return AGENT_ERR_PROTOCOL_MISMATCH;
+	}
+
+	/* Read rest of fixed part */
+	length = 0;
+	if (flags & AGENT_FRAME_STATUS)
+		length += sizeof(int32_t);
+	if (flags & AGENT_FRAME_INT)
+		length += sizeof(int32_t);
+	if (flags & AGENT_FRAME_INT2)
+		length += sizeof(int32_t);
+	if (flags & AGENT_FRAME_NUM)
+		length += sizeof(num_t);
+	if (flags & AGENT_FRAME_ARG)
+		length += sizeof(uint32_t);
+
+	pos = frame;
+	ret = agent_read(fd, frame, length);
+	if (ret != AGENT_OK)
 		return ret;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->protocol_version = version;
+	hdr->type = type;
+	if (flags & AGENT_FRAME_STATUS) {
+		_get(value);
+		hdr->status = value;
 	}
+	if (flags & AGENT_FRAME_INT) {
+		_get(value);
+		hdr->int_arg = value;
+	}
+	if (flags & AGENT_FRAME_INT2) {
+		_get(value);
+		hdr->int_arg2 = value;
+	}
+	if (flags & AGENT_FRAME_NUM)
+		_get(hdr->num_arg);
+	if (flags & AGENT_FRAME_ARG)
+		_get(arg_len);
 
-	if (a->rhdr.protocol_version != AGENT_PROTOCOL_VERSION) {
-		print(PRINT_ERROR, "Protocol mismatch detected (%u != %u)\n", 
-		      a->rhdr.protocol_version, AGENT_PROTOCOL_VERSION);
+	if (arg_len > AGENT_DATA_MAX) {
+		print(PRINT_ERROR, "Argument too large (%u bytes)\n", arg_len);
 		return AGENT_ERR_PROTOCOL_MISMATCH;
 	}
-	return AGENT_OK;
+
+	hdr->arg_len = arg_len;
+	if (arg_len < AGENT_ARG_MAX) {
+		/* Remains null-terminated */
+		ret = agent_read(fd, hdr->str_arg, arg_len);
+	} else {
+		ret = _data_buff_reserve(a, arg_len);
+		if (ret != AGENT_OK)
+			return ret;
+		ret = agent_read(fd, a->data_buff, arg_len);
+		hdr->data = a->data_buff;
+	}
+
+	return ret;
 }
 
+#undef _put
+#undef _get
+
 void agent_hdr_init(agent *a, int status)
 {
 	a->shdr.protocol_version = AGENT_PROTOCOL_VERSION;
@@ -168,11 +338,15 @@ void agent_hdr_init(agent *a, int status)
 	a->shdr.int_arg = a->shdr.int_arg2 = 0;
 	a->shdr.num_arg = num_i(0);
 	memset(a->shdr.str_arg, 0, sizeof(a->shdr.str_arg));
+	a->shdr.arg_len = 0;
+	a->shdr.data = NULL;
 }
 
 void agent_hdr_sanitize(agent *a)
 {
 	agent_hdr_init(a, 0);
+	if (a->data_buff)
+		memset(a->data_buff, 0, a->data_buff_size);
 }
 
 void agent_hdr_set_num(agent *a, const num_t *num_arg)
@@ -196,9 +370,12 @@ int agent_hdr_set_str(agent *a, const char *str_arg)
 		if (length >= sizeof(a->shdr.str_arg))
 			return 1;
 		strncpy(a->shdr.str_arg, str_arg, sizeof(a->shdr.str_arg) - 1);
+		a->shdr.arg_len = length;
 	} else {
 		memset(a->shdr.str_arg, 0, sizeof(a->shdr.str_arg));
+		a->shdr.arg_len = 0;
 	}
+	a->shdr.data = NULL;
 
 	return AGENT_OK;
 }
@@ -211,11 +388,28 @@ int agent_hdr_set_bin_str(agent *a, const char *str_arg, size_t length)
 		if (length >= sizeof(a->shdr.str_arg))
 			return 1;
 		memcpy(a->shdr.str_arg, str_arg, length);
+		a->shdr.arg_len = length;
 	} else {
 		memset(a->shdr.str_arg, 0, sizeof(a->shdr.str_arg));
+		a->shdr.arg_len = 0;
 	}
-	
+	a->shdr.data = NULL;
+
+	return AGENT_OK;
+}
+
+int agent_hdr_set_data(agent *a, const char *data, size_t length)
+{
+	assert(length <= AGENT_DATA_MAX);
+	if (length > AGENT_DATA_MAX)
+		return 1;
+
+	/* Small arguments go inside the header */
+	if (length < sizeof(a->shdr.str_arg))
+		return agent_hdr_set_bin_str(a, data, length);
 
+	a->shdr.data = data;
+	a->shdr.arg_len = length;
 	return AGENT_OK;
 }
 
@@ -26,7 +26,10 @@
 #define AGENT_INTERNAL 1
 
 #define AGENT_PATH "otpagent"
-#define AGENT_PROTOCOL_VERSION (0xDEAD0000U | 0x00U)
+
+/* Socket of the agent daemon (agent_otp --daemon) */
+#define AGENT_SOCKET_PATH "/var/run/otpagent.sock"
+#define AGENT_PROTOCOL_VERSION (0xDEAD0000U | 0x01U)
 
 #include <unistd.h>
 #include <sys/types.h> /* pid_t etc. */
@@ -121,6 +124,29 @@ enum AGENT_REQUEST {
 	/** Clear recent failures */
 	AGENT_REQ_CLEAR_RECENT_FAILURES,
 
+	/** Get number of consecutive passcodes at once.
+	 * Args: num_arg - first counter, int_arg - count.
+	 * Reply: int_arg passcodes of int_arg2 length packed
+	 * into the data argument.
+	 */
+	AGENT_REQ_GET_PASSCODES,
+
+	/** Export state as lines of the text database.
+	 * Args: int_arg - AGENT_BULK_ALL exports whole global database.
+	 * Reply: int_arg entries packed into the data argument. Whole
+	 * database is sent in a series of replies of up to AGENT_BULK_CHUNK
+	 * bytes; int_arg2 is non-zero while more replies follow.
+	 */
+	AGENT_REQ_STATE_EXPORT,
+
+	/** Import state from lines of the text database in data argument.
+	 * Args: int_arg - AGENT_BULK_ALL replaces whole global database
+	 * with entries sent in a series of requests; int_arg2 is non-zero
+	 * while more requests follow. Otherwise data holds a single entry.
+	 * Reply: int_arg - imported entries, after the last request.
+	 */
+	AGENT_REQ_STATE_IMPORT,
+
 };
 
 
@@ -130,6 +156,33 @@ enum AGENT_REQUEST {
  */
 #define AGENT_ARG_MAX 255
 
+/* Maximal size of data argument; larger arguments
+ * than AGENT_ARG_MAX are not kept in the header */
+#define AGENT_DATA_MAX (1024 * 1024)
+
+/* Maximal number of passcodes sent in reply to a single request */
+#define AGENT_PASSCODES_MAX 1000
+
+/* Export/import of the whole database */
+#define AGENT_BULK_ALL 1
+
+/* Maximal amount of entries transferred in a single header */
+#define AGENT_BULK_CHUNK (256 * 1024)
+
+/* Header is transferred as a frame containing only fields which are set:
+ *   u32 protocol_version, u8 type, u8 frame flags,
+ *   [i32 status] [i32 int_arg] [i32 int_arg2] [num_t num_arg]
+ *   [u32 length, argument data]
+ * Missing fields are received as zeroes.
+ */
+enum AGENT_FRAME_FLAGS {
+	AGENT_FRAME_STATUS = 1,
+	AGENT_FRAME_INT = 2,
+	AGENT_FRAME_INT2 = 4,
+	AGENT_FRAME_NUM = 8,
+	AGENT_FRAME_ARG = 16,
+};
+
 struct agent_header {
 	/* Ensures both executables are having the same
 	 * version */
@@ -155,6 +208,13 @@ struct agent_header {
 	 * passwords, contact/label, alphabet reply (under 128 chars)
 	 */
 	char str_arg[AGENT_ARG_MAX];
+
+	/* Length of the binary argument held in str_arg or data */
+	size_t arg_len;
+
+	/* Argument too large for str_arg. When sending it points to
+	 * caller memory, when receiving to agent data buffer */
+	const char *data;
 };
 
 
@@ -174,6 +234,10 @@ typedef struct {
 	/** Recv header */
 	struct agent_header rhdr;
 
+	/** Buffer for received data arguments */
+	char *data_buff;
+	size_t data_buff_size;
+
 	/** Username owning state; used only if ran by privileged user */
 	char *username;
 
@@ -184,6 +248,9 @@ typedef struct {
 	 * Currently only freshly generated key can be
 	 * stored here */
 	state *s;
+
+	/** Import of the whole database in progress */
+	struct db_bulk *import;
 } agent;
 
 /***
@@ -193,6 +260,12 @@ typedef struct {
 /** Configure agent interface to run as server */
 extern int agent_server(agent **a_out);
 
+/** Connect to agent daemon listening on a given socket */
+extern int agent_connect_socket(agent **a_out, const char *socket_path);
+
+/** Read UID/GID of the process on the other end of unix socket */
+extern int agent_peer_cred(int fd, uid_t *uid, gid_t *gid);
+
 /** Prepares header for sending. */
 extern void agent_hdr_init(agent *a, int status);
 /** Clear all data from header */
@@ -205,6 +278,9 @@ extern void agent_hdr_set_int(agent *a, int int_arg, int int_arg2);
 extern int agent_hdr_set_str(agent *a, const char *str_arg);
 /** Like agent_hdr_set_str but allows \x00 bytes inside str */
 extern int agent_hdr_set_bin_str(agent *a, const char *str_arg, size_t length);
+/** Sets argument of up to AGENT_DATA_MAX bytes; data must be kept
+ * valid until header is sent */
+extern int agent_hdr_set_data(agent *a, const char *data, size_t length);
 
 
 /** Send header to the agent */
@@ -266,6 +342,12 @@ static inline const char *agent_hdr_get_arg_str(const agent *a) {
 	return a->rhdr.str_arg;
 }
 
+/** Data argument getter */
+static inline const char *agent_hdr_get_arg_data(const agent *a, size_t *length) {
+	*length = a->rhdr.arg_len;
+	return a->rhdr.data ? a->rhdr.data : a->rhdr.str_arg;
+}
+
 
 /* Now include also public interface */
 #include "agent_interface.h"
@@ -0,0 +1,293 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ **********************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "commit.h"
+#include "ppp.h"
+#include "db.h"
+#include "config.h"
+#include "print.h"
+
+/*
+ * Each session forked by the daemon gets one end of a socket pair.
+ * Session sends a whole entry line (or a username to remove) and waits
+ * for an int status. It can't send another update before getting the
+ * reply, so the daemon keeps at most one update per session. Updates
+ * arriving while a batch is written wait in socket buffers and form
+ * the next batch.
+ */
+
+typedef struct {
+	int fd;		/* Daemon end of the channel, -1 when closed */
+	int pending;	/* Update received and not yet confirmed */
+	char update[STATE_ENTRY_SIZE + 1];
+} commit_client;
+
+static commit_client *_clients = NULL;
+static int _clients_count = 0;
+static int _clients_size = 0;
+
+/* Poll set, one entry more than clients for listening socket */
+static struct pollfd *_fds = NULL;
+
+int commit_channel(void)
+{
+	commit_client *c;
+	struct pollfd *fds;
+	int sv[2];
+
+	if (_clients_count == _clients_size) {
+		const int size = _clients_size ? _clients_size * 2 : 16;
+
+		c = realloc(_clients, size * sizeof(*c));
+		if (!c)
+			goto nomem;
+		_clients = c;
+
+		fds = realloc(_fds, (size + 1) * sizeof(*fds));
+		if (!fds)
+			goto nomem;
+		_fds = fds;
+
+		_clients_size = size;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) != 0) {
+		print_perror(PRINT_ERROR, "Unable to create committer channel");
+		return -1;
+	}
+
+	c = &_clients[_clients_count++];
+	c->fd = sv[0];
+	c->pending = 0;
+	return sv[1];
+
+nomem:
+	print(PRINT_ERROR, "Not enough memory for committer channel\n");
+	return -1;
+}
+
+void commit_session(int fd)
+{
+	int i;
+
+	for (i = 0; i < _clients_count; i++) {
+		if (_clients[i].fd != -1)
+			close(_clients[i].fd);
+	}
+	free(_clients);
+	free(_fds);
+	_clients = NULL;
+	_fds = NULL;
+	_clients_count = _clients_size = 0;
+
+	db_file_set_committer(fd);
+}
+
+/* Milliseconds since some unspecified point */
+static long long _commit_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Poll timeout for a deadline; -1 deadline never passes */
+static int _commit_timeout(long long deadline)
+{
+	long long now;
+
+	if (deadline < 0)
+		return -1;
+
+	now = _commit_now();
+	return now < deadline ? (int) (deadline - now) : 0;
+}
+
+static int _commit_pending(void)
+{
+	int i, pending = 0;
+	for (i = 0; i < _clients_count; i++)
+		pending += _clients[i].pending;
+	return pending;
+}
+
+/* Read an update. Session which disconnected is dropped */
+static void _commit_receive(commit_client *c)
+{
+	ssize_t ret;
+
+	do {
+		ret = recv(c->fd, c->update, sizeof(c->update) - 1, 0);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret <= 0) {
+		close(c->fd);
+		c->fd = -1;
+		return;
+	}
+
+	/* Too long update is rejected by db_file_commit */
+	c->update[ret] = '\0';
+	c->pending = 1;
+}
+
+/* Wait for updates of sessions without one pending. Returns number
+ * of ready descriptors or -1 on error. */
+static int _commit_poll(int listen_fd, int timeout, int *listening)
+{
+	int i, j, ret;
+
+	/* Forget closed sessions */
+	for (i = j = 0; i < _clients_count; i++) {
+		if (_clients[i].fd != -1)
+			_clients[j++] = _clients[i];
+	}
+	_clients_count = j;
+
+	if (_fds == NULL) {
+		_fds = malloc(sizeof(*_fds));
+		if (!_fds) {
+			print(PRINT_ERROR, "Not enough memory for committer\n");
+			return -1;
+		}
+	}
+
+	_fds[0].fd = listen_fd;
+	_fds[0].events = POLLIN;
+	_fds[0].revents = 0;
+	for (i = 0; i < _clients_count; i++) {
+		/* Negative descriptors are ignored by poll */
+		_fds[i + 1].fd = _clients[i].pending ? -1 : _clients[i].fd;
+		_fds[i + 1].events = POLLIN;
+		_fds[i + 1].revents = 0;
+	}
+
+	ret = poll(_fds, _clients_count + 1, timeout);
+	if (ret == -1) {
+		if (errno == EINTR)
+			return 0;
+		print_perror(PRINT_ERROR, "Error while waiting for state updates");
+		return -1;
+	}
+
+	for (i = 0; i < _clients_count; i++) {
+		if (_fds[i + 1].revents)
+			_commit_receive(&_clients[i]);
+	}
+
+	if (listening)
+		*listening = (_fds[0].revents & POLLIN) != 0;
+	return ret;
+}
+
+/* Write all pending updates and confirm them */
+static void _commit_batch(void)
+{
+	cfg_t *cfg = cfg_get();
+	char **updates;
+	char *update;
+	long long started;
+	db_sync_stats sync = *db_file_sync_stats();
+	int32_t status;
+	int count = 0;
+	int i;
+
+	started = _commit_now();
+
+	updates = malloc(_clients_count * sizeof(*updates));
+	if (updates) {
+		for (i = 0; i < _clients_count; i++) {
+			if (_clients[i].pending)
+				updates[count++] = _clients[i].update;
+		}
+		status = db_file_commit(cfg->global_db_path, updates, count);
+		free(updates);
+	} else {
+		status = STATE_NOMEM;
+	}
+
+	if (status == 0) {
+		print(PRINT_NOTICE, "Committed %d state updates in %lld ms "
+		      "(%lu flushes took %llu us)\n",
+		      count, _commit_now() - started,
+		      db_file_sync_stats()->syncs + db_file_sync_stats()->dir_syncs -
+		      sync.syncs - sync.dir_syncs,
+		      db_file_sync_stats()->sync_us - sync.sync_us);
+	}
+
+	for (i = 0; i < _clients_count; i++) {
+		commit_client *c = &_clients[i];
+		int32_t ret = status;
+		if (!c->pending)
+			continue;
+
+		/* Don't fail the whole batch because of one bad update */
+		if (ret != 0 && count > 1) {
+			update = c->update;
+			ret = db_file_commit(cfg->global_db_path, &update, 1);
+		}
+
+		/* Session which went away is dropped on next poll */
+		(void) send(c->fd, &ret, sizeof(ret), MSG_NOSIGNAL);
+
+		memset(c->update, 0, sizeof(c->update));
+		c->pending = 0;
+	}
+}
+
+int commit_serve(int listen_fd, int timeout)
+{
+	const long long deadline = timeout >= 0 ? _commit_now() + timeout : -1;
+	cfg_t *cfg = cfg_get();
+	long long batch;
+	int listening = 0;
+
+	for (;;) {
+		if (_commit_poll(listen_fd, _commit_timeout(deadline), &listening) == -1)
+			return -1;
+
+		if (_commit_pending() && cfg->group_commit_delay > 0) {
+			/* Let other sessions join the batch */
+			batch = _commit_now() + cfg->group_commit_delay;
+			while (_commit_pending() < _clients_count &&
+			       _commit_now() < batch) {
+				if (_commit_poll(-1, _commit_timeout(batch), NULL) == -1)
+					return -1;
+			}
+		}
+
+		if (_commit_pending())
+			_commit_batch();
+
+		if (listening)
+			return 1;
+
+		if (deadline >= 0 && _commit_now() >= deadline)
+			return 0;
+	}
+}
@@ -0,0 +1,40 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Group commit of global database updates sent by daemon sessions.
+ **********************************************************************/
+
+#ifndef _COMMIT_H_
+#define _COMMIT_H_
+
+/** Create a channel for a session about to be forked. Returns
+ * descriptor of the session end or -1 on error; daemon closes it
+ * after fork like the client socket. */
+extern int commit_channel(void);
+
+/** Called in the forked session. Drops channels of other sessions
+ * and sends database updates through the given one. */
+extern void commit_session(int fd);
+
+/** Write updates sent by sessions until listen_fd is readable or
+ * timeout (in ms, -1 = infinite) passes. Negative listen_fd is
+ * ignored. Returns 1 if listen_fd is readable, 0 on timeout and
+ * -1 on error. */
+extern int commit_serve(int listen_fd, int timeout);
+
+#endif
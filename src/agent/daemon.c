@@ -0,0 +1,228 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "commit.h"
+#include "security.h"
+#include "config.h"
+#include "print.h"
+
+/* Create listening socket. Stale socket left by previous
+ * daemon is removed, other files are left alone. */
+static int _daemon_listen(const char *socket_path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		print(PRINT_ERROR, "Agent socket path too long: %s\n", socket_path);
+		return -1;
+	}
+
+	if (lstat(socket_path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			print(PRINT_ERROR, "%s exists and is not a socket\n", socket_path);
+			return -1;
+		}
+		(void) unlink(socket_path);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		print_perror(PRINT_ERROR, "Unable to create agent socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		print_perror(PRINT_ERROR, "Unable to bind agent socket %s", socket_path);
+		goto error;
+	}
+
+	/* Every user can connect; peers are identified by SO_PEERCRED */
+	if (chmod(socket_path, 0666) != 0) {
+		print_perror(PRINT_ERROR, "Unable to set agent socket permissions");
+		goto error;
+	}
+
+	if (listen(fd, 64) != 0) {
+		print_perror(PRINT_ERROR, "Unable to listen on agent socket");
+		goto error;
+	}
+
+	return fd;
+
+error:
+	close(fd);
+	(void) unlink(socket_path);
+	return -1;
+}
+
+/* Runs in forked process; handles single client */
+static int _daemon_session(int fd, uid_t uid, gid_t gid)
+{
+	cfg_t *cfg = cfg_get();
+	struct timeval tv;
+	agent *a = NULL;
+	int ret;
+
+	security_set_peer(uid, gid);
+
+	/* Client which stops talking to us ends its session */
+	tv.tv_sec = cfg->daemon_timeout;
+	tv.tv_usec = 0;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0) {
+		print_perror(PRINT_ERROR, "Unable to set client socket timeout");
+		close(fd);
+		return 1;
+	}
+
+	ret = agent_server(&a);
+	if (ret != AGENT_OK) {
+		print(PRINT_ERROR, "Unable to start agent server: %s\n", agent_strerror(ret));
+		close(fd);
+		return 1;
+	}
+
+	a->in = fd;
+	a->out = dup(fd);
+	if (a->out == -1) {
+		print_perror(PRINT_ERROR, "Unable to duplicate client socket");
+		(void) agent_disconnect(a);
+		return 1;
+	}
+
+	return agent_session(a, 0);
+}
+
+int daemon_run(const char *socket_path)
+{
+	cfg_t *cfg = cfg_get();
+	int listen_fd, fd, ret, channel = -1;
+	int group_commit;
+	int sessions = 0;
+	uid_t uid;
+	gid_t gid;
+	pid_t pid;
+
+	if (!security_is_privileged()) {
+		print(PRINT_ERROR, "Agent daemon must be run by root.\n");
+		return 1;
+	}
+
+	listen_fd = _daemon_listen(socket_path);
+	if (listen_fd == -1)
+		return 1;
+
+	/* Sessions are counted and reaped by the loop below, so their
+	 * exit can't be ignored. Disconnected clients should only break
+	 * their own session. */
+	(void) signal(SIGCHLD, SIG_DFL);
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	print(PRINT_NOTICE, "Agent daemon listening on %s\n", socket_path);
+
+	/* Daemon writes the global database for its sessions */
+	group_commit = cfg->group_commit == CONFIG_ENABLED &&
+		cfg->db == CONFIG_DB_GLOBAL &&
+		cfg->db_format == CONFIG_DB_FORMAT_TEXT;
+	if (group_commit)
+		print(PRINT_NOTICE, "Group commit of state updates enabled\n");
+
+	for (;;) {
+		if (group_commit && commit_serve(listen_fd, -1) != 1)
+			break;
+
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			print_perror(PRINT_ERROR, "Error while accepting agent client");
+			break;
+		}
+
+		/* Count sessions which are still running */
+		while (sessions > 0 && waitpid(-1, NULL, WNOHANG) > 0)
+			sessions--;
+
+		if (sessions >= cfg->daemon_sessions) {
+			print(PRINT_WARN, "Too many agent sessions; client refused\n");
+			close(fd);
+			continue;
+		}
+
+		if (agent_peer_cred(fd, &uid, &gid) != AGENT_OK) {
+			print(PRINT_ERROR, "Unable to identify agent client\n");
+			close(fd);
+			continue;
+		}
+
+		if (group_commit) {
+			channel = commit_channel();
+			if (channel == -1) {
+				close(fd);
+				continue;
+			}
+		}
+
+		/* Don't let sessions repeat buffered output */
+		print_flush();
+		fflush(NULL);
+
+		pid = fork();
+		if (pid == 0) {
+			close(listen_fd);
+			if (group_commit)
+				commit_session(channel);
+			ret = _daemon_session(fd, uid, gid);
+			print_flush();
+			exit(ret);
+		}
+
+		if (pid == -1)
+			print_perror(PRINT_ERROR, "Unable to fork agent session");
+		else
+			sessions++;
+		if (group_commit)
+			close(channel);
+		close(fd);
+	}
+
+	close(listen_fd);
+	(void) unlink(socket_path);
+	return 1;
+}
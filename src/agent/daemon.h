@@ -0,0 +1,35 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Long-lived agent serving clients connecting through unix socket.
+ **********************************************************************/
+
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+#include "agent_private.h"
+
+/** Listen on a socket and serve each client in a forked process.
+ * Returns only on error. */
+extern int daemon_run(const char *socket_path);
+
+/** Serve a single connected client; implemented in agent.c.
+ * If init is true, libotp is initialized first. */
+extern int agent_session(agent *a, int init);
+
+#endif
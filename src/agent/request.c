@@ -16,6 +16,8 @@
  * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
  **********************************************************************/
 
+#include <limits.h> /* INT_MAX */
+
 #include "agent_private.h"
 #include "security.h"
 
@@ -191,6 +193,194 @@ static int _state_fini_atomical(agent *a, int prev_ret)
 	}
 }
 
+/* Send 'count' passcodes starting with 'counter' packed
+ * in a single data argument */
+static int _send_passcodes(agent *a, num_t counter, int count)
+{
+	char *buff;
+	unsigned int code_length;
+	int i, ret;
+
+	ret = ppp_get_int(a->s, PPP_FIELD_CODE_LENGTH, &code_length);
+	if (ret != 0 || code_length == 0 || code_length > 16)
+		return _send_reply(a, AGENT_ERR);
+
+	buff = malloc(count * 17);
+	if (!buff)
+		return _send_reply(a, AGENT_ERR_MEMORY);
+
+	ret = ppp_get_passcodes(a->s, counter, count, buff);
+	if (ret != 0)
+		goto cleanup;
+
+	/* Pack passcodes in place; they are shorter than 17 */
+	for (i = 1; i < count; i++)
+		memmove(buff + i * code_length, buff + i * 17, code_length);
+
+	agent_hdr_init(a, 0);
+	agent_hdr_set_int(a, count, code_length);
+	ret = agent_hdr_set_data(a, buff, count * code_length);
+	assert(ret == AGENT_OK);
+
+cleanup:
+	ret = _send_reply(a, ret);
+
+	memset(buff, 0, count * 17);
+	free(buff);
+	agent_hdr_sanitize(a);
+	return ret;
+}
+
+/* Entries of exported database collected for a single reply */
+typedef struct {
+	agent *a;
+	char *buff;
+	size_t length;
+	int entries;
+} _export_chunk;
+
+/* Send collected entries; replies with 'more' set are followed
+ * by another one, the last carries status of the export */
+static int _export_send(_export_chunk *c, int status, int more)
+{
+	int ret;
+
+	agent_hdr_init(c->a, 0);
+	agent_hdr_set_int(c->a, c->entries, more);
+	ret = agent_hdr_set_data(c->a, c->buff, c->length);
+	assert(ret == AGENT_OK);
+
+	ret = _send_reply(c->a, status);
+	agent_hdr_sanitize(c->a);
+
+	memset(c->buff, 0, c->length);
+	c->length = 0;
+	c->entries = 0;
+	return ret;
+}
+
+static int _export_entry(void *arg, const char *entry, size_t length)
+{
+	_export_chunk *c = arg;
+	int ret;
+
+	if (c->length + length > AGENT_BULK_CHUNK) {
+		ret = _export_send(c, AGENT_OK, 1);
+		if (ret != 0)
+			return ret;
+	}
+
+	memcpy(c->buff + c->length, entry, length);
+	c->length += length;
+	c->entries++;
+	return 0;
+}
+
+/* Send whole database in a series of replies */
+static int _send_export(agent *a)
+{
+	_export_chunk c = { a, NULL, 0, 0 };
+	int ret;
+
+	c.buff = malloc(AGENT_BULK_CHUNK);
+	if (!c.buff)
+		return _send_reply(a, AGENT_ERR_MEMORY);
+
+	ret = ppp_db_export(_export_entry, &c);
+	if (ret != 0) {
+		print(PRINT_ERROR, "Error while exporting database: %s\n",
+		      agent_strerror(ret));
+		memset(c.buff, 0, c.length);
+		c.length = 0;
+		c.entries = 0;
+	}
+	ret = _export_send(&c, ret, 0);
+
+	free(c.buff);
+	return ret;
+}
+
+/* Pass entries of a single request to the database import */
+static int _receive_import(agent *a, int more)
+{
+	unsigned long entries = 0;
+	const char *data;
+	size_t length;
+	int ret = AGENT_OK;
+
+	data = agent_hdr_get_arg_data(a, &length);
+
+	if (!a->import)
+		ret = ppp_db_import_start(&a->import);
+
+	if (ret == 0 && length > 0)
+		ret = ppp_db_import(a->import, data, length);
+
+	if (ret == 0 && !more) {
+		ret = ppp_db_import_finish(a->import, &entries);
+		a->import = NULL;
+	}
+
+	if (ret != 0) {
+		print(PRINT_ERROR, "Error while importing database: %s\n",
+		      agent_strerror(ret));
+		if (a->import) {
+			ppp_db_import_abort(a->import);
+			a->import = NULL;
+		}
+	}
+
+	agent_hdr_sanitize(a);
+	agent_hdr_set_int(a, entries > INT_MAX ? INT_MAX : (int) entries, 0);
+	return _send_reply(a, ret);
+}
+
+/* Validate if user doesn't already have a disabled state
+ * before his state is replaced by a new one */
+static int _verify_state_replace(agent *a, const cfg_t *cfg)
+{
+	int ret;
+
+	ret = _state_init(a, _LOAD);
+	if (ret != 0) {
+		print(PRINT_NOTICE, "User has no state so it can't be disabled or regenerated.\n");
+		if (cfg->key_generation == CONFIG_DISALLOW) {
+			print(PRINT_WARN, "Policy check failed: Disallowing key generation.\n");
+			return AGENT_ERR_POLICY_GENERATION;
+		}
+		return AGENT_OK;
+	}
+
+	if (ppp_flag_check(a->s, FLAG_DISABLED) && cfg->disabling == CONFIG_DISALLOW) {
+		ret = _state_fini(a, _NONE);
+		if (ret != AGENT_OK) {
+			print(PRINT_NOTICE, "Error during finalization: %s\n",
+			      agent_strerror(ret));
+		}
+		print(PRINT_WARN, "Policy check failed: Disallowing key "
+		      "regeneration with disabled state.\n");
+		return AGENT_ERR_POLICY;
+	}
+
+	if (cfg->key_regeneration == CONFIG_DISALLOW) {
+		ret = _state_fini(a, _NONE);
+		if (ret != AGENT_OK) {
+			print(PRINT_NOTICE, "Error during finalization: %s\n",
+			      agent_strerror(ret));
+		}
+		print(PRINT_WARN, "Policy check failed: Disallowing key regeneration.\n");
+		return AGENT_ERR_POLICY_REGENERATION;
+	}
+
+	ret = _state_fini(a, _NONE);
+	if (ret != 0) {
+		print(PRINT_ERROR, "Error while finalizing user state after policy check: %s\n",
+		      agent_strerror(ret));
+		return AGENT_ERR;
+	}
+	return AGENT_OK;
+}
+
 static int request_verify_policy(agent *a, const cfg_t *cfg)
 {
 	/* Read request parameters */
@@ -248,8 +438,6 @@ static int request_verify_policy(agent *a, const cfg_t *cfg)
 
 		/* Validate if user doesn't already have a disabled state */
 	case AGENT_REQ_STATE_NEW:
-	{
-		int ret;
 		if (a->s) {
 			/* This option is always run without reading state first */
 			return AGENT_ERR_MUST_DROP_STATE;
@@ -258,45 +446,33 @@ static int request_verify_policy(agent *a, const cfg_t *cfg)
 		if (privileged)
 			return AGENT_OK;
 
-		ret = _state_init(a, _LOAD);
-		if (ret != 0) {
-			print(PRINT_NOTICE, "User has no state so it can't be disabled or regenerated.\n");
-			if (cfg->key_generation == CONFIG_DISALLOW) {
-				print(PRINT_WARN, "Policy check failed: Disallowing key generation.\n");
-				return AGENT_ERR_POLICY_GENERATION;
-			}
+		return _verify_state_replace(a, cfg);
+
+		/* Only administrator can transfer whole database. Exported
+		 * state contains the key, so it's also covered by KEY_PRINT */
+	case AGENT_REQ_STATE_EXPORT:
+		if (privileged)
 			return AGENT_OK;
-		}
 
-		if (ppp_flag_check(a->s, FLAG_DISABLED) && cfg->disabling == CONFIG_DISALLOW) {
-			ret = _state_fini(a, _NONE);
-			if (ret != AGENT_OK) {
-				print(PRINT_NOTICE, "Error during finalization: %s\n",
-				      agent_strerror(ret));
-			}
-			print(PRINT_WARN, "Policy check failed: Disallowing key "
-			      "regeneration with disabled state.\n");
+		if (r_int == AGENT_BULK_ALL ||
+		    cfg->state_export == CONFIG_DISALLOW ||
+		    cfg->key_print != CONFIG_ALLOW)
 			return AGENT_ERR_POLICY;
-		}
+		return AGENT_OK;
 
-		if (cfg->key_regeneration == CONFIG_DISALLOW) {
-			ret = _state_fini(a, _NONE);
-			if (ret != AGENT_OK) {
-				print(PRINT_NOTICE, "Error during finalization: %s\n",
-				      agent_strerror(ret));
-			}
-			print(PRINT_WARN, "Policy check failed: Disallowing key regeneration.\n");
-			return AGENT_ERR_POLICY_REGENERATION;
-		}
+	case AGENT_REQ_STATE_IMPORT:
+		if (r_int != AGENT_BULK_ALL && a->s)
+			return AGENT_ERR_MUST_DROP_STATE;
+
+		if (privileged)
+			return AGENT_OK;
+
+		if (r_int == AGENT_BULK_ALL ||
+		    cfg->state_import == CONFIG_DISALLOW)
+			return AGENT_ERR_POLICY;
+
+		return _verify_state_replace(a, cfg);
 
-		ret = _state_fini(a, _NONE);
-		if (ret != 0) {
-			print(PRINT_ERROR, "Error while finalizing user state after policy check: %d\n",
-			      agent_strerror(ret));
-			return AGENT_ERR;
-		}
-		return AGENT_OK;
-	}
 		/* Those which doesn't require policy check */
 	case AGENT_REQ_STATE_LOAD:
 	case AGENT_REQ_STATE_STORE:
@@ -317,6 +493,7 @@ static int request_verify_policy(agent *a, const cfg_t *cfg)
 			return AGENT_OK;
 
 	case AGENT_REQ_GET_PASSCODE:
+	case AGENT_REQ_GET_PASSCODES:
 		if (!privileged && cfg->passcode_print == CONFIG_DISALLOW)
 			return AGENT_ERR_POLICY;
 		else
@@ -677,6 +854,81 @@ static int request_execute(agent *a, const cfg_t *cfg)
 		_send_reply(a, ret);
 		break;
 
+	case AGENT_REQ_GET_PASSCODES:
+		if (!a->s) {
+			_send_reply(a, AGENT_ERR_NO_STATE);
+		} else if (r_int <= 0 || r_int > AGENT_PASSCODES_MAX) {
+			_send_reply(a, AGENT_ERR_REQ_ARG);
+		} else {
+			/* Sends the reply itself */
+			(void) _send_passcodes(a, r_num, r_int);
+		}
+		break;
+
+	case AGENT_REQ_STATE_EXPORT:
+		if (r_int == AGENT_BULK_ALL) {
+			/* Sends the replies itself */
+			(void) _send_export(a);
+			break;
+		}
+
+		if (!a->s) {
+			_send_reply(a, AGENT_ERR_NO_STATE);
+		} else {
+			char entry[STATE_ENTRY_SIZE];
+
+			agent_hdr_init(a, 0);
+			ret = ppp_state_export(a->s, entry, sizeof(entry));
+			if (ret == 0) {
+				agent_hdr_set_int(a, 1, 0);
+				ret = agent_hdr_set_data(a, entry, strlen(entry));
+				assert(ret == AGENT_OK);
+			}
+			_send_reply(a, ret);
+
+			memset(entry, 0, sizeof(entry));
+			agent_hdr_sanitize(a);
+		}
+		break;
+
+	case AGENT_REQ_STATE_IMPORT:
+	{
+		size_t length;
+		const char *entry;
+
+		if (r_int == AGENT_BULK_ALL) {
+			/* Sends the reply itself */
+			(void) _receive_import(a, r_int2);
+			break;
+		}
+
+		/* Single, complete entry */
+		entry = agent_hdr_get_arg_data(a, &length);
+		if (length == 0 || length >= STATE_ENTRY_SIZE ||
+		    memchr(entry, '\n', length) != entry + length - 1) {
+			_send_reply(a, AGENT_ERR_REQ_ARG);
+			break;
+		}
+
+		ret = _state_init(a, _NONE);
+		if (ret == 0) {
+			ret = ppp_state_import(a->s, entry, length, ppp_flags);
+			if (ret == 0)
+				ret = _state_fini(a, _STORE);
+			else
+				(void) _state_fini(a, _NONE);
+		}
+		if (ret != 0) {
+			print(PRINT_WARN, "Error while handling STATE_IMPORT: %s\n",
+			      agent_strerror(ret));
+		}
+
+		agent_hdr_sanitize(a);
+		agent_hdr_set_int(a, ret == 0 ? 1 : 0, 0);
+		_send_reply(a, ret);
+		break;
+	}
+
 	case AGENT_REQ_GET_PROMPT:
 		if (!a->s) {
 			/* This doesn't need to work atomically */
@@ -41,6 +41,8 @@
 #include <sys/stat.h>
 /* pwd */
 #include <pwd.h>
+/* setgroups, initgroups */
+#include <grp.h>
 /* open */
 #include <fcntl.h>
 
@@ -51,6 +53,9 @@ static uid_t real_uid=-1, set_uid=-1;
 static uid_t real_gid=-1, set_gid=-1;
 static int is_suid = 0, has_tty = 0;
 
+/* Supplementary groups are the daemon's, not the peer's */
+static int foreign_groups = 0;
+
 extern char **environ;
 
 void security_init(void)
@@ -182,6 +187,40 @@ void security_init(void)
 	putenv("IFS= \t\n");
 }
 
+void security_set_peer(uid_t uid, gid_t gid)
+{
+	/* Only root daemon can serve other users */
+	assert(set_uid == 0);
+
+	/* From now on the connection is handled as if the
+	 * peer had run SUID-root agent itself */
+	real_uid = uid;
+	real_gid = gid;
+	is_suid = (uid != set_uid) ? 1 : 0;
+	foreign_groups = 1;
+}
+
+/* Replace groups inherited from the daemon with groups of the user we
+ * switch to. SUID agent has groups of its caller already. */
+static int _set_groups(uid_t uid, gid_t gid)
+{
+	const struct passwd *pw;
+
+	if (!foreign_groups)
+		return 0;
+
+	pw = getpwuid(uid);
+	if (pw) {
+		if (initgroups(pw->pw_name, gid) != 0)
+			return 1;
+	} else if (setgroups(0, NULL) != 0) {
+		return 1;
+	}
+
+	foreign_groups = 0;
+	return 0;
+}
+
 static void _ensure_no_privileges()
 {
 	if ((real_gid != set_gid) && (setgid(set_gid) == 0))
@@ -207,6 +246,10 @@ void security_permanent_switch(uid_t uid, uid_t gid)
 	 * seteuid(drop_to); - drop
 	 * ensure correctness
 	 */
+	if (_set_groups(uid, gid) != 0) {
+		goto error;
+	}
+
 	if (setresgid(gid, gid, gid) != 0) {
 		goto error;
 	}
@@ -238,6 +281,8 @@ void security_permanent_drop(void)
 	 * Ensure somehow the saved-UID is correct (/proc)
 	 */
 
+	if (_set_groups(real_uid, real_gid) != 0)
+		goto error;
 	if (setresgid(real_gid, real_gid, real_gid) != 0)
 		goto error;
 	if (setresuid(real_uid, real_uid, real_uid) != 0)
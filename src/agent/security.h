@@ -37,6 +37,10 @@ extern void security_permanent_drop(void);
 /** Pernamently switch user to given uid/gid */
 extern void security_permanent_switch(uid_t uid, uid_t gid);
 
+/** Make daemon handle connection of the given user
+ * as if it was run by this user */
+extern void security_set_peer(uid_t uid, gid_t gid);
+
 /** Are we SUID? Check ones defined in argument. */
 extern int security_is_suid();
 
@@ -17,13 +17,33 @@
  **********************************************************************/
 
 #include <stdio.h>
+#include <signal.h>	/* kill */
+#include <unistd.h>	/* fork, pipe */
+#include <sys/wait.h>
+#include <sys/ioctl.h>	/* FIONREAD */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>	/* open */
+#include <poll.h>
+#include <time.h>	/* clock_gettime */
+#include <grp.h>	/* setgroups */
 
 #include "testcases.h"
 
 #define PPP_INTERNAL 1
 #include "ppp.h"
+#include "db.h"
+#include "trace.h"
 
 #include "security.h"
+#include "daemon.h"
+#include "commit.h"
+
+#include "polarssl_aes.h"
+#include "aesni.h"
+#include "shani.h"
+#include "coreutils_sha256.h"
 
 /***************************
  * Crypto/NUM Testcases
@@ -77,6 +97,81 @@ int crypto_testcase(void)
 	}
 	printf("\n");
 
+	/* FIPS-197 C.3 known answer */
+	printf("crypto_aes_test (FIPS-197) [ 3]: ");
+	{
+		unsigned char kat_key[32], kat_plain[16];
+		const unsigned char kat_cipher[16] =
+			"\x8e\xa2\xb7\xca\x51\x67\x45\xbf"
+			"\xea\xfc\x49\x90\x4b\x49\x60\x89";
+		for (i = 0; i < 32; i++)
+			kat_key[i] = i;
+		for (i = 0; i < 16; i++)
+			kat_plain[i] = i * 0x11;
+
+		crypto_aes_encrypt(kat_key, kat_plain, encrypted);
+		crypto_aes_decrypt(kat_key, encrypted, decrypted);
+		if (memcmp(encrypted, kat_cipher, 16) != 0 ||
+		    memcmp(decrypted, kat_plain, 16) != 0) {
+			printf("FAILED\n");
+			failed++;
+		} else {
+			printf("PASSED\n");
+		}
+	}
+
+#if AESNI_AVAILABLE
+	/* Both implementations must agree */
+	printf("crypto_aes_test (AES-NI %s) [ 4]: ",
+	       aesni_supported() ? "used" : "unavailable");
+	if (aesni_supported()) {
+		aes_context ctx;
+		aesni_key ni_enc, ni_dec;
+		unsigned char tables[16];
+		for (i = 0; i < 10; i++) {
+			crypto_file_rng("/dev/urandom", NULL, key, sizeof(key));
+			crypto_file_rng("/dev/urandom", NULL, plain, 16);
+			aes_setkey_enc(&ctx, key, 256);
+			aes_crypt_ecb(&ctx, AES_ENCRYPT, plain, tables);
+			aesni_setkey_enc(&ni_enc, key);
+			aesni_setkey_dec(&ni_dec, key);
+			aesni_encrypt(&ni_enc, plain, encrypted);
+			aesni_decrypt(&ni_dec, encrypted, decrypted);
+
+			if (memcmp(encrypted, tables, 16) != 0 ||
+			    memcmp(decrypted, plain, 16) != 0) {
+				printf("FAILED ");
+				failed++;
+			} else {
+				printf("PASSED ");
+			}
+		}
+		memcpy(key, "This is the key", 16);
+		memset(key + 16, 0, 16);
+	}
+	printf("\n");
+#endif
+
+	/* Cached key schedule must follow key changes */
+	printf("crypto_aes_test (cached) [ 5]: ");
+	{
+		crypto_aes_key *cache = crypto_aes_key_new();
+		unsigned char cached[16];
+		for (i = 0; i < 4; i++) {
+			key[0] = i / 2;
+			crypto_aes_encrypt(key, plain, encrypted);
+			if (crypto_aes_encrypt_cached(cache, key, plain, cached) != 0 ||
+			    memcmp(encrypted, cached, 16) != 0) {
+				printf("FAILED ");
+				failed++;
+			} else {
+				printf("PASSED ");
+			}
+		}
+		crypto_aes_key_free(cache);
+	}
+	printf("\n");
+
 
 	/* SHA256 testcase */
 	{
@@ -97,6 +192,88 @@ int crypto_testcase(void)
 		}
 	}
 
+	/* PBKDF2 known answers; second one uses pre-hashed long password */
+	printf("sha_test (PBKDF2) [ 2]: ");
+	{
+		unsigned char pass[70];
+		unsigned char dk[32];
+		const unsigned char dk_origin[32] =
+			"\xc5\xe4\x78\xd5\x92\x88\xc8\x41\xaa\x53\x0d"
+			"\xb6\x84\x5c\x4c\x8d\x96\x28\x93\xa0\x01\xce"
+			"\x4e\x11\xa4\x96\x38\x73\xaa\x98\x13\x4a";
+		const unsigned char dk_long[32] =
+			"\x54\xa4\x20\x7c\x57\x93\x6f\x66\xd0\x73\xcc"
+			"\x72\x2a\xb8\xfd\x87\x50\x39\xfa\xe7\xd9\xf1"
+			"\x10\x8e\x20\x76\x23\xa8\xa5\xa1\xc5\x0e";
+
+		crypto_pbkdf2_sha256((const unsigned char *) "password", 8,
+				     (const unsigned char *) "salt", 4,
+				     4096, dk, sizeof(dk));
+		if (memcmp(dk, dk_origin, 32) != 0) {
+			printf("FAILED ");
+			failed++;
+		} else {
+			printf("PASSED ");
+		}
+
+		memset(pass, 'x', sizeof(pass));
+		crypto_pbkdf2_sha256(pass, sizeof(pass),
+				     (const unsigned char *) "saltSALTsaltSALT", 16,
+				     3, dk, sizeof(dk));
+		if (memcmp(dk, dk_long, 32) != 0) {
+			printf("FAILED\n");
+			failed++;
+		} else {
+			printf("PASSED\n");
+		}
+	}
+
+#if SHANI_AVAILABLE
+	/* SHA extensions must agree with portable code. Also
+	 * compare their throughput */
+	printf("sha_test (SHA-NI %s) [ 3]: ",
+	       shani_supported() ? "used" : "unavailable");
+	if (shani_supported()) {
+		static uint32_t data[64 * 16];
+		struct sha256_ctx ni, generic;
+		struct timespec start, end;
+		double elapsed[2];
+		int backend, j;
+
+		crypto_file_rng("/dev/urandom", NULL, (unsigned char *) data, sizeof(data));
+		for (i = 1; i <= 64; i *= 4) {
+			sha256_init_ctx(&ni);
+			sha256_init_ctx(&generic);
+			shani_process_blocks(ni.state, (unsigned char *) data, i);
+			sha256_process_block_generic(data, 64 * i, &generic);
+			if (memcmp(ni.state, generic.state, sizeof(ni.state)) != 0) {
+				printf("FAILED ");
+				failed++;
+			} else {
+				printf("PASSED ");
+			}
+		}
+
+		for (backend = 0; backend < 2; backend++) {
+			sha256_init_ctx(&ni);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (j = 0; j < 256; j++) {
+				if (backend == 0)
+					shani_process_blocks(ni.state, (unsigned char *) data, 64);
+				else
+					sha256_process_block_generic(data, sizeof(data), &ni);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			elapsed[backend] = (end.tv_sec - start.tv_sec)
+				+ (end.tv_nsec - start.tv_nsec) / 1e9;
+		}
+		printf("(%.0f MB/s vs %.0f MB/s)",
+		       256.0 * sizeof(data) / elapsed[0] / 1e6,
+		       256.0 * sizeof(data) / elapsed[1] / 1e6);
+	}
+	printf("\n");
+#endif
+
 	return failed;
 }
 
@@ -154,7 +331,62 @@ int spass_testcase(void)
 	} else {
 		printf("OK\n");
 	}
-		
+
+	/* Hashes of both formats must verify regardless of configuration */
+	{
+		cfg_t *cfg = cfg_get();
+		const int kdf = cfg->spass_kdf;
+		const int cost = cfg->spass_kdf_cost;
+
+		cfg->spass_kdf = CONFIG_DISABLED;
+		ret = ppp_set_spass(&s, "TestSpAsSs#4$4", 0);
+		cfg->spass_kdf = CONFIG_ENABLED;
+		cfg->spass_kdf_cost = 4;
+		printf("SPASS TESTCASE [6]: ");
+		if (ret != PPP_ERROR_SPASS_SET || s.spass_set != STATE_SPASS_SHA256 ||
+		    ppp_spass_validate(&s, "TestSpAsSs#4$4") != 0) {
+			failed++;
+			printf("FAILED\n");
+		} else {
+			printf("OK\n");
+		}
+
+		ret = ppp_set_spass(&s, "TestSpAsSs#4$4", 0);
+		printf("SPASS TESTCASE [7]: ");
+		if (ret != PPP_ERROR_SPASS_SET || s.spass_set != STATE_SPASS_KDF ||
+		    s.spass[0] != CRYPTO_KDF_PBKDF2_SHA256 || s.spass[1] != 4 ||
+		    ppp_spass_validate(&s, "TestSpAsSs#4$4") != 0 ||
+		    ppp_spass_validate(&s, "TestSpAsSs#4$5") == 0) {
+			failed++;
+			printf("FAILED\n");
+		} else {
+			printf("OK\n");
+		}
+
+		/* Unknown KDF tag must never match */
+		s.spass[0] = 0xFF;
+		printf("SPASS TESTCASE [8]: ");
+		if (ppp_spass_validate(&s, "TestSpAsSs#4$4") == 0) {
+			failed++;
+			printf("FAILED\n");
+		} else {
+			printf("OK\n");
+		}
+
+		ret = crypto_kdf_calibrate(CRYPTO_KDF_PBKDF2_SHA256, 5);
+		printf("SPASS TESTCASE [9]: ");
+		if (ret < CRYPTO_KDF_COST_MIN || ret > CRYPTO_KDF_COST_MAX) {
+			failed++;
+			printf("FAILED\n");
+		} else {
+			printf("OK (cost %d)\n", ret);
+		}
+
+		cfg->spass_kdf = kdf;
+		cfg->spass_kdf_cost = cost;
+	}
+
+	ppp_set_spass(&s, NULL, 0);
 	state_fini(&s);
 
 	return failed;
@@ -274,6 +506,9 @@ int state_testcase(void)
 	
 	s1.counter = num_i(321323211UL);
 
+	/* Tagged static password must survive store/load */
+	test++; if (ppp_set_spass(&s1, "TestSpAsSs#4$4", 0) != PPP_ERROR_SPASS_SET)
+		printf("state_testcase[%2d] failed(%d)\n", test, failed++);
 
 	/*
 	test++; if (state_lock(&s1) != 0)
@@ -307,6 +542,13 @@ int state_testcase(void)
 	test++; if (s1.flags != s2.flags || s1.code_length != s2.code_length)
 		printf("state_testcase[%2d] failed(%d)\n", test, failed++);
 
+	test++; if (state_peek(&s2) != 0 || num_cmp(s1.counter, s2.counter) != 0)
+		printf("state_testcase[%2d] failed(%d)\n", test, failed++);
+
+	test++; if (s1.spass_set != s2.spass_set ||
+		    memcmp(s1.spass, s2.spass, sizeof(s1.spass)) != 0 ||
+		    ppp_spass_validate(&s2, "TestSpAsSs#4$4") != 0)
+		printf("state_testcase[%2d] failed(%d)\n", test, failed++);
 
 	printf("state_testcases %d FAILED %d PASSED\n", failed, test-failed);
 
@@ -318,6 +560,1443 @@ int state_testcase(void)
 }
 
 
+/***************************
+ * Text DB entry testcases
+ **************************/
+int db_entry_testcase(int fast)
+{
+	/* Entries without username; 0 - valid, 1 - must be rejected */
+	static const struct {
+		int invalid;
+		const char *entry;
+	} corpus[] = {
+#define KEY "00112233445566778899AABBCCDDEEFF00112233445566778899aabbccddeeff"
+#define SPASS "0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF"
+		{ 0, ":1:" KEY ":6:0:0:0:0:4:1:5::0::\n" },
+		{ 0, ":1:" KEY ":FFFFFFFFFF:A0:3:1:1380000000:16:3:0:" SPASS ":7:Label-1:a@b.c" },
+		{ 0, ":1:" KEY ":0:0:0:0:0:2:0:1:$2$" SPASS ":0:x:+48 123" },
+		{ 1, ":2:" KEY ":6:0:0:0:0:4:1:5::0::" },
+		{ 1, ":1:" KEY "0:6:0:0:0:0:4:1:5::0::" },
+		{ 1, ":1:" KEY ":6:0:0:0:0:4:1:5::0:::" },
+		{ 1, ":1:" KEY ":6:0:0:0:0:4:1:5::0:" },
+		{ 1, ":1:0G112233445566778899AABBCCDDEEFF00112233445566778899AABBCCDDEEFF:6:0:0:0:0:4:1:5::0::" },
+		{ 1, ":1:" KEY "::0:0:0:0:4:1:5::0::" },
+		{ 1, ":1:" KEY ":100000000000000000000000000000000:0:0:0:0:4:1:5::0::" },
+		{ 1, ":1:" KEY ":6:0:-1:0:0:4:1:5::0::" },
+		{ 1, ":1:" KEY ":6:0: 1:0:0:4:1:5::0::" },
+		{ 1, ":1:" KEY ":6:0:4294967296:0:0:4:1:5::0::" },
+		{ 1, ":1:" KEY ":6:0:0:0:0:17:1:5::0::" },
+		{ 1, ":1:" KEY ":6:0:0:0:0:4:1:zz::0::" },
+		{ 1, ":1:" KEY ":6:0:0:0:0:4:1:5:" SPASS "0:0::" },
+		{ 1, ":1:" KEY ":6:0:0:0:0:4:1:5:$2$" SPASS "0:0::" },
+		{ 1, ":1:" KEY ":6:0:0:0:0:4:1:5:$3$" SPASS ":0::" },
+		{ 1, ":1:" KEY ":6:0:0:0:0:4:1:5:" SPASS ":::" },
+		{ 1, ":1:" KEY ":6:0:0:0:0:4:1:5::0:Label {x}:" },
+		{ 1, ":1:" KEY ":6:0:0:0:0:4:1:5::0:012345678901234567890123456789:" },
+		{ 1, ":1:" KEY ":6:0:0:0:0:4:1:5::0::" SPASS "0123" },
+#undef KEY
+#undef SPASS
+	};
+
+	const int benchmark = fast ? 100000 : 1000000;
+	const int mutations = fast ? 2000 : 20000;
+	const char mutation_chars[] = ":0aF$-\n ";
+	char *current_user = security_get_calling_user();
+	char line[STATE_ENTRY_SIZE], valid[STATE_ENTRY_SIZE];
+	struct timespec start, end;
+	unsigned int seed = 1;
+	size_t len, valid_len = 0;
+	int failed = 0;
+	int test = 0;
+	int accepted = 0;
+	int i, ret;
+	double elapsed;
+	state s;
+
+	if (state_init(&s, current_user) != 0)
+		printf("db_entry_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Known corpus; parse errors are silenced */
+	print_config(PRINT_STDOUT | PRINT_NONE);
+	for (i = 0; i < (int) (sizeof(corpus) / sizeof(corpus[0])); i++) {
+		len = snprintf(line, sizeof(line), "%s%s", current_user, corpus[i].entry);
+		ret = db_file_parse_entry(&s, line, len);
+		test++; if ((ret != 0) != corpus[i].invalid)
+			printf("db_entry_testcase[%2d] failed (%d)\n", test, failed++);
+		if (i == 1) {
+			memcpy(valid, line, len);
+			valid_len = len;
+			test++; if (num_cmp(s.counter, num_i(0xFFFFFFFFFFULL)) != 0 ||
+				    s.spass_set != STATE_SPASS_SHA256 ||
+				    s.channel_time != 1380000000 ||
+				    s.sequence_key[31] != 0xff ||
+				    strcmp(s.contact, "a@b.c") != 0)
+				printf("db_entry_testcase[%2d] failed (%d)\n", test, failed++);
+		}
+	}
+
+	/* Entry must not be read past its length */
+	len = snprintf(line, sizeof(line), "%s%s", current_user, corpus[0].entry);
+	test++; if (db_file_parse_entry(&s, line, len - 3) == 0)
+		printf("db_entry_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Random mutations of a valid entry; parser must neither crash
+	 * nor accept an entry which breaks state invariants */
+	for (i = 0; i < mutations; i++) {
+		int m;
+		char *copy;
+		memcpy(line, valid, valid_len);
+		len = valid_len;
+		for (m = 0; m < 3; m++) {
+			size_t pos;
+			seed = seed * 1103515245 + 12345;
+			pos = (seed >> 8) % len;
+			switch ((seed >> 4) % 4) {
+			case 0:
+				line[pos] = mutation_chars[(seed >> 20) % (sizeof(mutation_chars) - 1)];
+				break;
+			case 1:
+				line[pos] = seed >> 16;
+				break;
+			case 2:
+				len = pos + 1;
+				break;
+			case 3:
+				memmove(line + pos, line + pos + 1, len - pos - 1);
+				if (len > 1)
+					len--;
+				break;
+			}
+		}
+
+		/* Exactly sized copy, so overreads are visible to valgrind */
+		copy = malloc(len);
+		memcpy(copy, line, len);
+		if (db_file_parse_entry(&s, copy, len) == 0) {
+			accepted++;
+			if (s.code_length < 2 || s.code_length > 16 ||
+			    !state_validate_str(s.label) || !state_validate_str(s.contact))
+				failed++;
+		}
+		free(copy);
+	}
+	print_config(PRINT_STDOUT);
+	test++;
+	printf("db_entry_testcase: %d of %d mutated entries accepted\n", accepted, mutations);
+
+	/* Parsing throughput */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < benchmark; i++) {
+		if (db_file_parse_entry(&s, valid, valid_len) != 0)
+			break;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	test++; if (i != benchmark)
+		printf("db_entry_testcase[%2d] failed (%d)\n", test, failed++);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("db_entry_testcase: %d entries parsed in %.3fs (%.0f entries/s)\n",
+	       benchmark, elapsed, benchmark / elapsed);
+
+	printf("db_entry_testcases %d FAILED %d PASSED\n", failed, test-failed);
+
+	state_fini(&s);
+	free(current_user);
+	return failed;
+}
+
+/***************************
+ * Indexed DB Testcases
+ **************************/
+int db_index_testcase(void)
+{
+	state s1, s2;
+	int failed = 0;
+	int test = 0;
+	int i;
+	char line[STATE_ENTRY_SIZE];
+	char *db = NULL, *lck = NULL, *tmp = NULL;
+	char *text_db = NULL;
+	FILE *f;
+	int ready[2], done[2];
+	pid_t child;
+	char c = 0;
+	unsigned long timeouts;
+	cfg_t *cfg = cfg_get();
+	char *current_user = security_get_calling_user();
+
+	if (state_init(&s1, current_user) != 0)
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (state_init(&s2, current_user) != 0)
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Create text entry of current user */
+	cfg->db_format = CONFIG_DB_FORMAT_TEXT;
+	ppp_flag_del(&s1, FLAG_SALTED);
+	test++; if (state_key_generate(&s1) != 0)
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+	s1.counter = num_i(1234567UL);
+	s1.failures = 3;
+	strcpy(s1.label, "Index label");
+
+	test++; if (state_store(&s1, 0) != 0)
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Put it into a text database together with many other users */
+	test++; if (db_file_path(current_user, &db, &lck, &tmp, NULL, NULL, NULL) != 0) {
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+		goto cleanup;
+	}
+	text_db = malloc(strlen(db) + 5);
+	strcpy(text_db, db);
+	strcat(text_db, ".txt");
+
+	f = fopen(db, "r");
+	test++; if (!f || fgets(line, sizeof(line), f) == NULL) {
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+		if (f)
+			fclose(f);
+		goto cleanup;
+	}
+	fclose(f);
+
+	f = fopen(text_db, "w");
+	test++; if (!f) {
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+		goto cleanup;
+	}
+	for (i = 0; i < 3000; i++)
+		fprintf(f, "user%d%s", i, strchr(line, ':'));
+	fputs(line, f);
+	fclose(f);
+
+	/* Convert and read it back */
+	test++; if (db_index_convert(text_db, db) != 0)
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+
+	cfg->db_format = CONFIG_DB_FORMAT_INDEXED;
+
+	test++; if (state_load(&s2) != 0)
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (memcmp(s1.sequence_key, s2.sequence_key, 32) != 0 ||
+	            num_cmp(s1.counter, s2.counter) != 0 ||
+	            s1.failures != s2.failures ||
+	            s1.flags != s2.flags ||
+	            strcmp(s1.label, s2.label) != 0)
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Update record in place; updates alternate between record copies */
+	for (i = 0; i < 3; i++) {
+		s2.counter = num_i(7654321UL + i);
+		test++; if (state_lock(&s2) != 0 || state_store(&s2, 0) != 0 ||
+		            state_unlock(&s2) != 0)
+			printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+
+		test++; if (state_load(&s1) != 0 || num_cmp(s1.counter, s2.counter) != 0)
+			printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+	}
+
+	/* Lookups without lock must see only complete updates */
+	test++; if (state_peek(&s1) != 0 || num_cmp(s1.counter, s2.counter) != 0)
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+
+	child = fork();
+	if (child == 0) {
+		print_config(PRINT_STDOUT | PRINT_NONE);
+		for (i = 1; i <= 300; i++) {
+			s2.counter = num_i(i);
+			if (state_lock(&s2) != 0 || state_store(&s2, 0) != 0 ||
+			    state_unlock(&s2) != 0)
+				_exit(1);
+		}
+		_exit(0);
+	}
+
+	{
+		int status = 1, peeks = 0, peek_failed = 0;
+		num_t previous = num_i(0);
+		while (child != -1 && waitpid(child, &status, WNOHANG) == 0) {
+			peeks++;
+			if (state_peek(&s1) != 0) {
+				peek_failed++;
+				continue;
+			}
+			/* Either old value or one of the new, growing ones */
+			if (num_cmp(s1.counter, num_i(7654321UL + 2)) != 0) {
+				if (num_cmp(s1.counter, previous) < 0 ||
+				    num_cmp(s1.counter, num_i(300)) > 0)
+					peek_failed++;
+				previous = s1.counter;
+			}
+		}
+		test++; if (child == -1 || status != 0 || peek_failed != 0)
+			printf("db_index_testcase[%2d] failed (%d, %d of %d peeks)\n",
+			       test, failed++, peek_failed, peeks);
+	}
+
+	/* Lock of the user held by other process must exclude us */
+	test++; if (pipe(ready) != 0 || pipe(done) != 0) {
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+		goto cleanup;
+	}
+
+	child = fork();
+	if (child == 0) {
+		/* Hold the lock until parent closes its pipe */
+		close(ready[0]);
+		close(done[1]);
+		if (state_lock(&s2) == 0)
+			c = 1;
+		if (write(ready[1], &c, 1) != 1 || read(done[0], &c, 1) < 0)
+			_exit(1);
+		_exit(0);
+	}
+	close(ready[1]);
+	close(done[0]);
+
+	test++; if (child == -1 || read(ready[0], &c, 1) != 1 || c != 1)
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Both ways of waiting must time out */
+	trace_start();
+	cfg->lock_timeout = 50;
+	for (i = CONFIG_LOCK_WAIT_RETRY; i <= CONFIG_LOCK_WAIT_BLOCK; i++) {
+		cfg->lock_wait = i;
+		timeouts = db_file_lock_stats()->timeouts;
+		test++; if (child == -1 || state_lock(&s1) != STATE_LOCK_ERROR ||
+		            db_file_lock_stats()->timeouts != timeouts + 1)
+			printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+	}
+
+	/* Waits are reported in the trace */
+	{
+		const char *trace = "/tmp/otpasswd_lock_trace_testcase";
+		char line[1024] = "";
+		FILE *f;
+
+		unlink(trace);
+		if (trace_finish(trace, "user", 0) == 0 &&
+		    (f = fopen(trace, "r")) != NULL) {
+			if (!fgets(line, sizeof(line), f))
+				line[0] = '\0';
+			fclose(f);
+		}
+		unlink(trace);
+		test++; if (!strstr(line, " lock_wait=") || !strstr(line, "/2 ") ||
+		            !strstr(line, " lock_timeouts=2\n"))
+			printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+	}
+
+	/* Lock released by exiting child is granted to the waiting one */
+	cfg->lock_timeout = 1000;
+	close(done[1]);
+	test++; if (child == -1 || state_lock(&s1) != 0 || state_unlock(&s1) != 0)
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+	cfg->lock_wait = CONFIG_LOCK_WAIT_RETRY;
+
+	close(ready[0]);
+	if (child != -1)
+		waitpid(child, NULL, 0);
+
+	/* Remove state */
+	test++; if (state_lock(&s1) != 0 || state_store(&s1, 1) != 0 ||
+	            state_unlock(&s1) != 0)
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (state_load(&s2) != STATE_NON_EXISTENT)
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (state_peek(&s2) != STATE_NON_EXISTENT)
+		printf("db_index_testcase[%2d] failed (%d)\n", test, failed++);
+
+cleanup:
+	cfg->db_format = CONFIG_DB_FORMAT_TEXT;
+	printf("db_index_testcases %d FAILED %d PASSED\n", failed, test-failed);
+
+	if (text_db)
+		unlink(text_db);
+	if (lck)
+		unlink(lck);
+	free(text_db);
+	free(db);
+	free(lck);
+	free(tmp);
+
+	state_fini(&s1);
+	state_fini(&s2);
+
+	free(current_user);
+	return failed;
+}
+
+
+/***************************
+ * Write-ahead log testcases
+ **************************/
+
+/* Store state the way ppp_increment does */
+static int _wal_testcase_update(state *s)
+{
+	int ret = state_lock(s);
+	if (ret != 0)
+		return ret;
+	ret = state_store(s, 0);
+	if (state_unlock(s) != 0 && ret == 0)
+		ret = STATE_LOCK_ERROR;
+	return ret;
+}
+
+int wal_testcase(void)
+{
+	state s1, s2;
+	int failed = 0;
+	int test = 0;
+	int i, fd;
+	struct stat st_db, st_wal;
+	ino_t ino;
+	char *db = NULL, *lck = NULL, *tmp = NULL;
+	char *wal = NULL, *stale = NULL;
+	cfg_t *cfg = cfg_get();
+	const int limit = cfg->db_wal_limit;
+	char *current_user = security_get_calling_user();
+
+	if (state_init(&s1, current_user) != 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (state_init(&s2, current_user) != 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (db_file_path(current_user, &db, &lck, &tmp, NULL, NULL, NULL) != 0) {
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+		goto cleanup;
+	}
+	wal = malloc(strlen(db) + 5);
+	stale = malloc(strlen(db) + 7);
+	sprintf(wal, "%s.wal", db);
+	sprintf(stale, "%s.stale", db);
+
+	cfg->db_format = CONFIG_DB_FORMAT_TEXT;
+	cfg->db_wal = CONFIG_ENABLED;
+	cfg->db_wal_limit = 4;
+
+	/* New key is always written into the database */
+	ppp_flag_del(&s1, FLAG_SALTED);
+	test++; if (state_key_generate(&s1) != 0 || state_store(&s1, 0) != 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (stat(db, &st_db) != 0 || access(wal, F_OK) == 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+	ino = st_db.st_ino;
+
+	/* Logins only append to the log */
+	test++; if (state_load(&s1) != 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+	for (i = 1; i <= 4; i++) {
+		s1.counter = num_add_i(s1.counter, 1);
+		s1.failures = i;
+		s1.recent_failures = i % 2;
+		s1.channel_time = 1380000000 + i;
+		test++; if (_wal_testcase_update(&s1) != 0)
+			printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+	}
+
+	test++; if (stat(db, &st_db) != 0 || st_db.st_ino != ino ||
+	            stat(wal, &st_wal) != 0 || st_wal.st_size == 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Log is replayed by locked and lock-free reads */
+	test++; if (state_load(&s2) != 0 ||
+	            num_cmp(s1.counter, s2.counter) != 0 ||
+	            s2.failures != 4 || s2.recent_failures != 0 ||
+	            s2.channel_time != 1380000004)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (state_peek(&s2) != 0 || num_cmp(s1.counter, s2.counter) != 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Unused bytes of a state don't change its base */
+	if (!s2.spass_set)
+		memset(s2.spass, 0xa5, sizeof(s2.spass));
+	s2.label[sizeof(s2.label) - 1] = 'x';
+	test++; if (db_wal_base(&s1) != db_wal_base(&s2))
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Full log is folded into the database */
+	s1.counter = num_add_i(s1.counter, 1);
+	test++; if (_wal_testcase_update(&s1) != 0 ||
+	            stat(db, &st_db) != 0 || st_db.st_ino == ino ||
+	            access(wal, F_OK) == 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+	ino = st_db.st_ino;
+
+	test++; if (state_load(&s2) != 0 || num_cmp(s1.counter, s2.counter) != 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Damaged record is skipped */
+	s1.counter = num_add_i(s1.counter, 1);
+	test++; if (_wal_testcase_update(&s1) != 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+	s1.counter = num_add_i(s1.counter, 1);
+	test++; if (_wal_testcase_update(&s1) != 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+
+	fd = open(wal, O_RDWR);
+	test++; if (fd == -1 || fstat(fd, &st_wal) != 0 ||
+	            pwrite(fd, "\xff", 1, st_wal.st_size - 20) != 1)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+	if (fd != -1)
+		close(fd);
+
+	print_config(PRINT_STDOUT | PRINT_NONE);
+	i = state_load(&s2);
+	test++; if (i != 0 || num_cmp(num_sub_i(s1.counter, 1), s2.counter) != 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Other changes rewrite the database and fold the log */
+	strcpy(s1.label, "WAL label");
+	i = link(wal, stale) == 0 ? _wal_testcase_update(&s1) : 1;
+	print_config(PRINT_STDOUT);
+	test++; if (i != 0 || stat(db, &st_db) != 0 || st_db.st_ino == ino ||
+	            access(wal, F_OK) == 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Log left behind by a crash after the rewrite is ignored */
+	test++; if (rename(stale, wal) != 0 || state_load(&s2) != 0 ||
+	            num_cmp(s1.counter, s2.counter) != 0 ||
+	            strcmp(s2.label, "WAL label") != 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* ...and cleared by the next append */
+	test++; if (state_load(&s1) != 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+	s1.counter = num_add_i(s1.counter, 1);
+	test++; if (_wal_testcase_update(&s1) != 0 ||
+	            state_load(&s2) != 0 || num_cmp(s1.counter, s2.counter) != 0 ||
+	            stat(wal, &st_wal) != 0 || st_wal.st_size > 200)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Removing state removes its log */
+	test++; if (state_lock(&s1) != 0 || state_store(&s1, 1) != 0 ||
+	            state_unlock(&s1) != 0 || access(wal, F_OK) == 0)
+		printf("wal_testcase[%2d] failed (%d)\n", test, failed++);
+
+cleanup:
+	cfg->db_wal = CONFIG_DISABLED;
+	cfg->db_wal_limit = limit;
+	if (wal)
+		unlink(wal);
+	if (stale)
+		unlink(stale);
+
+	printf("wal_testcases %d FAILED %d PASSED\n", failed, test-failed);
+
+	state_fini(&s1);
+	state_fini(&s2);
+	free(db);
+	free(lck);
+	free(tmp);
+	free(wal);
+	free(stale);
+	free(current_user);
+	return failed;
+}
+
+int sync_testcase(void)
+{
+	static const char *names[] = { "none", "file", "full" };
+	const int stores = 10;
+	state s;
+	int failed = 0;
+	int test = 0;
+	int level, i;
+	db_sync_stats before;
+	const db_sync_stats *after;
+	struct timespec start, end;
+	double elapsed;
+	cfg_t *cfg = cfg_get();
+	const int db_sync = cfg->db_sync;
+	char *current_user = security_get_calling_user();
+
+	if (state_init(&s, current_user) != 0)
+		printf("sync_testcase[%2d] failed (%d)\n", test, failed++);
+
+	cfg->db_format = CONFIG_DB_FORMAT_TEXT;
+
+	ppp_flag_del(&s, FLAG_SALTED);
+	test++; if (state_key_generate(&s) != 0 || state_store(&s, 0) != 0 ||
+	            state_load(&s) != 0)
+		printf("sync_testcase[%2d] failed (%d)\n", test, failed++);
+
+	for (level = CONFIG_DB_SYNC_NONE; level <= CONFIG_DB_SYNC_FULL; level++) {
+		cfg->db_sync = level;
+		before = *db_file_sync_stats();
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < stores; i++) {
+			s.counter = num_add_i(s.counter, 1);
+			if (_wal_testcase_update(&s) != 0)
+				break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		/* Each store flushes only its own file and directory */
+		after = db_file_sync_stats();
+		test++; if (i != stores ||
+		            after->syncs - before.syncs !=
+		            (level == CONFIG_DB_SYNC_NONE ? 0 : stores) ||
+		            after->dir_syncs - before.dir_syncs !=
+		            (level == CONFIG_DB_SYNC_FULL ? stores : 0))
+			printf("sync_testcase[%2d] failed (%d)\n", test, failed++);
+
+		elapsed = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+		printf("sync_testcase: DB_SYNC=%s %.0f us per store (%llu us flushing)\n",
+		       names[level], elapsed / stores,
+		       (after->sync_us - before.sync_us) / stores);
+	}
+
+	test++; if (state_load(&s) != 0)
+		printf("sync_testcase[%2d] failed (%d)\n", test, failed++);
+
+	cfg->db_sync = db_sync;
+
+	printf("sync_testcases %d FAILED %d PASSED\n", failed, test-failed);
+
+	state_fini(&s);
+	free(current_user);
+	return failed;
+}
+
+/***************************
+ * Bulk transfer testcases
+ ***************************/
+
+/* Collects exported entries in a file */
+typedef struct {
+	FILE *f;
+	unsigned long entries;
+} _bulk_testcase_out;
+
+static int _bulk_testcase_emit(void *arg, const char *entry, size_t length)
+{
+	_bulk_testcase_out *out = arg;
+	out->entries++;
+	return fwrite(entry, 1, length, out->f) == length ? 0 : STATE_IO_ERROR;
+}
+
+/* Import whole file in pieces of a given size */
+static int _bulk_testcase_import(const char *db, FILE *in, size_t piece,
+                                 unsigned long *entries)
+{
+	char buff[4096];
+	db_bulk *b;
+	size_t length;
+	int ret;
+
+	assert(piece <= sizeof(buff));
+	ret = db_bulk_import_start(db, &b);
+	if (ret != 0)
+		return ret;
+
+	rewind(in);
+	while (ret == 0 && (length = fread(buff, 1, piece, in)) > 0)
+		ret = db_bulk_import(b, buff, length);
+
+	if (ret == 0)
+		ret = db_bulk_import_finish(b, entries);
+	db_bulk_import_free(b);
+	return ret;
+}
+
+/* Compare contents of two files */
+static int _bulk_testcase_cmp(FILE *a, FILE *b)
+{
+	int c;
+	rewind(a);
+	rewind(b);
+	do {
+		c = fgetc(a);
+		if (c != fgetc(b))
+			return 1;
+	} while (c != EOF);
+	return 0;
+}
+
+int bulk_testcase(void)
+{
+	state s1, s2;
+	int failed = 0;
+	int test = 0;
+	int i;
+	char line[STATE_ENTRY_SIZE];
+	char *db = NULL, *lck = NULL, *tmp = NULL;
+	char *old = NULL, *old_wal = NULL;
+	_bulk_testcase_out text = { NULL, 0 }, index = { NULL, 0 };
+	FILE *f, *bad = NULL;
+	unsigned long entries = 0;
+	struct stat st;
+	cfg_t *cfg = cfg_get();
+	char *current_user = security_get_calling_user();
+
+	if (state_init(&s1, current_user) != 0)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (state_init(&s2, current_user) != 0)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (db_file_path(current_user, &db, &lck, &tmp, NULL, NULL, NULL) != 0) {
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+		goto cleanup;
+	}
+	old = malloc(strlen(db) + 5);
+	old_wal = malloc(strlen(db) + 9);
+	sprintf(old, "%s.old", db);
+	sprintf(old_wal, "%s.old.wal", db);
+
+	/* Text database of many users; current one is the last */
+	cfg->db_format = CONFIG_DB_FORMAT_TEXT;
+	ppp_flag_del(&s1, FLAG_SALTED);
+	strcpy(s1.label, "Bulk label");
+	test++; if (state_key_generate(&s1) != 0 || state_store(&s1, 0) != 0 ||
+	            db_file_generate_entry(&s1, line, sizeof(line)) != 0)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+
+	f = fopen(db, "w");
+	test++; if (!f) {
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+		goto cleanup;
+	}
+	for (i = 0; i < 3000; i++)
+		fprintf(f, "bulk%d%s", i, strchr(line, ':'));
+	fputs(line, f);
+	fclose(f);
+
+	/* Login recorded only in the write-ahead log */
+	cfg->db_wal = CONFIG_ENABLED;
+	test++; if (state_load(&s1) != 0)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+	s1.counter = num_i(4321);
+	test++; if (_wal_testcase_update(&s1) != 0)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+
+	text.f = tmpfile();
+	index.f = tmpfile();
+	bad = tmpfile();
+	test++; if (!text.f || !index.f || !bad) {
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+		goto cleanup;
+	}
+
+	/* Export includes logged update */
+	test++; if (db_file_export(db, _bulk_testcase_emit, &text) != 0 ||
+	            text.entries != 3001)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Import into indexed format, split at odd places */
+	cfg->db_format = CONFIG_DB_FORMAT_INDEXED;
+	test++; if (_bulk_testcase_import(db, text.f, 37, &entries) != 0 ||
+	            entries != 3001)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Previous database and its log are kept */
+	test++; if (stat(old, &st) != 0 || stat(old_wal, &st) != 0)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (state_load(&s2) != 0 ||
+	            memcmp(s1.sequence_key, s2.sequence_key, 32) != 0 ||
+	            num_cmp(s2.counter, num_i(4321)) != 0 ||
+	            strcmp(s2.label, "Bulk label") != 0)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Both formats export the same entries */
+	test++; if (db_index_export(db, _bulk_testcase_emit, &index) != 0 ||
+	            index.entries != 3001 ||
+	            _bulk_testcase_cmp(text.f, index.f) != 0)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Duplicate user rejects whole import */
+	rewind(text.f);
+	test++; if (fgets(line, sizeof(line), text.f) == NULL)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+	fputs(line, bad);
+	fputs(line, bad);
+
+	print_config(PRINT_STDOUT | PRINT_NONE);
+	test++; if (_bulk_testcase_import(db, bad, sizeof(line), &entries) != STATE_PARSE_ERROR)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Entry with invalid field */
+	rewind(bad);
+	fprintf(bad, "bulk%s", strchr(line, ':'));
+	*strrchr(line, ':') = '\0';
+	fprintf(bad, "%s:\t\n", line);
+	test++; if (_bulk_testcase_import(db, bad, sizeof(line), &entries) != STATE_PARSE_ERROR)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Last entry without end of line */
+	rewind(bad);
+	fputs("bulk:", bad);
+	fflush(bad);
+	test++; if (ftruncate(fileno(bad), 5) != 0 ||
+	            _bulk_testcase_import(db, bad, sizeof(line), &entries) != STATE_PARSE_ERROR)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+	print_config(PRINT_STDOUT | PRINT_NOTICE);
+
+	/* Failed imports don't change the database */
+	index.entries = 0;
+	rewind(index.f);
+	test++; if (db_index_export(db, _bulk_testcase_emit, &index) != 0 ||
+	            index.entries != 3001 ||
+	            _bulk_testcase_cmp(text.f, index.f) != 0)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Back to text format */
+	cfg->db_format = CONFIG_DB_FORMAT_TEXT;
+	test++; if (_bulk_testcase_import(db, text.f, 4096, &entries) != 0 ||
+	            entries != 3001 || state_load(&s2) != 0 ||
+	            num_cmp(s2.counter, num_i(4321)) != 0)
+		printf("bulk_testcase[%2d] failed (%d)\n", test, failed++);
+
+cleanup:
+	cfg->db_format = CONFIG_DB_FORMAT_TEXT;
+	cfg->db_wal = CONFIG_DISABLED;
+	printf("bulk_testcases %d FAILED %d PASSED\n", failed, test-failed);
+
+	if (text.f)
+		fclose(text.f);
+	if (index.f)
+		fclose(index.f);
+	if (bad)
+		fclose(bad);
+	if (db) {
+		unlink(db);
+		unlink(lck);
+		unlink(old);
+		unlink(old_wal);
+	}
+	free(db);
+	free(lck);
+	free(tmp);
+	free(old);
+	free(old_wal);
+
+	state_fini(&s1);
+	state_fini(&s2);
+	free(current_user);
+	return failed;
+}
+
+int trace_testcase(void)
+{
+	const char *path = "/tmp/otpasswd_trace_testcase";
+	char line[1024] = "";
+	state s;
+	FILE *f;
+	int failed = 0;
+	int test = 0;
+	char *current_user = security_get_calling_user();
+
+	unlink(path);
+
+	/* Nothing is recorded without a trace */
+	trace_enter(TRACE_LOCK);
+	trace_leave(TRACE_LOCK);
+	test++; if (trace_finish(path, "user", 0) != 1 || access(path, F_OK) == 0)
+		printf("trace_testcase[%2d] failed (%d)\n", test, failed++);
+
+	trace_start();
+	trace_enter(TRACE_PROMPT);
+	usleep(2000);
+	trace_leave(TRACE_PROMPT);
+	test++; if (trace_spent(TRACE_PROMPT) < 2000)
+		printf("trace_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Nested phase is timed once */
+	trace_enter(TRACE_OOB);
+	trace_enter(TRACE_OOB);
+	trace_leave(TRACE_OOB);
+	usleep(1000);
+	trace_leave(TRACE_OOB);
+	test++; if (trace_spent(TRACE_OOB) < 1000)
+		printf("trace_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Storing a new key goes through lock and store */
+	test++; if (state_init(&s, current_user) != 0)
+		printf("trace_testcase[%2d] failed (%d)\n", test, failed++);
+	ppp_flag_del(&s, FLAG_SALTED);
+	test++; if (state_key_generate(&s) != 0 || state_store(&s, 0) != 0 ||
+	            state_load(&s) != 0 || trace_spent(TRACE_STORE) == 0)
+		printf("trace_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Single line with sanitized username */
+	test++; if (trace_finish(path, "bad user=x", 7) != 0)
+		printf("trace_testcase[%2d] failed (%d)\n", test, failed++);
+
+	f = fopen(path, "r");
+	if (f) {
+		if (!fgets(line, sizeof(line), f))
+			line[0] = '\0';
+		fclose(f);
+	}
+	test++; if (strncmp(line, "trace=1 user=bad?user?x result=7 total=", 39) != 0 ||
+	            !strstr(line, " prompt=") || !strstr(line, "/1") ||
+	            !strstr(line, " oob=") || !strstr(line, " lock=") ||
+	            !strstr(line, " store=") ||
+	            (cfg_get()->db_sync != CONFIG_DB_SYNC_NONE &&
+	             !strstr(line, " sync_files=")) ||
+	            line[strlen(line) - 1] != '\n')
+		printf("trace_testcase[%2d] failed (%d)\n", test, failed++);
+
+	printf("trace_testcase: %s", line);
+
+	/* Empty path writes nothing */
+	unlink(path);
+	trace_start();
+	test++; if (trace_finish("", "user", 0) != 0 || access(path, F_OK) == 0)
+		printf("trace_testcase[%2d] failed (%d)\n", test, failed++);
+
+	printf("trace_testcases %d FAILED %d PASSED\n", failed, test-failed);
+
+	state_fini(&s);
+	free(current_user);
+	return failed;
+}
+
+
+/***************************
+ * Agent daemon Testcases
+ **************************/
+int agent_frame_testcase(void)
+{
+	const size_t data_len = 100000;
+	agent s, r;
+	int sv[2];
+	int failed = 0;
+	int test = 0;
+	int pending = 0;
+	size_t length, i;
+	const char *data;
+	num_t num = num_ii(1, 2);
+	pid_t child;
+
+	memset(&s, 0, sizeof(s));
+	memset(&r, 0, sizeof(r));
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		printf("agent_frame_testcase[%2d] failed (%d)\n", test, failed++);
+		goto cleanup;
+	}
+	s.in = r.out = -1;
+	s.out = sv[0];
+	r.in = sv[1];
+
+	/* Query without arguments carries only the frame head */
+	agent_hdr_init(&s, 0);
+	agent_hdr_set_type(&s, AGENT_REQ_FLAG_GET);
+	test++; if (agent_hdr_send(&s) != AGENT_OK ||
+	            ioctl(r.in, FIONREAD, &pending) != 0 || pending != 6)
+		printf("agent_frame_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (agent_hdr_recv(&r) != AGENT_OK ||
+	            agent_hdr_get_type(&r) != AGENT_REQ_FLAG_GET ||
+	            r.rhdr.status != 0 || agent_hdr_get_arg_int(&r) != 0 ||
+	            num_cmp_i(agent_hdr_get_arg_num(&r), 0) != 0 ||
+	            r.rhdr.arg_len != 0 || agent_hdr_get_arg_str(&r)[0] != '\0')
+		printf("agent_frame_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* All fields set */
+	agent_hdr_init(&s, AGENT_ERR_POLICY);
+	agent_hdr_set_type(&s, AGENT_REQ_REPLY);
+	agent_hdr_set_int(&s, -5, 7);
+	agent_hdr_set_num(&s, &num);
+	agent_hdr_set_str(&s, "label");
+	test++; if (agent_hdr_send(&s) != AGENT_OK ||
+	            agent_hdr_recv(&r) != AGENT_OK ||
+	            r.rhdr.status != AGENT_ERR_POLICY ||
+	            agent_hdr_get_arg_int(&r) != -5 ||
+	            agent_hdr_get_arg_int2(&r) != 7 ||
+	            num_cmp(agent_hdr_get_arg_num(&r), num) != 0 ||
+	            strcmp(agent_hdr_get_arg_str(&r), "label") != 0)
+		printf("agent_frame_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Data argument larger than socket buffer might be */
+	fflush(NULL);
+	child = fork();
+	if (child == 0) {
+		char *buff = malloc(data_len);
+		if (!buff)
+			exit(1);
+		for (i = 0; i < data_len; i++)
+			buff[i] = i % 251;
+		agent_hdr_init(&s, 0);
+		agent_hdr_set_type(&s, AGENT_REQ_REPLY);
+		agent_hdr_set_data(&s, buff, data_len);
+		exit(agent_hdr_send(&s) == AGENT_OK ? 0 : 1);
+	}
+
+	test++; if (child == -1 || agent_hdr_recv(&r) != AGENT_OK) {
+		printf("agent_frame_testcase[%2d] failed (%d)\n", test, failed++);
+	} else {
+		data = agent_hdr_get_arg_data(&r, &length);
+		for (i = 0; i < length; i++)
+			if (data[i] != (char)(i % 251))
+				break;
+		test++; if (length != data_len || i != data_len)
+			printf("agent_frame_testcase[%2d] failed (%d)\n", test, failed++);
+	}
+	if (child > 0)
+		waitpid(child, NULL, 0);
+
+	close(sv[0]);
+	close(sv[1]);
+
+cleanup:
+	free(r.data_buff);
+	printf("agent_frame_testcases %d FAILED %d PASSED\n", failed, test-failed);
+	return failed;
+}
+
+/* Connect to daemon without talking to it */
+static int _daemon_silent_client(const char *socket_path)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Returns 1 if daemon closes connection within timeout.
+ * Initial reply of the session is skipped. */
+static int _daemon_closed(int fd, int timeout)
+{
+	struct pollfd pfd;
+	char buff[100];
+	ssize_t ret;
+
+	do {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, timeout) != 1)
+			return 0;
+		ret = read(fd, buff, sizeof(buff));
+	} while (ret > 0);
+	return ret == 0;
+}
+
+int daemon_testcase(void)
+{
+	cfg_t *cfg = cfg_get();
+	const int sessions = cfg->daemon_sessions;
+	const int timeout = cfg->daemon_timeout;
+	int silent[3];
+	const char *socket_path = "/tmp/otpagent_testcase.sock";
+	const char *alphabet = NULL, *reply = NULL;
+	agent *a = NULL;
+	int failed = 0;
+	int test = 0;
+	int ret = AGENT_ERR_NO_DAEMON;
+	int i;
+	pid_t daemon;
+
+	/* Small limits so they can be reached */
+	cfg->daemon_sessions = 2;
+	cfg->daemon_timeout = 2;
+
+	fflush(NULL);
+	daemon = fork();
+	if (daemon == 0) {
+		/* Returns only on error */
+		exit(daemon_run(socket_path));
+	}
+
+	cfg->daemon_sessions = sessions;
+	cfg->daemon_timeout = timeout;
+
+	if (daemon == -1) {
+		printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+		goto cleanup;
+	}
+
+	/* Wait until it listens */
+	for (i = 0; i < 100 && ret == AGENT_ERR_NO_DAEMON; i++) {
+		ret = agent_connect_socket(&a, socket_path);
+		if (ret == AGENT_ERR_NO_DAEMON)
+			usleep(10000);
+	}
+
+	test++; if (ret != AGENT_OK) {
+		printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+		goto cleanup;
+	}
+
+	/* Request served by daemon must match the local one */
+	test++; if (ppp_alphabet_get(1, &alphabet) != 0 ||
+	            agent_get_alphabet(a, 1, &reply) != 0 ||
+	            strcmp(alphabet, reply) != 0)
+		printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+
+	ret = agent_state_load(a);
+	test++; if (ret != AGENT_OK && ret != STATE_NON_EXISTENT)
+		printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (agent_disconnect(a) != 0)
+		printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+	a = NULL;
+
+	/* Daemon keeps serving other clients */
+	test++; if (agent_connect_socket(&a, socket_path) != AGENT_OK ||
+	            agent_get_alphabet(a, 1, &reply) != 0 ||
+	            agent_disconnect(a) != 0)
+		printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+	a = NULL;
+
+	/* Batch of passcodes spanning several reply frames
+	 * must match passcodes read one by one */
+	test++; if (agent_connect_socket(&a, socket_path) != AGENT_OK ||
+	            agent_state_new(a) != AGENT_OK ||
+	            agent_key_generate(a) != AGENT_OK) {
+		printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+	} else {
+		char passcodes[100 * 17];
+		char passcode[17];
+		num_t counter = num_i(1234);
+
+		ret = agent_get_passcodes(a, counter, 100, passcodes);
+		test++; if (ret != AGENT_OK)
+			printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+
+		for (i = 0; i < 100 && ret == AGENT_OK; i++) {
+			if (agent_get_passcode(a, num_add_i(counter, i), passcode) != AGENT_OK ||
+			    strcmp(passcode, passcodes + i * 17) != 0)
+				break;
+		}
+		test++; if (i != 100)
+			printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+
+		/* Connection is still in sync */
+		test++; if (agent_get_passcodes(a, counter, AGENT_PASSCODES_MAX + 1,
+		                                passcodes) != AGENT_ERR_REQ_ARG ||
+		            agent_get_alphabet(a, 1, &reply) != AGENT_OK)
+			printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+	}
+	if (a) {
+		(void) agent_state_drop(a);
+		(void) agent_disconnect(a);
+		a = NULL;
+	}
+
+	/* Session of other user doesn't keep groups of root daemon */
+	if (security_is_privileged()) {
+		pid_t session;
+		int status = 1;
+
+		fflush(NULL);
+		session = fork();
+		if (session == 0) {
+			gid_t groups[256] = { 0 };
+			int n;
+
+			/* Daemon might have been started without any */
+			if (setgroups(1, groups) != 0)
+				_exit(1);
+			security_set_peer(65534, 65534);
+			security_permanent_drop();
+			n = getgroups(sizeof(groups) / sizeof(*groups), groups);
+			if (n < 0 || getegid() == 0)
+				_exit(1);
+			for (i = 0; i < n; i++) {
+				if (groups[i] == 0)
+					_exit(1);
+			}
+			_exit(0);
+		}
+		test++; if (session == -1 || waitpid(session, &status, 0) != session ||
+		            !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+	}
+
+	/* Let finished sessions exit */
+	usleep(100000);
+
+	/* Clients over the limit are refused, idle ones are dropped */
+	for (i = 0; i < 3; i++)
+		silent[i] = _daemon_silent_client(socket_path);
+
+	test++; if (silent[0] == -1 || silent[1] == -1 || silent[2] == -1 ||
+	            !_daemon_closed(silent[2], 1000))
+		printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (silent[0] == -1 || _daemon_closed(silent[0], 500))
+		printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (silent[0] == -1 || silent[1] == -1 ||
+	            !_daemon_closed(silent[0], 5000) ||
+	            !_daemon_closed(silent[1], 5000))
+		printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Their slots are free again */
+	usleep(100000);
+	test++; if (agent_connect_socket(&a, socket_path) != AGENT_OK ||
+	            agent_get_alphabet(a, 1, &reply) != 0 ||
+	            agent_disconnect(a) != 0)
+		printf("daemon_testcase[%2d] failed (%d)\n", test, failed++);
+	a = NULL;
+
+	for (i = 0; i < 3; i++) {
+		if (silent[i] != -1)
+			close(silent[i]);
+	}
+
+cleanup:
+	if (daemon > 0) {
+		kill(daemon, SIGTERM);
+		waitpid(daemon, NULL, 0);
+	}
+	unlink(socket_path);
+
+	printf("daemon_testcases %d FAILED %d PASSED\n", failed, test-failed);
+	return failed;
+}
+
+
+/***************************
+ * Group commit testcases
+ **************************/
+
+/* Counter of the user in text database, -1 if user is missing */
+static long _commit_testcase_counter(const char *db_path, const char *username)
+{
+	char line[STATE_ENTRY_SIZE];
+	const size_t length = strlen(username);
+	const char *field;
+	long counter = -1;
+	FILE *f = fopen(db_path, "r");
+
+	if (!f)
+		return -1;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, username, length) != 0 || line[length] != ':')
+			continue;
+		/* Counter is the fourth field */
+		field = strchr(strchr(line + length + 1, ':') + 1, ':') + 1;
+		counter = strtol(field, NULL, 16);
+		break;
+	}
+	fclose(f);
+	return counter;
+}
+
+int commit_testcase(void)
+{
+#define ENTRY ":1:00112233445566778899AABBCCDDEEFF00112233445566778899aabbccddeeff:%X:0:0:0:0:4:1:5::0::\n"
+	const char *db_path = "/tmp/otpasswd_testcase.db";
+	const int sessions = 8, updates_per_session = 20;
+	char entries[5][STATE_ENTRY_SIZE];
+	char *updates[5];
+	char name[20];
+	char saved_path[CONFIG_PATH_LEN];
+	char *lck = NULL, *tmp = NULL;
+	int failed = 0;
+	int test = 0;
+	int i, channel, status, running;
+	pid_t child;
+	state s;
+	FILE *f;
+	cfg_t *cfg = cfg_get();
+
+	lck = malloc(strlen(db_path) + 5);
+	tmp = malloc(strlen(db_path) + 5);
+	sprintf(lck, "%s.lck", db_path);
+	sprintf(tmp, "%s.tmp", db_path);
+
+	f = fopen(db_path, "w");
+	test++; if (!f) {
+		printf("commit_testcase[%2d] failed (%d)\n", test, failed++);
+		goto cleanup;
+	}
+	for (i = 0; i < 100; i++)
+		fprintf(f, "user%d" ENTRY, i, i);
+	fclose(f);
+
+	/* Replace, remove, add and update one user twice */
+	sprintf(entries[0], "user5" ENTRY, 0x500);
+	sprintf(entries[1], "user7");
+	sprintf(entries[2], "newuser" ENTRY, 1);
+	sprintf(entries[3], "user9" ENTRY, 0x901);
+	sprintf(entries[4], "user9" ENTRY, 0x902);
+	for (i = 0; i < 5; i++)
+		updates[i] = entries[i];
+
+	test++; if (db_file_commit(db_path, updates, 5) != 0)
+		printf("commit_testcase[%2d] failed (%d)\n", test, failed++);
+
+	test++; if (_commit_testcase_counter(db_path, "user5") != 0x500 ||
+	            _commit_testcase_counter(db_path, "user7") != -1 ||
+	            _commit_testcase_counter(db_path, "user9") != 0x902 ||
+	            _commit_testcase_counter(db_path, "newuser") != 1 ||
+	            _commit_testcase_counter(db_path, "user99") != 99)
+		printf("commit_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Malformed update rejects the whole batch */
+	print_config(PRINT_STDOUT | PRINT_NONE);
+	sprintf(entries[0], "user5" ENTRY, 0x501);
+	sprintf(entries[1], "user6:1:0\n:");
+	i = db_file_commit(db_path, updates, 2);
+	print_config(PRINT_STDOUT);
+	test++; if (i != STATE_PARSE_ERROR ||
+	            _commit_testcase_counter(db_path, "user5") != 0x500 ||
+	            access(tmp, F_OK) == 0)
+		printf("commit_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Direct writer unlinks the lock file before releasing it;
+	 * committer waiting for it must lock the new one */
+	{
+		int ready[2];
+		char c = 0;
+
+		test++; if (pipe(ready) != 0) {
+			printf("commit_testcase[%2d] failed (%d)\n", test, failed++);
+			goto cleanup;
+		}
+
+		fflush(NULL);
+		child = fork();
+		if (child == 0) {
+			int fd = open(lck, O_RDWR|O_CREAT, S_IWUSR|S_IRUSR);
+			close(ready[0]);
+			if (fd == -1 || db_file_lock_range(fd, F_WRLCK, 0, 0) != 0 ||
+			    write(ready[1], &c, 1) != 1)
+				_exit(1);
+			usleep(50000);
+			unlink(lck);
+			(void) db_file_lock_range(fd, F_UNLCK, 0, 0);
+			_exit(0);
+		}
+		close(ready[1]);
+
+		sprintf(entries[0], "user5" ENTRY, 0x502);
+		test++; if (child == -1 || read(ready[0], &c, 1) != 1 ||
+		            db_file_commit(db_path, updates, 1) != 0 ||
+		            access(lck, F_OK) != 0 ||
+		            _commit_testcase_counter(db_path, "user5") != 0x502)
+			printf("commit_testcase[%2d] failed (%d)\n", test, failed++);
+
+		close(ready[0]);
+		if (child != -1)
+			waitpid(child, NULL, 0);
+	}
+
+	/* Concurrent sessions storing through committer */
+	strcpy(saved_path, cfg->global_db_path);
+	strcpy(cfg->global_db_path, db_path);
+	fflush(NULL);
+	for (i = 0; i < sessions; i++) {
+		channel = commit_channel();
+		if (channel == -1)
+			break;
+
+		child = fork();
+		if (child == 0) {
+			int j, errors = 0;
+
+			print_config(PRINT_STDOUT | PRINT_NONE);
+			commit_session(channel);
+			cfg->db = CONFIG_DB_GLOBAL;
+
+			sprintf(name, "user%d", i);
+			state_init(&s, name);
+
+			/* Lock of the session as taken by db_file_lock */
+			s.lock = open(lck, O_RDWR|O_CREAT, S_IWUSR|S_IRUSR);
+			if (db_file_lock_range(s.lock, F_WRLCK,
+			                       db_index_lock_offset(name), 1) != 0)
+				exit(1);
+
+			for (j = 1; j <= updates_per_session; j++) {
+				s.counter = num_i(0x1000 * i + j);
+				if (db_file_store(&s, 0) != 0)
+					errors++;
+			}
+
+			/* Last session leaves */
+			if (i == sessions - 1 && db_file_store(&s, 1) != 0)
+				errors++;
+			exit(errors);
+		}
+		close(channel);
+		if (child == -1)
+			break;
+	}
+
+	test++; if (i != sessions)
+		printf("commit_testcase[%2d] failed (%d)\n", test, failed++);
+
+	print_config(PRINT_STDOUT | PRINT_NONE);
+	for (running = i; running > 0; ) {
+		if (commit_serve(-1, 10) == -1)
+			break;
+		while (running > 0 && (child = waitpid(-1, &status, WNOHANG)) > 0) {
+			running--;
+			test++; if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				printf("commit_testcase[%2d] failed (%d)\n", test, failed++);
+		}
+	}
+	print_config(PRINT_STDOUT);
+	strcpy(cfg->global_db_path, saved_path);
+
+	test++; if (running != 0)
+		printf("commit_testcase[%2d] failed (%d)\n", test, failed++);
+
+	for (i = 0; i < sessions - 1; i++) {
+		sprintf(name, "user%d", i);
+		test++; if (_commit_testcase_counter(db_path, name) != 0x1000 * i + updates_per_session)
+			printf("commit_testcase[%2d] failed (%d)\n", test, failed++);
+	}
+
+	sprintf(name, "user%d", sessions - 1);
+	test++; if (_commit_testcase_counter(db_path, name) != -1 ||
+	            _commit_testcase_counter(db_path, "user99") != 99)
+		printf("commit_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Conversion is refused until indexed format is configured */
+	{
+		const int saved_db = cfg->db;
+
+		strcpy(cfg->global_db_path, db_path);
+		cfg->db = CONFIG_DB_GLOBAL;
+		print_config(PRINT_STDOUT | PRINT_NONE);
+		test++; if (ppp_db_convert() != PPP_ERROR ||
+		            _commit_testcase_counter(db_path, "user99") != 99)
+			printf("commit_testcase[%2d] failed (%d)\n", test, failed++);
+
+		print_config(PRINT_STDOUT);
+		cfg->db = saved_db;
+		strcpy(cfg->global_db_path, saved_path);
+	}
+
+cleanup:
+	unlink(db_path);
+	unlink(lck);
+	unlink(tmp);
+	free(lck);
+	free(tmp);
+
+	printf("commit_testcases %d FAILED %d PASSED\n", failed, test-failed);
+	return failed;
+#undef ENTRY
+}
+
 /***************************
  * PPP Testcases
  **************************/
@@ -652,6 +2331,7 @@ int ppp_testcase(int fast)
 	char *current_user = security_get_calling_user();
 	int tmp;
 	int stat_tests = (fast == 1) ? 500 : 120000;
+	state s2;
 	
 	const unsigned char ex_bin[32] = {
 		0x00, 0x00, 0x00, 0x00,
@@ -744,6 +2424,71 @@ int ppp_testcase(int fast)
 	_PPP_TEST(70+34, 7, 'A', 7, "Ao_\"e82");
 	_PPP_TEST(70+36, 7, 'C', 7, "(&JV?E_");
 
+	/* Batch generation must match single passcodes; count
+	 * not divisible by batch size, salt enabled */
+	{
+		char passcodes[37 * 17];
+		const unsigned int flags = s.flags;
+		int i;
+		s.flags |= FLAG_SALTED;
+		s.counter = num_ii(0x12, 1000);
+		printf("ppp_testcase[%2d]: batch of 37 passcodes", test++);
+		if (ppp_get_passcodes(&s, s.counter, 37, passcodes) != 0) {
+			printf(" FAILED\n");
+			failed++;
+		} else {
+			for (i = 0; i < 37; i++) {
+				ppp_get_passcode(&s, num_add_i(s.counter, i), passcode);
+				if (strcmp(passcode, passcodes + i * 17) != 0)
+					break;
+			}
+			if (i == 37) {
+				printf(" PASSED\n");
+			} else {
+				printf(" FAILED\n");
+				failed++;
+			}
+		}
+		s.flags = flags;
+	}
+
+	/* Alphabet encoding must equal repeated division */
+	printf("ppp_testcase[%2d]: alphabet encoding", test++);
+	{
+		int id, i, errors = 0;
+		const char *alphabet;
+		unsigned char cnt_bin[16], cipher_bin[16];
+		num_t cipher;
+		char expected[17];
+		const unsigned int flags = s.flags;
+		s.flags &= ~FLAG_SALTED;
+		s.code_length = 16;
+		for (id = 1; id < ppp_alphabet_count; id++) {
+			ppp_alphabet_get(id, &alphabet);
+			s.alphabet = id;
+			for (tmp = 0; tmp < 50; tmp++) {
+				const num_t cnt = num_ii(tmp, 0x1234567ULL * tmp);
+				num_export(cnt, (char *)cnt_bin, NUM_FORMAT_BIN);
+				crypto_aes_encrypt(s.sequence_key, cnt_bin, cipher_bin);
+				num_import(&cipher, (char *)cipher_bin, NUM_FORMAT_BIN);
+				for (i = 0; i < 16; i++)
+					expected[i] = alphabet[num_div_i(&cipher, cipher, strlen(alphabet))];
+				expected[i] = '\0';
+
+				ppp_get_passcode(&s, cnt, passcode);
+				if (strcmp(passcode, expected) != 0)
+					errors++;
+			}
+		}
+		s.alphabet = 1;
+		s.flags = flags;
+		if (errors) {
+			printf(" FAILED (%d)\n", errors);
+			failed++;
+		} else
+			printf(" PASSED\n");
+	}
+
 	state_fini(&s);
 
 	/* Authenticate testcase */
@@ -768,6 +2513,105 @@ int ppp_testcase(int fast)
 		failed++;
 	}
 
+	/* Look-ahead window authentication */
+	printf("*** Window authenticate testcase\n");
+	if (state_init(&s, current_user) != 0 || ppp_window_load(&s) != 0) {
+		printf("ppp_testcase[%2d]: window load FAILED\n", test++);
+		failed++;
+	} else if (state_init(&s2, current_user) != 0) {
+		printf("ppp_testcase[%2d]: window state FAILED\n", test++);
+		failed++;
+	} else {
+		num_t counter = s.counter;
+		char skipped[17];
+
+		ppp_get_passcode(&s, num_add_i(counter, 3), skipped);
+		ppp_get_passcode(&s, num_add_i(counter, 2), passcode);
+
+		/* Outside of window */
+		printf("ppp_testcase[%2d]: window miss", test++);
+		if (ppp_window_authenticate(&s, skipped, 3) != 3) {
+			printf(" FAILED\n");
+			failed++;
+		} else printf(" PASSED\n");
+
+		printf("ppp_testcase[%2d]: window hit", test++);
+		if (ppp_window_authenticate(&s, passcode, 3) != 0 ||
+		    num_cmp(s.counter, num_add_i(counter, 3)) != 0) {
+			printf(" FAILED\n");
+			failed++;
+		} else printf(" PASSED\n");
+		state_fini(&s);
+
+		/* Counter was stored; passcode can't be reused */
+		printf("ppp_testcase[%2d]: window replay", test++);
+		if (state_init(&s, current_user) != 0 || ppp_window_load(&s) != 0 ||
+		    num_cmp(s.counter, num_add_i(counter, 3)) != 0 ||
+		    ppp_window_authenticate(&s, passcode, 3) != 3 ||
+		    ppp_window_authenticate(&s, skipped, 3) != 0) {
+			printf(" FAILED\n");
+			failed++;
+		} else printf(" PASSED\n");
+		state_fini(&s);
+
+		/* Failed try uses up the prompted passcode */
+		printf("ppp_testcase[%2d]: window failure", test++);
+		if (state_init(&s, current_user) != 0 || ppp_window_load(&s) != 0 ||
+		    ppp_get_passcode(&s, s.counter, passcode) != 0 ||
+		    ppp_window_authenticate(&s, skipped, 3) != 3 ||
+		    ppp_failures(&s, 0) != 0 ||
+		    ppp_state_load(&s2, PPP_DONT_LOCK) != 0 ||
+		    num_cmp(s2.counter, num_add_i(s.counter, 1)) != 0 ||
+		    s2.failures != s.failures + 1 ||
+		    ppp_window_load(&s) != 0 ||
+		    ppp_window_authenticate(&s, passcode, 3) != 3) {
+			printf(" FAILED\n");
+			failed++;
+		} else printf(" PASSED\n");
+		state_fini(&s);
+
+		/* User disabled while answering the prompt */
+		printf("ppp_testcase[%2d]: window disabled", test++);
+		if (state_init(&s, current_user) != 0 || ppp_window_load(&s) != 0 ||
+		    ppp_get_passcode(&s, s.counter, passcode) != 0 ||
+		    ppp_state_load(&s2, 0) != 0) {
+			printf(" FAILED\n");
+			failed++;
+		} else {
+			ppp_flag_add(&s2, FLAG_DISABLED);
+			if (ppp_state_release(&s2, PPP_STORE | PPP_UNLOCK) != 0 ||
+			    ppp_window_authenticate(&s, passcode, 3) != PPP_ERROR_DISABLED) {
+				printf(" FAILED\n");
+				failed++;
+			} else printf(" PASSED\n");
+
+			if (ppp_state_load(&s2, 0) == 0) {
+				ppp_flag_del(&s2, FLAG_DISABLED);
+				(void) ppp_state_release(&s2, PPP_STORE | PPP_UNLOCK);
+			}
+		}
+		state_fini(&s);
+
+		/* Key regenerated while answering the prompt; counter
+		 * alone doesn't tell */
+		printf("ppp_testcase[%2d]: window new key", test++);
+		if (state_init(&s, current_user) != 0 || ppp_window_load(&s) != 0 ||
+		    ppp_get_passcode(&s, s.counter, passcode) != 0 ||
+		    state_load(&s2) != 0 || state_key_generate(&s2) != 0) {
+			printf(" FAILED\n");
+			failed++;
+		} else {
+			s2.counter = s.counter;
+			if (state_store(&s2, 0) != 0 ||
+			    ppp_window_authenticate(&s, passcode, 3) != 3) {
+				printf(" FAILED\n");
+				failed++;
+			} else printf(" PASSED\n");
+		}
+		state_fini(&s2);
+	}
+	state_fini(&s);
+
 	free(current_user);
 	return failed;
 }
@@ -784,6 +2628,78 @@ int config_testcase(void)
 		return 0;
 }
 
+/* Read whole log into buff; returns its length or -1 */
+static int _print_testcase_read(const char *path, char *buff, size_t size)
+{
+	int len;
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return -1;
+	len = fread(buff, 1, size - 1, f);
+	buff[len] = '\0';
+	fclose(f);
+	return len;
+}
+
+int print_testcase(void)
+{
+	static const int levels[] = {
+		PRINT_NONE, PRINT_ERROR, PRINT_WARN, PRINT_NOTICE
+	};
+	const char *log = "/tmp/otpasswd_print_testcase.log";
+	cfg_t *cfg = cfg_get();
+	char buff[4096];
+	char *first, *second, *third;
+	int failed = 0;
+	int test = 0;
+	int i, len;
+
+	unlink(log);
+	if (print_init(PRINT_NOTICE, log) != 0 ||
+	    print_buffer(256) != 0)
+		printf("print_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Notices and warnings wait in memory... */
+	print(PRINT_NOTICE, "first\n");
+	print(PRINT_WARN, "second\n");
+	test++; if (_print_testcase_read(log, buff, sizeof(buff)) != 0)
+		printf("print_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* ...until an error writes them in order */
+	print(PRINT_ERROR, "third\n");
+	len = _print_testcase_read(log, buff, sizeof(buff));
+	first = strstr(buff, "NOTICE:  first\n");
+	second = strstr(buff, "WARNING: second\n");
+	third = strstr(buff, "ERROR:   third\n");
+	test++; if (len <= 0 || !first || !second || !third ||
+	            first > second || second > third)
+		printf("print_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Full buffer is written out */
+	for (i = 0; i < 20; i++)
+		print(PRINT_NOTICE, "notice %02d\n", i);
+	test++; if (_print_testcase_read(log, buff, sizeof(buff)) <= len ||
+	            !strstr(buff, "notice 00\n"))
+		printf("print_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Unbuffered log is written at once */
+	len = _print_testcase_read(log, buff, sizeof(buff));
+	test++; if (print_buffer(0) != 0)
+		printf("print_testcase[%2d] failed (%d)\n", test, failed++);
+	print(PRINT_NOTICE, "last\n");
+	test++; if (_print_testcase_read(log, buff, sizeof(buff)) <= len ||
+	            !strstr(buff, "NOTICE:  last\n"))
+		printf("print_testcase[%2d] failed (%d)\n", test, failed++);
+
+	/* Back to logging of ppp_init */
+	print_fini();
+	(void) print_init(PRINT_STDOUT | levels[cfg->pam_logging], NULL);
+	unlink(log);
+
+	printf("print_testcases %d FAILED %d PASSED\n", failed, test-failed);
+	return failed;
+}
+
 
 int num_testcase(int fast)
 {
@@ -1077,6 +2993,36 @@ int num_testcase(int fast)
 	if (i >= 30000) 
 		printf("OK\n");
 
+	/* Native 128 bit path must match portable one */
+	printf("* Native vs portable mul/div (%s): ",
+	       NUM_HAVE_INT128 ? "int128" : "portable only");
+	a = num_ii(0x0123456789ABCDEFULL, 0xFEDCBA9876543210ULL);
+	for (i = 0; i < passes; i++) {
+		num_t q1, q2;
+		uint64_t r1, r2;
+		bi = (0x9E3779B97F4A7C15ULL * (i + 1)) >> (i % 64);
+		if (bi == 0)
+			bi = 1;
+
+		r1 = num_div_i(&q1, a, bi);
+		r2 = num_div_i_generic(&q2, a, bi);
+		if (r1 != r2 || num_cmp(q1, q2) != 0)
+			break;
+
+		/* Small multiplier so the product fits in 128 bits */
+		c = num_mul_i(q1, bi);
+		d = num_mul_i_generic(q2, bi);
+		if (num_cmp(c, d) != 0)
+			break;
+
+		a = num_add(num_mul_i(num_ii(0, a.hi ^ a.lo), 0x5851F42D4C957F2DULL),
+		            num_i(i));
+	}
+	if (i != passes) {
+		printf("FAILED at %d\n", i);
+		failed++;
+	} else printf("OK\n");
+
 #else
 
 	unsigned char num[16];
@@ -30,9 +30,19 @@ extern int crypto_testcase(void);
 extern int num_testcase(int fast);
 extern int card_testcase(void);
 extern int state_testcase(void);
+extern int db_entry_testcase(int fast);
+extern int db_index_testcase(void);
+extern int wal_testcase(void);
+extern int sync_testcase(void);
+extern int bulk_testcase(void);
+extern int trace_testcase(void);
+extern int agent_frame_testcase(void);
+extern int daemon_testcase(void);
+extern int commit_testcase(void);
 extern int spass_testcase(void);
 extern int ppp_testcase(int fast);
 extern int config_testcase(void);
+extern int print_testcase(void);
 
 
 #endif
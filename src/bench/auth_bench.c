@@ -0,0 +1,338 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Authentication benchmark. Generates a global database of
+ *   synthetic users and measures logins (ppp_increment followed by
+ *   ppp_authenticate) done by concurrent processes.
+ **********************************************************************/
+
+#define _GNU_SOURCE	/* setresuid */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#define PPP_INTERNAL 1
+#include "ppp.h"
+#include "db.h"
+#include "config.h"
+#include "print.h"
+
+typedef struct {
+	const char *name;
+	int format;	/* CONFIG_DB_FORMAT_* */
+	int wal;	/* CONFIG_ENABLED/DISABLED */
+} bench_backend;
+
+static const bench_backend _backends[] = {
+	{ "text", CONFIG_DB_FORMAT_TEXT, CONFIG_DISABLED },
+	{ "wal", CONFIG_DB_FORMAT_TEXT, CONFIG_ENABLED },
+	{ "indexed", CONFIG_DB_FORMAT_INDEXED, CONFIG_DISABLED },
+};
+
+static const int _backends_count = sizeof(_backends) / sizeof(*_backends);
+
+/* Microseconds since some unspecified point */
+static unsigned long long _bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void _bench_username(char *buff, int i)
+{
+	sprintf(buff, "bench%07d", i);
+}
+
+/* Write text database of users sharing a single key */
+static int _bench_generate(const char *path, int users)
+{
+	char entry[STATE_ENTRY_SIZE];
+	char username[16];
+	char *state_username;
+	state s;
+	FILE *f;
+	int i, ret;
+
+	ret = state_init(&s, "bench");
+	if (ret != 0)
+		return ret;
+
+	ret = state_key_generate(&s);
+	if (ret != 0)
+		goto cleanup;
+
+	f = fopen(path, "w");
+	if (!f) {
+		print_perror(PRINT_ERROR, "Unable to create %s", path);
+		ret = 1;
+		goto cleanup;
+	}
+
+	state_username = s.username;
+	s.username = username;
+	for (i = 0; i < users && ret == 0; i++) {
+		_bench_username(username, i);
+		ret = db_file_generate_entry(&s, entry, sizeof(entry));
+		if (ret == 0 && fputs(entry, f) == EOF)
+			ret = 1;
+	}
+	s.username = state_username;
+
+	if (fclose(f) != 0)
+		ret = 1;
+
+cleanup:
+	state_fini(&s);
+	return ret;
+}
+
+/* Remove database together with its lock, temporary file and log */
+static void _bench_remove(const char *path)
+{
+	static const char *suffixes[] = { "", ".lck", ".tmp", ".wal", ".text" };
+	char name[CONFIG_PATH_LEN + 8];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(suffixes) / sizeof(*suffixes); i++) {
+		snprintf(name, sizeof(name), "%s%s", path, suffixes[i]);
+		(void) unlink(name);
+	}
+}
+
+/* Single worker process. Returns number of failed logins */
+static int _bench_worker(int worker, int users, int logins, unsigned int *latency)
+{
+	char username[16];
+	char passcode[17];
+	unsigned int seed = 2654435761u * (worker + 1);
+	unsigned long long started;
+	state *s;
+	int i, ret, failed = 0;
+
+	for (i = 0; i < logins; i++) {
+		_bench_username(username, rand_r(&seed) % users);
+
+		started = _bench_now();
+		ret = ppp_state_init(&s, username);
+		if (ret == 0) {
+			ret = ppp_increment(s);
+			if (ret == 0)
+				ret = ppp_get_current(s, passcode);
+			if (ret == 0)
+				ret = ppp_authenticate(s, passcode);
+			ppp_state_fini(s);
+		}
+		latency[i] = _bench_now() - started;
+
+		/* Don't repeat the same error for each login */
+		if (ret != 0) {
+			print(PRINT_ERROR, "Login of %s failed (%d)\n", username, ret);
+			failed = logins - i;
+			break;
+		}
+	}
+	return failed;
+}
+
+static int _bench_cmp(const void *a, const void *b)
+{
+	const unsigned int x = *(const unsigned int *) a;
+	const unsigned int y = *(const unsigned int *) b;
+	return x < y ? -1 : x > y;
+}
+
+static unsigned int _bench_percentile(const unsigned int *sorted, int count, double p)
+{
+	int i = (int) (p / 100.0 * count);
+	if (i >= count)
+		i = count - 1;
+	return sorted[i];
+}
+
+static int _bench_run(const bench_backend *b, const char *dir,
+                      int users, int processes, int logins)
+{
+	cfg_t *cfg = cfg_get();
+	const int total = processes * logins;
+	char text[CONFIG_PATH_LEN + 8];
+	unsigned int *latency;
+	unsigned long long started, elapsed;
+	int i, status, ret = 1, failed = 0;
+	pid_t pid;
+
+	snprintf(cfg->global_db_path, sizeof(cfg->global_db_path),
+	         "%s/otpasswd_bench_%s", dir, b->name);
+	cfg->db = CONFIG_DB_GLOBAL;
+	cfg->db_format = b->format;
+	cfg->db_wal = b->wal;
+
+	_bench_remove(cfg->global_db_path);
+
+	/* Indexed database is converted from a text one */
+	if (b->format == CONFIG_DB_FORMAT_INDEXED) {
+		snprintf(text, sizeof(text), "%s.text", cfg->global_db_path);
+		if (_bench_generate(text, users) != 0 ||
+		    db_index_convert(text, cfg->global_db_path) != 0)
+			goto cleanup;
+		(void) unlink(text);
+	} else if (_bench_generate(cfg->global_db_path, users) != 0) {
+		goto cleanup;
+	}
+
+	/* Workers write latencies of their logins here */
+	latency = mmap(NULL, total * sizeof(*latency), PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (latency == MAP_FAILED) {
+		print_perror(PRINT_ERROR, "Unable to allocate latency table");
+		goto cleanup;
+	}
+
+	fflush(NULL);
+	started = _bench_now();
+	for (i = 0; i < processes; i++) {
+		pid = fork();
+		if (pid == 0) {
+			failed = _bench_worker(i, users, logins, latency + i * logins);
+			fflush(NULL);
+			_exit(failed ? 1 : 0);
+		}
+		if (pid == -1) {
+			print_perror(PRINT_ERROR, "Unable to fork benchmark worker");
+			failed++;
+		}
+	}
+
+	while (wait(&status) != -1) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed++;
+	}
+	elapsed = _bench_now() - started;
+
+	qsort(latency, total, sizeof(*latency), _bench_cmp);
+	printf("%-8s users=%-7d processes=%-3d %9.0f logins/s  "
+	       "p50=%u p90=%u p99=%u p99.9=%u max=%u us%s\n",
+	       b->name, users, processes,
+	       total / (elapsed / 1e6),
+	       _bench_percentile(latency, total, 50),
+	       _bench_percentile(latency, total, 90),
+	       _bench_percentile(latency, total, 99),
+	       _bench_percentile(latency, total, 99.9),
+	       latency[total - 1],
+	       failed ? "  (FAILED LOGINS)" : "");
+
+	munmap(latency, total * sizeof(*latency));
+	ret = failed ? 2 : 0;
+
+cleanup:
+	_bench_remove(cfg->global_db_path);
+	return ret;
+}
+
+static void _bench_usage(const char *name)
+{
+	printf("Usage: %s [options]\n"
+	       "Measures logins against synthetic global databases.\n\n"
+	       "  -u USERS      users in database (default 1000; 1 - 1000000)\n"
+	       "  -n LOGINS     logins per process (default 1000)\n"
+	       "  -p PROCESSES  concurrent processes (default 1; 1 - 256)\n"
+	       "  -b BACKEND    text, wal, indexed or all (default all)\n"
+	       "  -d DIR        directory for databases (default /tmp)\n\n"
+	       "Remaining policy is read from the config file. As for DB=global,\n"
+	       CONFIG_DIR " must exist and belong to USER from config.\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = "/tmp";
+	const char *backend = "all";
+	int users = 1000, logins = 1000, processes = 1;
+	int i, opt, ran = 0, ret = 0;
+	cfg_t *cfg;
+
+	while ((opt = getopt(argc, argv, "u:n:p:b:d:h")) != -1) {
+		switch (opt) {
+		case 'u': users = atoi(optarg); break;
+		case 'n': logins = atoi(optarg); break;
+		case 'p': processes = atoi(optarg); break;
+		case 'b': backend = optarg; break;
+		case 'd': dir = optarg; break;
+		default:
+			_bench_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (users < 1 || users > 1000000 || logins < 1 ||
+	    processes < 1 || processes > 256) {
+		_bench_usage(argv[0]);
+		return 1;
+	}
+
+	(void) print_init(PRINT_WARN | PRINT_STDOUT, NULL);
+
+	cfg = cfg_get();
+	if (!cfg) {
+		printf("Unable to read config file\n");
+		print_fini();
+		return 1;
+	}
+
+	/* Databases are accessed like the global one by the agent: as
+	 * USER from config, or as the caller if config has no USER */
+	if (cfg->user_uid == (uid_t) -1) {
+		cfg->user_uid = getuid();
+		cfg->user_gid = getgid();
+	} else if (getuid() == 0 &&
+	           (setresgid(cfg->user_gid, cfg->user_gid, cfg->user_gid) != 0 ||
+	            setresuid(cfg->user_uid, cfg->user_uid, cfg->user_uid) != 0)) {
+		print_perror(PRINT_ERROR, "Unable to switch to USER from config");
+		print_fini();
+		return 1;
+	}
+
+	if (getuid() != cfg->user_uid) {
+		printf("Benchmark must be run by root or USER from config file\n");
+		print_fini();
+		return 1;
+	}
+	umask(077);
+
+	for (i = 0; i < _backends_count; i++) {
+		if (strcmp(backend, "all") != 0 && strcmp(backend, _backends[i].name) != 0)
+			continue;
+		ran++;
+		if (_bench_run(&_backends[i], dir, users, processes, logins) != 0)
+			ret = 1;
+	}
+
+	if (!ran) {
+		printf("Unknown backend %s\n", backend);
+		ret = 1;
+	}
+
+	print_fini();
+	return ret;
+}
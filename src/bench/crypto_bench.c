@@ -0,0 +1,686 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Micro-benchmark of crypto and num primitives and of passcode
+ *   generation. Prints one line per operation: name, nanoseconds,
+ *   cycles and allocations per operation.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <getopt.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define BENCH_TSC 1
+#else
+#define BENCH_TSC 0
+#endif
+
+#if BENCH_OPENSSL
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#endif
+
+#define PPP_INTERNAL 1
+#include "ppp.h"
+#include "config.h"
+#include "print.h"
+#include "crypto.h"
+#include "num.h"
+
+#include "polarssl_aes.h"
+#include "aesni.h"
+#include "shani.h"
+#include "slow_aes256.h"
+#include "coreutils_sha256.h"
+
+/* Measurement settings */
+static unsigned long long _min_ns = 20000000;	/* Shortest measured run */
+static int _rounds = 3;				/* Best of that many runs */
+static const char *_filter = NULL;		/* Substring of names to run */
+
+/* Results are accumulated here so that compiler can't drop the work */
+static volatile unsigned int _sink;
+
+/***
+ * Allocation counting. Linux builds wrap allocator at link time,
+ * OpenSSL gets its own counting allocator.
+ ***/
+static unsigned long _allocs = 0;
+
+#if BENCH_WRAP_MALLOC
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t nmemb, size_t size);
+extern void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	_allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	_allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	_allocs++;
+	return __real_realloc(ptr, size);
+}
+#endif
+
+#if BENCH_OPENSSL && OPENSSL_VERSION_NUMBER >= 0x10100000L
+static void *_ossl_malloc(size_t size, const char *file, int line)
+{
+	(void) file; (void) line;
+	_allocs++;
+	return malloc(size);
+}
+
+static void *_ossl_realloc(void *ptr, size_t size, const char *file, int line)
+{
+	(void) file; (void) line;
+	_allocs++;
+	return realloc(ptr, size);
+}
+
+static void _ossl_free(void *ptr, const char *file, int line)
+{
+	(void) file; (void) line;
+	free(ptr);
+}
+#endif
+
+/***
+ * Harness
+ ***/
+typedef void (*bench_fn)(void *arg, unsigned long n);
+
+/* Nanoseconds since some unspecified point */
+static unsigned long long _bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned long long _bench_cycles(void)
+{
+#if BENCH_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* Run fn n times per measurement; best of _rounds measurements
+ * is reported. Number of iterations is raised until one run
+ * takes at least _min_ns. */
+static void _bench(const char *name, bench_fn fn, void *arg)
+{
+	unsigned long long started, cycles, ns;
+	unsigned long long best_ns = ~0ULL, best_cycles = ~0ULL;
+	unsigned long n = 1, allocs;
+	int i;
+
+	if (_filter && !strstr(name, _filter))
+		return;
+
+	for (;;) {
+		started = _bench_now();
+		fn(arg, n);
+		ns = _bench_now() - started;
+		if (ns >= _min_ns || n >= (1UL << 30))
+			break;
+		/* Jump close to required time */
+		n = ns > 0 && _min_ns / ns < 64 ? n * (_min_ns / ns + 1) : n * 64;
+	}
+
+	allocs = _allocs;
+	for (i = 0; i < _rounds; i++) {
+		started = _bench_now();
+		cycles = _bench_cycles();
+		fn(arg, n);
+		cycles = _bench_cycles() - cycles;
+		ns = _bench_now() - started;
+
+		if (ns < best_ns)
+			best_ns = ns;
+		if (cycles < best_cycles)
+			best_cycles = cycles;
+	}
+	allocs = _allocs - allocs;
+
+	if (BENCH_TSC)
+		printf("%-40s %10.1f %10.1f %8.2f\n", name,
+		       (double) best_ns / n, (double) best_cycles / n,
+		       (double) allocs / n / _rounds);
+	else
+		printf("%-40s %10.1f %10s %8.2f\n", name,
+		       (double) best_ns / n, "-", (double) allocs / n / _rounds);
+	fflush(stdout);
+}
+
+/* Shared input of benchmarks */
+static const unsigned char _key[32] = {
+	0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe,
+	0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+	0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7,
+	0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4,
+};
+static unsigned char _data[1024];
+
+/***
+ * AES
+ ***/
+static void _aes_polarssl_key(void *arg, unsigned long n)
+{
+	unsigned char out[16];
+	aes_context ctx;
+	(void) arg;
+
+	while (n--) {
+		aes_setkey_enc(&ctx, _key, 256);
+		aes_crypt_ecb(&ctx, AES_ENCRYPT, _data, out);
+		_sink += out[0];
+	}
+}
+
+static void _aes_polarssl_block(void *arg, unsigned long n)
+{
+	unsigned char out[16];
+	aes_context *ctx = arg;
+
+	while (n--) {
+		aes_crypt_ecb(ctx, AES_ENCRYPT, _data, out);
+		_sink += out[0];
+	}
+}
+
+#if AESNI_AVAILABLE
+static void _aes_aesni_key(void *arg, unsigned long n)
+{
+	unsigned char out[16];
+	aesni_key ni;
+	(void) arg;
+
+	while (n--) {
+		aesni_setkey_enc(&ni, _key);
+		aesni_encrypt(&ni, _data, out);
+		_sink += out[0];
+	}
+}
+
+static void _aes_aesni_block(void *arg, unsigned long n)
+{
+	unsigned char out[16];
+	const aesni_key *ni = arg;
+
+	while (n--) {
+		aesni_encrypt(ni, _data, out);
+		_sink += out[0];
+	}
+}
+
+/* 8 blocks at once, like batches of ppp_get_passcodes */
+static void _aes_aesni_batch(void *arg, unsigned long n)
+{
+	unsigned char out[16 * 8];
+	const aesni_key *ni = arg;
+
+	while (n--) {
+		aesni_encrypt_blocks(ni, _data, out, 8);
+		_sink += out[0];
+	}
+}
+#endif
+
+static void _aes_slow_key(void *arg, unsigned long n)
+{
+	unsigned char out[16];
+	aes256_context ctx;
+	(void) arg;
+
+	while (n--) {
+		aes256_init(&ctx, _key);
+		memcpy(out, _data, sizeof(out));
+		aes256_encrypt_ecb(&ctx, out);
+		aes256_done(&ctx);
+		_sink += out[0];
+	}
+}
+
+#if BENCH_OPENSSL
+/* Key is set for each block as in OpenSSL variant of crypto_aes_encrypt */
+static void _aes_openssl_key(void *arg, unsigned long n)
+{
+	unsigned char out[32];
+	EVP_CIPHER_CTX *ctx = arg;
+	int written;
+
+	while (n--) {
+		EVP_EncryptInit_ex(ctx, EVP_aes_256_ecb(), NULL, _key, NULL);
+		EVP_CIPHER_CTX_set_padding(ctx, 0);
+		EVP_EncryptUpdate(ctx, out, &written, _data, 16);
+		_sink += out[0];
+	}
+}
+
+static void _aes_openssl_block(void *arg, unsigned long n)
+{
+	unsigned char out[32];
+	EVP_CIPHER_CTX *ctx = arg;
+	int written;
+
+	while (n--) {
+		EVP_EncryptUpdate(ctx, out, &written, _data, 16);
+		_sink += out[0];
+	}
+}
+#endif
+
+static void _aes_crypto(void *arg, unsigned long n)
+{
+	unsigned char out[16];
+	(void) arg;
+
+	while (n--) {
+		crypto_aes_encrypt(_key, _data, out);
+		_sink += out[0];
+	}
+}
+
+static void _aes_crypto_cached(void *arg, unsigned long n)
+{
+	unsigned char out[16];
+	crypto_aes_key *cache = arg;
+
+	while (n--) {
+		crypto_aes_encrypt_cached(cache, _key, _data, out);
+		_sink += out[0];
+	}
+}
+
+static void _bench_aes(void)
+{
+	crypto_aes_key *cache;
+	aes_context ctx;
+#if AESNI_AVAILABLE
+	aesni_key ni;
+#endif
+#if BENCH_OPENSSL
+	EVP_CIPHER_CTX *evp;
+#endif
+
+	_bench("aes/polarssl/key+block", _aes_polarssl_key, NULL);
+	aes_setkey_enc(&ctx, _key, 256);
+	_bench("aes/polarssl/block", _aes_polarssl_block, &ctx);
+	memset(&ctx, 0, sizeof(ctx));
+
+#if AESNI_AVAILABLE
+	if (aesni_supported()) {
+		_bench("aes/aesni/key+block", _aes_aesni_key, NULL);
+		aesni_setkey_enc(&ni, _key);
+		_bench("aes/aesni/block", _aes_aesni_block, &ni);
+		_bench("aes/aesni/batch", _aes_aesni_batch, &ni);
+		memset(&ni, 0, sizeof(ni));
+	}
+#endif
+
+	_bench("aes/slow_aes256/key+block", _aes_slow_key, NULL);
+
+#if BENCH_OPENSSL
+	evp = EVP_CIPHER_CTX_new();
+	if (evp) {
+		_bench("aes/openssl/key+block", _aes_openssl_key, evp);
+		EVP_EncryptInit_ex(evp, EVP_aes_256_ecb(), NULL, _key, NULL);
+		EVP_CIPHER_CTX_set_padding(evp, 0);
+		_bench("aes/openssl/block", _aes_openssl_block, evp);
+		EVP_CIPHER_CTX_free(evp);
+	}
+#endif
+
+	_bench("aes/crypto_aes_encrypt", _aes_crypto, NULL);
+
+	cache = crypto_aes_key_new();
+	if (cache) {
+		_bench("aes/crypto_aes_encrypt_cached", _aes_crypto_cached, cache);
+		crypto_aes_key_free(cache);
+	}
+}
+
+/***
+ * SHA-256
+ ***/
+static void _sha_generic(void *arg, unsigned long n)
+{
+	struct sha256_ctx ctx;
+	(void) arg;
+
+	sha256_init_ctx(&ctx);
+	while (n--)
+		sha256_process_block_generic(_data, 64, &ctx);
+	_sink += ctx.state[0];
+}
+
+#if SHANI_AVAILABLE
+static void _sha_shani(void *arg, unsigned long n)
+{
+	struct sha256_ctx ctx;
+	(void) arg;
+
+	sha256_init_ctx(&ctx);
+	while (n--)
+		shani_process_blocks(ctx.state, _data, 1);
+	_sink += ctx.state[0];
+}
+#endif
+
+/* Argument points to length of hashed data */
+static void _sha_crypto(void *arg, unsigned long n)
+{
+	const unsigned int length = *(unsigned int *) arg;
+	unsigned char hash[32];
+
+	while (n--) {
+		crypto_sha256(_data, length, hash);
+		_sink += hash[0];
+	}
+}
+
+#if BENCH_OPENSSL
+static void _sha_openssl(void *arg, unsigned long n)
+{
+	const unsigned int length = *(unsigned int *) arg;
+	unsigned char hash[32];
+
+	while (n--) {
+		SHA256(_data, length, hash);
+		_sink += hash[0];
+	}
+}
+#endif
+
+static void _sha_verify_salted(void *arg, unsigned long n)
+{
+	const unsigned char *salted = arg;
+
+	while (n--)
+		_sink += crypto_verify_salted_sha256(salted, _data, 32);
+}
+
+static void _bench_sha(void)
+{
+	static unsigned int lengths[] = { 32, 1024 };
+	unsigned char salted[40];
+	char name[64];
+	unsigned int i;
+
+	_bench("sha256/generic/block", _sha_generic, NULL);
+#if SHANI_AVAILABLE
+	if (shani_supported())
+		_bench("sha256/shani/block", _sha_shani, NULL);
+#endif
+
+	for (i = 0; i < sizeof(lengths) / sizeof(*lengths); i++) {
+		snprintf(name, sizeof(name), "sha256/crypto_sha256/%u", lengths[i]);
+		_bench(name, _sha_crypto, &lengths[i]);
+#if BENCH_OPENSSL
+		snprintf(name, sizeof(name), "sha256/openssl/%u", lengths[i]);
+		_bench(name, _sha_openssl, &lengths[i]);
+#endif
+	}
+
+	if (crypto_salted_sha256(_data, 32, salted) == 0)
+		_bench("sha256/crypto_verify_salted_sha256", _sha_verify_salted, salted);
+}
+
+/***
+ * num
+ ***/
+static void _num_mul_i(void *arg, unsigned long n)
+{
+	/* 64 bit operand can't overflow */
+	num_t x = num_i(0x0123456789abcdefULL);
+	num_t y;
+	(void) arg;
+
+	while (n--) {
+		y = num_mul_i(x, 0x9e3779b97f4a7c15ULL);
+		x.lo ^= y.hi;
+	}
+	_sink += (unsigned int) x.lo;
+}
+
+static void _num_mul_i_generic(void *arg, unsigned long n)
+{
+	/* 64 bit operand can't overflow */
+	num_t x = num_i(0x0123456789abcdefULL);
+	num_t y;
+	(void) arg;
+
+	while (n--) {
+		y = num_mul_i_generic(x, 0x9e3779b97f4a7c15ULL);
+		x.lo ^= y.hi;
+	}
+	_sink += (unsigned int) x.lo;
+}
+
+/* Dividing by alphabet length is what passcode encoding does */
+static void _num_div_i(void *arg, unsigned long n)
+{
+	num_t x = num_ii(0x0123456789abcdefULL, 0x0fedcba987654321ULL);
+	num_t q;
+	uint64_t r = 0;
+	(void) arg;
+
+	while (n--) {
+		r += num_div_i(&q, x, 88);
+		x.lo ^= q.lo;
+	}
+	_sink += (unsigned int) r;
+}
+
+static void _num_div_i_generic(void *arg, unsigned long n)
+{
+	num_t x = num_ii(0x0123456789abcdefULL, 0x0fedcba987654321ULL);
+	num_t q;
+	uint64_t r = 0;
+	(void) arg;
+
+	while (n--) {
+		r += num_div_i_generic(&q, x, 88);
+		x.lo ^= q.lo;
+	}
+	_sink += (unsigned int) r;
+}
+
+/* Argument points to the format */
+static void _num_export(void *arg, unsigned long n)
+{
+	const enum num_str_type t = *(enum num_str_type *) arg;
+	num_t x = num_ii(0x0123456789abcdefULL, 0x0fedcba987654321ULL);
+	char buff[64];
+
+	while (n--) {
+		num_export(x, buff, t);
+		_sink += buff[0];
+	}
+}
+
+static void _num_import(void *arg, unsigned long n)
+{
+	const enum num_str_type t = *(enum num_str_type *) arg;
+	num_t x = num_ii(0x0123456789abcdefULL, 0x0fedcba987654321ULL);
+	char buff[64];
+
+	num_export(x, buff, t);
+	while (n--) {
+		num_import(&x, buff, t);
+		_sink += (unsigned int) x.lo;
+	}
+}
+
+static void _bench_num(void)
+{
+	static const struct {
+		const char *name;
+		enum num_str_type type;
+	} formats[] = {
+		{ "dec", NUM_FORMAT_DEC },
+		{ "hex", NUM_FORMAT_HEX },
+		{ "bin", NUM_FORMAT_BIN },
+	};
+	char name[64];
+	unsigned int i;
+
+	_bench("num/mul_i", _num_mul_i, NULL);
+	_bench("num/mul_i_generic", _num_mul_i_generic, NULL);
+	_bench("num/div_i", _num_div_i, NULL);
+	_bench("num/div_i_generic", _num_div_i_generic, NULL);
+
+	for (i = 0; i < sizeof(formats) / sizeof(*formats); i++) {
+		snprintf(name, sizeof(name), "num/export/%s", formats[i].name);
+		_bench(name, _num_export, (void *) &formats[i].type);
+		snprintf(name, sizeof(name), "num/import/%s", formats[i].name);
+		_bench(name, _num_import, (void *) &formats[i].type);
+	}
+}
+
+/***
+ * Passcodes
+ ***/
+static void _ppp_passcode(void *arg, unsigned long n)
+{
+	const state *s = arg;
+	char passcode[17];
+	num_t counter = num_i(0);
+
+	while (n--) {
+		ppp_get_passcode(s, counter, passcode);
+		counter = num_add_i(counter, 1);
+		_sink += passcode[0];
+	}
+}
+
+static int _bench_ppp(void)
+{
+	cfg_t *cfg = cfg_get();
+	char name[64];
+	state s;
+	int alphabet, length, ret;
+
+	/* Measure every alphabet regardless of policy */
+	cfg->alphabet_change = CONFIG_ALLOW;
+	cfg->alphabet_min_length = 1;
+	cfg->alphabet_max_length = 256;
+
+	ret = state_init(&s, "bench");
+	if (ret != 0)
+		return ret;
+
+	ret = state_key_generate(&s);
+	if (ret != 0)
+		goto cleanup;
+
+	for (alphabet = 0; alphabet < ppp_alphabet_count; alphabet++) {
+		if (ppp_verify_alphabet(alphabet) != 0)
+			continue;
+		s.alphabet = alphabet;
+		for (length = 2; length <= 16; length++) {
+			s.code_length = length;
+			snprintf(name, sizeof(name), "passcode/alphabet%d/length%d",
+			         alphabet, length);
+			_bench(name, _ppp_passcode, &s);
+		}
+	}
+
+cleanup:
+	state_fini(&s);
+	return ret;
+}
+
+static void _bench_usage(const char *name)
+{
+	printf("Usage: %s [options]\n"
+	       "Measures crypto, num and passcode primitives.\n\n"
+	       "  -t MSEC     shortest measured run (default 20; 1 - 10000)\n"
+	       "  -r ROUNDS   report best of ROUNDS runs (default 3; 1 - 100)\n"
+	       "  -f FILTER   run only operations containing FILTER\n\n"
+	       "Columns are: operation, ns/op, cycles/op, allocations/op.\n"
+	       "Cycles are counted by time stamp counter when available.\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, msec = 20;
+
+	while ((opt = getopt(argc, argv, "t:r:f:h")) != -1) {
+		switch (opt) {
+		case 't': msec = atoi(optarg); break;
+		case 'r': _rounds = atoi(optarg); break;
+		case 'f': _filter = optarg; break;
+		default:
+			_bench_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (msec < 1 || msec > 10000 || _rounds < 1 || _rounds > 100) {
+		_bench_usage(argv[0]);
+		return 1;
+	}
+	_min_ns = (unsigned long long) msec * 1000000;
+
+#if BENCH_OPENSSL && OPENSSL_VERSION_NUMBER >= 0x10100000L
+	/* Must be set before OpenSSL allocates anything */
+	(void) CRYPTO_set_mem_functions(_ossl_malloc, _ossl_realloc, _ossl_free);
+#endif
+
+	(void) print_init(PRINT_WARN | PRINT_STDOUT, NULL);
+
+	if (crypto_file_rng("/dev/urandom", NULL, _data, sizeof(_data)) != 0) {
+		printf("Unable to read random data\n");
+		print_fini();
+		return 1;
+	}
+
+	printf("%-40s %10s %10s %8s\n", "operation", "ns/op", "cycles/op", "allocs/op");
+
+	_bench_aes();
+	_bench_sha();
+	_bench_num();
+
+	/* Passcodes depend on policy from config file */
+	if (cfg_get() == NULL)
+		printf("Unable to read config file; passcodes not measured\n");
+	else if (_bench_ppp() != 0)
+		printf("Unable to create state; passcodes not measured\n");
+
+	print_fini();
+	return 0;
+}
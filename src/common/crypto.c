@@ -19,7 +19,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
+#include <time.h>
 
 #include "crypto.h"
 
@@ -157,7 +159,7 @@ int crypto_sha256(const unsigned char *data, const unsigned int length, unsigned
 
 #if USE_SLOWAES
 
-#include "aes256.h"
+#include "slow_aes256.h"
 
 int crypto_aes_encrypt(const unsigned char *key,
 		     const unsigned char *plain,
@@ -194,12 +196,25 @@ int crypto_aes_decrypt(const unsigned char *key,
 #if USE_POLARSSL
 
 #include "polarssl_aes.h"
+#include "aesni.h"
 
+/* Tables are used if processor lacks AES-NI */
 int crypto_aes_encrypt(const unsigned char *key,
 		     const unsigned char *plain,
 		     unsigned char *encrypted)
 {
 	aes_context ctx;
+
+#if AESNI_AVAILABLE
+	if (aesni_supported()) {
+		aesni_key ni;
+		aesni_setkey_enc(&ni, key);
+		aesni_encrypt(&ni, plain, encrypted);
+		memset(&ni, 0, sizeof(ni));
+		return 0;
+	}
+#endif
+
 	aes_setkey_enc(&ctx, key, 256);
 
 
@@ -215,6 +230,17 @@ int crypto_aes_decrypt(const unsigned char *key,
 		unsigned char *decrypted)
 {
 	aes_context ctx;
+
+#if AESNI_AVAILABLE
+	if (aesni_supported()) {
+		aesni_key ni;
+		aesni_setkey_dec(&ni, key);
+		aesni_decrypt(&ni, encrypted, decrypted);
+		memset(&ni, 0, sizeof(ni));
+		return 0;
+	}
+#endif
+
 	aes_setkey_dec(&ctx, key, 256);
 
 	aes_crypt_ecb(&ctx, AES_DECRYPT, encrypted, decrypted);
@@ -224,86 +250,323 @@ int crypto_aes_decrypt(const unsigned char *key,
 
 #endif /* USE_POLARSSL */
 
+struct crypto_aes_key {
+	/* Key used to build the schedule */
+	unsigned char key[32];
+	int expanded;
+#if USE_POLARSSL
+	aes_context ctx;
+#if AESNI_AVAILABLE
+	aesni_key ni;
+#endif
+#endif
+};
+
+crypto_aes_key *crypto_aes_key_new(void)
+{
+	return calloc(1, sizeof(crypto_aes_key));
+}
 
-extern int crypto_salted_sha256(const unsigned char *data,
-				const unsigned int length, 
-				unsigned char *salted_hash)
+void crypto_aes_key_free(crypto_aes_key *cache)
 {
+	if (!cache)
+		return;
+	memset(cache, 0, sizeof(*cache));
+	free(cache);
+}
+
+int crypto_aes_encrypt_cached(crypto_aes_key *cache,
+			      const unsigned char *key,
+			      const unsigned char *plain,
+			      unsigned char *encrypted)
+{
+	return crypto_aes_encrypt_blocks_cached(cache, key, plain, encrypted, 1);
+}
+
+int crypto_aes_encrypt_blocks_cached(crypto_aes_key *cache,
+				     const unsigned char *key,
+				     const unsigned char *plain,
+				     unsigned char *encrypted,
+				     unsigned int blocks)
+{
+	unsigned int i;
 	int ret;
-	unsigned char *buf = malloc(length + 8);
-	assert(data && salted_hash); /* salted_hash must be atleast 32 + 8 bytes long */
 
-	if (!buf)
-		return 1;
+#if USE_POLARSSL
+	if (cache) {
+		const int expand = !cache->expanded ||
+			memcmp(cache->key, key, sizeof(cache->key)) != 0;
+#if AESNI_AVAILABLE
+		if (aesni_supported()) {
+			if (expand) {
+				aesni_setkey_enc(&cache->ni, key);
+				memcpy(cache->key, key, sizeof(cache->key));
+				cache->expanded = 1;
+			}
+
+			aesni_encrypt_blocks(&cache->ni, plain, encrypted, blocks);
+			return 0;
+		}
+#endif
 
-	/* Initialize salting buffer with 8 bytes of salt */
-	if (crypto_file_rng("/dev/urandom", NULL, buf, 8) != 0) {
-		ret = 2;
-		goto cleanup;
+		if (expand) {
+			if (aes_setkey_enc(&cache->ctx, key, 256) != 0)
+				return 1;
+			memcpy(cache->key, key, sizeof(cache->key));
+			cache->expanded = 1;
+		}
+
+		for (i = 0; i < blocks; i++)
+			aes_crypt_ecb(&cache->ctx, AES_ENCRYPT,
+				      plain + 16 * i, encrypted + 16 * i);
+		return 0;
 	}
+#else
+	/* Other implementations expand the key each time */
+	(void) cache;
+#endif
+
+	for (i = 0; i < blocks; i++) {
+		ret = crypto_aes_encrypt(key, plain + 16 * i, encrypted + 16 * i);
+		if (ret != 0)
+			return ret;
+	}
+	return 0;
+}
 
-	/* Copy salt bytes to the resulting buffer also */
-	memcpy(salted_hash, buf, 8);
 
+#if USE_SHA256_COREUTILS
+/* Static password hashing is built directly on the streaming and
+ * compression function interface of bundled SHA256 */
 
-	/* Copy user password to the hashing buffer just after the salt */
-	memcpy(buf+8, data, length);
+int crypto_salted_sha256(const unsigned char *data,
+			 const unsigned int length,
+			 unsigned char *salted_hash)
+{
+	struct sha256_ctx ctx;
+	assert(data && salted_hash); /* salted_hash must be atleast 32 + 8 bytes long */
 
+	/* Salt is stored in the first 8 bytes of the result */
+	if (crypto_file_rng("/dev/urandom", NULL, salted_hash, 8) != 0)
+		return 2;
 
-	/* Hash buffer; put resulting 32 bytes of data into salted_hash */
-	if (crypto_sha256(buf, length+8, salted_hash + 8) != 0) {
-		ret = 3;
-		goto cleanup;
-	}
+	sha256_init_ctx(&ctx);
+	sha256_process_bytes(salted_hash, 8, &ctx);
+	sha256_process_bytes(data, length, &ctx);
+	sha256_finish_ctx(&ctx, salted_hash + 8);
+	memset(&ctx, 0, sizeof(ctx));
+	return 0;
+}
 
-	ret = 0;
-cleanup:
-	free(buf);
-	return ret;
+/* Compare without leaking position of the first difference */
+static int _crypto_memeq(const unsigned char *a, const unsigned char *b,
+			 unsigned int length)
+{
+	unsigned char diff = 0;
+	unsigned int i;
+	for (i = 0; i < length; i++)
+		diff |= a[i] ^ b[i];
+	return diff == 0;
 }
 
 int crypto_verify_salted_sha256(const unsigned char *salted_hash, 
                                 const unsigned char *data, const unsigned int length)
 {
-	int ret = 1;
-	unsigned char salted_hash_new[40];
-	unsigned char *buf;
+	struct sha256_ctx ctx;
+	unsigned char hash[32];
+	int ret;
 
 	assert(salted_hash != NULL);
 	assert(data != NULL);
 	if (!salted_hash || !data || length == 0)
 		return 1;
 
-	buf = malloc(length + 8);
+	sha256_init_ctx(&ctx);
+	sha256_process_bytes(salted_hash, 8, &ctx);
+	sha256_process_bytes(data, length, &ctx);
+	sha256_finish_ctx(&ctx, hash);
+
+	ret = _crypto_memeq(hash, salted_hash + 8, 32) ? 0 : 1;
+	memset(&ctx, 0, sizeof(ctx));
+	memset(hash, 0, sizeof(hash));
+	return ret;
+}
+
+/* Run one prepared 64 byte block through a copy of precomputed
+ * HMAC pad state and store the digest at the beginning of the block */
+static void _hmac_block(const struct sha256_ctx *pad, uint32_t *block)
+{
+	struct sha256_ctx ctx;
+	memcpy(ctx.state, pad->state, sizeof(ctx.state));
+	ctx.total[0] = ctx.total[1] = 0;
+	sha256_process_block(block, 64, &ctx);
+	sha256_read_ctx(&ctx, block);
+}
+
+int crypto_pbkdf2_sha256(const unsigned char *pass, unsigned int pass_len,
+			 const unsigned char *salt, unsigned int salt_len,
+			 unsigned long iterations,
+			 unsigned char *key, unsigned int key_len)
+{
+	struct sha256_ctx inner, outer, ctx;
+	/* Blocks are word aligned for sha256_process_block */
+	uint32_t pad_block[16];
+	unsigned char *pad = (unsigned char *) pad_block;
+	/* 32 bytes of message, padding and length of ipad/opad + message */
+	uint32_t block[16];
+	unsigned char *b = (unsigned char *) block;
+	unsigned char acc[32];
+	const unsigned char counter[4] = {0, 0, 0, 1};
+	unsigned long i;
+	int j;
+
+	assert(pass && salt && key);
+	if (iterations == 0 || key_len == 0 || key_len > 32)
+		return 1;
+
+	/* Long passwords are hashed first */
+	memset(pad_block, 0, sizeof(pad_block));
+	if (pass_len > sizeof(pad_block))
+		sha256_buffer(pass, pass_len, pad);
+	else
+		memcpy(pad, pass, pass_len);
+
+	/* Absorb both pads once; each iteration starts from copied state */
+	for (j = 0; j < 64; j++)
+		pad[j] ^= 0x36;
+	sha256_init_ctx(&inner);
+	sha256_process_block(pad, 64, &inner);
+
+	for (j = 0; j < 64; j++)
+		pad[j] ^= 0x36 ^ 0x5c;
+	sha256_init_ctx(&outer);
+	sha256_process_block(pad, 64, &outer);
+
+	/* U1 = HMAC(pass, salt || INT(1)) */
+	ctx = inner;
+	sha256_process_bytes(salt, salt_len, &ctx);
+	sha256_process_bytes(counter, 4, &ctx);
+	sha256_finish_ctx(&ctx, b);
+
+	/* Later messages always are 32 bytes long, so padding of
+	 * both inner and outer block is constant */
+	memset(b + 32, 0, 32);
+	b[32] = 0x80;
+	b[62] = (64 + 32) * 8 >> 8;
+	b[63] = (64 + 32) * 8 & 0xff;
+
+	_hmac_block(&outer, block);
+	memcpy(acc, b, sizeof(acc));
+
+	/* Ui = HMAC(pass, Ui-1) */
+	for (i = 1; i < iterations; i++) {
+		_hmac_block(&inner, block);
+		_hmac_block(&outer, block);
+		for (j = 0; j < 32; j++)
+			acc[j] ^= b[j];
+	}
 
-	if (!buf)
+	memcpy(key, acc, key_len);
+
+	memset(pad_block, 0, sizeof(pad_block));
+	memset(acc, 0, sizeof(acc));
+	memset(block, 0, sizeof(block));
+	memset(&ctx, 0, sizeof(ctx));
+	memset(&inner, 0, sizeof(inner));
+	memset(&outer, 0, sizeof(outer));
+	return 0;
+}
+
+/* Layout of tagged hash */
+#define KDF_ID 0
+#define KDF_COST 1
+#define KDF_SALT 4
+#define KDF_SALT_SIZE 12
+#define KDF_KEY 16
+#define KDF_KEY_SIZE (CRYPTO_KDF_SIZE - KDF_KEY)
+
+/* Derive key using selected KDF. New functions are added here. */
+static int _kdf_derive(int kdf, unsigned int cost,
+		       const unsigned char *data, unsigned int length,
+		       const unsigned char *salt, unsigned char *key)
+{
+	if (cost < CRYPTO_KDF_COST_MIN || cost > CRYPTO_KDF_COST_MAX)
+		return 1;
+
+	switch (kdf) {
+	case CRYPTO_KDF_PBKDF2_SHA256:
+		return crypto_pbkdf2_sha256(data, length, salt, KDF_SALT_SIZE,
+					    1UL << cost, key, KDF_KEY_SIZE);
+	default:
 		return 1;
+	}
+}
 
-	/* Copy salt from salted hash to hashing buffer */
-	memcpy(buf, salted_hash, 8);
+int crypto_kdf_hash(int kdf, unsigned int cost,
+		    const unsigned char *data, const unsigned int length,
+		    unsigned char *tagged)
+{
+	assert(data && tagged);
 
-	/* and to the resulting hash too */
-	memcpy(salted_hash_new, buf, 8);
+	memset(tagged, 0, CRYPTO_KDF_SIZE);
+	tagged[KDF_ID] = kdf;
+	tagged[KDF_COST] = cost;
 
-	/* Copy user password to the hashing buffer just after the salt */
-	memcpy(buf+8, data, length);
+	if (crypto_file_rng("/dev/urandom", NULL, tagged + KDF_SALT, KDF_SALT_SIZE) != 0)
+		return 2;
 
-	/* Hash buffer; put resulting 32 bytes of data into salted_hash */
-	if (crypto_sha256(buf, length+8, salted_hash_new + 8) != 0) {
-		ret = 3;
-		goto cleanup;
+	if (_kdf_derive(kdf, cost, data, length,
+			tagged + KDF_SALT, tagged + KDF_KEY) != 0) {
+		memset(tagged, 0, CRYPTO_KDF_SIZE);
+		return 1;
 	}
+	return 0;
+}
 
-	if (memcmp(salted_hash_new, salted_hash, 40) == 0)
-		ret = 0; /* Correct */
-	else 
-		ret = 1; /* Incorrect */
+int crypto_kdf_verify(const unsigned char *tagged,
+		      const unsigned char *data, const unsigned int length)
+{
+	unsigned char key[KDF_KEY_SIZE];
+	int ret;
 
-cleanup:
-	free(buf);
+	assert(tagged && data);
+	if (!tagged || !data || length == 0)
+		return 1;
+
+	if (_kdf_derive(tagged[KDF_ID], tagged[KDF_COST], data, length,
+			tagged + KDF_SALT, key) != 0)
+		return 2;
+
+	ret = _crypto_memeq(key, tagged + KDF_KEY, KDF_KEY_SIZE) ? 0 : 1;
+	memset(key, 0, sizeof(key));
 	return ret;
 }
 
+int crypto_kdf_calibrate(int kdf, unsigned int msec)
+{
+	const unsigned char data[] = "calibration";
+	unsigned char salt[KDF_SALT_SIZE] = {0};
+	unsigned char key[KDF_KEY_SIZE];
+	struct timespec start, end;
+	unsigned long elapsed;
+	unsigned int cost;
+
+	/* Cost grows exponentially; stop at first one which is slow enough */
+	for (cost = CRYPTO_KDF_COST_MIN; cost < CRYPTO_KDF_COST_MAX; cost++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (_kdf_derive(kdf, cost, data, sizeof(data) - 1, salt, key) != 0)
+			return -1;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		elapsed = (end.tv_sec - start.tv_sec) * 1000000UL
+			+ (end.tv_nsec - start.tv_nsec) / 1000;
+		if (elapsed >= msec * 1000UL)
+			break;
+	}
+	return cost;
+}
+#endif /* USE_SHA256_COREUTILS */
+
 
 
 int crypto_file_rng(const char *device, const char *msg, unsigned char *buf, const int count)
@@ -403,3 +666,17 @@ int crypto_hex_to_binary(const char *hex,
 	
 	return 0;
 }
+
+unsigned int crypto_crc32(const void *data, unsigned int length)
+{
+	const unsigned char *pos = data;
+	uint32_t crc = 0xFFFFFFFFU;
+	int i;
+
+	while (length--) {
+		crc ^= *pos++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xEDB88320U & -(crc & 1));
+	}
+	return ~crc;
+}
@@ -55,6 +55,32 @@ extern int crypto_aes_decrypt(
 	const unsigned char *encrypted,
 	unsigned char *decrypted);
 
+/* Expanded AES encryption key kept between calls */
+typedef struct crypto_aes_key crypto_aes_key;
+
+/* Allocate empty key schedule; NULL on memory error */
+extern crypto_aes_key *crypto_aes_key_new(void);
+
+/* Wipe and free key schedule */
+extern void crypto_aes_key_free(crypto_aes_key *cache);
+
+/* Encrypt 128 bits with 256 bit key. Key is expanded only
+ * if it differs from the one cached. Cache might be NULL. */
+extern int crypto_aes_encrypt_cached(
+	crypto_aes_key *cache,
+	const unsigned char *key,
+	const unsigned char *plain,
+	unsigned char *encrypted);
+
+/* Like crypto_aes_encrypt_cached, but encrypts 'blocks'
+ * independent blocks of 128 bits (ECB) */
+extern int crypto_aes_encrypt_blocks_cached(
+	crypto_aes_key *cache,
+	const unsigned char *key,
+	const unsigned char *plain,
+	unsigned char *encrypted,
+	unsigned int blocks);
+
 /* Calculate 256bit long hash of data */
 extern int crypto_sha256(
 	const unsigned char *data,
@@ -77,6 +103,43 @@ extern int crypto_verify_salted_sha256(
 	const unsigned char *data,
 	const unsigned int length);
 
+/* PBKDF2 with HMAC-SHA256; derives up to 32 bytes of key */
+extern int crypto_pbkdf2_sha256(
+	const unsigned char *pass, unsigned int pass_len,
+	const unsigned char *salt, unsigned int salt_len,
+	unsigned long iterations,
+	unsigned char *key, unsigned int key_len);
+
+/* Password hashing with a selectable KDF. Hash is a tagged blob
+ * of CRYPTO_KDF_SIZE bytes: KDF id, cost, 2 reserved bytes,
+ * 12 bytes of salt and 24 bytes of derived key.
+ * Cost is a log2 of KDF iterations.
+ */
+#define CRYPTO_KDF_SIZE 40
+#define CRYPTO_KDF_COST_MIN 1
+#define CRYPTO_KDF_COST_MAX 24
+
+enum crypto_kdf_id {
+	CRYPTO_KDF_PBKDF2_SHA256 = 1,
+};
+
+extern int crypto_kdf_hash(
+	int kdf,
+	unsigned int cost,
+	const unsigned char *data,
+	const unsigned int length,
+	unsigned char *tagged);
+
+/* Returns 0 if data matches, 1 if it doesn't and 2 if tag is invalid */
+extern int crypto_kdf_verify(
+	const unsigned char *tagged,
+	const unsigned char *data,
+	const unsigned int length);
+
+/* Find smallest cost for which a single hash calculation
+ * takes at least msec milliseconds on this host. -1 on error. */
+extern int crypto_kdf_calibrate(int kdf, unsigned int msec);
+
 /* Display hexadecimally binary data */
 extern void crypto_print_hex(
 	const unsigned char *data,
@@ -96,5 +159,9 @@ extern int crypto_hex_to_binary(
 	const unsigned int length,
 	unsigned char *binary);
 
+/* CRC-32 (IEEE 802.3) of data. Detects damaged records,
+ * gives no protection against intentional changes. */
+extern unsigned int crypto_crc32(const void *data, unsigned int length);
+
 
 #endif
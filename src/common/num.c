@@ -144,7 +144,8 @@ num_t num_sub(const num_t arg1, const num_t arg2)
 	return r;
 }
 
-num_t num_mul_i(num_t arg1, const uint64_t arg2)
+/* Portable bit-serial implementations */
+num_t num_mul_i_generic(num_t arg1, const uint64_t arg2)
 {
 	int i;
 	int can_overflow = 0;
@@ -166,7 +167,7 @@ num_t num_mul_i(num_t arg1, const uint64_t arg2)
 	return reply;
 }
 
-uint64_t num_div_i(num_t *result, const num_t divwhat, const uint64_t divby)
+uint64_t num_div_i_generic(num_t *result, const num_t divwhat, const uint64_t divby)
 {
 	int i;
 	uint64_t remainder = 0;
@@ -195,6 +196,71 @@ uint64_t num_div_i(num_t *result, const num_t divwhat, const uint64_t divby)
 	return remainder;
 }
 
+#if NUM_HAVE_INT128
+
+typedef unsigned __int128 num_u128;
+
+num_t num_mul_i(num_t arg1, const uint64_t arg2)
+{
+	const num_u128 lo = (num_u128)arg1.lo * arg2;
+	const num_u128 hi = (num_u128)arg1.hi * arg2;
+	num_t reply = {
+		.hi = (uint64_t)hi + (uint64_t)(lo >> 64),
+		.lo = (uint64_t)lo,
+	};
+
+	/* Bits above 128 or carry out of the high word */
+	if ((hi >> 64) != 0 || reply.hi < (uint64_t)hi)
+		num_set_overflow();
+
+	return reply;
+}
+
+/* Divide 128 bit number (high part smaller than divisor) by 64 bits */
+static inline uint64_t _num_div_128_64(uint64_t hi, uint64_t lo, uint64_t divby,
+                                      uint64_t *remainder)
+{
+#if defined(__x86_64__)
+	uint64_t quotient;
+	/* Can't trap, as hi < divby */
+	__asm__ ("divq %4"
+	         : "=a" (quotient), "=d" (*remainder)
+	         : "a" (lo), "d" (hi), "rm" (divby));
+	return quotient;
+#else
+	const num_u128 n = ((num_u128)hi << 64) | lo;
+	*remainder = (uint64_t)(n % divby);
+	return (uint64_t)(n / divby);
+#endif
+}
+
+uint64_t num_div_i(num_t *result, const num_t divwhat, const uint64_t divby)
+{
+	uint64_t remainder;
+
+	/* Keep whatever generic implementation does */
+	if (divby == 0)
+		return num_div_i_generic(result, divwhat, divby);
+
+	result->hi = divwhat.hi / divby;
+	result->lo = _num_div_128_64(divwhat.hi % divby, divwhat.lo, divby, &remainder);
+	return remainder;
+}
+
+#else
+
+num_t num_mul_i(num_t arg1, const uint64_t arg2)
+{
+	return num_mul_i_generic(arg1, arg2);
+}
+
+uint64_t num_div_i(num_t *result, const num_t divwhat, const uint64_t divby)
+{
+	return num_div_i_generic(result, divwhat, divby);
+}
+
+#endif /* NUM_HAVE_INT128 */
+
 
 /***********************************************
  * Conversions
@@ -382,6 +448,36 @@ int num_import(num_t *num, const char *buff, enum num_str_type t)
 }
 
 
+int num_import_hex(num_t *num, const char *buff, size_t length)
+{
+	uint64_t hi = 0, lo = 0;
+	unsigned int digit;
+	size_t i;
+
+	if (length < 1 || length > 32)
+		return 1;
+
+	for (i = 0; i < length; i++) {
+		if (buff[i] >= '0' && buff[i] <= '9')
+			digit = buff[i] - '0';
+		else if (buff[i] >= 'A' && buff[i] <= 'F')
+			digit = 10 + buff[i] - 'A';
+		else if (buff[i] >= 'a' && buff[i] <= 'f')
+			digit = 10 + buff[i] - 'a';
+		else
+			return 1;
+
+		/* Shift both halves by a nibble */
+		hi = (hi << 4) | (lo >> 60);
+		lo = (lo << 4) | digit;
+	}
+
+	num->hi = hi;
+	num->lo = lo;
+	return 0;
+}
+
+
 /*****************************
  * Printing helpers 
  *****************************/
@@ -106,6 +106,17 @@ extern num_t num_mul_i(num_t arg1, const uint64_t arg2);
 /** Divide num by integer. Whole part in result, reminder is returned */
 extern uint64_t num_div_i(num_t *result, const num_t divwhat, const uint64_t divby);
 
+/** Use compiler 128 bit integers for multiplication/division if available */
+#if defined(__SIZEOF_INT128__)
+#define NUM_HAVE_INT128 1
+#else
+#define NUM_HAVE_INT128 0
+#endif
+
+/** Portable bit-serial versions of num_mul_i and num_div_i */
+extern num_t num_mul_i_generic(num_t arg1, const uint64_t arg2);
+extern uint64_t num_div_i_generic(num_t *result, const num_t divwhat, const uint64_t divby);
+
 /** Add to integer */
 #define num_add_i(a, b) num_add((a), num_i(b))
 /** Subtract from integer */
@@ -143,6 +154,11 @@ extern int num_export(const num_t num, char *buff, enum num_str_type t);
  */
 extern int num_import(num_t *num, const char *buff, enum num_str_type t);
 
+/** Parse 'length' hex digits (MSB first) which don't need to be
+ * \0 terminated. 0 - success
+ */
+extern int num_import_hex(num_t *num, const char *buff, size_t length);
+
 /* Helpers */
 /** Print num as HEX. Set MSB to 1 for PPPv3 compatibility */
 extern void num_print_hex(const num_t num, int msb);
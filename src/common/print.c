@@ -22,19 +22,33 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <time.h>
 #include <syslog.h>
 
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
 #include "print.h"
 
 const int PRINT_LEVEL_MASK = 0x3F;
 
+/* Socket of local syslog daemon */
+static const char _syslog_path[] = "/dev/log";
+
 /* Currently used print_level */
 struct log_state {
 	/* Log messages of level equal or greater to print_level */
 	int initialized;
 	int flags;
 	FILE *log_file;	/* Log to file if not null */
-} log_state = {0, 0, NULL};
+	int syslog_fd;	/* Connection to syslog; -1 if not connected */
+
+	/* Log file output waiting for print_flush; NULL - unbuffered */
+	char *buffer;
+	size_t buffer_size;
+	size_t buffer_used;
+} log_state = {0, 0, NULL, -1, NULL, 0, 0};
 
 struct log_state log_state;
 
@@ -66,10 +80,140 @@ void print_config(int flags)
 	log_state.flags = flags;
 }
 
+int print_buffer(size_t size)
+{
+	char *buffer = NULL;
+
+	assert(log_state.initialized == 1);
+
+	/* Only the log file is buffered */
+	if (size && log_state.log_file) {
+		buffer = malloc(size);
+		if (!buffer)
+			return 1;
+	}
+
+	print_flush();
+	free(log_state.buffer);
+	log_state.buffer = buffer;
+	log_state.buffer_size = buffer ? size : 0;
+	return 0;
+}
+
+void print_flush(void)
+{
+	if (!log_state.log_file)
+		return;
+
+	if (log_state.buffer_used) {
+		(void) fwrite(log_state.buffer, 1, log_state.buffer_used,
+		              log_state.log_file);
+		log_state.buffer_used = 0;
+	}
+
+	fflush(log_state.log_file);
+}
+
+/* Connect to syslog daemon; 0 on success */
+static int _print_syslog_connect(void)
+{
+	struct sockaddr_un addr;
+
+	if (log_state.syslog_fd != -1)
+		close(log_state.syslog_fd);
+
+	log_state.syslog_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (log_state.syslog_fd == -1)
+		return 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, _syslog_path);
+	if (connect(log_state.syslog_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		close(log_state.syslog_fd);
+		log_state.syslog_fd = -1;
+		return 1;
+	}
+	return 0;
+}
+
+/* Send message to syslog. Connection is kept until print_fini. We
+ * don't use openlog as it would change the ident of a program which
+ * loaded PAM module for the rest of its life. */
+static void _print_syslog(int syslog_level, const char *intro, const char *buff)
+{
+	static const char *months[] = {
+		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+	};
+	char line[640];
+	struct tm tm;
+	time_t now = time(NULL);
+	int len;
+
+	if (log_state.syslog_fd == -1)
+		(void) _print_syslog_connect();
+
+	if (log_state.syslog_fd == -1 || localtime_r(&now, &tm) == NULL) {
+		/* No datagram socket; let libc find a way */
+		openlog("otpasswd", LOG_CONS | LOG_PID, LOG_AUTHPRIV);
+		syslog(syslog_level, "%s%s", intro, buff);
+		closelog();
+		return;
+	}
+
+	/* RFC 3164 line; the same as syslog(3) sends */
+	len = snprintf(line, sizeof(line), "<%d>%s %2d %02d:%02d:%02d otpasswd[%d]: %s%s",
+	               LOG_AUTHPRIV | syslog_level, months[tm.tm_mon], tm.tm_mday,
+	               tm.tm_hour, tm.tm_min, tm.tm_sec, (int) getpid(), intro, buff);
+	if (len <= 0)
+		return;
+	if (len >= (int) sizeof(line))
+		len = sizeof(line) - 1;
+
+	/* Syslog daemon could have been restarted */
+	if (send(log_state.syslog_fd, line, len, 0) == -1 &&
+	    _print_syslog_connect() == 0)
+		(void) send(log_state.syslog_fd, line, len, 0);
+}
+
+/* Write message to the log file or keep it until print_flush */
+static void _print_log_file(int level, const char *position,
+                            const char *intro, const char *buff)
+{
+	const size_t position_len = strlen(position);
+	const size_t intro_len = strlen(intro);
+	const size_t buff_len = strlen(buff);
+	const size_t len = position_len + intro_len + buff_len;
+	char *p;
+
+	if (log_state.buffer && len > log_state.buffer_size - log_state.buffer_used)
+		print_flush();
+
+	if (!log_state.buffer || len > log_state.buffer_size) {
+		fputs(position, log_state.log_file);
+		fputs(intro, log_state.log_file);
+		fputs(buff, log_state.log_file);
+		fflush(log_state.log_file);
+		return;
+	}
+
+	p = log_state.buffer + log_state.buffer_used;
+	memcpy(p, position, position_len);
+	memcpy(p + position_len, intro, intro_len);
+	memcpy(p + position_len + intro_len, buff, buff_len);
+	log_state.buffer_used += len;
+
+	/* Errors are written at once together with preceding messages */
+	if (level >= PRINT_ERROR)
+		print_flush();
+}
+
 int _print(const char *file, const int line, int level, const char *fmt, ...)
 {
 	int ret;
 	char buff[512]; 
+	char position[128] = "";
 	char *intro;
 	int syslog_level = LOG_INFO;
 	va_list ap;
@@ -124,38 +268,26 @@ int _print(const char *file, const int line, int level, const char *fmt, ...)
 
 	}
 
+	if (file && level != PRINT_MESSAGE) {
+		const char *base = strrchr(file, '/');
+		base = base ? base + 1 : file;
+		snprintf(position, sizeof(position), "%s:%d ", base, line);
+	}
+
 	/* stdout */
 	if (use_stdout) {
-		if (file) {
-			const char *base = strrchr(file, '/') + 1;
-			if (!base) base = file;
-			if (level != PRINT_MESSAGE)
-				fprintf(stdout, "%s:%d ", base, line);
-		}
+		fputs(position, stdout);
 		fputs(intro, stdout);
 		fputs(buff, stdout);
 	}
 
 	/* syslog */
-	if (use_syslog) {
-		openlog("otpasswd", LOG_CONS | LOG_PID, LOG_AUTHPRIV);
-		syslog(syslog_level, "%s%s", intro, buff); /* FIXME; is intro needed? */
-		closelog();
-	}
+	if (use_syslog)
+		_print_syslog(syslog_level, intro, buff);
 
 	/* log file */
-	if (log_state.log_file) {
-		if (file) {
-			const char *base = strrchr(file, '/') + 1;
-			if (!base) base = file;
-			if (level != PRINT_MESSAGE)
-				fprintf(log_state.log_file, "%s:%d ", base, line);
-		}
-
-		fputs(intro, log_state.log_file);
-		fputs(buff, log_state.log_file);
-		fflush(log_state.log_file);
-	}
+	if (log_state.log_file)
+		_print_log_file(level, position, intro, buff);
 	return 0;
 }
 
@@ -185,8 +317,19 @@ int _print_perror(const char *file, int line, int level, const char *fmt, ...)
 
 void print_fini()
 {
+	print_flush();
+	free(log_state.buffer);
+	log_state.buffer = NULL;
+	log_state.buffer_size = log_state.buffer_used = 0;
+
+	if (log_state.syslog_fd != -1) {
+		close(log_state.syslog_fd);
+		log_state.syslog_fd = -1;
+	}
+
 	if (log_state.log_file)
 		fclose(log_state.log_file);
+	log_state.log_file = NULL;
 
 	log_state.initialized = 0;
 }
@@ -22,6 +22,7 @@
 #ifndef _PRINT_H_
 #define _PRINT_H_
 
+#include <stddef.h>
 #include "num.h"
 
 /* With DEBUG_POSITIONS messages printed on 
@@ -62,6 +63,13 @@ extern void print_fini();
 /** Set log_level/syslog/stdout to another value */
 extern void print_config(int flags);
 
+/** Keep up to size bytes of log file output in memory. Errors and
+ * print_flush/print_fini write it out. 0 - write each message at once */
+extern int print_buffer(size_t size);
+
+/** Write out buffered log; call before fork and exit */
+extern void print_flush(void);
+
 /** Log some data */
 extern int _print(const char *file, const int line, int level, const char *fmt, ...);
 
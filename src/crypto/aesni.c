@@ -0,0 +1,175 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ **********************************************************************/
+
+#include "aesni.h"
+
+#if AESNI_AVAILABLE
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+/* Allows using intrinsics without compiling everything with -maes */
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+int aesni_supported(void)
+{
+	static int supported = -1;
+	unsigned int eax, ebx, ecx, edx;
+
+	if (supported == -1) {
+		supported = 0;
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+		    (ecx & bit_AES) && (edx & bit_SSE2))
+			supported = 1;
+	}
+	return supported;
+}
+
+/* Round key following two previous ones. 'assist' is
+ * the result of aeskeygenassist on the latter of them. */
+static inline AESNI_TARGET __m128i _next_key(__m128i key, __m128i assist)
+{
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, assist);
+}
+
+/* Even round keys use RotWord+SubWord+Rcon, odd - only SubWord */
+#define _EVEN(i, rcon) \
+	rk[i] = _next_key(rk[(i) - 2], _mm_shuffle_epi32( \
+		_mm_aeskeygenassist_si128(rk[(i) - 1], rcon), 0xff))
+#define _ODD(i) \
+	rk[i] = _next_key(rk[(i) - 2], _mm_shuffle_epi32( \
+		_mm_aeskeygenassist_si128(rk[(i) - 1], 0x00), 0xaa))
+
+static AESNI_TARGET void _expand(__m128i *rk, const unsigned char *key)
+{
+	rk[0] = _mm_loadu_si128((const __m128i *) key);
+	rk[1] = _mm_loadu_si128((const __m128i *) (key + 16));
+	_EVEN(2, 0x01); _ODD(3);
+	_EVEN(4, 0x02); _ODD(5);
+	_EVEN(6, 0x04); _ODD(7);
+	_EVEN(8, 0x08); _ODD(9);
+	_EVEN(10, 0x10); _ODD(11);
+	_EVEN(12, 0x20); _ODD(13);
+	_EVEN(14, 0x40);
+}
+
+#undef _EVEN
+#undef _ODD
+
+AESNI_TARGET void aesni_setkey_enc(aesni_key *ctx, const unsigned char *key)
+{
+	__m128i rk[15];
+	int i;
+
+	_expand(rk, key);
+	for (i = 0; i < 15; i++)
+		_mm_storeu_si128((__m128i *) (ctx->rk + 16 * i), rk[i]);
+
+	for (i = 0; i < 15; i++)
+		rk[i] = _mm_setzero_si128();
+}
+
+AESNI_TARGET void aesni_setkey_dec(aesni_key *ctx, const unsigned char *key)
+{
+	__m128i rk[15];
+	__m128i tmp;
+	int i;
+
+	_expand(rk, key);
+
+	/* Equivalent inverse cipher; reversed order, middle keys
+	 * passed through InvMixColumns */
+	for (i = 0; i < 15; i++) {
+		tmp = rk[14 - i];
+		if (i != 0 && i != 14)
+			tmp = _mm_aesimc_si128(tmp);
+		_mm_storeu_si128((__m128i *) (ctx->rk + 16 * i), tmp);
+	}
+
+	for (i = 0; i < 15; i++)
+		rk[i] = _mm_setzero_si128();
+}
+
+AESNI_TARGET void aesni_encrypt(const aesni_key *ctx,
+                                const unsigned char *input, unsigned char *output)
+{
+	const __m128i *rk = (const __m128i *) ctx->rk;
+	__m128i block = _mm_loadu_si128((const __m128i *) input);
+	int i;
+
+	block = _mm_xor_si128(block, _mm_loadu_si128(rk));
+	for (i = 1; i < 14; i++)
+		block = _mm_aesenc_si128(block, _mm_loadu_si128(rk + i));
+	block = _mm_aesenclast_si128(block, _mm_loadu_si128(rk + 14));
+
+	_mm_storeu_si128((__m128i *) output, block);
+}
+
+AESNI_TARGET void aesni_encrypt_blocks(const aesni_key *ctx,
+                                       const unsigned char *input, unsigned char *output,
+                                       unsigned int blocks)
+{
+	const __m128i *rk = (const __m128i *) ctx->rk;
+	const __m128i *in = (const __m128i *) input;
+	__m128i *out = (__m128i *) output;
+	__m128i b0, b1, b2, b3, key;
+	int i;
+
+	for (; blocks >= 4; blocks -= 4, in += 4, out += 4) {
+		key = _mm_loadu_si128(rk);
+		b0 = _mm_xor_si128(_mm_loadu_si128(in), key);
+		b1 = _mm_xor_si128(_mm_loadu_si128(in + 1), key);
+		b2 = _mm_xor_si128(_mm_loadu_si128(in + 2), key);
+		b3 = _mm_xor_si128(_mm_loadu_si128(in + 3), key);
+		for (i = 1; i < 14; i++) {
+			key = _mm_loadu_si128(rk + i);
+			b0 = _mm_aesenc_si128(b0, key);
+			b1 = _mm_aesenc_si128(b1, key);
+			b2 = _mm_aesenc_si128(b2, key);
+			b3 = _mm_aesenc_si128(b3, key);
+		}
+		key = _mm_loadu_si128(rk + 14);
+		_mm_storeu_si128(out, _mm_aesenclast_si128(b0, key));
+		_mm_storeu_si128(out + 1, _mm_aesenclast_si128(b1, key));
+		_mm_storeu_si128(out + 2, _mm_aesenclast_si128(b2, key));
+		_mm_storeu_si128(out + 3, _mm_aesenclast_si128(b3, key));
+	}
+
+	for (; blocks > 0; blocks--, in++, out++)
+		aesni_encrypt(ctx, (const unsigned char *) in, (unsigned char *) out);
+}
+
+AESNI_TARGET void aesni_decrypt(const aesni_key *ctx,
+                                const unsigned char *input, unsigned char *output)
+{
+	const __m128i *rk = (const __m128i *) ctx->rk;
+	__m128i block = _mm_loadu_si128((const __m128i *) input);
+	int i;
+
+	block = _mm_xor_si128(block, _mm_loadu_si128(rk));
+	for (i = 1; i < 14; i++)
+		block = _mm_aesdec_si128(block, _mm_loadu_si128(rk + i));
+	block = _mm_aesdeclast_si128(block, _mm_loadu_si128(rk + 14));
+
+	_mm_storeu_si128((__m128i *) output, block);
+}
+
+#endif /* AESNI_AVAILABLE */
@@ -0,0 +1,60 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   AES-256 using x86 AES-NI instructions. Must be used only if
+ *   aesni_supported() returns true.
+ **********************************************************************/
+
+#ifndef _AESNI_H_
+#define _AESNI_H_
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AESNI_AVAILABLE 1
+#else
+#define AESNI_AVAILABLE 0
+#endif
+
+#if AESNI_AVAILABLE
+
+/* Expanded AES-256 key; 15 round keys */
+typedef struct {
+	unsigned char rk[15 * 16];
+} aesni_key;
+
+/* Check with CPUID if processor has AES-NI */
+extern int aesni_supported(void);
+
+/* Expand 256 bit key for encryption or decryption */
+extern void aesni_setkey_enc(aesni_key *ctx, const unsigned char *key);
+extern void aesni_setkey_dec(aesni_key *ctx, const unsigned char *key);
+
+/* Encrypt/decrypt single 128 bit block */
+extern void aesni_encrypt(const aesni_key *ctx,
+                          const unsigned char *input, unsigned char *output);
+extern void aesni_decrypt(const aesni_key *ctx,
+                          const unsigned char *input, unsigned char *output);
+
+/* Encrypt number of independent blocks; rounds of 4 blocks are
+ * interleaved to hide latency of aesenc */
+extern void aesni_encrypt_blocks(const aesni_key *ctx,
+                                 const unsigned char *input, unsigned char *output,
+                                 unsigned int blocks);
+
+#endif /* AESNI_AVAILABLE */
+
+#endif
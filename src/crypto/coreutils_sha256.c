@@ -29,6 +29,7 @@
 //#include <config.h>
 
 #include "coreutils_sha256.h"
+#include "shani.h"
 
 #include <stddef.h>
 #include <stdlib.h>
@@ -321,7 +322,7 @@ static const uint32_t sha256_round_constants[64] = {
    Most of this code comes from GnuPG's cipher/sha1.c.  */
 
 void
-sha256_process_block (const void *buffer, size_t len, struct sha256_ctx *ctx)
+sha256_process_block_generic (const void *buffer, size_t len, struct sha256_ctx *ctx)
 {
   const uint32_t *words = buffer;
   size_t nwords = len / sizeof (uint32_t);
@@ -448,3 +449,20 @@ sha256_process_block (const void *buffer, size_t len, struct sha256_ctx *ctx)
       h = ctx->state[7] += h;
     }
 }
+
+/* Use SHA extensions of the processor when available */
+void
+sha256_process_block (const void *buffer, size_t len, struct sha256_ctx *ctx)
+{
+#if SHANI_AVAILABLE
+  if (shani_supported ())
+    {
+      ctx->total[0] += len;
+      if (ctx->total[0] < len)
+        ++ctx->total[1];
+      shani_process_blocks (ctx->state, buffer, len / 64);
+      return;
+    }
+#endif
+  sha256_process_block_generic (buffer, len, ctx);
+}
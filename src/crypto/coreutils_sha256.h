@@ -50,6 +50,11 @@ extern void sha256_init_ctx (struct sha256_ctx *ctx);
 extern void sha256_process_block (const void *buffer, size_t len,
 				  struct sha256_ctx *ctx);
 
+/* Portable implementation of sha256_process_block, used when
+   processor has no SHA extensions.  */
+extern void sha256_process_block_generic (const void *buffer, size_t len,
+					  struct sha256_ctx *ctx);
+
 /* Starting with the result of former calls of this function (or the
    initialization function update the context for the next LEN bytes
    starting at BUFFER.
@@ -0,0 +1,124 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ **********************************************************************/
+
+#include "shani.h"
+
+#if SHANI_AVAILABLE
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+/* Allows using intrinsics without compiling everything with -msha */
+#define SHANI_TARGET __attribute__((target("sha,sse4.1")))
+
+#ifndef bit_SHA
+#define bit_SHA (1 << 29)
+#endif
+
+int shani_supported(void)
+{
+	static int supported = -1;
+	unsigned int eax, ebx, ecx, edx;
+
+	if (supported == -1) {
+		supported = 0;
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+		    (ecx & bit_SSSE3) && (ecx & bit_SSE4_1) &&
+		    __get_cpuid_max(0, NULL) >= 7) {
+			__cpuid_count(7, 0, eax, ebx, ecx, edx);
+			if (ebx & bit_SHA)
+				supported = 1;
+		}
+	}
+	return supported;
+}
+
+static const uint32_t _k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+SHANI_TARGET void shani_process_blocks(uint32_t *state,
+                                       const unsigned char *data, size_t blocks)
+{
+	/* Swaps bytes of each big endian message word */
+	const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+	                                    0x0405060700010203ULL);
+	__m128i abef, cdgh, abef_save, cdgh_save;
+	__m128i w[16], msg, tmp;
+	int i;
+
+	/* sha256rnds2 keeps state as ABEF and CDGH */
+	tmp = _mm_loadu_si128((const __m128i *) &state[0]);
+	cdgh = _mm_loadu_si128((const __m128i *) &state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);             /* CDAB */
+	cdgh = _mm_shuffle_epi32(cdgh, 0x1B);           /* EFGH */
+	abef = _mm_alignr_epi8(tmp, cdgh, 8);           /* ABEF */
+	cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);        /* CDGH */
+
+	for (; blocks > 0; blocks--, data += 64) {
+		abef_save = abef;
+		cdgh_save = cdgh;
+
+		for (i = 0; i < 4; i++)
+			w[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+				(const __m128i *) (data + 16 * i)), swap);
+
+		/* Each iteration does 4 rounds and schedules 4 words,
+		 * 16 rounds ahead */
+		for (i = 0; i < 16; i++) {
+			msg = _mm_add_epi32(w[i], _mm_loadu_si128((const __m128i *) &_k[4 * i]));
+			cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			abef = _mm_sha256rnds2_epu32(abef, cdgh, msg);
+
+			if (i >= 3 && i < 15) {
+				tmp = _mm_sha256msg1_epu32(w[i - 3], w[i - 2]);
+				tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[i], w[i - 1], 4));
+				w[i + 1] = _mm_sha256msg2_epu32(tmp, w[i]);
+			}
+		}
+
+		abef = _mm_add_epi32(abef, abef_save);
+		cdgh = _mm_add_epi32(cdgh, cdgh_save);
+	}
+
+	tmp = _mm_shuffle_epi32(abef, 0x1B);            /* FEBA */
+	cdgh = _mm_shuffle_epi32(cdgh, 0xB1);           /* DCHG */
+	abef = _mm_blend_epi16(tmp, cdgh, 0xF0);        /* DCBA */
+	cdgh = _mm_alignr_epi8(cdgh, tmp, 8);           /* HGFE */
+
+	_mm_storeu_si128((__m128i *) &state[0], abef);
+	_mm_storeu_si128((__m128i *) &state[4], cdgh);
+}
+
+#endif /* SHANI_AVAILABLE */
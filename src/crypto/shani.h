@@ -0,0 +1,46 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   SHA-256 compression function using x86 SHA extensions.
+ *   Must be used only if shani_supported() returns true.
+ **********************************************************************/
+
+#ifndef _SHANI_H_
+#define _SHANI_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHANI_AVAILABLE 1
+#else
+#define SHANI_AVAILABLE 0
+#endif
+
+#if SHANI_AVAILABLE
+
+/* Check with CPUID if processor has SHA extensions */
+extern int shani_supported(void);
+
+/* Update 8 word SHA-256 state with 'blocks' 64 byte blocks of data */
+extern void shani_process_blocks(uint32_t *state,
+                                 const unsigned char *data, size_t blocks);
+
+#endif /* SHANI_AVAILABLE */
+
+#endif
@@ -32,6 +32,7 @@
 #include <unistd.h>
 
 #include "ppp.h"
+#include "trace.h"
 
 static int _alphabet_check(const char *alphabet) {
 	/* Check duplicates and character range. */
@@ -106,6 +107,16 @@ static void _config_defaults(cfg_t *cfg)
 		.user_gid = -1,
 
 		.db = CONFIG_DB_UNCONFIGURED,
+		.db_format = CONFIG_DB_FORMAT_TEXT,
+		.lock_wait = CONFIG_LOCK_WAIT_RETRY,
+		.lock_timeout = 1000,
+		.db_sync = CONFIG_DB_SYNC_FULL,
+		.group_commit = CONFIG_DISABLED,
+		.group_commit_delay = 0,
+		.daemon_sessions = 64,
+		.daemon_timeout = 60,
+		.db_wal = CONFIG_DISABLED,
+		.db_wal_limit = 1024,
 		.global_db_path = "/etc/otpasswd/otshadow",
 		.user_db_path = ".otpasswd",
 
@@ -120,11 +131,13 @@ static void _config_defaults(cfg_t *cfg)
 		.ldap_pass = "",
 
 		.pam_logging = 2,
+		.trace_file = "",
 		.pam_silent = CONFIG_DISABLED,
 		.pam_enforce = CONFIG_DISABLED,
 		.pam_enforce_policy = CONFIG_ENABLED,
 		.pam_retry = 0,
 		.pam_retries = 3,
+		.pam_window = 0,
 
 		.pam_key_regeneration_prompt = 0,
 		.pam_failure_warning = 1,
@@ -158,6 +171,9 @@ static void _config_defaults(cfg_t *cfg)
 		.spass_require_digit  = 1,
 		.spass_require_special = 1,
 		.spass_require_uppercase = 1,
+		.spass_kdf = CONFIG_ENABLED,
+		.spass_kdf_cost = 0,
+		.spass_kdf_time = 20,
 
 		.passcode_def_length = 4,
 		.passcode_min_length = 2,
@@ -402,6 +418,65 @@ static int _config_parse(cfg_t *cfg, const char *config_path)
 				      " %d in config file\n", line_count);
 				goto error;
 			}
+		} else if (_EQ(line_buf, "db_format")) {
+			_right_trim(equality);
+			if (_EQ(equality, "text"))
+				cfg->db_format = CONFIG_DB_FORMAT_TEXT;
+			else if (_EQ(equality, "indexed"))
+				cfg->db_format = CONFIG_DB_FORMAT_INDEXED;
+			else {
+				print(PRINT_ERROR,
+				      "Illegal db_format parameter at line"
+				      " %d in config file\n", line_count);
+				goto error;
+			}
+		} else if (_EQ(line_buf, "lock_wait")) {
+			_right_trim(equality);
+			if (_EQ(equality, "retry"))
+				cfg->lock_wait = CONFIG_LOCK_WAIT_RETRY;
+			else if (_EQ(equality, "block"))
+				cfg->lock_wait = CONFIG_LOCK_WAIT_BLOCK;
+			else {
+				print(PRINT_ERROR,
+				      "Illegal lock_wait parameter at line"
+				      " %d in config file\n", line_count);
+				goto error;
+			}
+		} else if (_EQ(line_buf, "lock_timeout")) {
+			REQUIRE_INT_ARG(1, 60000);
+			cfg->lock_timeout = arg;
+		} else if (_EQ(line_buf, "db_sync")) {
+			_right_trim(equality);
+			if (_EQ(equality, "none"))
+				cfg->db_sync = CONFIG_DB_SYNC_NONE;
+			else if (_EQ(equality, "file"))
+				cfg->db_sync = CONFIG_DB_SYNC_FILE;
+			else if (_EQ(equality, "full"))
+				cfg->db_sync = CONFIG_DB_SYNC_FULL;
+			else {
+				print(PRINT_ERROR,
+				      "Illegal db_sync parameter at line"
+				      " %d in config file\n", line_count);
+				goto error;
+			}
+		} else if (_EQ(line_buf, "group_commit")) {
+			REQUIRE_ED_ARG();
+			cfg->group_commit = arg;
+		} else if (_EQ(line_buf, "group_commit_delay")) {
+			REQUIRE_INT_ARG(0, 100);
+			cfg->group_commit_delay = arg;
+		} else if (_EQ(line_buf, "daemon_sessions")) {
+			REQUIRE_INT_ARG(1, 10000);
+			cfg->daemon_sessions = arg;
+		} else if (_EQ(line_buf, "daemon_timeout")) {
+			REQUIRE_INT_ARG(1, 3600);
+			cfg->daemon_timeout = arg;
+		} else if (_EQ(line_buf, "db_wal")) {
+			REQUIRE_ED_ARG();
+			cfg->db_wal = arg;
+		} else if (_EQ(line_buf, "db_wal_limit")) {
+			REQUIRE_INT_ARG(1, 1000000);
+			cfg->db_wal_limit = arg;
 		} else if (_EQ(line_buf, "db_user")) {
 			if (strchr(equality, '/') != NULL) {
 				print(PRINT_ERROR,
@@ -443,9 +518,14 @@ static int _config_parse(cfg_t *cfg, const char *config_path)
 		} else if (_EQ(line_buf, "pam_retries")) {
 			REQUIRE_INT_ARG(2, 5);
 			cfg->pam_retries = arg;
+		} else if (_EQ(line_buf, "pam_window")) {
+			REQUIRE_INT_ARG(0, CONFIG_PAM_WINDOW_MAX);
+			cfg->pam_window = arg;
 		} else if (_EQ(line_buf, "pam_logging")) {
 			REQUIRE_INT_ARG(0, 3);
 			cfg->pam_logging = arg;
+		} else if (_EQ(line_buf, "trace_file")) {
+			_COPY(cfg->trace_file, equality);
 		} else if (_EQ(line_buf, "pam_silent")) {
 			REQUIRE_ED_ARG();
 			cfg->pam_silent = arg;
@@ -597,6 +677,15 @@ static int _config_parse(cfg_t *cfg, const char *config_path)
 		} else if (_EQ(line_buf, "spass_require_uppercase")) {
 			REQUIRE_INT_ARG(0, 20);
 			cfg->spass_require_uppercase = arg;
+		} else if (_EQ(line_buf, "spass_kdf")) {
+			REQUIRE_ED_ARG();
+			cfg->spass_kdf = arg;
+		} else if (_EQ(line_buf, "spass_kdf_cost")) {
+			REQUIRE_INT_ARG(0, CONFIG_SPASS_KDF_COST_MAX);
+			cfg->spass_kdf_cost = arg;
+		} else if (_EQ(line_buf, "spass_kdf_time")) {
+			REQUIRE_INT_ARG(1, 5000);
+			cfg->spass_kdf_time = arg;
 
 		} else {
 			/* Error */
@@ -680,7 +769,9 @@ cfg_t *cfg_get(void)
 	if (cfg_init)
 		return cfg_init;
 
+	trace_enter(TRACE_CONFIG);
 	retval = _config_init(&cfg, CONFIG_PATH);
+	trace_leave(TRACE_CONFIG);
 	if (retval != 0 && retval != 5)
 		return NULL;
 
@@ -29,6 +29,8 @@
 #define CONFIG_PATH_LEN		100
 #define CONFIG_SQL_LEN		50
 #define CONFIG_ALPHABET_LEN	90
+#define CONFIG_PAM_WINDOW_MAX	20
+#define CONFIG_SPASS_KDF_COST_MAX	24
 
 /** DB types */
 enum CONFIG_DB_TYPE {
@@ -40,6 +42,32 @@ enum CONFIG_DB_TYPE {
 	CONFIG_DB_UNCONFIGURED = 10
 };
 
+/** On-disk formats of file based databases */
+enum CONFIG_DB_FORMAT {
+	/* One colon-separated line per user */
+	CONFIG_DB_FORMAT_TEXT = 0,
+	/* Fixed-size binary records with a hashed username index */
+	CONFIG_DB_FORMAT_INDEXED = 1
+};
+
+/** Ways of waiting for a locked state */
+enum CONFIG_LOCK_WAIT {
+	/* Poll the lock with increasing delays */
+	CONFIG_LOCK_WAIT_RETRY = 0,
+	/* Sleep in the kernel until the lock is released */
+	CONFIG_LOCK_WAIT_BLOCK = 1
+};
+
+/** What is flushed to disk when database is written */
+enum CONFIG_DB_SYNC {
+	/* Leave it to the system */
+	CONFIG_DB_SYNC_NONE = 0,
+	/* Written file, before it replaces the old one */
+	CONFIG_DB_SYNC_FILE = 1,
+	/* Written file and its directory after the rename */
+	CONFIG_DB_SYNC_FULL = 2
+};
+
 /** Fields */
 enum {
 	OOB_DISABLED = 0,
@@ -71,6 +99,36 @@ typedef struct {
 	/** Database selected */
 	int db;
 
+	/** Format of global/user database file */
+	int db_format;
+
+	/** Way of waiting for a lock held by other process */
+	int lock_wait;
+
+	/** Time in milliseconds after which waiting for a lock fails */
+	int lock_timeout;
+
+	/** What is flushed to disk when database is written */
+	int db_sync;
+
+	/** Should agent daemon write updates of global database in batches */
+	int group_commit;
+
+	/** Time in milliseconds committer waits for more updates */
+	int group_commit_delay;
+
+	/** Maximal number of sessions agent daemon serves at once */
+	int daemon_sessions;
+
+	/** Time in seconds after which idle daemon session is dropped */
+	int daemon_timeout;
+
+	/** Should counter updates of text database go to write-ahead log */
+	int db_wal;
+
+	/** Number of log records after which log is folded into database */
+	int db_wal_limit;
+
 	/** Location of global database file */
 	char global_db_path[CONFIG_PATH_LEN];
 
@@ -107,6 +165,9 @@ typedef struct {
 	 */
 	int pam_logging;
 
+	/** File to append timing of each authentication to; empty - none */
+	char trace_file[CONFIG_PATH_LEN];
+
 	/** Silent flag. 1 - Be silent. Can be set in 
 	 * config or as an module option */
 	int pam_silent;
@@ -121,6 +182,11 @@ typedef struct {
 	/** How many retries are allowed */
 	int pam_retries;
 
+	/** Number of upcoming passcodes accepted at the prompt.
+	 * 0 - passcode is reserved by storing state before each prompt.
+	 * Otherwise state is stored only once, after successful login */
+	int pam_window;
+
 	/** Do we allow key regeneration (,) prompt? */
 	int pam_key_regeneration_prompt;
 
@@ -229,6 +295,15 @@ typedef struct {
 	/** Minimal number of uppercase letters */
 	int spass_require_uppercase;
 
+	/** Hash new spasses with PBKDF2 (enabled) or salted SHA256 (disabled) */
+	int spass_kdf;
+
+	/** Log2 of KDF iterations; 0 - calibrate to spass_kdf_time */
+	int spass_kdf_cost;
+
+	/** Target time of spass verification in milliseconds */
+	int spass_kdf_time;
+
 	/** Disallow (0), allow (1) or enforce (2) salt */
 	int salt;
 
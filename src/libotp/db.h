@@ -23,6 +23,9 @@
 #ifndef _DB_H_
 #define _DB_H_
 
+#include <sys/types.h> /* uid_t, gid_t */
+#include <sys/stat.h>  /* struct stat */
+
 /*
  * Each database has 4 functions used to access it.
  * Two for locking/unlocking, one for loading user info
@@ -47,6 +50,153 @@ extern int db_file_unlock(state *s);
 extern int db_file_load(state *s);
 extern int db_file_store(state *s, int remove);
 
+/* Load state for read-only use without taking any locks. */
+extern int db_file_peek(state *s);
+
+/* Helpers shared by all file based databases */
+extern int db_file_path(const char *username, char **db, char **lck, char **tmp,
+                        uid_t *uid, gid_t *gid, char **home);
+extern int db_file_permissions(const char *db_path, const char *user_home);
+extern int db_file_parse_entry(state *s, const char *entry, size_t length);
+extern int db_file_generate_entry(const state *s, char *buffer, int buff_length);
+
+/* Lock only a part of the lock file; len = 0 extends lock to
+ * the end of file. Lock fd is stored in the state like with db_file_lock */
+extern int db_file_lock_part(state *s, off_t start, off_t len);
+
+/* Set (or with F_UNLCK release) a lock on a range of opened lock file.
+ * Waits for a lock held by someone else as set by LOCK_WAIT
+ * and LOCK_TIMEOUT config options. LOCK_WAIT=block arms a process
+ * wide SIGALRM timer and must not be used by threaded programs. */
+extern int db_file_lock_range(int fd, short type, off_t start, off_t len);
+
+/* Lock acquisition counters of this process; reported in traces */
+typedef struct {
+	unsigned long locks;		/* Locks acquired */
+	unsigned long waits;		/* Locks which were held by someone else */
+	unsigned long timeouts;		/* Waits which failed */
+	unsigned long long wait_us;	/* Total time spent waiting */
+	unsigned long long max_wait_us;	/* Longest wait */
+} db_lock_stats;
+
+extern const db_lock_stats *db_file_lock_stats(void);
+
+/* Flush a written database file (as set by DB_SYNC) */
+extern int db_file_sync(int fd);
+
+/* Flush directory holding the path after a rename (DB_SYNC=full) */
+extern int db_file_sync_dir(const char *path);
+
+/* Flushing counters of this process; reported in traces */
+typedef struct {
+	unsigned long syncs;		/* Flushed files */
+	unsigned long dir_syncs;	/* Flushed directories */
+	unsigned long long sync_us;	/* Total time spent flushing */
+	unsigned long long max_sync_us;	/* Longest flush */
+} db_sync_stats;
+
+extern const db_sync_stats *db_file_sync_stats(void);
+
+/* Group commit of global database.
+ *
+ * Session of the agent daemon given a committer descriptor locks only
+ * a byte of the lock file selected for the user and sends its updates
+ * through the descriptor instead of rewriting the database. Daemon
+ * collects updates of concurrent sessions and writes them with
+ * db_file_commit. Reply (an int status) is sent back after the batch
+ * is on disk. -1 returns to writing the database directly. */
+extern void db_file_set_committer(int fd);
+
+/* Apply updates to the text database in a single rewrite. Each update
+ * is either a complete entry line or a bare username to remove.
+ * All updates are written or none of them is. */
+extern int db_file_commit(const char *db_path, char *const *updates, int count);
+
+
+/*** Write-ahead log of text DB. ***/
+
+/* Records of the log are kept next to the database (path + .wal).
+ * Log applies only to the database file described by 'snapshot'
+ * (stat of the opened database); other logs are ignored. */
+typedef struct db_wal db_wal;
+typedef struct db_wal_record db_wal_record;
+
+/* Returned by db_wal_append when log should be folded into database */
+#define DB_WAL_FULL 1
+
+/* Checksum of state fields which are not kept in the log */
+extern unsigned int db_wal_base(const state *s);
+
+/* Append counters of the state to the log and flush it */
+extern int db_wal_append(const char *db_path, const struct stat *snapshot,
+                         const state *s);
+
+/* Update state read from the database with its newest record */
+extern int db_wal_replay(const char *db_path, const struct stat *snapshot,
+                         state *s);
+
+/* Read newest records of all users; *log is NULL when there are none */
+extern int db_wal_load(const char *db_path, const struct stat *snapshot,
+                       db_wal **log);
+extern const db_wal_record *db_wal_find(const db_wal *log, const char *username);
+/* Returns 1 if record was applied, 0 if the state changed since it was logged */
+extern int db_wal_apply(const db_wal_record *r, state *s);
+extern void db_wal_free(db_wal *log);
+
+/* Remove log after it was folded into the database */
+extern int db_wal_remove(const char *db_path);
+
+/* Move log together with its database */
+extern int db_wal_rename(const char *db_path, const char *new_db_path);
+
+
+/*** Indexed file DB. ***/
+
+/* Locking state file */
+extern int db_index_lock(state *s);
+extern int db_index_unlock(state *s);
+
+/* Load/Store state from/to indexed database. */
+extern int db_index_load(state *s);
+extern int db_index_store(state *s, int remove);
+
+/* Look up state in mapped database for read-only use without
+ * taking any locks. Falls back to db_index_load when database
+ * structure keeps changing during the lookup. */
+extern int db_index_peek(state *s);
+
+/* Convert text database into indexed one. */
+extern int db_index_convert(const char *text_db, const char *index_db);
+
+/* Byte of the lock file locked by state lock of the user */
+extern off_t db_index_lock_offset(const char *username);
+
+
+/*** Bulk transfer of file databases. ***/
+
+/* Whole database is transferred as lines of the text database,
+ * so an export can be used directly as a text database. */
+
+/* Called with each exported entry line (including \n);
+ * nonzero return stops the export and is returned */
+typedef int (*db_bulk_emit)(void *arg, const char *entry, size_t length);
+
+/* Export all entries; updates still in the write-ahead log included */
+extern int db_file_export(const char *db_path, db_bulk_emit emit, void *arg);
+extern int db_index_export(const char *index_db, db_bulk_emit emit, void *arg);
+
+/* Import entries in place of a whole database. Data can be split at
+ * any place. New database of cfg->db_format is built next to 'db_path'
+ * and replaces it only when db_bulk_import_finish succeeds. Previous
+ * database is kept with .old suffix. Caller of finish must hold lock
+ * of the whole database. Free the import in any case. */
+typedef struct db_bulk db_bulk;
+
+extern int db_bulk_import_start(const char *db_path, db_bulk **b);
+extern int db_bulk_import(db_bulk *b, const char *data, size_t length);
+extern int db_bulk_import_finish(db_bulk *b, unsigned long *entries);
+extern void db_bulk_import_free(db_bulk *b);
+
 
 /*** MySQL DB. ***/
 
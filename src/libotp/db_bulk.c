@@ -0,0 +1,372 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Streaming import of a whole database from text database entries.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <unistd.h>	/* link, unlink, fchown */
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "print.h"
+#include "state.h"
+#include "db.h"
+#include "config.h"
+#include "ppp_common.h"
+
+/*
+ * Entries are validated one by one as their lines are completed and
+ * appended to a text file next to the database (path + .import). The
+ * indexed database is converted from it when the stream ends. Nothing
+ * but the line being completed is kept in memory, apart from a set of
+ * 64-bit username hashes used to reject duplicate entries.
+ *
+ * Old database is left in place until the new one is complete and
+ * is then replaced with a single rename, so readers which take no
+ * locks always see one of them.
+ */
+
+/* Initial size of the username set, power of two */
+#define DB_BULK_MIN_USERS	1024
+
+struct db_bulk {
+	char *db;		/* Replaced database */
+	char *text;		/* Validated entries */
+	char *index;		/* Indexed database converted from text */
+	FILE *out;
+	int format;		/* CONFIG_DB_FORMAT_* */
+
+	/* Incomplete line from the previous data */
+	char line[STATE_ENTRY_SIZE];
+	size_t line_length;
+
+	/* Open addressing set of username hashes; 0 marks free slot */
+	uint64_t *users;
+	size_t users_size;
+
+	unsigned long entries;
+};
+
+/* FNV-1a hash of username, never 0 */
+static uint64_t _db_bulk_hash(const char *username, size_t length)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < length; i++) {
+		hash ^= (unsigned char) username[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash ? hash : 1;
+}
+
+static void _db_bulk_set_add(uint64_t *users, size_t size, uint64_t hash)
+{
+	size_t i = hash & (size - 1);
+	while (users[i] != 0)
+		i = (i + 1) & (size - 1);
+	users[i] = hash;
+}
+
+/* Add username to the set; returns 1 if it was already there */
+static int _db_bulk_add_user(db_bulk *b, const char *username, size_t length)
+{
+	const uint64_t hash = _db_bulk_hash(username, length);
+	size_t i;
+
+	for (i = hash & (b->users_size - 1); b->users[i] != 0;
+	     i = (i + 1) & (b->users_size - 1)) {
+		if (b->users[i] == hash)
+			return 1;
+	}
+
+	/* Keep set at most half full */
+	if (b->entries + 1 > b->users_size / 2) {
+		const size_t size = b->users_size * 2;
+		uint64_t *users = calloc(size, sizeof(*users));
+		if (!users)
+			return STATE_NOMEM;
+		for (i = 0; i < b->users_size; i++) {
+			if (b->users[i] != 0)
+				_db_bulk_set_add(users, size, b->users[i]);
+		}
+		free(b->users);
+		b->users = users;
+		b->users_size = size;
+	}
+
+	_db_bulk_set_add(b->users, b->users_size, hash);
+	return 0;
+}
+
+static char *_db_bulk_path(const char *db_path, const char *suffix)
+{
+	char *path = malloc(strlen(db_path) + strlen(suffix) + 1);
+	if (path) {
+		strcpy(path, db_path);
+		strcat(path, suffix);
+	}
+	return path;
+}
+
+/* Validate complete line and write it out */
+static int _db_bulk_entry(db_bulk *b, const char *line, size_t length)
+{
+	char username[STATE_ENTRY_SIZE];
+	const char *sep;
+	state s;
+	size_t i;
+	int ret;
+
+	const unsigned long entry = b->entries + 1;
+
+	sep = memchr(line, ':', length);
+	if (length < 10 || !sep || sep == line) {
+		print(PRINT_ERROR, "Imported entry %lu is invalid.\n", entry);
+		return STATE_PARSE_ERROR;
+	}
+
+	for (i = 0; line + i < sep; i++) {
+		if (!isgraph((unsigned char) line[i])) {
+			print(PRINT_ERROR, "Imported entry %lu has invalid "
+			      "username.\n", entry);
+			return STATE_PARSE_ERROR;
+		}
+		username[i] = line[i];
+	}
+	username[i] = '\0';
+
+	if (state_init(&s, username) != 0)
+		return STATE_NOMEM;
+
+	ret = db_file_parse_entry(&s, line, length);
+	if (ret == 0 && s.alphabet >= (unsigned int) ppp_alphabet_count) {
+		print(PRINT_ERROR, "Illegal alphabet. State entry is invalid\n");
+		ret = STATE_PARSE_ERROR;
+	}
+	state_fini(&s);
+
+	if (ret != 0) {
+		print(PRINT_ERROR, "Imported entry %lu of user %s is invalid.\n",
+		      entry, username);
+		return ret;
+	}
+
+	ret = _db_bulk_add_user(b, username, i);
+	if (ret == 1) {
+		print(PRINT_ERROR, "Duplicate entry for user %s in imported "
+		      "data\n", username);
+		return STATE_PARSE_ERROR;
+	}
+	if (ret != 0)
+		return ret;
+
+	if (fwrite(line, 1, length, b->out) != length) {
+		print_perror(PRINT_ERROR, "Error while writing %s", b->text);
+		return STATE_IO_ERROR;
+	}
+
+	b->entries++;
+	return 0;
+}
+
+/***********************************
+ * Interface
+ ***********************************/
+int db_bulk_import_start(const char *db_path, db_bulk **b_out)
+{
+	cfg_t *cfg = cfg_get();
+	db_bulk *b;
+
+	*b_out = NULL;
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return STATE_NOMEM;
+
+	b->format = cfg->db_format;
+	b->db = strdup(db_path);
+	b->text = _db_bulk_path(db_path, ".import");
+	b->index = _db_bulk_path(db_path, ".import.idx");
+	b->users_size = DB_BULK_MIN_USERS;
+	b->users = calloc(b->users_size, sizeof(*b->users));
+	if (!b->db || !b->text || !b->index || !b->users) {
+		db_bulk_import_free(b);
+		return STATE_NOMEM;
+	}
+
+	b->out = fopen(b->text, "w");
+	if (!b->out) {
+		print_perror(PRINT_ERROR, "Unable to create %s", b->text);
+		db_bulk_import_free(b);
+		return STATE_IO_ERROR;
+	}
+
+	/* When run by root ensure correct owner */
+	if (geteuid() == 0 && cfg->db == CONFIG_DB_GLOBAL &&
+	    cfg->user_uid != (uid_t) -1 &&
+	    fchown(fileno(b->out), cfg->user_uid, cfg->user_gid) != 0) {
+		print_perror(PRINT_ERROR, "Unable to set owner of %s", b->text);
+		db_bulk_import_free(b);
+		return STATE_IO_ERROR;
+	}
+
+	*b_out = b;
+	return 0;
+}
+
+int db_bulk_import(db_bulk *b, const char *data, size_t length)
+{
+	const char *eol;
+	size_t part;
+	int ret;
+
+	if (!b->out) {
+		print(PRINT_ERROR, "Import was already finished\n");
+		return STATE_IO_ERROR;
+	}
+
+	while (length > 0) {
+		eol = memchr(data, '\n', length);
+		part = eol ? (size_t) (eol - data) + 1 : length;
+
+		/* Both parts and the \0 must fit */
+		if (b->line_length + part >= sizeof(b->line)) {
+			print(PRINT_ERROR, "Imported entry %lu is too long.\n",
+			      b->entries + 1);
+			return STATE_PARSE_ERROR;
+		}
+
+		if (!eol) {
+			memcpy(b->line + b->line_length, data, part);
+			b->line_length += part;
+			break;
+		}
+
+		if (b->line_length == 0) {
+			/* Whole line is in the data */
+			ret = _db_bulk_entry(b, data, part);
+		} else {
+			memcpy(b->line + b->line_length, data, part);
+			ret = _db_bulk_entry(b, b->line, b->line_length + part);
+			memset(b->line, 0, b->line_length + part);
+			b->line_length = 0;
+		}
+		if (ret != 0)
+			return ret;
+
+		data += part;
+		length -= part;
+	}
+	return 0;
+}
+
+int db_bulk_import_finish(db_bulk *b, unsigned long *entries)
+{
+	const char *ready;
+	char *backup = NULL;
+	int ret;
+
+	if (!b->out) {
+		print(PRINT_ERROR, "Import was already finished\n");
+		return STATE_IO_ERROR;
+	}
+
+	if (b->line_length != 0) {
+		print(PRINT_ERROR, "Imported entry %lu is not terminated.\n",
+		      b->entries + 1);
+		return STATE_PARSE_ERROR;
+	}
+
+	ret = fflush(b->out) == 0 ? db_file_sync(fileno(b->out)) : STATE_IO_ERROR;
+	if (fclose(b->out) != 0 && ret == 0)
+		ret = STATE_IO_ERROR;
+	b->out = NULL;
+	if (ret != 0) {
+		print_perror(PRINT_ERROR, "Error while writing %s", b->text);
+		return STATE_IO_ERROR;
+	}
+
+	ready = b->text;
+	if (b->format == CONFIG_DB_FORMAT_INDEXED) {
+		ret = db_index_convert(b->text, b->index);
+		if (ret != 0)
+			return ret;
+		ready = b->index;
+	}
+
+	backup = _db_bulk_path(b->db, ".old");
+	if (!backup)
+		return STATE_NOMEM;
+
+	/* Current database stays in place until the rename */
+	if ((unlink(backup) != 0 && errno != ENOENT) ||
+	    (link(b->db, backup) != 0 && errno != ENOENT)) {
+		print_perror(PRINT_ERROR, "Unable to keep %s as %s", b->db, backup);
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	if (rename(ready, b->db) != 0) {
+		print_perror(PRINT_ERROR, "Unable to replace %s", b->db);
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	/* Log of the replaced text database goes with it */
+	ret = db_wal_rename(b->db, backup);
+	if (ret != 0)
+		goto cleanup;
+
+	if (db_file_sync_dir(b->db) != 0)
+		print(PRINT_WARN, "State file might not survive a crash\n");
+
+	print(PRINT_NOTICE, "Imported %lu entries\n", b->entries);
+	if (entries)
+		*entries = b->entries;
+
+cleanup:
+	free(backup);
+	return ret;
+}
+
+void db_bulk_import_free(db_bulk *b)
+{
+	if (!b)
+		return;
+
+	if (b->out)
+		fclose(b->out);
+	if (b->text)
+		(void) unlink(b->text);
+	if (b->index)
+		(void) unlink(b->index);
+
+	memset(b->line, 0, sizeof(b->line));
+	free(b->users);
+	free(b->db);
+	free(b->text);
+	free(b->index);
+	free(b);
+}
@@ -21,10 +21,17 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>	/* UINT_MAX */
+#include <stdint.h>	/* INTMAX_MAX */
 
 #include <unistd.h>	/* usleep, open, close, unlink, getuid */
+#include <signal.h>	/* sigaction */
+#include <time.h>	/* clock_gettime */
+#include <sys/time.h>	/* setitimer */
 #include <sys/types.h>
 #include <sys/stat.h>	/* stat */
+#include <sys/mman.h>	/* mmap */
+#include <sys/socket.h>	/* send, recv */
 #include <pwd.h>	/* getpwnam */
 #include <fcntl.h>
 
@@ -33,6 +40,7 @@
 #include "db.h"
 #include "config.h"
 #include "crypto.h"
+#include "trace.h"
 
 #if S_SPLINT_S
 #define PRIuMAX "llu"
@@ -41,26 +49,6 @@
 /******************
  * Static helpers
  ******************/
-static char *_strtok(char *input, const char *delim)
-{
-	static char *position = NULL;
-	char *token;
-	if (input != NULL)
-		position = input;
-
-	/* FIXME: valgrind doesn't like following line:
-	 * As of 0.7 valgrind doesn't seem to have a problem here. */
-	token = strsep(&position, delim); /* Non C99 function */
-
-	/* Cut token at any \n found */
-	if (token) {
-		char *pos = strchr(token, '\n');
-		if (pos)
-			*pos = '\0';
-	}
-	return token;
-}
-
 /* We might be run by root (from PAM) or suid to cfg->user_uid.
  *
  * 1) Check if db exists
@@ -78,7 +66,7 @@ static char *_strtok(char *input, const char *delim)
  * State files are created with PAM also. Because of this
  * we must ensure correct owner of file.
  */
-static int _db_file_permissions(const char *db_path, const char *user_home)
+int db_file_permissions(const char *db_path, const char *user_home)
 {
 	/* Limit number of warnings printed */
 	static int printed = 0;
@@ -247,8 +235,8 @@ static int _db_file_permissions(const char *db_path, const char *user_home)
 /* Returns a name of current state + lock + temp file.
  * When DB=USER is set it also returns UID, GID and HOME of a given user
  */
-static int _db_path(const char *username, char **db, char **lck, char **tmp,
-                    uid_t *uid, gid_t *gid, char **home)
+int db_file_path(const char *username, char **db, char **lck, char **tmp,
+                 uid_t *uid, gid_t *gid, char **home)
 {
 	int retval = 1;
 	static struct passwd *pwdata = NULL;
@@ -271,7 +259,9 @@ static int _db_path(const char *username, char **db, char **lck, char **tmp,
 		int length;
 
 		/* Get home */
+		trace_enter(TRACE_PASSWD);
 		pwdata = getpwnam(username);
+		trace_leave(TRACE_PASSWD);
 		if (pwdata && pwdata->pw_dir) {
 			userhome = pwdata->pw_dir;
 		} else {
@@ -354,6 +344,7 @@ error:
 /* State files constants */
 static const int _version = 1;
 static const char *_delim = ":"; /* Change it also in snprintf in store */
+static const char *_spass_kdf_tag = "$2$"; /* Prefix of STATE_SPASS_KDF hashes */
 
 static const int fields = 15;
 
@@ -375,14 +366,65 @@ enum {
 	FIELD_CONTACT,
 };
 
+/* Find entry of username inside a database mapped into memory.
+ * Lines are checked like in _db_find_user_entry, but nothing is copied:
+ * entry is set to the beginning of user line (with newline). */
+static int _db_find_user_entry_mem(
+	const char *username, const char *data, size_t size,
+	const char **entry, size_t *entry_length)
+{
+	const size_t user_len = strlen(username);
+	const char *end = data + size;
+	const char *eol;
+	size_t line_length;
+
+	while (data < end) {
+		eol = memchr(data, '\n', end - data);
+		if (eol == NULL) {
+			print(PRINT_NOTICE,
+			      "Line too long inside the state file\n");
+			return STATE_PARSE_ERROR;
+		}
+
+		line_length = eol + 1 - data;
+		if (line_length >= STATE_ENTRY_SIZE) {
+			print(PRINT_NOTICE,
+			      "Line too long inside the state file\n");
+			return STATE_PARSE_ERROR;
+		}
+
+		if (line_length < 10) {
+			/* This can't hold correct state */
+			print(PRINT_NOTICE,
+			      "State file is invalid. Line too short.\n");
+			return STATE_PARSE_ERROR;
+		}
+
+		if (line_length > user_len && data[user_len] == _delim[0] &&
+		    memcmp(data, username, user_len) == 0) {
+			*entry = data;
+			*entry_length = line_length;
+			return 0;
+		}
+
+		data = eol + 1;
+	}
+
+	/* Not found */
+	return STATE_NO_USER_ENTRY;
+}
+
+static int _db_fold_entry(const db_wal *log, char *line, size_t size);
+
 /* Find entry in database for username. Unmodified line
  * is left in buffer.
  *
  * If out is given each line we pass without a match
- * is written into this file.
+ * is written into this file, updated with records of
+ * the log if given.
  */
 static int _db_find_user_entry(
-	const char *username, FILE *f, FILE *out,
+	const char *username, FILE *f, FILE *out, const db_wal *log,
 	char *buff, size_t buff_size)
 {
 	size_t line_length;
@@ -434,6 +476,12 @@ static int _db_find_user_entry(
 		}
 
 		if (out) {
+			if (_db_fold_entry(log, buff, buff_size) != 0) {
+				print(PRINT_NOTICE,
+				      "Unable to apply logged update to state file\n");
+				return STATE_PARSE_ERROR;
+			}
+
 			if (fputs(buff, out) < 0) {
 				print(PRINT_NOTICE,
 				      "Error while writing data to file!\n");
@@ -446,237 +494,227 @@ static int _db_find_user_entry(
 	return STATE_NO_USER_ENTRY;
 }
 
-static int _db_parse_user_entry(char *buff, char **field)
+/* Split entry into fields, checking their number and lengths on the
+ * way. Fields point into the entry and aren't \0 terminated. */
+static int _db_split_user_entry(const char *entry, size_t length,
+				const char **field, size_t *field_len)
 {
-	int i, ret;
-	/* Parse entry - split into fields, verify version */
-	for (i=0; i<fields; i++) {
-		field[i] = _strtok(i == 0 ? buff : NULL, _delim);
-		if (field[i] == NULL) {
-			print(PRINT_ERROR,
-			      "State file invalid. Not enough fields.\n");
+	const char *end = entry + length;
+	const char *sep;
+	int i;
+
+	for (i = 0; i < fields; i++) {
+		sep = memchr(entry, _delim[0], end - entry);
+		if (sep == NULL) {
+			if (i != fields - 1) {
+				print(PRINT_ERROR,
+				      "State file invalid. Not enough fields.\n");
+				return STATE_PARSE_ERROR;
+			}
+			sep = end;
+		} else if (i == fields - 1) {
+			print(PRINT_ERROR, "State file invalid. Too much fields.\n");
 			return STATE_PARSE_ERROR;
 		}
 
-		if (strlen(field[i]) > STATE_MAX_FIELD_SIZE) {
+		field[i] = entry;
+		field_len[i] = sep - entry;
+		if (field_len[i] > STATE_MAX_FIELD_SIZE) {
 			print(PRINT_ERROR,
 			      "State file corrupted. Entry too long\n");
 			return STATE_PARSE_ERROR;
 		}
+		entry = sep + 1;
+	}
+	return 0;
+}
 
-		/* If we parsed field version, check it immediately */
-		if (i == FIELD_VERSION) {
-			if (sscanf(field[i], "%u", &ret) != 1) {
-				print(PRINT_ERROR,
-				      "Error while parsing state file "
-				      "version.\n");
-				return STATE_PARSE_ERROR;
-			}
+/* Decode non-empty unsigned number not larger than max.
+ * Signs, spaces and trailing garbage are not accepted. */
+static int _db_parse_uint(const char *field, size_t length, unsigned int base,
+			  uintmax_t max, uintmax_t *result)
+{
+	uintmax_t value = 0;
+	unsigned int digit;
+	size_t i;
 
-			if (ret != _version) {
-				print(PRINT_ERROR,
-				      "State file version is incompatible. "
-				      "Recreate key.\n");
-				return STATE_PARSE_ERROR;
-			}
-		}
-	}
+	if (length == 0)
+		return 1;
 
-	if (_strtok(NULL, _delim) != NULL) {
-		print(PRINT_ERROR, "State file invalid. Too much fields.\n");
-		return STATE_PARSE_ERROR;
+	for (i = 0; i < length; i++) {
+		if (field[i] >= '0' && field[i] <= '9')
+			digit = field[i] - '0';
+		else if (base == 16 && field[i] >= 'A' && field[i] <= 'F')
+			digit = 10 + field[i] - 'A';
+		else if (base == 16 && field[i] >= 'a' && field[i] <= 'f')
+			digit = 10 + field[i] - 'a';
+		else
+			return 1;
+
+		if (value > (max - digit) / base)
+			return 1;
+		value = value * base + digit;
 	}
 
+	*result = value;
 	return 0;
 }
 
-/**********************************************
- * Interface functions for managing state files
- **********************************************/
-int db_file_load(state *s)
+/* Copy text field into a buffer of 'size' bytes and validate it */
+static int _db_parse_str(const char *field, size_t length, char *str, size_t size)
 {
-	/* State file should never be larger than 160 bytes */
-	char buff[STATE_ENTRY_SIZE];
-
-	/* Did we lock it here? */
-	int locked;
-
-	/* Pointers to fields in file */
-	char *field[fields];
+	if (length >= size || memchr(field, '\0', length) != NULL)
+		return 1;
+	memcpy(str, field, length);
+	str[length] = '\0';
+	return state_validate_str(str) ? 0 : 1;
+}
 
-	/* Temporary variable for returned values */
-	int ret = 0;
+/* Parse a single text entry (line) of a file database into
+ * a state. Entry, which might end with a newline, is scanned once
+ * and fields are decoded in place, so it can be a part of mapped
+ * file. Also used when converting text databases into other formats. */
+int db_file_parse_entry(state *s, const char *entry, size_t length)
+{
+	/* Fields inside the entry */
+	const char *field[fields];
+	size_t len[fields];
 
-	/* State file */
-	FILE *f = NULL;
+	/* Decoded numbers */
+	uintmax_t value;
 
 	/* Value returned. */
 	int retval;
 
-	/* Iterator */
-	int i;
-
-	/* Files: database, lock and temporary */
-	char *db = NULL, *lck = NULL, *tmp = NULL, *home = NULL;
-	ret = _db_path(s->username, &db, &lck, &tmp, NULL, NULL, &home);
-	if (ret != 0) {
-		return ret;
-	}
-
-	/* Permissions will be checked during locking
-	 * now, or was already checked */
-	retval = _db_file_permissions(db, home);
-	if (retval != 0) {
-		goto cleanup1;
-	}
-
-	/* DB file should always be locked before changing.
-	 * Locking can only be omitted when we want to discard
-	 * any changes or that we don't bother if somebody changes
-	 * them at the same time.
-	 * Here we just detect that it's not locked and lock it then
-	 */
-	if (s->lock <= 0) {
-		print(PRINT_NOTICE,
-		      "State file not locked while reading from it\n");
-		retval = db_file_lock(s);
-		if (retval != 0) {
-			print(PRINT_ERROR, "Unable to lock file for reading!\n");
-			goto cleanup1;
-		}
+	if (length > 0 && entry[length - 1] == '\n')
+		length--;
 
-		/* Locked locally, unlock locally later */
-		locked = 1;
-	} else {
-		locked = 0;
-	}
+	retval = _db_split_user_entry(entry, length, field, len);
+	if (retval != 0)
+		return retval;
 
-	f = fopen(db, "r");
-	if (!f) {
-		if (errno == ENOENT)
-			retval = STATE_NON_EXISTENT;
-		else
-			retval = STATE_IO_ERROR;
-		print_perror(PRINT_ERROR,
-			     "Unable to open %s for reading.",
-			     db);
-		goto cleanup;
+	/* Verify version before anything else */
+	if (_db_parse_uint(field[FIELD_VERSION], len[FIELD_VERSION], 10,
+			   UINT_MAX, &value) != 0) {
+		print(PRINT_ERROR, "Error while parsing state file version.\n");
+		return STATE_PARSE_ERROR;
 	}
 
-	/* Read all file into a buffer */
-	ret = _db_find_user_entry(s->username, f, NULL, buff, sizeof(buff));
-	if (ret != 0) {
-		/* No entry, or file invalid */
-		retval = ret;
-		goto cleanup;
+	if (value != _version) {
+		print(PRINT_ERROR,
+		      "State file version is incompatible. Recreate key.\n");
+		return STATE_PARSE_ERROR;
 	}
 
-	ret = _db_parse_user_entry(buff, field);
-	if (ret != 0) {
-		/* Parse error */
-		retval = ret;
-		goto cleanup;
+	if (len[FIELD_USER] != strlen(s->username) ||
+	    memcmp(field[FIELD_USER], s->username, len[FIELD_USER]) != 0) {
+		print(PRINT_ERROR, "State entry belongs to a different user.\n");
+		return STATE_PARSE_ERROR;
 	}
 
 	/* Parse fields, if anybody bad happens return parse error */
 	retval = STATE_PARSE_ERROR;
 
-	/* Parse sequence key */
-	for (i = 0; i < 32; i++) {
-		char *pos = &field[FIELD_KEY][i*2];
-		int tmp;
-		if (!*pos || !*(pos+1)) {
-			print(PRINT_ERROR, "Error while parsing sequence key.\n");
-			goto cleanup;
-		}
-		if (sscanf(pos, "%02X", &tmp) != 1) {
-			print(PRINT_ERROR, "Error while parsing sequence key.\n");
-			goto cleanup;
-		}
-		s->sequence_key[i] = tmp;
+	if (len[FIELD_KEY] != 64 ||
+	    crypto_hex_to_binary(field[FIELD_KEY], 64, s->sequence_key) != 0) {
+		print(PRINT_ERROR, "Error while parsing sequence key.\n");
+		goto error;
 	}
 
-	if (num_import(&s->counter, field[FIELD_COUNTER], NUM_FORMAT_HEX) != 0) {
+	if (num_import_hex(&s->counter, field[FIELD_COUNTER], len[FIELD_COUNTER]) != 0) {
 		print(PRINT_ERROR, "Error while parsing counter.\n");
-		goto cleanup;
+		goto error;
 	}
 
-	if (num_import(&s->latest_card, field[FIELD_LATEST_CARD], NUM_FORMAT_HEX) != 0) {
+	if (num_import_hex(&s->latest_card, field[FIELD_LATEST_CARD],
+			   len[FIELD_LATEST_CARD]) != 0) {
 		print(PRINT_ERROR,
 		      "Error while parsing number "
 		      "of latest printed passcard\n");
-		goto cleanup;
+		goto error;
 	}
 
-	/* TODO: Change sscanf to more simple function */
-	if (sscanf(field[FIELD_FAILURES], "%u", &s->failures) != 1) {
+	if (_db_parse_uint(field[FIELD_FAILURES], len[FIELD_FAILURES], 10,
+			   UINT_MAX, &value) != 0) {
 		print(PRINT_ERROR, "Error while parsing failures count\n");
-		goto cleanup;
+		goto error;
 	}
+	s->failures = value;
 
-	if (sscanf(field[FIELD_RECENT_FAILURES], "%u", &s->recent_failures) != 1) {
+	if (_db_parse_uint(field[FIELD_RECENT_FAILURES], len[FIELD_RECENT_FAILURES], 10,
+			   UINT_MAX, &value) != 0) {
 		print(PRINT_ERROR, "Error while parsing recent failure count\n");
-		goto cleanup;
+		goto error;
 	}
+	s->recent_failures = value;
 
-	if (sscanf(field[FIELD_CHANNEL_TIME], "%" PRIuMAX, &s->channel_time) != 1) {
+	if (_db_parse_uint(field[FIELD_CHANNEL_TIME], len[FIELD_CHANNEL_TIME], 10,
+			   INTMAX_MAX, &value) != 0) {
 		print(PRINT_ERROR, "Error while parsing channel use time.\n");
-		goto cleanup;
+		goto error;
 	}
+	s->channel_time = value;
 
-	if (sscanf(field[FIELD_CODE_LENGTH], "%u", &s->code_length) != 1) {
+	if (_db_parse_uint(field[FIELD_CODE_LENGTH], len[FIELD_CODE_LENGTH], 10,
+			   UINT_MAX, &value) != 0) {
 		print(PRINT_ERROR, "Error while parsing passcode length\n");
-		goto cleanup;
+		goto error;
 	}
+	s->code_length = value;
 
-	if (sscanf(field[FIELD_ALPHABET], "%u", &s->alphabet) != 1) {
+	if (_db_parse_uint(field[FIELD_ALPHABET], len[FIELD_ALPHABET], 10,
+			   UINT_MAX, &value) != 0) {
 		print(PRINT_ERROR, "Error while parsing alphabet\n");
-		goto cleanup;
+		goto error;
 	}
+	s->alphabet = value;
 
-	if (sscanf(field[FIELD_FLAGS], "%x", &s->flags) != 1) {
+	if (_db_parse_uint(field[FIELD_FLAGS], len[FIELD_FLAGS], 16,
+			   UINT_MAX, &value) != 0) {
 		print(PRINT_ERROR, "Error while parsing flags\n");
-		goto cleanup;
+		goto error;
 	}
+	s->flags = value;
 
-	if (strlen(field[FIELD_SPASS]) == 0) {
-		s->spass_set = 0;
+	if (len[FIELD_SPASS] == 0) {
+		s->spass_set = STATE_SPASS_UNSET;
 	} else {
-		if (crypto_hex_to_binary(field[FIELD_SPASS], 80, s->spass) != 0) {
+		const char *spass = field[FIELD_SPASS];
+		size_t spass_len = len[FIELD_SPASS];
+		const size_t tag_len = strlen(_spass_kdf_tag);
+		int format = STATE_SPASS_SHA256;
+
+		if (spass_len > tag_len && memcmp(spass, _spass_kdf_tag, tag_len) == 0) {
+			spass += tag_len;
+			spass_len -= tag_len;
+			format = STATE_SPASS_KDF;
+		}
+
+		if (spass_len != 80 || crypto_hex_to_binary(spass, 80, s->spass) != 0) {
 			print(PRINT_ERROR, "Error while parsing static password.\n");
-			goto cleanup;
+			goto error;
 		}
 
-		if (sscanf(field[FIELD_SPASS_TIME], "%" PRIuMAX, &s->spass_time) != 1) {
+		if (_db_parse_uint(field[FIELD_SPASS_TIME], len[FIELD_SPASS_TIME], 10,
+				   INTMAX_MAX, &value) != 0) {
 			print(PRINT_ERROR, "Error while parsing static password change time.\n");
-			goto cleanup;
+			goto error;
 		}
+		s->spass_time = value;
 
-		s->spass_set = 1;
+		s->spass_set = format;
 	}
 
-	/* Copy label and contact */
-	strncpy(s->label, field[FIELD_LABEL], sizeof(s->label)-1);
-	strncpy(s->contact, field[FIELD_CONTACT], sizeof(s->contact)-1);
-
-	if (s->label[sizeof(s->label)-1] != '\0') {
-		print(PRINT_ERROR, "Label field too long\n");
-		goto cleanup;
-	}
-
-	if (s->contact[sizeof(s->contact)-1] != '\0') {
-		print(PRINT_ERROR, "Contact field too long\n");
-		goto cleanup;
-	}
-
-	if (!state_validate_str(s->label)) {
-		print(PRINT_ERROR, "Illegal characters in label\n");
-		goto cleanup;
+	if (_db_parse_str(field[FIELD_LABEL], len[FIELD_LABEL],
+			  s->label, sizeof(s->label)) != 0) {
+		print(PRINT_ERROR, "Label field too long or contains illegal characters\n");
+		goto error;
 	}
 
-	if (!state_validate_str(s->contact)) {
-		print(PRINT_ERROR, "Illegal characters in contact\n");
-		goto cleanup;
+	if (_db_parse_str(field[FIELD_CONTACT], len[FIELD_CONTACT],
+			  s->contact, sizeof(s->contact)) != 0) {
+		print(PRINT_ERROR, "Contact field too long or contains illegal characters\n");
+		goto error;
 	}
 
 	/* Everything is read. Now - check if it's correct */
@@ -684,41 +722,153 @@ int db_file_load(state *s)
 		print(PRINT_ERROR,
 		      "Read a negative counter. "
 		      "State file is corrupted.\n");
-		goto cleanup;
+		goto error;
 	}
 
 	if (num_sgn(s->latest_card) == -1) {
 		print(PRINT_ERROR,
 		      "Latest printed card is negative. "
 		      "State file is corrupted.\n");
-		goto cleanup;
+		goto error;
 	}
 
 	if (s->code_length < 2 || s->code_length > 16) {
-		print(PRINT_ERROR, "Illegal passcode length. %s is invalid\n",
-		      db);
-		goto cleanup;
+		print(PRINT_ERROR, "Illegal passcode length. State entry is invalid\n");
+		goto error;
 	}
 
 	if (s->flags > (FLAG_SHOW|FLAG_SALTED|FLAG_DISABLED)) {
-		print(PRINT_ERROR, "Unsupported set of flags. %s is invalid\n",
-		      db);
-		goto cleanup;
+		print(PRINT_ERROR, "Unsupported set of flags. State entry is invalid\n");
+		goto error;
 
 	}
 
 	retval = 0;
+error:
+	return retval;
+}
+
+/**********************************************
+ * Interface functions for managing state files
+ **********************************************/
+/* Load state; if 'lock' is false state is read without any locking.
+ * This is safe for read-only use as db_file_store replaces the
+ * database with rename, so the mapped file is never changed. */
+static int _db_file_load(state *s, int lock)
+{
+	/* Whole state file mapped read-only */
+	const char *data = MAP_FAILED;
+	struct stat st;
+
+	/* User entry inside the mapping */
+	const char *entry;
+	size_t entry_length;
+
+	/* Did we lock it here? */
+	int locked = 0;
+
+	/* Temporary variable for returned values */
+	int ret = 0;
+
+	/* State file */
+	int fd = -1;
+
+	/* Value returned. */
+	int retval;
+
+	/* Files: database, lock and temporary */
+	char *db = NULL, *lck = NULL, *tmp = NULL, *home = NULL;
+	ret = db_file_path(s->username, &db, &lck, &tmp, NULL, NULL, &home);
+	if (ret != 0) {
+		return ret;
+	}
+
+	/* Permissions will be checked during locking
+	 * now, or was already checked */
+	retval = db_file_permissions(db, home);
+	if (retval != 0) {
+		goto cleanup1;
+	}
+
+	/* DB file should always be locked before changing.
+	 * Locking can only be omitted when we want to discard
+	 * any changes or that we don't bother if somebody changes
+	 * them at the same time.
+	 * Here we just detect that it's not locked and lock it then
+	 */
+	if (lock && s->lock <= 0) {
+		print(PRINT_NOTICE,
+		      "State file not locked while reading from it\n");
+		retval = db_file_lock(s);
+		if (retval != 0) {
+			print(PRINT_ERROR, "Unable to lock file for reading!\n");
+			goto cleanup1;
+		}
+
+		/* Locked locally, unlock locally later */
+		locked = 1;
+	}
+
+	fd = open(db, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			retval = STATE_NON_EXISTENT;
+		else
+			retval = STATE_IO_ERROR;
+		print_perror(PRINT_ERROR,
+			     "Unable to open %s for reading.",
+			     db);
+		goto cleanup;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		print_perror(PRINT_ERROR, "Unable to stat %s", db);
+		retval = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	if (st.st_size == 0) {
+		retval = STATE_NO_USER_ENTRY;
+		goto cleanup;
+	}
+
+	/* Map the file once; entry is found and parsed inside the mapping */
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		print_perror(PRINT_ERROR, "Unable to map %s", db);
+		retval = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	ret = _db_find_user_entry_mem(s->username, data, st.st_size,
+				      &entry, &entry_length);
+	if (ret != 0) {
+		/* No entry, or file invalid */
+		retval = ret;
+		goto cleanup;
+	}
+
+	ret = db_file_parse_entry(s, entry, entry_length);
+	if (ret != 0) {
+		/* Parse error */
+		retval = ret;
+		goto cleanup;
+	}
+
+	/* Newer counters might wait in the log */
+	s->wal_base = db_wal_base(s);
+	retval = db_wal_replay(db, &st, s);
 cleanup:
-	/* Clear memory */
-	memset(buff, 0, sizeof(buff));
+	if (data != MAP_FAILED)
+		munmap((void *) data, st.st_size);
 	/* Unlocked if locally locked */
 	if ((locked == 1) && (db_file_unlock(s) != 0)) {
 		print(PRINT_ERROR, "Error while unlocking state file!\n");
 		if (retval == 0)
 			retval = STATE_LOCK_ERROR;
 	}
-	if (f)
-		fclose(f);
+	if (fd != -1)
+		close(fd);
 
 cleanup1:
 	free(db);
@@ -728,7 +878,17 @@ cleanup1:
 	return retval;
 }
 
-static int _db_generate_user_entry(const state *s, char *buffer, int buff_length)
+int db_file_load(state *s)
+{
+	return _db_file_load(s, 1);
+}
+
+int db_file_peek(state *s)
+{
+	return _db_file_load(s, 0);
+}
+
+int db_file_generate_entry(const state *s, char *buffer, int buff_length)
 {
 	int retval = 1;
 	int tmp;
@@ -737,7 +897,7 @@ static int _db_generate_user_entry(const state *s, char *buffer, int buff_length
 	char sequence_key[65] = {0};
 	char counter[35] = {0};
 	char latest_card[35] = {0};
-	char spass[81] = {0};
+	char spass[84] = {0};
 
 	if (crypto_binary_to_hex(s->sequence_key, 32, sequence_key) != 0) {
 		print(PRINT_ERROR, "Strange error while converting sequence key into hex\n");
@@ -754,7 +914,12 @@ static int _db_generate_user_entry(const state *s, char *buffer, int buff_length
 	}
 
 	if (s->spass_set) {
-		tmp = crypto_binary_to_hex(s->spass, 40, spass);
+		char *hex = spass;
+		if (s->spass_set == STATE_SPASS_KDF) {
+			strcpy(spass, _spass_kdf_tag);
+			hex += strlen(_spass_kdf_tag);
+		}
+		tmp = crypto_binary_to_hex(s->spass, 40, hex);
 		if (tmp != 0) {
 			print(PRINT_ERROR, "Error while converting static password data\n");
 			goto error;
@@ -785,6 +950,372 @@ error:
 	return retval;
 }
 
+/******************
+ * Group commit
+ ******************/
+
+/* Byte of the lock file held while the committer rewrites database.
+ * It is the structure byte of indexed format, sessions lock bytes
+ * after it and direct writers the whole file. */
+#define DB_FILE_LOCK_COMMIT	0
+
+static int _db_file_lock_open(const char *lck, off_t start, off_t len, int *fd_out);
+
+/* Channel to the committer; -1 when database is written directly */
+static int _commit_fd = -1;
+
+void db_file_set_committer(int fd)
+{
+	_commit_fd = fd;
+}
+
+/* Send update to the committer and wait until it's written */
+static int _db_file_store_remote(const state *s, int remove)
+{
+	char update[STATE_ENTRY_SIZE];
+	int32_t status;
+	ssize_t ret;
+
+	if (remove) {
+		ret = snprintf(update, sizeof(update), "%s", s->username);
+		if (ret >= (ssize_t) sizeof(update))
+			return STATE_PARSE_ERROR;
+	} else if (db_file_generate_entry(s, update, sizeof(update)) != 0) {
+		print(PRINT_ERROR,
+		      "Strange error while generating new user "
+		      "entry line\n");
+		return 1;
+	}
+
+	do {
+		ret = send(_commit_fd, update, strlen(update), MSG_NOSIGNAL);
+	} while (ret == -1 && errno == EINTR);
+	memset(update, 0, sizeof(update));
+
+	if (ret == -1) {
+		print_perror(PRINT_ERROR, "Unable to send state update to committer");
+		return STATE_IO_ERROR;
+	}
+
+	do {
+		ret = recv(_commit_fd, &status, sizeof(status), 0);
+	} while (ret == -1 && errno == EINTR);
+
+	if (ret != sizeof(status)) {
+		print(PRINT_ERROR, "Committer didn't confirm state update\n");
+		return STATE_IO_ERROR;
+	}
+
+	return status;
+}
+
+/* Update must be a bare username or a single entry line */
+static int _db_commit_check(const char *update)
+{
+	const size_t length = strlen(update);
+	const char *sep = strchr(update, _delim[0]);
+	const char *newline = strchr(update, '\n');
+
+	if (length == 0 || length >= STATE_ENTRY_SIZE || sep == update)
+		return 1;
+
+	if (sep == NULL)
+		return newline != NULL;
+
+	return newline != update + length - 1;
+}
+
+/* Index of the last update of the user or -1 */
+static int _db_commit_find(char *const *updates, int count,
+                           const char *username, size_t length)
+{
+	int i;
+	for (i = count - 1; i >= 0; i--) {
+		if (strncmp(updates[i], username, length) == 0 &&
+		    (updates[i][length] == _delim[0] || updates[i][length] == '\0'))
+			return i;
+	}
+	return -1;
+}
+
+int db_file_commit(const char *db_path, char *const *updates, int count)
+{
+	int ret = STATE_NOMEM;
+	int lock_fd = -1, out_fd;
+	int created = 0;
+	FILE *in = NULL, *out = NULL;
+	char *lck = NULL, *tmp = NULL;
+	char *written = NULL;
+	char line[STATE_ENTRY_SIZE];
+	db_wal *log = NULL;
+	const char *sep;
+	size_t length;
+	struct stat st;
+	cfg_t *cfg = cfg_get();
+	int i;
+
+	if (count <= 0)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		if (_db_commit_check(updates[i]) != 0) {
+			print(PRINT_ERROR, "Malformed state update passed to committer\n");
+			return STATE_PARSE_ERROR;
+		}
+	}
+
+	length = strlen(db_path);
+	lck = malloc(length + 5);
+	tmp = malloc(length + 5);
+	written = calloc(count, 1);
+	if (!lck || !tmp || !written)
+		goto cleanup;
+	sprintf(lck, "%s.lck", db_path);
+	sprintf(tmp, "%s.tmp", db_path);
+
+	/* Direct writers lock the whole file; byte of the committer
+	 * is enough to exclude them */
+	ret = _db_file_lock_open(lck, DB_FILE_LOCK_COMMIT, 1, &lock_fd);
+	if (ret != 0)
+		goto cleanup;
+
+	/* Temporary file gets owner of the database */
+	in = fopen(db_path, "r");
+	if (in) {
+		if (fstat(fileno(in), &st) != 0) {
+			print_perror(PRINT_ERROR, "Unable to read state file parameters");
+			ret = STATE_IO_ERROR;
+			goto cleanup;
+		}
+
+		ret = db_wal_load(db_path, &st, &log);
+		if (ret != 0)
+			goto cleanup;
+	} else if (errno == ENOENT) {
+		st.st_uid = cfg->user_uid;
+		st.st_gid = cfg->user_gid;
+	} else {
+		print_perror(PRINT_ERROR, "Unable to open %s for reading", db_path);
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	out_fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, S_IWUSR|S_IRUSR);
+	if (out_fd != -1) {
+		created = 1;
+		out = fdopen(out_fd, "w");
+		if (!out)
+			close(out_fd);
+	}
+	if (!out) {
+		print_perror(PRINT_ERROR, "Unable to open %s for writing", tmp);
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	if (geteuid() == 0 && fchown(out_fd, st.st_uid, st.st_gid) != 0) {
+		print_perror(PRINT_ERROR, "Unable to ensure owner/group of temporary file");
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	/* 1) Copy the database replacing entries of updated users */
+	while (in && fgets(line, sizeof(line), in) != NULL) {
+		length = strlen(line);
+		if (length < 10 || line[length - 1] != '\n') {
+			print(PRINT_ERROR, "Invalid line inside the state file\n");
+			ret = STATE_PARSE_ERROR;
+			goto cleanup;
+		}
+
+		sep = strchr(line, _delim[0]);
+		i = sep ? _db_commit_find(updates, count, line, sep - line) : -1;
+		if (i == -1) {
+			if (_db_fold_entry(log, line, sizeof(line)) != 0) {
+				print(PRINT_ERROR, "Unable to apply logged update to state file\n");
+				ret = STATE_PARSE_ERROR;
+				goto cleanup;
+			}
+			ret = fputs(line, out);
+		} else if (written[i]) {
+			print(PRINT_ERROR, "Duplicate entry in state file\n");
+			ret = STATE_PARSE_ERROR;
+			goto cleanup;
+		} else {
+			written[i] = 1;
+			/* Removed users are skipped */
+			ret = strchr(updates[i], '\n') ? fputs(updates[i], out) : 0;
+		}
+
+		if (ret < 0) {
+			print(PRINT_ERROR, "Error while writing data to state file\n");
+			ret = STATE_IO_ERROR;
+			goto cleanup;
+		}
+	}
+
+	if (in && ferror(in)) {
+		print_perror(PRINT_ERROR, "Error while reading state file");
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	/* 2) Append new users */
+	for (i = 0; i < count; i++) {
+		sep = strchr(updates[i], _delim[0]);
+		if (written[i] || sep == NULL)
+			continue;
+
+		/* Older update of the same user */
+		if (_db_commit_find(updates, count, updates[i], sep - updates[i]) != i)
+			continue;
+
+		if (fputs(updates[i], out) < 0) {
+			print(PRINT_ERROR, "Error while writing data to state file\n");
+			ret = STATE_IO_ERROR;
+			goto cleanup;
+		}
+	}
+
+	/* 3) Single flush for the whole batch, then rename */
+	if (fflush(out) != 0) {
+		print_perror(PRINT_ERROR, "Error while flushing state file");
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	ret = db_file_sync(out_fd);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = fclose(out);
+	out = NULL;
+	if (ret != 0) {
+		print_perror(PRINT_ERROR, "Error while closing state file");
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	if (rename(tmp, db_path) != 0) {
+		print_perror(PRINT_ERROR, "Unable to rename temporary state file");
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	if (db_file_sync_dir(db_path) != 0)
+		print(PRINT_WARN, "State file might not survive a crash\n");
+
+	if (log)
+		(void) db_wal_remove(db_path);
+
+	ret = 0;
+
+cleanup:
+	if (in)
+		fclose(in);
+	if (out)
+		fclose(out);
+	if (ret != 0 && created)
+		(void) unlink(tmp);
+	if (lock_fd != -1) {
+		(void) db_file_lock_range(lock_fd, F_UNLCK, DB_FILE_LOCK_COMMIT, 1);
+		close(lock_fd);
+	}
+	memset(line, 0, sizeof(line));
+	db_wal_free(log);
+	free(written);
+	free(lck);
+	free(tmp);
+	return ret;
+}
+
+/* Update entry line with the newest logged record of its user */
+static int _db_fold_entry(const db_wal *log, char *line, size_t size)
+{
+	const db_wal_record *r;
+	char *sep;
+	state s;
+	int ret;
+
+	if (!log || (sep = strchr(line, _delim[0])) == NULL)
+		return 0;
+
+	*sep = '\0';
+	r = db_wal_find(log, line);
+	ret = r ? state_init(&s, line) : 0;
+	*sep = _delim[0];
+	if (!r || ret != 0)
+		return ret;
+
+	ret = db_file_parse_entry(&s, line, strlen(line));
+	if (ret == 0 && db_wal_apply(r, &s))
+		ret = db_file_generate_entry(&s, line, size);
+
+	state_fini(&s);
+	return ret;
+}
+
+int db_file_export(const char *db_path, db_bulk_emit emit, void *arg)
+{
+	char line[STATE_ENTRY_SIZE];
+	struct stat st;
+	db_wal *log = NULL;
+	FILE *f;
+	unsigned long entries = 0;
+	size_t length;
+	int ret;
+
+	/* Database is replaced by rename; opened file is a snapshot */
+	f = fopen(db_path, "r");
+	if (!f) {
+		print_perror(PRINT_ERROR, "Unable to open %s for reading", db_path);
+		return errno == ENOENT ? STATE_NON_EXISTENT : STATE_IO_ERROR;
+	}
+
+	if (fstat(fileno(f), &st) != 0) {
+		print_perror(PRINT_ERROR, "Unable to stat %s", db_path);
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	ret = db_wal_load(db_path, &st, &log);
+	if (ret != 0)
+		goto cleanup;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		entries++;
+		length = strlen(line);
+		if (length < 10 || line[length-1] != '\n') {
+			print(PRINT_ERROR, "Entry %lu of %s is invalid.\n",
+			      entries, db_path);
+			ret = STATE_PARSE_ERROR;
+			goto cleanup;
+		}
+
+		ret = _db_fold_entry(log, line, sizeof(line));
+		if (ret != 0) {
+			print(PRINT_ERROR, "Unable to apply logged update "
+			      "to entry %lu.\n", entries);
+			goto cleanup;
+		}
+
+		ret = emit(arg, line, strlen(line));
+		if (ret != 0)
+			goto cleanup;
+	}
+
+	if (ferror(f)) {
+		print(PRINT_ERROR, "Error while reading %s\n", db_path);
+		ret = STATE_IO_ERROR;
+	}
+
+cleanup:
+	memset(line, 0, sizeof(line));
+	db_wal_free(log);
+	fclose(f);
+	return ret;
+}
+
 int db_file_store(state *s, int remove)
 {
 	/* Return value, by default return error */
@@ -792,6 +1323,10 @@ int db_file_store(state *s, int remove)
 
 	/* State file */
 	FILE *in = NULL, *out = NULL;
+	struct stat snapshot;
+
+	/* Log folded by this write */
+	db_wal *log = NULL;
 
 	/* Did we lock the file? */
 	int locked = 0;
@@ -804,7 +1339,7 @@ int db_file_store(state *s, int remove)
 	char *db = NULL, *lck = NULL, *tmp = NULL;
 	uid_t user_uid;
 	gid_t user_gid;
-	ret = _db_path(s->username, &db, &lck, &tmp, &user_uid, &user_gid, NULL);
+	ret = db_file_path(s->username, &db, &lck, &tmp, &user_uid, &user_gid, NULL);
 	if (ret != 0) {
 		return ret;
 	}
@@ -820,6 +1355,21 @@ int db_file_store(state *s, int remove)
 		locked = 1;
 	}
 
+	if (_commit_fd != -1) {
+		ret = _db_file_store_remote(s, remove);
+		goto cleanup_lock;
+	}
+
+	/* Only counters changed since the state was read */
+	if (cfg->db_wal == CONFIG_ENABLED && !remove &&
+	    s->wal_base != 0 && s->wal_base == db_wal_base(s) &&
+	    stat(db, &snapshot) == 0) {
+		ret = db_wal_append(db, &snapshot, s);
+		if (ret == 0)
+			goto cleanup_lock;
+		/* Log is full (or broken), fold it with a rewrite */
+	}
+
 	if (cfg->db == CONFIG_DB_USER && remove) {
 		ret = unlink(db);
 		if (ret != 0) {
@@ -827,7 +1377,7 @@ int db_file_store(state *s, int remove)
 			print_perror(PRINT_ERROR,
 				     "Unable to unlink state file\n");
 		} else {
-			ret = 0;
+			ret = db_wal_remove(db);
 		}
 		goto cleanup_lock;
 	}
@@ -845,6 +1395,17 @@ int db_file_store(state *s, int remove)
 			ret = STATE_IO_ERROR;
 			goto cleanup;
 		}
+	} else {
+		/* Logged updates of other users are written too */
+		if (fstat(fileno(in), &snapshot) != 0) {
+			print_perror(PRINT_ERROR, "Unable to stat %s", db);
+			ret = STATE_IO_ERROR;
+			goto cleanup;
+		}
+
+		ret = db_wal_load(db, &snapshot, &log);
+		if (ret != 0)
+			goto cleanup;
 	}
 
 	out = fopen(tmp, "w");
@@ -888,7 +1449,8 @@ int db_file_store(state *s, int remove)
 
 	if (in) {
 		/* 1) Copy entries before our username */
-		ret = _db_find_user_entry(s->username, in, out,	user_entry_buff, sizeof(user_entry_buff));
+		ret = _db_find_user_entry(s->username, in, out, log,
+		                          user_entry_buff, sizeof(user_entry_buff));
 		if (ret != STATE_NO_USER_ENTRY && ret != 0) {
 			/* Error happened. */
 			goto cleanup;
@@ -897,7 +1459,7 @@ int db_file_store(state *s, int remove)
 
 	/* 2) Generate our new entry and store it into file */
 	if (remove == 0) {
-		ret = _db_generate_user_entry(s, user_entry_buff,
+		ret = db_file_generate_entry(s, user_entry_buff,
 					      sizeof(user_entry_buff));
 		if (ret != 0) {
 			print(PRINT_ERROR,
@@ -916,7 +1478,8 @@ int db_file_store(state *s, int remove)
 
 	/* 3) Copy rest of the file */
 	if (in) {
-		ret = _db_find_user_entry(s->username, in, out,	user_entry_buff, sizeof(user_entry_buff));
+		ret = _db_find_user_entry(s->username, in, out, log,
+		                          user_entry_buff, sizeof(user_entry_buff));
 		if (ret == 0) {
 			print(PRINT_ERROR, "Duplicate entry for user %s in state file\n", s->username);
 			goto cleanup;
@@ -932,6 +1495,8 @@ int db_file_store(state *s, int remove)
 
 	/* 4) Flush, save... then rename in cleanup part */
 	ret = fflush(out);
+	if (ret == 0)
+		ret = db_file_sync(fileno(out));
 	ret += fclose(out);
 	out = NULL;
 	if (ret != 0) {
@@ -950,7 +1515,6 @@ cleanup:
 		fclose(out);
 	}
 
-	sync(); /* Flush to disk required before rename */
 	if (ret == 0) {
 		/* If everything went fine, rename tmp to normal file */
 		if (rename(tmp, db) != 0) {
@@ -961,12 +1525,22 @@ cleanup:
 		} else {
 			/* When state updated via PAM (root)
 			 * we must set correct file owner. */
-			if (_db_file_permissions(db, NULL) != 0) {
+			if (db_file_permissions(db, NULL) != 0) {
 				print(PRINT_WARN,
 				      "Unable to set state file permissions. "
 				      "Key might be world-readable!\n");
 			}
 			print(PRINT_NOTICE, "State file written correctly\n");
+
+			/* Make the rename itself durable */
+			if (db_file_sync_dir(db) != 0)
+				print(PRINT_WARN, "State file might not survive a crash\n");
+
+			/* Log is in the database now */
+			if (log)
+				(void) db_wal_remove(db);
+			if (!remove)
+				s->wal_base = db_wal_base(s);
 		}
 
 	} else if (unlink(tmp) != 0) {
@@ -980,17 +1554,305 @@ cleanup_lock:
 	}
 
 cleanup_free:
+	db_wal_free(log);
 	free(db);
 	free(lck);
 	free(tmp);
 	return ret;
 }
 
-int db_file_lock(state *s)
+/******************
+ * Lock waiting
+ ******************/
+
+/* Counters of lock acquisition in this process */
+static db_lock_stats _lock_stats;
+
+/* Open file description locks are used with the blocking wait:
+ * they can't be shared accidentally by two states held in
+ * one process. Plain POSIX locks otherwise. */
+static int _db_lock_cmd(int wait)
+{
+	cfg_t *cfg = cfg_get();
+#ifdef F_OFD_SETLK
+	if (cfg->lock_wait == CONFIG_LOCK_WAIT_BLOCK)
+		return wait ? F_OFD_SETLKW : F_OFD_SETLK;
+#else
+	(void) cfg;
+#endif
+	return wait ? F_SETLKW : F_SETLK;
+}
+
+/* Microseconds since some unspecified point */
+static unsigned long long _db_lock_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void _db_lock_alarm(int sig)
+{
+	/* Only interrupts fcntl */
+	(void) sig;
+}
+
+/* Poll the lock with increasing delays until deadline */
+static int _db_lock_retry(int fd, struct flock *fl, unsigned long long deadline)
+{
+	useconds_t delay = 700;
+	unsigned long long now;
+
+	for (;;) {
+		if (fcntl(fd, _db_lock_cmd(0), fl) == 0)
+			return 0;
+
+		now = _db_lock_now();
+		if (now >= deadline)
+			return STATE_LOCK_ERROR;
+		if (delay > deadline - now)
+			delay = deadline - now;
+		usleep(delay);
+		if (delay < 20000)
+			delay *= 2;
+	}
+}
+
+/* Sleep in fcntl until lock is granted or deadline passes. Sleep is
+ * interrupted by SIGALRM timer; previous handler is restored later. */
+static int _db_lock_block(int fd, struct flock *fl, unsigned long long deadline)
+{
+	struct sigaction sa, old_sa;
+	struct itimerval timer, old_timer;
+	unsigned long long now;
+	int ret = STATE_LOCK_ERROR;
+
+	/* Someone else uses the timer; don't break it. */
+	if (getitimer(ITIMER_REAL, &old_timer) != 0 ||
+	    old_timer.it_value.tv_sec != 0 || old_timer.it_value.tv_usec != 0)
+		return _db_lock_retry(fd, fl, deadline);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _db_lock_alarm;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0; /* No SA_RESTART, fcntl must return EINTR */
+	if (sigaction(SIGALRM, &sa, &old_sa) != 0)
+		return _db_lock_retry(fd, fl, deadline);
+
+	for (;;) {
+		now = _db_lock_now();
+		if (now >= deadline)
+			break;
+
+		/* Repeat the signal in case it arrived before fcntl started */
+		memset(&timer, 0, sizeof(timer));
+		timer.it_value.tv_sec = (deadline - now) / 1000000;
+		timer.it_value.tv_usec = (deadline - now) % 1000000;
+		timer.it_interval.tv_usec = 10000;
+		setitimer(ITIMER_REAL, &timer, NULL);
+
+		if (fcntl(fd, _db_lock_cmd(1), fl) == 0) {
+			ret = 0;
+			break;
+		}
+		if (errno != EINTR)
+			break;
+	}
+
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_REAL, &timer, NULL);
+	sigaction(SIGALRM, &old_sa, NULL);
+	return ret;
+}
+
+int db_file_lock_range(int fd, short type, off_t start, off_t len)
 {
 	struct flock fl;
+	cfg_t *cfg = cfg_get();
+	unsigned long long started, waited;
+	int ret;
+
+	memset(&fl, 0, sizeof(fl)); /* l_pid must be 0 for OFD locks */
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = len;
+
+	if (type == F_UNLCK)
+		return fcntl(fd, _db_lock_cmd(0), &fl) == 0 ? 0 : STATE_LOCK_ERROR;
+
+	/* Usually the lock is free */
+	if (fcntl(fd, _db_lock_cmd(0), &fl) == 0) {
+		_lock_stats.locks++;
+		return 0;
+	}
+
+	if (errno != EACCES && errno != EAGAIN) {
+		print_perror(PRINT_NOTICE, "Unable to lock state file");
+		return STATE_LOCK_ERROR;
+	}
+
+	started = _db_lock_now();
+	_lock_stats.waits++;
+
+	if (cfg->lock_wait == CONFIG_LOCK_WAIT_BLOCK)
+		ret = _db_lock_block(fd, &fl,
+		                     started + cfg->lock_timeout * 1000ULL);
+	else
+		ret = _db_lock_retry(fd, &fl,
+		                     started + cfg->lock_timeout * 1000ULL);
+
+	waited = _db_lock_now() - started;
+	_lock_stats.wait_us += waited;
+	if (waited > _lock_stats.max_wait_us)
+		_lock_stats.max_wait_us = waited;
+
+	if (ret != 0) {
+		_lock_stats.timeouts++;
+		print(PRINT_WARN, "Timeout after %llu ms while waiting for state lock "
+		      "(%lu waits, %lu timeouts so far)\n",
+		      waited / 1000, _lock_stats.waits, _lock_stats.timeouts);
+		return STATE_LOCK_ERROR;
+	}
+
+	_lock_stats.locks++;
+	print(PRINT_NOTICE, "Waited %llu us for state lock\n", waited);
+	return 0;
+}
+
+const db_lock_stats *db_file_lock_stats(void)
+{
+	return &_lock_stats;
+}
+
+/******************
+ * Flushing
+ ******************/
+
+/* Time spent flushing database files in this process */
+static db_sync_stats _sync_stats;
+
+static void _db_sync_took(unsigned long long started)
+{
+	const unsigned long long took = _db_lock_now() - started;
+	_sync_stats.sync_us += took;
+	if (took > _sync_stats.max_sync_us)
+		_sync_stats.max_sync_us = took;
+}
+
+int db_file_sync(int fd)
+{
+	cfg_t *cfg = cfg_get();
+	unsigned long long started;
+	int ret;
+
+	if (cfg->db_sync == CONFIG_DB_SYNC_NONE)
+		return 0;
+
+	/* Size is flushed too, other metadata isn't needed */
+	trace_enter(TRACE_SYNC);
+	started = _db_lock_now();
+	ret = fdatasync(fd);
+	_sync_stats.syncs++;
+	_db_sync_took(started);
+	trace_leave(TRACE_SYNC);
+
+	if (ret != 0) {
+		print_perror(PRINT_ERROR, "Error while flushing state file");
+		return STATE_IO_ERROR;
+	}
+	return 0;
+}
+
+int db_file_sync_dir(const char *path)
+{
+	cfg_t *cfg = cfg_get();
+	unsigned long long started;
+	char *dir, *slash;
+	int fd, ret = 0;
+
+	if (cfg->db_sync != CONFIG_DB_SYNC_FULL)
+		return 0;
+
+	dir = strdup(path);
+	if (!dir)
+		return STATE_NOMEM;
+
+	slash = strrchr(dir, '/');
+	if (!slash)
+		strcpy(dir, ".");
+	else if (slash == dir)
+		slash[1] = '\0';
+	else
+		*slash = '\0';
+
+	trace_enter(TRACE_SYNC);
+	started = _db_lock_now();
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd == -1 || fsync(fd) != 0) {
+		print_perror(PRINT_ERROR, "Unable to flush directory %s", dir);
+		ret = STATE_IO_ERROR;
+	}
+	if (fd != -1)
+		close(fd);
+	_sync_stats.dir_syncs++;
+	_db_sync_took(started);
+	trace_leave(TRACE_SYNC);
+
+	free(dir);
+	return ret;
+}
+
+const db_sync_stats *db_file_sync_stats(void)
+{
+	return &_sync_stats;
+}
+
+/* Open (create) the lock file and lock its range for writing */
+static int _db_file_lock_open(const char *lck, off_t start, off_t len, int *fd_out)
+{
+	struct stat st_fd, st_lck;
+	int ret;
+	int fd;
+
+	for (;;) {
+		/* Open/create lock file */
+		/* Read access is required for shared locks */
+		fd = open(lck, O_RDWR|O_CREAT, S_IWUSR|S_IRUSR);
+
+		if (fd == -1) {
+			/* Unable to create file, therefore unable to obtain lock */
+			print_perror(PRINT_NOTICE, "Unable to create %s lock file", lck);
+			return STATE_LOCK_ERROR;
+		}
+
+		ret = db_file_lock_range(fd, F_WRLCK, start, len);
+		if (ret != 0) {
+			close(fd);
+			print(PRINT_NOTICE, "Unable to lock opened state file\n");
+			return ret;
+		}
+
+		/* Previous holder unlinks the lock file before releasing
+		 * it; lock got on an unlinked file excludes nobody. */
+		if (stat(lck, &st_lck) != 0) {
+			if (errno != ENOENT)
+				break;
+		} else if (fstat(fd, &st_fd) != 0 ||
+		           (st_fd.st_dev == st_lck.st_dev &&
+		            st_fd.st_ino == st_lck.st_ino)) {
+			break;
+		}
+		close(fd);
+	}
+
+	*fd_out = fd;
+	return 0;
+}
+
+int db_file_lock_part(state *s, off_t start, off_t len)
+{
 	int ret;
-	int cnt;
 	int fd;
 
 	/* Files: database, lock and temporary */
@@ -999,7 +1861,7 @@ int db_file_lock(state *s)
 	/* Check that the lock already is not set */
 	assert(s->lock == -1);
 
-	ret = _db_path(s->username, &db, &lck, &tmp, NULL, NULL, &home);
+	ret = db_file_path(s->username, &db, &lck, &tmp, NULL, NULL, &home);
 	if (ret != 0) {
 		return ret;
 	}
@@ -1010,7 +1872,7 @@ int db_file_lock(state *s)
 	 *
 	 * Will also fail if the user doesn't have a home directory.
 	 */
-	ret = _db_file_permissions(db, home);
+	ret = db_file_permissions(db, home);
 	switch (ret) {
 	case STATE_IO_ERROR:
 		print(PRINT_NOTICE, "File permission check failed\n");
@@ -1026,39 +1888,9 @@ int db_file_lock(state *s)
 		break;
 	}
 
-	fl.l_type = F_WRLCK;
-	fl.l_whence = SEEK_SET;
-	fl.l_start = fl.l_len = 0;
-
-	/* Open/create lock file */
-	fd = open(lck, O_WRONLY|O_CREAT, S_IWUSR|S_IRUSR);
-
-	if (fd == -1) {
-		/* Unable to create file, therefore unable to obtain lock */
-		print_perror(PRINT_NOTICE, "Unable to create %s lock file", lck);
-		ret = STATE_LOCK_ERROR;
-		goto cleanup;
-	}
-
-	/*
-	 * Trying to lock the file 20 times.
-	 * Any working otpasswd session shouldn't lock it for so long.
-	 * If it does - system has some problem.
-	 */
-	for (cnt = 0; cnt < 20; cnt++) {
-		ret = fcntl(fd, F_SETLK, &fl);
-		if (ret == 0)
-			break;
-		usleep(700);
-	}
-
-	if (ret != 0) {
-		/* Unable to lock for 10 times */
-		close(fd);
-		print(PRINT_NOTICE, "Unable to lock opened state file\n");
-		ret = STATE_LOCK_ERROR;
+	ret = _db_file_lock_open(lck, start, len, &fd);
+	if (ret != 0)
 		goto cleanup;
-	}
 
 	s->lock = fd;
 	print(PRINT_NOTICE, "Got lock on state file\n");
@@ -1074,16 +1906,25 @@ cleanup:
 	return ret;
 }
 
+int db_file_lock(state *s)
+{
+	/* Committer rewrites the database for all the sessions */
+	if (_commit_fd != -1)
+		return db_file_lock_part(s, db_index_lock_offset(s->username), 1);
+
+	/* Whole file is locked */
+	return db_file_lock_part(s, 0, 0);
+}
+
 
 
 int db_file_unlock(state *s)
 {
-	struct flock fl;
 	int retval = STATE_LOCK_ERROR;
 
 	/* Files: database, lock and temporary */
 	char *db = NULL, *lck = NULL, *tmp = NULL;
-	retval = _db_path(s->username, &db, &lck, &tmp, NULL, NULL, NULL);
+	retval = db_file_path(s->username, &db, &lck, &tmp, NULL, NULL, NULL);
 	if (retval != 0) {
 		return retval;
 	}
@@ -1094,14 +1935,12 @@ int db_file_unlock(state *s)
 		goto error;
 	}
 
-	fl.l_type = F_UNLCK;
-	fl.l_whence = SEEK_SET;
-	fl.l_start = fl.l_len = 0;
-
-	/* First unlink, then unlock to solve race condition */
-	unlink(lck);
+	/* First unlink, then unlock to solve race condition.
+	 * Sessions using committer lock parts of a common file. */
+	if (_commit_fd == -1)
+		unlink(lck);
 
-	retval = fcntl(s->lock, F_SETLK, &fl);
+	retval = db_file_lock_range(s->lock, F_UNLCK, 0, 0);
 
 	close(s->lock);
 	s->lock = -1;
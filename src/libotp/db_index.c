@@ -0,0 +1,1406 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Indexed file database. Keeps user states in fixed-size binary
+ *   records found through a hashed username index, so locating and
+ *   updating a user doesn't depend on the number of stored users.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>	/* offsetof */
+#include <assert.h>
+#include <errno.h>
+
+#include <unistd.h>	/* pread, pwrite, fdatasync, close, unlink */
+#include <sys/types.h>
+#include <sys/stat.h>	/* fstat */
+#include <sys/mman.h>	/* mmap */
+#include <fcntl.h>
+
+#include "print.h"
+#include "state.h"
+#include "db.h"
+#include "config.h"
+#include "crypto.h"
+
+/*
+ * Database file layout:
+ *
+ * +--------+-------------------------+---------------------------+
+ * | header | buckets (uint32_t each) | records (fixed size each) |
+ * +--------+-------------------------+---------------------------+
+ *
+ * Bucket holds a number of the first record in its chain (records
+ * are counted from 1, 0 marks an empty chain). Records are linked
+ * with their 'next' field; removed records are kept on a free list
+ * linked the same way and reused before the file is extended.
+ *
+ * State data of a record is kept in two slots, each with a sequence
+ * number and a CRC-32 checksum. Update overwrites only the older slot
+ * and flushes it with fdatasync, so the newer one survives a write
+ * interrupted by a crash; on read the newest slot with a correct
+ * checksum is used.
+ *
+ * Numbers are stored in host byte order as the database is never
+ * shared between machines. Use text format to move states around.
+ *
+ * Read-only lookups (db_index_peek) map the file and take no locks.
+ * Torn slots are rejected by their checksums; changes of chains are
+ * detected with a generation counter in the header, which is odd
+ * while a record is being removed (a seqlock). New records are written
+ * completely before they are linked, so adding needs no marking. File
+ * is only ever extended or replaced with rename, so a mapping stays
+ * valid.
+ *
+ * Locking:
+ *
+ * Lock file is never removed and byte ranges of it are locked instead
+ * of the whole file. Byte 0 guards the structure of the database:
+ * it's locked shared while reading or updating a record in place and
+ * exclusively while records are added, removed or the index is rebuilt.
+ * State lock held between state_lock and state_unlock covers a single
+ * byte selected by the username hash, so logins of different users
+ * don't wait for each other while the same user is still serialized.
+ */
+
+/* Smallest (and initial) size of the index */
+#define DB_INDEX_MIN_BUCKETS	1024
+
+/* Index is doubled when there are more users than this per bucket */
+#define DB_INDEX_LOAD_FACTOR	2
+
+/* Byte of the lock file guarding database structure */
+#define DB_INDEX_LOCK_STRUCTURE	0
+
+/* Lookups without locks restarted because of concurrent changes
+ * before falling back to a locked one */
+#define DB_INDEX_PEEK_RETRIES	5
+
+/* Maximal length of username (including \0) */
+#define DB_INDEX_USER_SIZE	64
+
+static const char _magic[8] = {'O', 'T', 'P', 'I', 'D', 'X', '\0', '\0'};
+static const uint32_t _version = 2;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+
+	uint32_t buckets;	/* Size of the index, power of two */
+	uint32_t records;	/* Allocated records (used and free) */
+	uint32_t users;		/* Records in use */
+	uint32_t free_head;	/* First free record, 0 if none */
+
+	uint32_t generation;	/* Odd while a record is being removed */
+
+	char reserved[28];
+} db_index_header;
+
+typedef struct {
+	int64_t channel_time;
+	int64_t spass_time;
+
+	uint32_t sequence;	/* Incremented on each update */
+	uint32_t failures;
+	uint32_t recent_failures;
+	uint32_t code_length;
+	uint32_t alphabet;
+	uint32_t flags;
+	uint32_t spass_set;
+
+	char username[DB_INDEX_USER_SIZE];
+
+	unsigned char sequence_key[32];
+	unsigned char counter[16];	/* NUM_FORMAT_BIN */
+	unsigned char latest_card[16];	/* NUM_FORMAT_BIN */
+
+	unsigned char spass[STATE_SPASS_SIZE];
+	char label[STATE_LABEL_SIZE];
+	char contact[STATE_CONTACT_SIZE];
+
+	char reserved[14];
+
+	uint32_t checksum;	/* CRC-32 of all previous fields */
+} db_index_slot;
+
+typedef struct {
+	uint32_t next;		/* Next record in chain */
+	uint32_t used;		/* 0 - record is on the free list */
+
+	db_index_slot slot[2];
+} db_index_record;
+
+/******************
+ * Static helpers
+ ******************/
+
+/* FNV-1a hash of username */
+static uint32_t _db_index_hash(const char *username)
+{
+	uint32_t hash = 2166136261U;
+	for (; *username; username++) {
+		hash ^= (unsigned char) *username;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* Byte of the lock file locked for given user; used also
+ * by text database written through a committer */
+off_t db_index_lock_offset(const char *username)
+{
+	return DB_INDEX_LOCK_STRUCTURE + 1
+		+ (off_t) (_db_index_hash(username) & 0x7FFFFFFFU);
+}
+
+static int _db_index_lock_structure(const state *s, short type)
+{
+	const int ret = db_file_lock_range(s->lock, type, DB_INDEX_LOCK_STRUCTURE, 1);
+	if (ret != 0)
+		print(PRINT_NOTICE, "Unable to lock state database structure\n");
+	return ret;
+}
+
+static uint32_t _db_index_slot_checksum(const db_index_slot *slot)
+{
+	return crypto_crc32(slot, offsetof(db_index_slot, checksum));
+}
+
+static int _db_index_slot_valid(const db_index_slot *slot)
+{
+	return slot->checksum == _db_index_slot_checksum(slot) &&
+		slot->username[0] != '\0' &&
+		slot->username[sizeof(slot->username)-1] == '\0';
+}
+
+/* Returns index of the newest correct slot of a record or -1 */
+static int _db_index_current_slot(const db_index_record *r)
+{
+	const int valid0 = _db_index_slot_valid(&r->slot[0]);
+	const int valid1 = _db_index_slot_valid(&r->slot[1]);
+
+	if (valid0 && valid1) {
+		/* Sequence might wrap */
+		if ((int32_t) (r->slot[1].sequence - r->slot[0].sequence) > 0)
+			return 1;
+		return 0;
+	}
+	if (valid0)
+		return 0;
+	if (valid1)
+		return 1;
+	return -1;
+}
+
+static off_t _db_index_bucket_offset(const db_index_header *h, uint32_t bucket)
+{
+	assert(bucket < h->buckets);
+	return sizeof(*h) + (off_t) bucket * sizeof(uint32_t);
+}
+
+static off_t _db_index_record_offset(const db_index_header *h, uint32_t record)
+{
+	assert(record > 0);
+	return sizeof(*h) + (off_t) h->buckets * sizeof(uint32_t)
+		+ (off_t) (record - 1) * sizeof(db_index_record);
+}
+
+/* Read/write whole buffer at given offset */
+static int _db_index_read(int fd, void *buff, size_t length, off_t offset)
+{
+	char *pos = buff;
+	while (length > 0) {
+		const ssize_t ret = pread(fd, pos, length, offset);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1) {
+			print_perror(PRINT_ERROR, "Error while reading indexed database");
+			return STATE_IO_ERROR;
+		}
+		if (ret == 0) {
+			print(PRINT_ERROR, "Indexed database is truncated.\n");
+			return STATE_PARSE_ERROR;
+		}
+		pos += ret;
+		offset += ret;
+		length -= ret;
+	}
+	return 0;
+}
+
+static int _db_index_write(int fd, const void *buff, size_t length, off_t offset)
+{
+	const char *pos = buff;
+	while (length > 0) {
+		const ssize_t ret = pwrite(fd, pos, length, offset);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			print_perror(PRINT_ERROR, "Error while writing indexed database");
+			return STATE_IO_ERROR;
+		}
+		pos += ret;
+		offset += ret;
+		length -= ret;
+	}
+	return 0;
+}
+
+static int _db_index_check_header(const db_index_header *h)
+{
+	if (memcmp(h->magic, _magic, sizeof(_magic)) != 0) {
+		print(PRINT_ERROR, "Database is not in indexed format. "
+		      "Convert it with agent_otp --convert-db.\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (h->version != _version) {
+		print(PRINT_ERROR, "Indexed database version is incompatible.\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (h->record_size != sizeof(db_index_record)) {
+		print(PRINT_ERROR, "Indexed database has invalid record size.\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (h->buckets < DB_INDEX_MIN_BUCKETS ||
+	    (h->buckets & (h->buckets - 1)) != 0 ||
+	    h->users > h->records || h->free_head > h->records) {
+		print(PRINT_ERROR, "Indexed database header is corrupted.\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	return 0;
+}
+
+static int _db_index_read_header(int fd, db_index_header *h)
+{
+	int ret;
+
+	ret = _db_index_read(fd, h, sizeof(*h), 0);
+	if (ret != 0)
+		return ret;
+
+	return _db_index_check_header(h);
+}
+
+static int _db_index_write_header(int fd, const db_index_header *h)
+{
+	return _db_index_write(fd, h, sizeof(*h), 0);
+}
+
+/* Mark start and end of record removal for lockless readers */
+static int _db_index_begin_change(int fd, db_index_header *h)
+{
+	h->generation |= 1;
+	return _db_index_write_header(fd, h);
+}
+
+static void _db_index_end_change(db_index_header *h)
+{
+	h->generation++;
+}
+
+static int _db_index_read_bucket(int fd, const db_index_header *h,
+                                 uint32_t bucket, uint32_t *record)
+{
+	int ret;
+	ret = _db_index_read(fd, record, sizeof(*record),
+	                     _db_index_bucket_offset(h, bucket));
+	if (ret != 0)
+		return ret;
+	if (*record > h->records) {
+		print(PRINT_ERROR, "Indexed database bucket is corrupted.\n");
+		return STATE_PARSE_ERROR;
+	}
+	return 0;
+}
+
+static int _db_index_write_bucket(int fd, const db_index_header *h,
+                                  uint32_t bucket, uint32_t record)
+{
+	return _db_index_write(fd, &record, sizeof(record),
+	                       _db_index_bucket_offset(h, bucket));
+}
+
+static int _db_index_read_record(int fd, const db_index_header *h,
+                                 uint32_t record, db_index_record *r)
+{
+	int ret;
+	ret = _db_index_read(fd, r, sizeof(*r), _db_index_record_offset(h, record));
+	if (ret != 0)
+		return ret;
+	if (r->next > h->records) {
+		print(PRINT_ERROR, "Indexed database record is corrupted.\n");
+		return STATE_PARSE_ERROR;
+	}
+	return 0;
+}
+
+static int _db_index_write_record(int fd, const db_index_header *h,
+                                  uint32_t record, const db_index_record *r)
+{
+	return _db_index_write(fd, r, sizeof(*r), _db_index_record_offset(h, record));
+}
+
+/* Find user record. On success record number is stored in 'record',
+ * its contents in 'r', index of its current slot in 'current' and
+ * the previous record in chain in 'prev' (0 if the record is first
+ * in its bucket). */
+static int _db_index_find(int fd, const db_index_header *h, const char *username,
+                          uint32_t *record, uint32_t *prev,
+                          db_index_record *r, int *current)
+{
+	const uint32_t bucket = _db_index_hash(username) & (h->buckets - 1);
+	uint32_t cur, steps = 0;
+	int ret;
+
+	*prev = 0;
+	ret = _db_index_read_bucket(fd, h, bucket, &cur);
+	if (ret != 0)
+		return ret;
+
+	while (cur != 0) {
+		if (steps++ > h->records) {
+			print(PRINT_ERROR, "Loop in indexed database chain.\n");
+			return STATE_PARSE_ERROR;
+		}
+
+		ret = _db_index_read_record(fd, h, cur, r);
+		if (ret != 0)
+			return ret;
+
+		if (r->used) {
+			*current = _db_index_current_slot(r);
+			if (*current == -1) {
+				/* Can't tell whose record it is */
+				print(PRINT_ERROR, "Both copies of indexed database "
+				      "record %u are damaged.\n", cur);
+				return STATE_PARSE_ERROR;
+			}
+
+			if (strcmp(r->slot[*current].username, username) == 0) {
+				*record = cur;
+				return 0;
+			}
+		}
+
+		*prev = cur;
+		cur = r->next;
+	}
+
+	return STATE_NO_USER_ENTRY;
+}
+
+/* Add new record to the database and link it into its chain. Header is
+ * updated first, so the worst effect of interrupted insert is an
+ * unreachable record. */
+static int _db_index_insert(int fd, db_index_header *h, const db_index_slot *slot)
+{
+	const uint32_t bucket = _db_index_hash(slot->username) & (h->buckets - 1);
+	db_index_record r;
+	uint32_t head, record;
+	int ret;
+
+	ret = _db_index_read_bucket(fd, h, bucket, &head);
+	if (ret != 0)
+		return ret;
+
+	if (h->free_head != 0) {
+		db_index_record free_r;
+		record = h->free_head;
+		ret = _db_index_read_record(fd, h, record, &free_r);
+		if (ret != 0)
+			return ret;
+		h->free_head = free_r.next;
+	} else {
+		record = ++h->records;
+	}
+	h->users++;
+
+	/* Odd generation was left by interrupted removal */
+	if (h->generation & 1)
+		_db_index_end_change(h);
+
+	ret = _db_index_write_header(fd, h);
+	if (ret != 0)
+		return ret;
+
+	memset(&r, 0, sizeof(r));
+	r.next = head;
+	r.used = 1;
+	r.slot[0] = *slot;
+	r.slot[0].sequence = 1;
+	r.slot[0].checksum = _db_index_slot_checksum(&r.slot[0]);
+	ret = _db_index_write_record(fd, h, record, &r);
+	memset(&r, 0, sizeof(r));
+	if (ret != 0)
+		return ret;
+
+	return _db_index_write_bucket(fd, h, bucket, record);
+}
+
+/* Update state data of existing record. Only the older slot is
+ * written, the current one stays intact until the write is complete. */
+static int _db_index_update(int fd, const db_index_header *h, uint32_t record,
+                            const db_index_record *r, int current,
+                            db_index_slot *slot)
+{
+	const int older = current == 0 ? 1 : 0;
+	const off_t offset = _db_index_record_offset(h, record)
+		+ offsetof(db_index_record, slot) + older * sizeof(*slot);
+
+	slot->sequence = r->slot[current].sequence + 1;
+	slot->checksum = _db_index_slot_checksum(slot);
+	return _db_index_write(fd, slot, sizeof(*slot), offset);
+}
+
+/* Unlink record from its chain and put it on the free list. Header
+ * is written back even after failure so readers don't wait for the
+ * change to finish. */
+static int _db_index_remove(int fd, db_index_header *h, uint32_t record,
+                            uint32_t prev, const db_index_record *r, int current)
+{
+	db_index_record empty;
+	int ret;
+
+	ret = _db_index_begin_change(fd, h);
+	if (ret != 0)
+		goto end;
+
+	if (prev == 0) {
+		const uint32_t bucket =
+			_db_index_hash(r->slot[current].username) & (h->buckets - 1);
+		ret = _db_index_write_bucket(fd, h, bucket, r->next);
+	} else {
+		ret = _db_index_write(fd, &r->next, sizeof(r->next),
+		                      _db_index_record_offset(h, prev));
+	}
+	if (ret != 0)
+		goto end;
+
+	/* Clear removed state data */
+	memset(&empty, 0, sizeof(empty));
+	empty.next = h->free_head;
+	ret = _db_index_write_record(fd, h, record, &empty);
+	if (ret != 0)
+		goto end;
+
+	h->free_head = record;
+	h->users--;
+
+end:
+	_db_index_end_change(h);
+	if (ret != 0) {
+		(void) _db_index_write_header(fd, h);
+		return ret;
+	}
+	return _db_index_write_header(fd, h);
+}
+
+/* Create an empty database with a given index size in 'path'. If 'src'
+ * descriptor is given all its records are copied into the new file.
+ * Returns descriptor of the new file or -1. */
+static int _db_index_build(const char *path, uint32_t buckets,
+                           int src, const db_index_header *src_h,
+                           uid_t uid, gid_t gid, db_index_header *h)
+{
+	db_index_record r;
+	uint32_t i;
+	int current;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		print_perror(PRINT_ERROR, "Unable to create %s", path);
+		return -1;
+	}
+
+	/* When run by root (PAM, conversion) ensure correct owner */
+	if (geteuid() == 0 && uid != (uid_t) -1) {
+		if (fchown(fd, uid, gid) != 0) {
+			print_perror(PRINT_ERROR, "Unable to set owner of %s", path);
+			goto error;
+		}
+	}
+
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, _magic, sizeof(_magic));
+	h->version = _version;
+	h->record_size = sizeof(db_index_record);
+	h->buckets = buckets;
+
+	/* Buckets are zeroed by extending the file */
+	if (ftruncate(fd, _db_index_record_offset(h, 1)) != 0) {
+		print_perror(PRINT_ERROR, "Unable to create index in %s", path);
+		goto error;
+	}
+
+	if (_db_index_write_header(fd, h) != 0)
+		goto error;
+
+	if (src == -1)
+		return fd;
+
+	for (i = 1; i <= src_h->records; i++) {
+		if (_db_index_read_record(src, src_h, i, &r) != 0)
+			goto error;
+		if (!r.used)
+			continue;
+		current = _db_index_current_slot(&r);
+		if (current == -1) {
+			print(PRINT_ERROR, "Both copies of indexed database "
+			      "record %u are damaged.\n", i);
+			goto error;
+		}
+		if (_db_index_insert(fd, h, &r.slot[current]) != 0)
+			goto error;
+	}
+	memset(&r, 0, sizeof(r));
+	return fd;
+
+error:
+	memset(&r, 0, sizeof(r));
+	close(fd);
+	unlink(path);
+	return -1;
+}
+
+/* Replace database with a freshly built one of a given index size. On
+ * success 'fd' and 'h' describe the new database. */
+static int _db_index_rebuild(const char *db, const char *tmp, uint32_t buckets,
+                             uid_t uid, gid_t gid, int *fd, db_index_header *h)
+{
+	db_index_header new_h;
+	int new_fd;
+
+	if (*fd != -1) {
+		struct stat st;
+		/* Keep the owner of the current file */
+		if (fstat(*fd, &st) == 0) {
+			uid = st.st_uid;
+			gid = st.st_gid;
+		}
+	}
+
+	new_fd = _db_index_build(tmp, buckets, *fd, h, uid, gid, &new_h);
+	if (new_fd == -1)
+		return STATE_IO_ERROR;
+
+	if (db_file_sync(new_fd) != 0 || rename(tmp, db) != 0) {
+		print_perror(PRINT_ERROR, "Unable to replace indexed database");
+		close(new_fd);
+		unlink(tmp);
+		return STATE_IO_ERROR;
+	}
+
+	if (db_file_sync_dir(db) != 0)
+		print(PRINT_WARN, "State file might not survive a crash\n");
+
+	if (*fd != -1)
+		close(*fd);
+	*fd = new_fd;
+	*h = new_h;
+	return 0;
+}
+
+/* Convert state into a record slot */
+static int _db_index_from_state(const state *s, db_index_slot *r)
+{
+	memset(r, 0, sizeof(*r));
+
+	if (strlen(s->username) >= sizeof(r->username)) {
+		print(PRINT_ERROR, "Username too long for indexed database.\n");
+		return STATE_PARSE_ERROR;
+	}
+	strcpy(r->username, s->username);
+
+	memcpy(r->sequence_key, s->sequence_key, sizeof(r->sequence_key));
+	num_export(s->counter, (char *) r->counter, NUM_FORMAT_BIN);
+	num_export(s->latest_card, (char *) r->latest_card, NUM_FORMAT_BIN);
+
+	r->channel_time = s->channel_time;
+	r->spass_time = s->spass_time;
+	r->failures = s->failures;
+	r->recent_failures = s->recent_failures;
+	r->code_length = s->code_length;
+	r->alphabet = s->alphabet;
+	r->flags = s->flags;
+	r->spass_set = s->spass_set;
+	if (s->spass_set)
+		memcpy(r->spass, s->spass, sizeof(r->spass));
+
+	if (strlen(s->label) >= sizeof(r->label) ||
+	    strlen(s->contact) >= sizeof(r->contact)) {
+		print(PRINT_ERROR, "Label or contact too long for indexed database.\n");
+		return STATE_PARSE_ERROR;
+	}
+	memcpy(r->label, s->label, strlen(s->label) + 1);
+	memcpy(r->contact, s->contact, strlen(s->contact) + 1);
+	return 0;
+}
+
+/* Convert record slot into a state, validate it on the way */
+static int _db_index_to_state(const db_index_slot *r, state *s)
+{
+	if (r->code_length < 2 || r->code_length > 16) {
+		print(PRINT_ERROR, "Illegal passcode length. State entry is invalid\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (r->flags > (FLAG_SHOW|FLAG_SALTED|FLAG_DISABLED)) {
+		print(PRINT_ERROR, "Unsupported set of flags. State entry is invalid\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (r->spass_set > STATE_SPASS_KDF) {
+		print(PRINT_ERROR, "Unsupported static password format. State entry is invalid\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (r->label[sizeof(r->label)-1] != '\0' ||
+	    r->contact[sizeof(r->contact)-1] != '\0') {
+		print(PRINT_ERROR, "Label or contact field too long\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (!state_validate_str(r->label) || !state_validate_str(r->contact)) {
+		print(PRINT_ERROR, "Illegal characters in label or contact\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	memcpy(s->sequence_key, r->sequence_key, sizeof(s->sequence_key));
+	num_import(&s->counter, (const char *) r->counter, NUM_FORMAT_BIN);
+	num_import(&s->latest_card, (const char *) r->latest_card, NUM_FORMAT_BIN);
+
+	s->channel_time = r->channel_time;
+	s->failures = r->failures;
+	s->recent_failures = r->recent_failures;
+	s->code_length = r->code_length;
+	s->alphabet = r->alphabet;
+	s->flags = r->flags;
+
+	if (r->spass_set) {
+		memcpy(s->spass, r->spass, sizeof(s->spass));
+		s->spass_time = r->spass_time;
+		s->spass_set = r->spass_set;
+	} else {
+		s->spass_set = STATE_SPASS_UNSET;
+	}
+
+	strcpy(s->label, r->label);
+	strcpy(s->contact, r->contact);
+	return 0;
+}
+
+/**********************************************
+ * Interface functions for managing state files
+ **********************************************/
+int db_index_lock(state *s)
+{
+	/* Lock only range of the current user */
+	return db_file_lock_part(s, db_index_lock_offset(s->username), 1);
+}
+
+int db_index_unlock(state *s)
+{
+	int retval;
+
+	if (s->lock < 0) {
+		print(PRINT_NOTICE, "No lock to release!\n");
+		return STATE_LOCK_ERROR;
+	}
+
+	/* Lock file is shared by all users and is kept in place */
+	retval = db_file_lock_range(s->lock, F_UNLCK,
+	                            db_index_lock_offset(s->username), 1);
+
+	close(s->lock);
+	s->lock = -1;
+
+	if (retval != 0) {
+		print(PRINT_NOTICE, "Strange error while releasing lock\n");
+		return STATE_LOCK_ERROR;
+	}
+	return 0;
+}
+
+int db_index_load(state *s)
+{
+	db_index_header h;
+	db_index_record r;
+	uint32_t record, prev;
+	int current;
+
+	/* Did we lock it here? */
+	int locked = 0;
+
+	int fd = -1;
+	int retval;
+
+	/* Files: database, lock and temporary */
+	char *db = NULL, *lck = NULL, *tmp = NULL, *home = NULL;
+	retval = db_file_path(s->username, &db, &lck, &tmp, NULL, NULL, &home);
+	if (retval != 0) {
+		return retval;
+	}
+
+	retval = db_file_permissions(db, home);
+	if (retval != 0) {
+		goto cleanup1;
+	}
+
+	if (s->lock <= 0) {
+		print(PRINT_NOTICE,
+		      "State file not locked while reading from it\n");
+		retval = db_index_lock(s);
+		if (retval != 0) {
+			print(PRINT_ERROR, "Unable to lock file for reading!\n");
+			goto cleanup1;
+		}
+		locked = 1;
+	}
+
+	retval = _db_index_lock_structure(s, F_RDLCK);
+	if (retval != 0)
+		goto cleanup_lock;
+
+	fd = open(db, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			retval = STATE_NON_EXISTENT;
+		else
+			retval = STATE_IO_ERROR;
+		print_perror(PRINT_ERROR,
+			     "Unable to open %s for reading.",
+			     db);
+		goto cleanup;
+	}
+
+	retval = _db_index_read_header(fd, &h);
+	if (retval != 0)
+		goto cleanup;
+
+	retval = _db_index_find(fd, &h, s->username, &record, &prev, &r, &current);
+	if (retval != 0)
+		goto cleanup;
+
+	retval = _db_index_to_state(&r.slot[current], s);
+
+cleanup:
+	/* Clear memory */
+	memset(&r, 0, sizeof(r));
+	if (fd != -1)
+		close(fd);
+
+	_db_index_lock_structure(s, F_UNLCK);
+
+cleanup_lock:
+	if (locked && db_index_unlock(s) != 0) {
+		print(PRINT_ERROR, "Error while unlocking state file!\n");
+		if (retval == 0)
+			retval = STATE_LOCK_ERROR;
+	}
+
+cleanup1:
+	free(db);
+	free(lck);
+	free(tmp);
+	free(home);
+	return retval;
+}
+
+/* Lookup inside a mapped database. Returns 0, STATE_NO_USER_ENTRY or
+ * DB_INDEX_PEEK_AGAIN if anything looks wrong; it might be caused by
+ * a concurrent writer and a locked load will report real errors. */
+#define DB_INDEX_PEEK_AGAIN	(-1)
+
+static int _db_index_lookup_mapped(const char *map, size_t size,
+                                   const char *username, db_index_slot *slot)
+{
+	const db_index_header *mh = (const db_index_header *) map;
+	db_index_header h;
+	db_index_record r;
+	uint32_t generation, cur, steps = 0;
+	off_t offset;
+	int current;
+	int ret;
+
+	assert(size >= sizeof(h));
+	generation = __atomic_load_n(&mh->generation, __ATOMIC_ACQUIRE);
+	if (generation & 1)
+		return DB_INDEX_PEEK_AGAIN;
+
+	memcpy(&h, mh, sizeof(h));
+	if (memcmp(h.magic, _magic, sizeof(_magic)) != 0 ||
+	    h.version != _version || h.record_size != sizeof(r) ||
+	    h.buckets == 0 || (h.buckets & (h.buckets - 1)) != 0 ||
+	    (off_t) size < _db_index_record_offset(&h, 1))
+		return DB_INDEX_PEEK_AGAIN;
+
+	memcpy(&cur, map + _db_index_bucket_offset(&h, _db_index_hash(username) & (h.buckets - 1)),
+	       sizeof(cur));
+
+	ret = STATE_NO_USER_ENTRY;
+	while (cur != 0) {
+		offset = _db_index_record_offset(&h, cur);
+		if (steps++ > h.records || offset + (off_t) sizeof(r) > (off_t) size) {
+			ret = DB_INDEX_PEEK_AGAIN;
+			break;
+		}
+
+		memcpy(&r, map + offset, sizeof(r));
+		if (r.used) {
+			current = _db_index_current_slot(&r);
+			if (current == -1) {
+				ret = DB_INDEX_PEEK_AGAIN;
+				break;
+			}
+
+			if (strcmp(r.slot[current].username, username) == 0) {
+				*slot = r.slot[current];
+				ret = 0;
+				break;
+			}
+		}
+		cur = r.next;
+	}
+	memset(&r, 0, sizeof(r));
+
+	/* Anything read during a removal is suspicious */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&mh->generation, __ATOMIC_RELAXED) != generation)
+		return DB_INDEX_PEEK_AGAIN;
+	return ret;
+}
+
+int db_index_peek(state *s)
+{
+	db_index_slot slot;
+	const char *map;
+	struct stat st;
+	int attempt;
+	int fd;
+	int retval;
+
+	/* Files: database, lock and temporary */
+	char *db = NULL, *lck = NULL, *tmp = NULL, *home = NULL;
+	retval = db_file_path(s->username, &db, &lck, &tmp, NULL, NULL, &home);
+	if (retval != 0) {
+		return retval;
+	}
+
+	retval = db_file_permissions(db, home);
+	if (retval != 0) {
+		goto cleanup;
+	}
+
+	retval = DB_INDEX_PEEK_AGAIN;
+	for (attempt = 0; attempt < DB_INDEX_PEEK_RETRIES; attempt++) {
+		/* File is reopened as it might have been replaced or extended */
+		fd = open(db, O_RDONLY);
+		if (fd == -1) {
+			if (errno == ENOENT)
+				retval = STATE_NON_EXISTENT;
+			else
+				retval = STATE_IO_ERROR;
+			print_perror(PRINT_ERROR,
+				     "Unable to open %s for reading.",
+				     db);
+			goto cleanup;
+		}
+
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(db_index_header)) {
+			/* Let locked load tell what's wrong */
+			close(fd);
+			break;
+		}
+
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) {
+			print_perror(PRINT_ERROR, "Unable to map %s", db);
+			retval = STATE_IO_ERROR;
+			goto cleanup;
+		}
+
+		retval = _db_index_lookup_mapped(map, st.st_size, s->username, &slot);
+		munmap((void *) map, st.st_size);
+		if (retval != DB_INDEX_PEEK_AGAIN)
+			break;
+	}
+
+	if (retval == DB_INDEX_PEEK_AGAIN) {
+		print(PRINT_NOTICE, "Indexed database keeps changing, "
+		      "reading it under lock\n");
+		retval = db_index_load(s);
+	} else if (retval == 0) {
+		retval = _db_index_to_state(&slot, s);
+	}
+
+cleanup:
+	memset(&slot, 0, sizeof(slot));
+	free(db);
+	free(lck);
+	free(tmp);
+	free(home);
+	return retval;
+}
+
+int db_index_store(state *s, int remove)
+{
+	db_index_header h;
+	db_index_record r;
+	db_index_slot new_slot;
+	uint32_t record, prev;
+	int current;
+
+	cfg_t *cfg = cfg_get();
+
+	/* Did we lock the file? */
+	int locked = 0;
+
+	/* Type of structure lock we hold */
+	short structure = F_UNLCK;
+
+	int fd = -1;
+	int ret;
+
+	/* Files: database, lock and temporary */
+	char *db = NULL, *lck = NULL, *tmp = NULL;
+	uid_t user_uid;
+	gid_t user_gid;
+
+	memset(&r, 0, sizeof(r));
+	memset(&new_slot, 0, sizeof(new_slot));
+
+	ret = db_file_path(s->username, &db, &lck, &tmp, &user_uid, &user_gid, NULL);
+	if (ret != 0) {
+		return ret;
+	}
+
+	if (cfg->db == CONFIG_DB_GLOBAL) {
+		user_uid = cfg->user_uid;
+		user_gid = cfg->user_gid;
+	}
+
+	if (s->lock <= 0) {
+		print(PRINT_NOTICE,
+		      "State file not locked while writing to it. Locking for write.\n");
+		ret = db_index_lock(s);
+		if (ret != 0) {
+			print(PRINT_ERROR, "Unable to lock file for writing!\n");
+			goto cleanup_free;
+		}
+		locked = 1;
+	}
+
+	if (remove == 0) {
+		ret = _db_index_from_state(s, &new_slot);
+		if (ret != 0)
+			goto cleanup;
+	}
+
+	/* In-place update requires only a shared lock, we will
+	 * come back here if it turns out the structure will change */
+	structure = remove ? F_WRLCK : F_RDLCK;
+again:
+	ret = _db_index_lock_structure(s, structure);
+	if (ret != 0) {
+		structure = F_UNLCK;
+		goto cleanup;
+	}
+
+	if (cfg->db == CONFIG_DB_USER && remove) {
+		ret = unlink(db);
+		if (ret != 0) {
+			ret = STATE_IO_ERROR;
+			print_perror(PRINT_ERROR,
+				     "Unable to unlink state file\n");
+		} else {
+			ret = 0;
+		}
+		goto cleanup;
+	}
+
+	fd = open(db, O_RDWR);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			print_perror(PRINT_ERROR,
+				     "Unable to open %s for writing", db);
+			ret = STATE_IO_ERROR;
+			goto cleanup;
+		}
+
+		if (remove) {
+			/* Nothing to remove */
+			ret = STATE_NON_EXISTENT;
+			goto cleanup;
+		}
+
+		if (structure != F_WRLCK)
+			goto upgrade;
+
+		/* Create new, empty database */
+		ret = _db_index_rebuild(db, tmp, DB_INDEX_MIN_BUCKETS,
+		                        user_uid, user_gid, &fd, &h);
+		if (ret != 0)
+			goto cleanup;
+	} else {
+		ret = _db_index_read_header(fd, &h);
+		if (ret != 0)
+			goto cleanup;
+	}
+
+	ret = _db_index_find(fd, &h, s->username, &record, &prev, &r, &current);
+	if (ret != 0 && ret != STATE_NO_USER_ENTRY)
+		goto cleanup;
+
+	if (ret == 0 && remove) {
+		/* Remove existing entry */
+		ret = _db_index_remove(fd, &h, record, prev, &r, current);
+	} else if (ret == 0) {
+		/* Update existing entry in place */
+		ret = _db_index_update(fd, &h, record, &r, current, &new_slot);
+	} else if (remove) {
+		/* Removing nonexisting entry is fine */
+		ret = 0;
+	} else if (structure != F_WRLCK) {
+		goto upgrade;
+	} else {
+		/* New entry; grow index first if it's getting crowded */
+		if (h.users >= h.buckets * DB_INDEX_LOAD_FACTOR) {
+			print(PRINT_NOTICE, "Growing index of the state database\n");
+			ret = _db_index_rebuild(db, tmp, h.buckets * 2,
+			                        user_uid, user_gid, &fd, &h);
+			if (ret != 0)
+				goto cleanup;
+		}
+		ret = _db_index_insert(fd, &h, &new_slot);
+	}
+
+	if (ret != 0)
+		goto cleanup;
+
+	/* Flush only this file; size changes are covered by fdatasync too */
+	ret = db_file_sync(fd);
+	if (ret != 0)
+		goto cleanup;
+
+	/* When state updated via PAM (root)
+	 * we must set correct file owner. */
+	if (db_file_permissions(db, NULL) != 0) {
+		print(PRINT_WARN,
+		      "Unable to set state file permissions. "
+		      "Key might be world-readable!\n");
+	}
+	print(PRINT_NOTICE, "State file written correctly\n");
+	goto cleanup;
+
+upgrade:
+	/* Lock is released before taking an exclusive one, two processes
+	 * converting their shared locks at once would wait for each other. */
+	close(fd);
+	fd = -1;
+	_db_index_lock_structure(s, F_UNLCK);
+	structure = F_WRLCK;
+	goto again;
+
+cleanup:
+	memset(&r, 0, sizeof(r));
+	memset(&new_slot, 0, sizeof(new_slot));
+	if (fd != -1)
+		close(fd);
+
+	if (structure != F_UNLCK)
+		_db_index_lock_structure(s, F_UNLCK);
+
+	if (locked && db_index_unlock(s) != 0) {
+		print(PRINT_ERROR, "Error while unlocking state file!\n");
+	}
+
+cleanup_free:
+	free(db);
+	free(lck);
+	free(tmp);
+	return ret;
+}
+
+/* Converter from text database. Whole index is build in a temporary
+ * file which is renamed to 'index_db' only if all entries were
+ * converted correctly. */
+int db_index_convert(const char *text_db, const char *index_db)
+{
+	char buff[STATE_ENTRY_SIZE];
+	db_index_header h;
+	db_index_record found;
+	db_index_slot slot;
+	uint32_t record, prev;
+	int current;
+
+	uint32_t entries = 0, buckets = DB_INDEX_MIN_BUCKETS;
+	uid_t uid = (uid_t) -1;
+	gid_t gid = (gid_t) -1;
+
+	cfg_t *cfg = cfg_get();
+	FILE *in = NULL;
+	struct stat st;
+	db_wal *log = NULL;
+	char *tmp = NULL;
+	int fd = -1;
+	int ret = STATE_NOMEM;
+
+	assert(cfg != NULL);
+
+	tmp = malloc(strlen(index_db) + 5);
+	if (!tmp)
+		goto cleanup;
+	strcpy(tmp, index_db);
+	strcat(tmp, ".tmp");
+
+	in = fopen(text_db, "r");
+	if (!in) {
+		print_perror(PRINT_ERROR, "Unable to open %s for reading", text_db);
+		ret = errno == ENOENT ? STATE_NON_EXISTENT : STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	/* Updates still in the write-ahead log are converted too */
+	if (fstat(fileno(in), &st) != 0) {
+		print_perror(PRINT_ERROR, "Unable to stat %s", text_db);
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+	ret = db_wal_load(text_db, &st, &log);
+	if (ret != 0)
+		goto cleanup;
+
+	/* Size index for the number of entries */
+	while (fgets(buff, sizeof(buff), in) != NULL) {
+		if (strchr(buff, '\n') != NULL)
+			entries++;
+	}
+	while (buckets * DB_INDEX_LOAD_FACTOR < entries)
+		buckets *= 2;
+	rewind(in);
+
+	if (cfg->db == CONFIG_DB_GLOBAL) {
+		uid = cfg->user_uid;
+		gid = cfg->user_gid;
+	}
+
+	fd = _db_index_build(tmp, buckets, -1, NULL, uid, gid, &h);
+	if (fd == -1) {
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	for (entries = 0; ; entries++) {
+		char username[DB_INDEX_USER_SIZE];
+		char *sep;
+		size_t length;
+		state s;
+
+		if (fgets(buff, sizeof(buff), in) == NULL) {
+			if (ferror(in)) {
+				print(PRINT_ERROR, "Error while reading %s\n", text_db);
+				ret = STATE_IO_ERROR;
+				goto cleanup;
+			}
+			break;
+		}
+
+		length = strlen(buff);
+		if (length < 10 || buff[length-1] != '\n') {
+			print(PRINT_ERROR, "Entry %u of text database is invalid.\n",
+			      entries + 1);
+			ret = STATE_PARSE_ERROR;
+			goto cleanup;
+		}
+
+		sep = strchr(buff, ':');
+		if (!sep || sep == buff || (size_t) (sep - buff) >= sizeof(username)) {
+			print(PRINT_ERROR, "Entry %u has invalid username.\n",
+			      entries + 1);
+			ret = STATE_PARSE_ERROR;
+			goto cleanup;
+		}
+		memcpy(username, buff, sep - buff);
+		username[sep - buff] = '\0';
+
+		if (state_init(&s, username) != 0) {
+			ret = STATE_NOMEM;
+			goto cleanup;
+		}
+
+		ret = db_file_parse_entry(&s, buff, strlen(buff));
+		if (ret == 0) {
+			const db_wal_record *r = db_wal_find(log, username);
+			if (r)
+				(void) db_wal_apply(r, &s);
+			ret = _db_index_from_state(&s, &slot);
+		}
+		state_fini(&s);
+
+		if (ret != 0) {
+			print(PRINT_ERROR, "Unable to convert entry of user %s.\n",
+			      username);
+			goto cleanup;
+		}
+
+		ret = _db_index_find(fd, &h, username, &record, &prev,
+		                     &found, &current);
+		if (ret == 0) {
+			print(PRINT_ERROR, "Duplicate entry for user %s in state file\n",
+			      username);
+			ret = STATE_PARSE_ERROR;
+			goto cleanup;
+		}
+		if (ret != STATE_NO_USER_ENTRY)
+			goto cleanup;
+
+		ret = _db_index_insert(fd, &h, &slot);
+		if (ret != 0)
+			goto cleanup;
+	}
+
+	if (fdatasync(fd) != 0) {
+		print_perror(PRINT_ERROR, "Error while flushing %s", tmp);
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	if (rename(tmp, index_db) != 0) {
+		print_perror(PRINT_ERROR, "Unable to rename %s to %s", tmp, index_db);
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	print(PRINT_NOTICE, "Converted %u entries into indexed database\n", entries);
+	ret = 0;
+
+cleanup:
+	memset(buff, 0, sizeof(buff));
+	memset(&slot, 0, sizeof(slot));
+	memset(&found, 0, sizeof(found));
+	if (in)
+		fclose(in);
+	if (fd != -1) {
+		close(fd);
+		if (ret != 0)
+			unlink(tmp);
+	}
+	db_wal_free(log);
+	free(tmp);
+	return ret;
+}
+
+/* Records are read with structure locked shared, so the set of users
+ * doesn't change while they are updated in place by logins. */
+int db_index_export(const char *index_db, db_bulk_emit emit, void *arg)
+{
+	char buff[STATE_ENTRY_SIZE];
+	db_index_header h;
+	db_index_record r;
+	uint32_t i;
+	int current;
+
+	char *lck = NULL;
+	int fd = -1, lock_fd = -1;
+	int ret = STATE_NOMEM;
+
+	lck = malloc(strlen(index_db) + 5);
+	if (!lck)
+		goto cleanup;
+	strcpy(lck, index_db);
+	strcat(lck, ".lck");
+
+	lock_fd = open(lck, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (lock_fd == -1) {
+		print_perror(PRINT_ERROR, "Unable to open %s lock file", lck);
+		ret = STATE_LOCK_ERROR;
+		goto cleanup;
+	}
+
+	ret = db_file_lock_range(lock_fd, F_RDLCK, DB_INDEX_LOCK_STRUCTURE, 1);
+	if (ret != 0) {
+		print(PRINT_ERROR, "Unable to lock state database structure\n");
+		goto cleanup;
+	}
+
+	fd = open(index_db, O_RDONLY);
+	if (fd == -1) {
+		print_perror(PRINT_ERROR, "Unable to open %s for reading", index_db);
+		ret = errno == ENOENT ? STATE_NON_EXISTENT : STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	ret = _db_index_read_header(fd, &h);
+	if (ret != 0)
+		goto cleanup;
+
+	for (i = 1; i <= h.records; i++) {
+		state s;
+
+		ret = _db_index_read_record(fd, &h, i, &r);
+		if (ret != 0)
+			goto cleanup;
+		if (!r.used)
+			continue;
+
+		current = _db_index_current_slot(&r);
+		if (current == -1) {
+			print(PRINT_ERROR, "Both copies of indexed database "
+			      "record %u are damaged.\n", i);
+			ret = STATE_PARSE_ERROR;
+			goto cleanup;
+		}
+
+		if (state_init(&s, r.slot[current].username) != 0) {
+			ret = STATE_NOMEM;
+			goto cleanup;
+		}
+		ret = _db_index_to_state(&r.slot[current], &s);
+		if (ret == 0)
+			ret = db_file_generate_entry(&s, buff, sizeof(buff));
+		state_fini(&s);
+
+		if (ret != 0) {
+			print(PRINT_ERROR, "Unable to export record %u.\n", i);
+			goto cleanup;
+		}
+
+		ret = emit(arg, buff, strlen(buff));
+		if (ret != 0)
+			goto cleanup;
+	}
+
+cleanup:
+	memset(buff, 0, sizeof(buff));
+	memset(&r, 0, sizeof(r));
+	if (fd != -1)
+		close(fd);
+	if (lock_fd != -1)
+		close(lock_fd);
+	free(lck);
+	return ret;
+}
@@ -0,0 +1,461 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Write-ahead log of text database. Updates changing only counters,
+ *   failures and channel time are appended to the log instead of
+ *   rewriting the whole database.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>	/* offsetof */
+#include <stdint.h>
+#include <errno.h>
+
+#include <unistd.h>	/* pread, pwrite, ftruncate */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "print.h"
+#include "state.h"
+#include "db.h"
+#include "config.h"
+#include "crypto.h"
+
+/*
+ * Log file (database path + .wal) layout:
+ *
+ * +--------+-------------------------------+
+ * | header | records (fixed size each) ... |
+ * +--------+-------------------------------+
+ *
+ * Header identifies the database file (device, inode and modification
+ * time) the log applies to. Database is only ever replaced with rename,
+ * so a log left behind after its database was rewritten no longer
+ * matches and is ignored; it's cleared by the next append. Rewrite of
+ * the database folds the log in and then removes it, a crash between
+ * these steps leaves a harmless stale log.
+ *
+ * Records are only appended, under the state lock. Each holds the
+ * current (not relative) values of its user, so the newest record
+ * wins and replaying one twice is harmless. Torn or damaged records
+ * fail their checksum and are skipped. Record also carries checksum
+ * of the remaining state fields; it's not applied to a state which
+ * was changed in other ways since it was written.
+ *
+ * Numbers are stored in host byte order like in the indexed database.
+ */
+
+/* Maximal length of username (including \0) */
+#define DB_WAL_USER_SIZE	64
+
+static const char _magic[8] = {'O', 'T', 'P', 'W', 'A', 'L', '\0', '\0'};
+static const uint32_t _version = 1;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+
+	/* Identity of database file */
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+} db_wal_header;
+
+struct db_wal_record {
+	int64_t channel_time;
+
+	uint32_t sequence;	/* Position in the log */
+	uint32_t failures;
+	uint32_t recent_failures;
+	uint32_t base;		/* db_wal_base of the state */
+
+	char username[DB_WAL_USER_SIZE];
+	unsigned char counter[16];	/* NUM_FORMAT_BIN */
+
+	char reserved[4];
+
+	uint32_t checksum;	/* CRC-32 of all previous fields */
+};
+
+/* Newest correct record of each user sorted by username */
+struct db_wal {
+	db_wal_record *records;
+	int count;
+};
+
+/******************
+ * Static helpers
+ ******************/
+
+static char *_db_wal_path(const char *db_path)
+{
+	char *wal = malloc(strlen(db_path) + 5);
+	if (wal)
+		sprintf(wal, "%s.wal", db_path);
+	return wal;
+}
+
+/* Header of a log applying to given database file */
+static void _db_wal_header(db_wal_header *h, const struct stat *snapshot)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, _magic, sizeof(_magic));
+	h->version = _version;
+	h->record_size = sizeof(db_wal_record);
+	h->dev = snapshot->st_dev;
+	h->ino = snapshot->st_ino;
+	h->mtime_sec = snapshot->st_mtim.tv_sec;
+	h->mtime_nsec = snapshot->st_mtim.tv_nsec;
+}
+
+static uint32_t _db_wal_checksum(const db_wal_record *r)
+{
+	return crypto_crc32(r, offsetof(db_wal_record, checksum));
+}
+
+/* Order by username, older records first */
+static int _db_wal_compare(const void *a, const void *b)
+{
+	const db_wal_record *ra = a, *rb = b;
+	const int ret = strcmp(ra->username, rb->username);
+	if (ret != 0)
+		return ret;
+	return ra->sequence < rb->sequence ? -1 : ra->sequence > rb->sequence;
+}
+
+static int _db_wal_find_compare(const void *key, const void *record)
+{
+	return strcmp(key, ((const db_wal_record *) record)->username);
+}
+
+/******************
+ * Interface
+ ******************/
+
+unsigned int db_wal_base(const state *s)
+{
+	struct {
+		unsigned char sequence_key[32];
+		unsigned char latest_card[16];
+		unsigned char spass[STATE_SPASS_SIZE];
+		char label[STATE_LABEL_SIZE];
+		char contact[STATE_CONTACT_SIZE];
+		int64_t spass_time;
+		uint32_t code_length;
+		uint32_t alphabet;
+		uint32_t flags;
+		uint32_t spass_set;
+	} f;
+	unsigned int base;
+
+	memset(&f, 0, sizeof(f));
+	memcpy(f.sequence_key, s->sequence_key, sizeof(f.sequence_key));
+	num_export(s->latest_card, (char *) f.latest_card, NUM_FORMAT_BIN);
+	/* Only meaningful bytes; the rest may differ between loads */
+	if (s->spass_set)
+		memcpy(f.spass, s->spass, sizeof(f.spass));
+	memcpy(f.label, s->label, strnlen(s->label, sizeof(f.label)));
+	memcpy(f.contact, s->contact, strnlen(s->contact, sizeof(f.contact)));
+	f.spass_time = s->spass_time;
+	f.code_length = s->code_length;
+	f.alphabet = s->alphabet;
+	f.flags = s->flags;
+	f.spass_set = s->spass_set;
+
+	base = crypto_crc32(&f, sizeof(f));
+	memset(&f, 0, sizeof(f));
+
+	/* 0 is left for states which weren't read */
+	return base ? base : 1;
+}
+
+int db_wal_load(const char *db_path, const struct stat *snapshot, db_wal **log)
+{
+	db_wal_header h, expected;
+	db_wal_record *records = NULL;
+	struct stat st;
+	size_t count = 0, i, valid;
+	char *wal;
+	int fd = -1;
+	int ret = STATE_NOMEM;
+
+	*log = NULL;
+
+	wal = _db_wal_path(db_path);
+	if (!wal)
+		return STATE_NOMEM;
+
+	fd = open(wal, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			ret = 0;
+		} else {
+			print_perror(PRINT_ERROR, "Unable to open %s", wal);
+			ret = STATE_IO_ERROR;
+		}
+		goto cleanup;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		print_perror(PRINT_ERROR, "Unable to stat %s", wal);
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	/* Stale log is ignored */
+	_db_wal_header(&expected, snapshot);
+	if (st.st_size < (off_t) sizeof(h) ||
+	    pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+	    memcmp(&h, &expected, sizeof(h)) != 0) {
+		ret = 0;
+		goto cleanup;
+	}
+
+	count = (st.st_size - sizeof(h)) / sizeof(db_wal_record);
+	if (count == 0) {
+		ret = 0;
+		goto cleanup;
+	}
+
+	records = malloc(count * sizeof(*records));
+	if (!records)
+		goto cleanup;
+
+	if (pread(fd, records, count * sizeof(*records), sizeof(h)) !=
+	    (ssize_t) (count * sizeof(*records))) {
+		print_perror(PRINT_ERROR, "Unable to read %s", wal);
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	/* Skip damaged records */
+	for (i = valid = 0; i < count; i++) {
+		const db_wal_record *r = &records[i];
+		if (r->checksum != _db_wal_checksum(r) ||
+		    r->sequence != i ||
+		    memchr(r->username, '\0', sizeof(r->username)) == NULL) {
+			print(PRINT_WARN, "Skipping damaged record %zu of %s\n", i, wal);
+			continue;
+		}
+		records[valid++] = *r;
+	}
+
+	/* Keep the newest record of each user */
+	qsort(records, valid, sizeof(*records), _db_wal_compare);
+	for (i = count = 0; i < valid; i++) {
+		if (i + 1 < valid &&
+		    strcmp(records[i].username, records[i + 1].username) == 0)
+			continue;
+		records[count++] = records[i];
+	}
+
+	if (count == 0) {
+		ret = 0;
+		goto cleanup;
+	}
+
+	*log = malloc(sizeof(**log));
+	if (!*log)
+		goto cleanup;
+	(*log)->records = records;
+	(*log)->count = count;
+	records = NULL;
+	ret = 0;
+
+cleanup:
+	free(records);
+	if (fd != -1)
+		close(fd);
+	free(wal);
+	return ret;
+}
+
+const db_wal_record *db_wal_find(const db_wal *log, const char *username)
+{
+	if (!log)
+		return NULL;
+	return bsearch(username, log->records, log->count,
+	               sizeof(db_wal_record), _db_wal_find_compare);
+}
+
+int db_wal_apply(const db_wal_record *r, state *s)
+{
+	if (r->base != db_wal_base(s)) {
+		print(PRINT_WARN, "Ignoring logged update of %s made "
+		      "before other change of its state\n", r->username);
+		return 0;
+	}
+
+	num_import(&s->counter, (const char *) r->counter, NUM_FORMAT_BIN);
+	s->failures = r->failures;
+	s->recent_failures = r->recent_failures;
+	s->channel_time = r->channel_time;
+	return 1;
+}
+
+void db_wal_free(db_wal *log)
+{
+	if (!log)
+		return;
+	free(log->records);
+	free(log);
+}
+
+int db_wal_replay(const char *db_path, const struct stat *snapshot, state *s)
+{
+	const db_wal_record *r;
+	db_wal *log;
+	int ret;
+
+	ret = db_wal_load(db_path, snapshot, &log);
+	if (ret != 0 || !log)
+		return ret;
+
+	r = db_wal_find(log, s->username);
+	if (r)
+		(void) db_wal_apply(r, s);
+
+	db_wal_free(log);
+	return 0;
+}
+
+int db_wal_append(const char *db_path, const struct stat *snapshot, const state *s)
+{
+	db_wal_header h, expected;
+	db_wal_record r;
+	struct stat st;
+	off_t records;
+	char *wal;
+	int fd = -1, created;
+	int ret = STATE_IO_ERROR;
+	cfg_t *cfg = cfg_get();
+
+	if (strlen(s->username) >= sizeof(r.username))
+		return DB_WAL_FULL;
+
+	wal = _db_wal_path(db_path);
+	if (!wal)
+		return STATE_NOMEM;
+
+	fd = open(wal, O_RDWR | O_CREAT | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		print_perror(PRINT_ERROR, "Unable to open %s", wal);
+		goto cleanup;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		print_perror(PRINT_ERROR, "Unable to stat %s", wal);
+		goto cleanup;
+	}
+	created = st.st_size == 0;
+
+	_db_wal_header(&expected, snapshot);
+	if (st.st_size < (off_t) sizeof(h) ||
+	    pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+	    memcmp(&h, &expected, sizeof(h)) != 0) {
+		/* New log, or one already folded into the database */
+		if (ftruncate(fd, 0) != 0 ||
+		    pwrite(fd, &expected, sizeof(expected), 0) != sizeof(expected)) {
+			print_perror(PRINT_ERROR, "Unable to initialize %s", wal);
+			goto cleanup;
+		}
+
+		if (geteuid() == 0 &&
+		    fchown(fd, snapshot->st_uid, snapshot->st_gid) != 0) {
+			print_perror(PRINT_ERROR, "Unable to set owner of %s", wal);
+			goto cleanup;
+		}
+		st.st_size = sizeof(expected);
+	}
+
+	/* Torn record at the end gets overwritten */
+	records = (st.st_size - sizeof(h)) / sizeof(r);
+	if (records >= cfg->db_wal_limit) {
+		ret = DB_WAL_FULL;
+		goto cleanup;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.channel_time = s->channel_time;
+	r.sequence = records;
+	r.failures = s->failures;
+	r.recent_failures = s->recent_failures;
+	r.base = db_wal_base(s);
+	strcpy(r.username, s->username);
+	num_export(s->counter, (char *) r.counter, NUM_FORMAT_BIN);
+	r.checksum = _db_wal_checksum(&r);
+
+	if (pwrite(fd, &r, sizeof(r), sizeof(h) + records * sizeof(r)) != sizeof(r)) {
+		print_perror(PRINT_ERROR, "Unable to append to %s", wal);
+		goto cleanup;
+	}
+
+	if (db_file_sync(fd) != 0)
+		goto cleanup;
+
+	/* Newly created log must be found after a crash */
+	if (created && db_file_sync_dir(wal) != 0)
+		goto cleanup;
+
+	ret = 0;
+
+cleanup:
+	if (fd != -1)
+		close(fd);
+	free(wal);
+	return ret;
+}
+
+int db_wal_remove(const char *db_path)
+{
+	char *wal = _db_wal_path(db_path);
+	int ret = 0;
+
+	if (!wal)
+		return STATE_NOMEM;
+
+	if (unlink(wal) != 0 && errno != ENOENT) {
+		print_perror(PRINT_WARN, "Unable to remove %s", wal);
+		ret = STATE_IO_ERROR;
+	}
+	free(wal);
+	return ret;
+}
+
+int db_wal_rename(const char *db_path, const char *new_db_path)
+{
+	char *wal = _db_wal_path(db_path);
+	char *new_wal = _db_wal_path(new_db_path);
+	int ret = STATE_NOMEM;
+
+	if (wal && new_wal) {
+		ret = 0;
+		if (rename(wal, new_wal) != 0 && errno != ENOENT) {
+			print_perror(PRINT_ERROR, "Unable to move %s", wal);
+			ret = STATE_IO_ERROR;
+		}
+	}
+	free(wal);
+	free(new_wal);
+	return ret;
+}
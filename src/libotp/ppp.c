@@ -25,6 +25,7 @@
 /* for umask */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h> /* close */
 
 #include "num.h"
 #include "crypto.h"
@@ -34,6 +35,10 @@
 #include "config.h"
 #include "nls.h"
 
+/* Low-level interface, for database conversion */
+#include "db.h"
+#include "trace.h"
+
 /* Number of combinations calculated for 4 passcodes */
 /* 64 characters -> 16 777 216 */
 static const char alphabet_simple[] =
@@ -125,6 +130,143 @@ void ppp_fini(void)
 	print_fini();
 }
 
+int ppp_db_convert(void)
+{
+	cfg_t *cfg = cfg_get();
+	state *s = NULL;
+	char *backup = NULL;
+	int retval;
+
+	assert(cfg != NULL);
+
+	if (cfg->db != CONFIG_DB_GLOBAL) {
+		print(PRINT_ERROR, "Only global database can be converted.\n");
+		return PPP_ERROR;
+	}
+
+	/* Text logins would parse (and rewrite) the converted file */
+	if (cfg->db_format != CONFIG_DB_FORMAT_INDEXED) {
+		print(PRINT_ERROR, "Set DB_FORMAT=indexed in config file "
+		      "before converting the database.\n");
+		return PPP_ERROR;
+	}
+
+	backup = malloc(strlen(cfg->global_db_path) + 5);
+	if (!backup)
+		return STATE_NOMEM;
+	strcpy(backup, cfg->global_db_path);
+	strcat(backup, ".old");
+
+	/* Lock file is common for both formats and doesn't
+	 * depend on the username in global database. */
+	retval = ppp_state_init(&s, "root");
+	if (retval != 0)
+		goto cleanup;
+
+	/* Whole lock file; indexed logins lock only their byte */
+	retval = db_file_lock_part(s, 0, 0);
+	if (retval != 0)
+		goto cleanup;
+
+	if (rename(cfg->global_db_path, backup) != 0) {
+		print_perror(PRINT_ERROR, "Unable to move %s aside",
+		             cfg->global_db_path);
+		retval = STATE_IO_ERROR;
+		goto unlock;
+	}
+
+	/* Log of the text database goes with it */
+	retval = db_wal_rename(cfg->global_db_path, backup);
+	if (retval == 0)
+		retval = db_index_convert(backup, cfg->global_db_path);
+	if (retval != 0) {
+		/* Bring the text database back */
+		if (rename(backup, cfg->global_db_path) != 0 ||
+		    db_wal_rename(backup, cfg->global_db_path) != 0) {
+			print_perror(PRINT_ERROR, "Unable to restore %s",
+			             cfg->global_db_path);
+		}
+	}
+
+unlock:
+	/* Lock file is kept; indexed database requires it */
+	close(s->lock);
+	s->lock = -1;
+
+cleanup:
+	if (s)
+		ppp_state_fini(s);
+	free(backup);
+	return retval;
+}
+
+int ppp_db_export(int (*emit)(void *arg, const char *entry, size_t length),
+                  void *arg)
+{
+	cfg_t *cfg = cfg_get();
+	assert(cfg != NULL);
+
+	if (cfg->db != CONFIG_DB_GLOBAL) {
+		print(PRINT_ERROR, "Only global database can be exported.\n");
+		return PPP_ERROR;
+	}
+
+	if (cfg->db_format == CONFIG_DB_FORMAT_INDEXED)
+		return db_index_export(cfg->global_db_path, emit, arg);
+	return db_file_export(cfg->global_db_path, emit, arg);
+}
+
+int ppp_db_import_start(struct db_bulk **b)
+{
+	cfg_t *cfg = cfg_get();
+	assert(cfg != NULL);
+
+	*b = NULL;
+	if (cfg->db != CONFIG_DB_GLOBAL) {
+		print(PRINT_ERROR, "Only global database can be imported.\n");
+		return PPP_ERROR;
+	}
+
+	return db_bulk_import_start(cfg->global_db_path, b);
+}
+
+int ppp_db_import(struct db_bulk *b, const char *data, size_t length)
+{
+	return db_bulk_import(b, data, length);
+}
+
+int ppp_db_import_finish(struct db_bulk *b, unsigned long *entries)
+{
+	state *s = NULL;
+	int retval;
+
+	/* Wait for all users like ppp_db_convert */
+	retval = ppp_state_init(&s, "root");
+	if (retval != 0)
+		goto cleanup;
+
+	retval = db_file_lock_part(s, 0, 0);
+	if (retval != 0)
+		goto cleanup;
+
+	retval = db_bulk_import_finish(b, entries);
+
+	/* Lock file is kept; indexed database requires it */
+	close(s->lock);
+	s->lock = -1;
+
+cleanup:
+	if (s)
+		ppp_state_fini(s);
+	db_bulk_import_free(b);
+	return retval;
+}
+
+void ppp_db_import_abort(struct db_bulk *b)
+{
+	db_bulk_import_free(b);
+}
+
 
 /***********************
  * Verification group 
@@ -264,6 +406,40 @@ int ppp_state_verify(const state *s)
 	return 0;
 }
 
+int ppp_state_export(const state *s, char *entry, int size)
+{
+	return db_file_generate_entry(s, entry, size);
+}
+
+int ppp_state_import(state *s, const char *entry, size_t length, int flags)
+{
+	int ret;
+
+	/* Entry must belong to the user of the state */
+	ret = db_file_parse_entry(s, entry, length);
+	if (ret != 0)
+		return ret;
+
+	/* ppp_calculate requires an existing alphabet */
+	if (ppp_verify_alphabet(s->alphabet) == PPP_ERROR_RANGE) {
+		print(PRINT_ERROR, "Illegal alphabet in imported state\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	ppp_calculate(s);
+
+	if (flags & PPP_CHECK_POLICY)
+		ret = ppp_state_verify(s);
+	else
+		ret = ppp_verify_range(s);
+	if (ret != 0)
+		return ret;
+
+	/* Stored like a freshly generated key */
+	s->new_key = 1;
+	return 0;
+}
+
 
 int ppp_alphabet_get(int id, const char **alphabet)
 {
@@ -327,45 +503,125 @@ void ppp_add_salt(const state *s, num_t *passcode)
 	}
 }
 
-int ppp_get_passcode(const state *s, const num_t counter, char *passcode)
+/* Number of counters encrypted at once by ppp_get_passcodes */
+#define PPP_BATCH 8
+
+/* Converts AES output into passcode characters.
+ * Built once per resolved alphabet. */
+typedef struct {
+	const char *alphabet;
+	unsigned int length;
+
+	/* log2(length) if it's a power of two, 0 otherwise */
+	unsigned int shift;
+
+	/* Number of digits fitting in 64 bits and length^chunk_digits */
+	unsigned int chunk_digits;
+	uint64_t chunk;
+
+	/* Reciprocal of length (Granlund-Montgomery) */
+	uint64_t magic;
+	unsigned int magic_shift;
+} ppp_encoder;
+
+static void _encoder_init(ppp_encoder *e, const char *alphabet)
 {
-	unsigned char cnt_bin[16] = {'\0'};
-	unsigned char cipher_bin[16] = {'\0'};
+	unsigned int l;
+
+	e->alphabet = alphabet;
+	e->length = strlen(alphabet);
+	assert(e->length >= 2);
+
+	e->shift = 0;
+	if ((e->length & (e->length - 1)) == 0) {
+		for (l = 1; (1U << l) != e->length; l++);
+		e->shift = l;
+	}
+
+	e->chunk = e->length;
+	e->chunk_digits = 1;
+	while (e->chunk <= UINT64_MAX / e->length) {
+		e->chunk *= e->length;
+		e->chunk_digits++;
+	}
+
+	/* l = ceil(log2(length)) */
+	for (l = 0; (1ULL << l) < e->length; l++);
+	e->magic_shift = l;
+#if NUM_HAVE_INT128
+	e->magic = (uint64_t)((((unsigned __int128)((1ULL << l) - e->length)) << 64)
+	                      / e->length) + 1;
+#else
+	e->magic = 0;
+#endif
+}
+
+/* Divide by alphabet length */
+static inline uint64_t _encoder_div(const ppp_encoder *e, uint64_t x)
+{
+#if NUM_HAVE_INT128
+	const uint64_t t = (uint64_t)(((unsigned __int128)x * e->magic) >> 64);
+	return (t + ((x - t) >> 1)) >> (e->magic_shift - 1);
+#else
+	return x / e->length;
+#endif
+}
+
+/* Gives the same result as repeated division of cipher by
+ * alphabet length, but divides 128 bit number only once per
+ * chunk_digits characters. */
+static void _encoder_encode(const ppp_encoder *e, num_t cipher,
+                            unsigned int code_length, char *passcode)
+{
+	unsigned int i = 0, in_chunk;
+	uint64_t chunk, q;
+
+	if (e->shift) {
+		const uint64_t mask = e->length - 1;
+		for (i = 0; i < code_length; i++) {
+			passcode[i] = e->alphabet[cipher.lo & mask];
+			cipher.lo = (cipher.lo >> e->shift) | (cipher.hi << (64 - e->shift));
+			cipher.hi >>= e->shift;
+		}
+	} else {
+		while (i < code_length) {
+			chunk = num_div_i(&cipher, cipher, e->chunk);
+			for (in_chunk = 0;
+			     in_chunk < e->chunk_digits && i < code_length;
+			     in_chunk++, i++) {
+				q = _encoder_div(e, chunk);
+				passcode[i] = e->alphabet[chunk - q * e->length];
+				chunk = q;
+			}
+		}
+	}
+
+	passcode[i] = '\0';
+}
+
+int ppp_get_passcodes(const state *s, const num_t counter,
+                      unsigned int count, char *passcodes)
+{
+	unsigned char cnt_bin[16 * PPP_BATCH] = {'\0'};
+	unsigned char cipher_bin[16 * PPP_BATCH] = {'\0'};
 	num_t cipher = num_i(0);
-	num_t quotient = num_i(0);
 	num_t salted_counter = num_i(0);
 	const char *alphabet = NULL;
-	int ret;
-	int i;
+	ppp_encoder encoder;
+	unsigned int done, in_batch, b;
+	int ret = 0;
 
 	const cfg_t *cfg = cfg_get();
 
 	/* Check for illegal data */
 	assert(s->code_length >= 2 && s->code_length <= 16);
 
-	if (!passcode)
+	if (!passcodes)
 		return 2;
 
-	/* Counter might be salted or unsalted, so make sure
-	 * we work with salted version */
-	salted_counter = counter;
-	ppp_add_salt(s, &salted_counter);
-
-	/* Convert numbers to binary */
-	num_export(salted_counter, (char *)cnt_bin, NUM_FORMAT_BIN);
-
-	/* Encrypt counter with key */
-	ret = crypto_aes_encrypt(s->sequence_key, cnt_bin, cipher_bin);
-	if (ret != 0) {
-		goto clear;
-	}
-
-	/* Convert result back to number */
-	num_import(&cipher, (char *)cipher_bin, NUM_FORMAT_BIN);
-
 	if (ppp_verify_alphabet(s->alphabet) != 0) {
 		print(PRINT_ERROR, "State contains invalid alphabet\n");
-		goto clear;
+		return 1;
 	}
 
 	if (s->alphabet == 0) {
@@ -373,28 +629,53 @@ int ppp_get_passcode(const state *s, const num_t counter, char *passcode)
 	} else {
 		alphabet = alphabets[s->alphabet];
 	}
+	_encoder_init(&encoder, alphabet);
 
+	for (done = 0; done < count; done += in_batch) {
+		in_batch = count - done < PPP_BATCH ? count - done : PPP_BATCH;
 
-	for (i=0; i<s->code_length; i++) {
-		const int alphabet_len = strlen(alphabet);
-		unsigned long int r = num_div_i(&quotient, cipher, alphabet_len);
-		cipher = quotient;
+		/* Counter might be salted or unsalted, so make sure
+		 * we work with salted version */
+		for (b = 0; b < in_batch; b++) {
+			salted_counter = num_add_i(counter, done + b);
+			ppp_add_salt(s, &salted_counter);
+			num_export(salted_counter, (char *)cnt_bin + 16 * b, NUM_FORMAT_BIN);
+		}
 
-		passcode[i] = alphabet[r];
-	}
+		/* Encrypt counters with key */
+		ret = crypto_aes_encrypt_blocks_cached(s->aes_key, s->sequence_key,
+		                                       cnt_bin, cipher_bin, in_batch);
+		if (ret != 0) {
+			goto clear;
+		}
 
-	passcode[i] = '\0';
+		/* Convert results into alphabet */
+		for (b = 0; b < in_batch; b++) {
+			num_import(&cipher, (char *)cipher_bin + 16 * b, NUM_FORMAT_BIN);
+			_encoder_encode(&encoder, cipher, s->code_length,
+			                passcodes + 17 * (done + b));
+		}
+	}
 
 clear:
 	memset(cnt_bin, 0, sizeof(cnt_bin));
 	memset(cipher_bin, 0, sizeof(cipher_bin));
 
 	num_clear(salted_counter);
-	num_clear(quotient);
 	num_clear(cipher);
 	return ret;
 }
 
+int ppp_get_passcode(const state *s, const num_t counter, char *passcode)
+{
+	int ret;
+
+	trace_enter(TRACE_PASSCODE);
+	ret = ppp_get_passcodes(s, counter, 1, passcode);
+	trace_leave(TRACE_PASSCODE);
+	return ret;
+}
+
 int ppp_get_current(const state *s, char *passcode)
 {
 	if (passcode == NULL)
@@ -695,8 +976,12 @@ int ppp_state_load(state *s, int flags)
 			return retval;
 	}
 
-	/* Loading... */
-	retval = state_load(s);
+	/* Loading... Unlocked loads are read-only and don't
+	 * need to wait for writers */
+	if (do_lock)
+		retval = state_load(s);
+	else
+		retval = state_peek(s);
 	if (retval != 0)
 		goto cleanup1;
 
@@ -842,10 +1127,12 @@ int ppp_increment(state *s)
 	int ret;
 	assert(s != NULL);
 
+	trace_enter(TRACE_INCREMENT);
+
 	/* Load user state */
 	ret = ppp_state_load(s, 0);
 	if (ret != 0)
-		return ret;
+		goto end;
 
 	/* Verify state correctness before trying anything more */
 	ret = ppp_state_verify(s);
@@ -875,15 +1162,136 @@ int ppp_increment(state *s)
 		num_clear(tmp);
 	}
 
-	return ret;
+	goto end;
 
 error:
 	/* Unlock. And ignore unlocking errors */
 	(void) ppp_state_release(s, PPP_UNLOCK);
+end:
+	trace_leave(TRACE_INCREMENT);
 	return ret;
 }
 
 
+int ppp_window_load(state *s)
+{
+	int ret;
+	assert(s != NULL);
+
+	/* Counter is checked again under lock after authentication */
+	ret = ppp_state_load(s, PPP_DONT_LOCK);
+	if (ret != 0)
+		return ret;
+
+	/* Verify state correctness before trying anything more */
+	ret = ppp_state_verify(s);
+	if (ret != 0)
+		return ret;
+
+	if (ppp_flag_check(s, FLAG_DISABLED))
+		return PPP_ERROR_DISABLED;
+
+	return 0;
+}
+
+int ppp_window_authenticate(state *s, const char *passcode,
+                            unsigned int window)
+{
+	char passcodes[CONFIG_PAM_WINDOW_MAX * 17];
+	unsigned char key[sizeof(s->sequence_key)];
+	unsigned int code_length, alphabet, salted;
+	num_t matched;
+	int found = -1;
+	unsigned int i;
+	int ret;
+
+	assert(s != NULL);
+	assert(window > 0 && window <= CONFIG_PAM_WINDOW_MAX);
+
+	if (passcode == NULL)
+		return 1;
+
+	/* Disabled user can't authenticate ever */
+	if (ppp_flag_check(s, FLAG_DISABLED))
+		return PPP_ERROR_DISABLED;
+
+	ret = ppp_state_verify(s);
+	if (ret != 0)
+		return ret;
+
+	ret = ppp_get_passcodes(s, s->counter, window, passcodes);
+	if (ret != 0)
+		return 2;
+
+	/* Compare all, so timing doesn't tell the position */
+	for (i = 0; i < window; i++) {
+		if (strcmp(passcode, passcodes + 17 * i) == 0 && found == -1)
+			found = i;
+	}
+	memset(passcodes, 0, sizeof(passcodes));
+
+	if (found == -1)
+		return 3;
+
+	matched = num_add_i(s->counter, found);
+
+	{
+		num_t unsalted = matched;
+		if (s->flags & FLAG_SALTED)
+			unsalted = num_and(unsalted, s->code_mask);
+		/* Equal is too big; see ppp_state_verify */
+		if (num_cmp(unsalted, s->max_code) >= 0)
+			return STATE_NUMSPACE;
+	}
+
+	/* Passcodes were generated from state read without lock */
+	memcpy(key, s->sequence_key, sizeof(key));
+	code_length = s->code_length;
+	alphabet = s->alphabet;
+	salted = s->flags & FLAG_SALTED;
+
+	/* Lock and load; the only state write of this login */
+	ret = ppp_state_load(s, 0);
+	if (ret != 0)
+		goto cleanup;
+
+	/* State might have been changed while user was answering */
+	if (ppp_flag_check(s, FLAG_DISABLED)) {
+		ret = PPP_ERROR_DISABLED;
+		goto error;
+	}
+
+	ret = ppp_state_verify(s);
+	if (ret != 0)
+		goto error;
+
+	if (memcmp(key, s->sequence_key, sizeof(key)) != 0 ||
+	    code_length != s->code_length || alphabet != s->alphabet ||
+	    salted != (s->flags & FLAG_SALTED)) {
+		print(PRINT_NOTICE, "State was changed during authentication.\n");
+		ret = 3;
+		goto error;
+	}
+
+	if (num_cmp(s->counter, matched) > 0) {
+		print(PRINT_NOTICE, "Passcode was used by another session.\n");
+		ret = 3;
+		goto error;
+	}
+
+	s->counter = num_add_i(matched, 1);
+	ret = ppp_state_release(s, PPP_STORE | PPP_UNLOCK);
+	goto cleanup;
+
+error:
+	/* Unlock. And ignore unlocking errors */
+	(void) ppp_state_release(s, PPP_UNLOCK);
+cleanup:
+	num_clear(matched);
+	memset(key, 0, sizeof(key));
+	return ret;
+}
+
 int ppp_skip(state *s, const num_t skip_to)
 {
 	int ret;
@@ -946,6 +1354,14 @@ int ppp_failures(const state *s, int zero)
 	if (zero == 0) {
 		s_tmp->failures++;
 		s_tmp->recent_failures++;
+
+		/* Prompted passcode is used up by the failed try. Without
+		 * this look-ahead window would give endless tries at the
+		 * same passcodes. Key might have been changed meanwhile. */
+		if (memcmp(s->sequence_key, s_tmp->sequence_key,
+		           sizeof(s->sequence_key)) == 0 &&
+		    num_cmp(s_tmp->counter, s->counter) <= 0)
+			s_tmp->counter = num_add_i(s->counter, 1);
 	} else {
 		s_tmp->recent_failures = 0;
 	}
@@ -1425,10 +1841,27 @@ static int _verify_spass(const char *spass, const cfg_t *cfg)
 }
 
 
+/* Cost of KDF hashing, calibrated once per process if not configured */
+static int _spass_kdf_cost(const cfg_t *cfg)
+{
+	static int calibrated = 0;
+
+	if (cfg->spass_kdf_cost != 0)
+		return cfg->spass_kdf_cost;
+
+	if (calibrated == 0) {
+		calibrated = crypto_kdf_calibrate(CRYPTO_KDF_PBKDF2_SHA256,
+						  cfg->spass_kdf_time);
+		print(PRINT_NOTICE, "Calibrated static password KDF cost: %d\n", calibrated);
+	}
+	return calibrated;
+}
+
 int ppp_set_spass(state *s, const char *spass, int flag)
 {
-	int len;
+	int len, cost, ret;
 	unsigned char sha_buf[STATE_SPASS_SIZE];
+	int format;
 	int errors = 0;
 	cfg_t *cfg = cfg_get();
 
@@ -1438,7 +1871,7 @@ int ppp_set_spass(state *s, const char *spass, int flag)
 
 	if (!spass) {
 		/* Turning off static password */
-		s->spass_set = 0;
+		s->spass_set = STATE_SPASS_UNSET;
 		memset(s->spass, 0, sizeof(s->spass));
 		return PPP_ERROR_SPASS_UNSET;
 	}
@@ -1453,26 +1886,51 @@ int ppp_set_spass(state *s, const char *spass, int flag)
 	len = strlen(spass);
 
 	/* Change static password */
-	crypto_salted_sha256((unsigned char *)spass, len, sha_buf);
+	if (cfg->spass_kdf == CONFIG_ENABLED) {
+		cost = _spass_kdf_cost(cfg);
+		if (cost < 0)
+			return PPP_ERROR;
+		ret = crypto_kdf_hash(CRYPTO_KDF_PBKDF2_SHA256, cost,
+				      (unsigned char *)spass, len, sha_buf);
+		format = STATE_SPASS_KDF;
+	} else {
+		ret = crypto_salted_sha256((unsigned char *)spass, len, sha_buf);
+		format = STATE_SPASS_SHA256;
+	}
+
+	if (ret != 0) {
+		print(PRINT_ERROR, "Unable to hash static password.\n");
+		return PPP_ERROR;
+	}
+
 	memcpy(s->spass, sha_buf, STATE_SPASS_SIZE);
-	s->spass_set = 1;
+	memset(sha_buf, 0, sizeof(sha_buf));
+	s->spass_set = format;
 	s->spass_time = time(NULL);
 	return errors | PPP_ERROR_SPASS_SET;
 }
 
 int ppp_spass_validate(const state *s, const char *spass)
 {
-	int len;
-	
-	if (s->spass_set != 1) {
-		print(PRINT_WARN, "Static password validation failure because unset.\n");
-		return PPP_ERROR_SPASS_INCORRECT;
-	}
+	int len, ret;
 
 	assert(spass != NULL);
 	len = strlen(spass);
 
-	if (crypto_verify_salted_sha256(s->spass, (unsigned char *)spass, len) != 0) {
+	/* Hashes created before KDF support are still accepted */
+	switch (s->spass_set) {
+	case STATE_SPASS_SHA256:
+		ret = crypto_verify_salted_sha256(s->spass, (unsigned char *)spass, len);
+		break;
+	case STATE_SPASS_KDF:
+		ret = crypto_kdf_verify(s->spass, (unsigned char *)spass, len);
+		break;
+	default:
+		print(PRINT_WARN, "Static password validation failure because unset.\n");
+		return PPP_ERROR_SPASS_INCORRECT;
+	}
+
+	if (ret != 0) {
 		print(PRINT_WARN, "Incorrect static password.\n");
 		return PPP_ERROR_SPASS_INCORRECT;
 	} else {
@@ -56,6 +56,25 @@ extern int ppp_init(int print_flags, const char *print_logfile);
 /** Shuts down logging subsystem */
 extern void ppp_fini(void);
 
+/** Converts global text database into the indexed format; DB_FORMAT
+ * must be set to indexed already. Waits for all users while converting.
+ * Previous database is kept with .old suffix. */
+extern int ppp_db_convert(void);
+
+/** Passes all entries of the global database to 'emit' as
+ * lines of the text database. See db_file_export. */
+extern int ppp_db_export(int (*emit)(void *arg, const char *entry, size_t length),
+                         void *arg);
+
+/** Replaces global database with a stream of text database entries.
+ * Data can be split at any place. Finish (which frees the import)
+ * or abort is required after a successful start. See db_bulk_import. */
+struct db_bulk;
+extern int ppp_db_import_start(struct db_bulk **b);
+extern int ppp_db_import(struct db_bulk *b, const char *data, size_t length);
+extern int ppp_db_import_finish(struct db_bulk *b, unsigned long *entries);
+extern void ppp_db_import_abort(struct db_bulk *b);
+
 
 /*******************************************
  * High level functions for state management
@@ -133,9 +152,27 @@ extern int ppp_increment(state *s);
  */
 extern int ppp_skip(state *s, const num_t skip_to);
 
+/**
+ * Look-ahead window authentication; used instead of ppp_increment
+ * and ppp_authenticate. ppp_window_load reads state without locking
+ * and checks if it can be used for authentication. Nothing is reserved.
+ */
+extern int ppp_window_load(state *s);
+
+/**
+ * Check passcode against 'window' passcodes starting with
+ * the current one. On match lock and load state, make sure the
+ * passcode wasn't used and the state wasn't disabled or given a new
+ * key in the meantime and store counter following it.
+ * Returns 0 on success, 3 if passcode doesn't match.
+ */
+extern int ppp_window_authenticate(state *s, const char *passcode,
+                                   unsigned int window);
+
 
 /** Lock & Read
- * If zero = 0 then increment failure and recent_failures count.
+ * If zero = 0 then increment failure and recent_failures count
+ * and move counter past the passcode of 's' if it's still current.
  * If zero = 1 then clear recent_failures.
  * Store & unlock
  * Does not modify passed state structure.
@@ -158,6 +195,13 @@ extern int ppp_oob_time(const state *s);
  */
 extern int ppp_get_passcode(const state *s, const num_t counter, char *passcode);
 
+/** Calculate 'count' consecutive passcodes starting with counter.
+ * Counters are encrypted in batches and then converted into
+ * alphabet. i-th passcode is stored at passcodes + i * 17.
+ */
+extern int ppp_get_passcodes(const state *s, const num_t counter,
+                             unsigned int count, char *passcodes);
+
 /** Return current passcode. Helper for ppp_get_passcode function. */
 extern int ppp_get_current(const state *s, char *passcode);
 
@@ -230,6 +274,14 @@ extern int ppp_verify_flags(int flags);
 /** Verify all parts of user state */
 extern int ppp_state_verify(const state *s);
 
+/** Write state as a single line of the text database */
+extern int ppp_state_export(const state *s, char *entry, int size);
+
+/** Replace state data with an entry exported for the same user.
+ * With PPP_CHECK_POLICY imported state must conform to the policy.
+ * State is stored without lock like a freshly generated one. */
+extern int ppp_state_import(state *s, const char *entry, size_t length, int flags);
+
 
 /*******************************************
  * State Getters / Setters
@@ -25,7 +25,12 @@
 #define STATE_LABEL_SIZE 30
 #define STATE_CONTACT_SIZE 60
 #define STATE_SPASS_SIZE 40 /* Hexadecimal SHA256 (64 bytes) of static password + SALT (16) */
-#define STATE_MAX_FIELD_SIZE 80
+#define STATE_MAX_FIELD_SIZE 83 /* Tagged spass */
+
+/* Static password formats (spass_set) */
+#define STATE_SPASS_UNSET 0
+#define STATE_SPASS_SHA256 1 /* 8 bytes of salt + salted SHA256 */
+#define STATE_SPASS_KDF 2    /* Tagged hash of crypto_kdf_hash */
 #define STATE_ENTRY_SIZE 512 /* Maximal size of a valid state entry (single line)
 			      * 32 (username) + 64 (key) + 32 (counter) + 60 (contact)
 			      * + 64 (static) + 32 latest + 20 (failures + recent failures) +
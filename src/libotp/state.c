@@ -29,6 +29,7 @@
 
 /* Low-level interface */
 #include "db.h"
+#include "trace.h"
 
 /********************************************
  * Helper functions for managing state files
@@ -92,9 +93,13 @@ int state_init(state *s, const char *username)
 	s->channel_time = 0;
 	s->lock = -1;
 	s->new_key = 0;
+	s->wal_base = 0;
 
 	s->prompt = NULL;
 
+	/* Without it passcodes are still generated, only slower */
+	s->aes_key = crypto_aes_key_new();
+
 	memset(s->sequence_key, 0, sizeof(s->sequence_key));
 	memset(s->label, 0, sizeof(s->label));
 	memset(s->contact, 0, sizeof(s->contact));
@@ -154,6 +159,9 @@ void state_fini(state *s)
 	}
 	free(s->username);
 
+	/* Wipes expanded key */
+	crypto_aes_key_free(s->aes_key);
+
 	/* Clear the rest of memory, this includes sequence_key */
 	memset(s, 0, sizeof(*s));
 }
@@ -220,23 +228,35 @@ int state_key_generate(state *s)
 int state_lock(state *s)
 {
 	cfg_t *cfg = cfg_get();
+	int ret;
 
+	trace_enter(TRACE_LOCK);
 	switch (cfg->db) {
 	case CONFIG_DB_USER:
 	case CONFIG_DB_GLOBAL:
-		return db_file_lock(s);
+		if (cfg->db_format == CONFIG_DB_FORMAT_INDEXED)
+			ret = db_index_lock(s);
+		else
+			ret = db_file_lock(s);
+		break;
 
 /*
 	case CONFIG_DB_MYSQL:
-		return db_mysql_lock(s);
+		ret = db_mysql_lock(s);
+		break;
 
 	case CONFIG_DB_LDAP:
-		return db_ldap_lock(s);
+		ret = db_ldap_lock(s);
+		break;
 */
 	default:
 		assert(0);
-		return 1;
+		ret = 1;
+		break;
 	}
+	trace_leave(TRACE_LOCK);
+
+	return ret;
 }
 
 int state_unlock(state *s)
@@ -245,6 +265,8 @@ int state_unlock(state *s)
 	switch (cfg->db) {
 	case CONFIG_DB_USER:
 	case CONFIG_DB_GLOBAL:
+		if (cfg->db_format == CONFIG_DB_FORMAT_INDEXED)
+			return db_index_unlock(s);
 		return db_file_unlock(s);
 
 /*
@@ -263,19 +285,49 @@ int state_unlock(state *s)
 int state_load(state *s)
 {
 	cfg_t *cfg = cfg_get();
+	int ret;
 
+	trace_enter(TRACE_LOAD);
 	switch (cfg->db) {
 	case CONFIG_DB_USER:
 	case CONFIG_DB_GLOBAL:
-		return db_file_load(s);
+		if (cfg->db_format == CONFIG_DB_FORMAT_INDEXED)
+			ret = db_index_load(s);
+		else
+			ret = db_file_load(s);
+		break;
 
 /*
 	case CONFIG_DB_MYSQL:
-		return db_mysql_load(s);
+		ret = db_mysql_load(s);
+		break;
 
 	case CONFIG_DB_LDAP:
-		return db_ldap_load(s);
+		ret = db_ldap_load(s);
+		break;
 */
+	default:
+		assert(0);
+		ret = 1;
+		break;
+	}
+	trace_leave(TRACE_LOAD);
+
+	return ret;
+}
+
+
+int state_peek(state *s)
+{
+	cfg_t *cfg = cfg_get();
+
+	switch (cfg->db) {
+	case CONFIG_DB_USER:
+	case CONFIG_DB_GLOBAL:
+		if (cfg->db_format == CONFIG_DB_FORMAT_INDEXED)
+			return db_index_peek(s);
+		return db_file_peek(s);
+
 	default:
 		assert(0);
 		return 1;
@@ -314,10 +366,14 @@ int state_store(state *s, int remove)
 
 	s->new_key = 0;
 
+	trace_enter(TRACE_STORE);
 	switch (cfg->db) {
 	case CONFIG_DB_USER:
 	case CONFIG_DB_GLOBAL:
-		ret = db_file_store(s, remove);
+		if (cfg->db_format == CONFIG_DB_FORMAT_INDEXED)
+			ret = db_index_store(s, remove);
+		else
+			ret = db_file_store(s, remove);
 		break;
 
 /*
@@ -334,6 +390,7 @@ int state_store(state *s, int remove)
 		ret = 1;
 		break;
 	}
+	trace_leave(TRACE_STORE);
 
 	if (locked) {
 		/* Unlock recently locked state */
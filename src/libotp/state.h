@@ -58,7 +58,7 @@ typedef struct {
 
 	/** Static password (spass) */
 	unsigned char spass[STATE_SPASS_SIZE];
-	int spass_set; /* Bool: 0 - not set, 1 - set */
+	int spass_set; /* Format: STATE_SPASS_UNSET, _SHA256 or _KDF */
 
 	/** Timestamp of the last change of static password */
 	state_time_t spass_time;
@@ -82,6 +82,10 @@ typedef struct {
 	/*** Temporary / not-saved data ***/
 	char *prompt; /**< Keep it here so we can safely dispose of it */
 
+	/** Expanded sequence_key reused by ppp_get_passcode. Rebuilt
+	 * when sequence_key changes; might be NULL. */
+	struct crypto_aes_key *aes_key;
+
 	/** Salt helpers. Initialized in state_init.
 	 * counter & salt_mask = salt
 	 * counter & code_mask = user passcode number
@@ -119,6 +123,11 @@ typedef struct {
 	 * entry without previously locking it before reading as the counter 
 	 * value will be overwritten nevertheless. */
 	int new_key;
+
+	/** Checksum of fields which can't be updated through write-ahead
+	 * log of text database (db_wal_base), taken when the state was
+	 * read. 0 if it wasn't read from text database. */
+	unsigned int wal_base;
 } state;
 
 
@@ -152,6 +161,10 @@ extern int state_unlock(state *s);
 /** Load/Store state from/to file database. */
 extern int state_load(state *s);
 
+/** Load state without locking. Result is a consistent
+ * snapshot, but musn't be stored back. */
+extern int state_peek(state *s);
+
 /** If remove == 1, remove user state */
 extern int state_store(state *s, int remove);
 
@@ -0,0 +1,158 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "trace.h"
+#include "print.h"
+#include "state.h"
+#include "db.h"
+
+/* Names used in trace line */
+static const char *_trace_names[TRACE_PHASES] = {
+	"config", "passwd", "lock", "load", "store", "sync",
+	"increment", "passcode", "prompt", "oob",
+};
+
+static struct {
+	int active;
+	unsigned long long started;
+
+	/* Nesting level of a phase; only the outermost one is timed */
+	int depth[TRACE_PHASES];
+	unsigned long long entered[TRACE_PHASES];
+	unsigned long long spent[TRACE_PHASES];
+	unsigned int count[TRACE_PHASES];
+
+	/* Lock and flush counters of the process when the trace started */
+	db_lock_stats lock;
+	db_sync_stats sync;
+} _trace;
+
+/* Microseconds since some unspecified point */
+static unsigned long long _trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void trace_start(void)
+{
+	memset(&_trace, 0, sizeof(_trace));
+	_trace.active = 1;
+	_trace.started = _trace_now();
+	_trace.lock = *db_file_lock_stats();
+	_trace.sync = *db_file_sync_stats();
+}
+
+void trace_enter(int phase)
+{
+	if (!_trace.active)
+		return;
+
+	if (_trace.depth[phase]++ == 0)
+		_trace.entered[phase] = _trace_now();
+}
+
+void trace_leave(int phase)
+{
+	if (!_trace.active || _trace.depth[phase] == 0)
+		return;
+
+	if (--_trace.depth[phase] == 0) {
+		_trace.spent[phase] += _trace_now() - _trace.entered[phase];
+		_trace.count[phase]++;
+	}
+}
+
+unsigned long long trace_spent(int phase)
+{
+	return _trace.spent[phase];
+}
+
+int trace_finish(const char *path, const char *username, int result)
+{
+	char line[1024];
+	char user[64];
+	const db_lock_stats *lock = db_file_lock_stats();
+	const db_sync_stats *sync = db_file_sync_stats();
+	int len, i, fd;
+	ssize_t written;
+
+	if (!_trace.active)
+		return 1;
+	_trace.active = 0;
+
+	if (!path || !*path)
+		return 0;
+
+	/* Keep the line parsable whatever the username is */
+	for (i = 0; username && username[i] && i < (int) sizeof(user) - 1; i++) {
+		const char c = username[i];
+		user[i] = (c <= ' ' || c == '=' || c > '~') ? '?' : c;
+	}
+	user[i] = '\0';
+
+	len = snprintf(line, sizeof(line), "trace=1 user=%s result=%d total=%llu",
+	               user, result, _trace_now() - _trace.started);
+	for (i = 0; i < TRACE_PHASES; i++) {
+		if (_trace.count[i] == 0)
+			continue;
+		len += snprintf(line + len, sizeof(line) - len, " %s=%llu/%u",
+		                _trace_names[i], _trace.spent[i], _trace.count[i]);
+	}
+
+	/* Locks held by someone else during this authentication */
+	if (lock->waits != _trace.lock.waits)
+		len += snprintf(line + len, sizeof(line) - len, " lock_wait=%llu/%lu",
+		                lock->wait_us - _trace.lock.wait_us,
+		                lock->waits - _trace.lock.waits);
+	if (lock->timeouts != _trace.lock.timeouts)
+		len += snprintf(line + len, sizeof(line) - len, " lock_timeouts=%lu",
+		                lock->timeouts - _trace.lock.timeouts);
+
+	/* What the sync phase flushed */
+	if (sync->syncs != _trace.sync.syncs || sync->dir_syncs != _trace.sync.dir_syncs)
+		len += snprintf(line + len, sizeof(line) - len, " sync_files=%lu sync_dirs=%lu",
+		                sync->syncs - _trace.sync.syncs,
+		                sync->dir_syncs - _trace.sync.dir_syncs);
+	len += snprintf(line + len, sizeof(line) - len, "\n");
+
+	/* Single write of a short line with O_APPEND doesn't interleave
+	 * with lines of concurrent logins */
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		print_perror(PRINT_WARN, "Unable to open trace file %s", path);
+		return 2;
+	}
+
+	written = write(fd, line, len);
+	close(fd);
+	if (written != len) {
+		print_perror(PRINT_WARN, "Unable to write trace file %s", path);
+		return 2;
+	}
+	return 0;
+}
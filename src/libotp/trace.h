@@ -0,0 +1,72 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Per-authentication timing of login phases. Time spent in each
+ *   phase is summed up and written as a single line when the
+ *   authentication finishes.
+ **********************************************************************/
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/** Traced phases. Phases might nest (e.g. store contains sync) */
+enum TRACE_PHASE {
+	/** Reading the config file */
+	TRACE_CONFIG = 0,
+	/** Looking up user home (getpwnam) */
+	TRACE_PASSWD,
+	/** Waiting for and getting a database lock */
+	TRACE_LOCK,
+	/** Reading state from database */
+	TRACE_LOAD,
+	/** Writing state into database */
+	TRACE_STORE,
+	/** Flushing written files to disk */
+	TRACE_SYNC,
+	/** Lock, load, increment and store of ppp_increment */
+	TRACE_INCREMENT,
+	/** Computing passcodes (AES) */
+	TRACE_PASSCODE,
+	/** Waiting for user to answer a prompt */
+	TRACE_PROMPT,
+	/** Sending out-of-band passcode */
+	TRACE_OOB,
+
+	TRACE_PHASES
+};
+
+/** Start timing a new authentication. Phases entered while no trace
+ * is started are not recorded. */
+extern void trace_start(void);
+
+/** Mark beginning and end of a phase */
+extern void trace_enter(int phase);
+extern void trace_leave(int phase);
+
+/** Time in microseconds spent in a phase of current trace */
+extern unsigned long long trace_spent(int phase);
+
+/** Stop the trace and append its line to the file at path. Nothing is
+ * written when path is empty. Returns 0 on success. Line format:
+ * trace=1 user=NAME result=N total=US PHASE=US/COUNT ...
+ * followed by lock_wait=US/COUNT and lock_timeouts=COUNT when a lock
+ * held by someone else had to be waited for and sync_files=COUNT
+ * sync_dirs=COUNT when anything was flushed. */
+extern int trace_finish(const char *path, const char *username, int result);
+
+#endif
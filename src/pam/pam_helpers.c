@@ -48,6 +48,7 @@
 
 /* libotp interface */
 #include "ppp.h"
+#include "trace.h"
 
 int ph_parse_module_options(int flags, int argc, const char **argv)
 {
@@ -73,6 +74,10 @@ int ph_parse_module_options(int flags, int argc, const char **argv)
 		print(PRINT_NOTICE, "pam_otpasswd silenced by PAM flag\n");
 	}
 
+	/* SIGALRM used by blocking lock waits might be delivered to
+	 * another thread of the program which loaded us */
+	cfg->lock_wait = CONFIG_LOCK_WAIT_RETRY;
+
 
 	return 0;
 }
@@ -184,10 +189,12 @@ int ph_oob_send(pam_handle_t *pamh, state *s, const char *username)
 	/* Copy, as releasing state will remove this data from RAM */
 	strncpy(contact, c, sizeof(contact)-1);
 
+	trace_enter(TRACE_OOB);
 	new_pid = fork();
 	if (new_pid == -1) {
 		print(PRINT_ERROR, 
 			    "unable to fork and call OOB utility\n");
+		trace_leave(TRACE_OOB);
 		return 1;
 	}
 
@@ -239,12 +246,14 @@ int ph_oob_send(pam_handle_t *pamh, state *s, const char *username)
 			break; /* Our child finished */
 		if (retval == -1) {
 			print_perror(PRINT_ERROR, "waitpid failed");
+			trace_leave(TRACE_OOB);
 			return 1;
 		}
 		if (retval == 0) {
 			continue;
 		}
 	}
+	trace_leave(TRACE_OOB);
 	if (times != 200) 
 		print(PRINT_NOTICE,  "Waited 7000*%d microseconds for OOB\n", 200-times);
 
@@ -344,7 +353,8 @@ void ph_show_message(pam_handle_t *pamh, const char *msg, const char *username)
 		ph_drop_response(resp);
 }
 
-int ph_increment(pam_handle_t *pamh, const char *username, state *s)
+/* Convert result of state loading into PAM error informing user if required */
+static int _ph_load_error(pam_handle_t *pamh, const char *username, int ret)
 {
 	const char *enforced_msg = "OTP: Key not generated, unable to login.";
 	const char *lock_msg = "OTP: Unable to lock state file.";
@@ -364,7 +374,7 @@ int ph_increment(pam_handle_t *pamh, const char *username, state *s)
 	const cfg_t *cfg = cfg_get();
 	assert(cfg != NULL);
 
-	switch (ppp_increment(s)) {
+	switch (ret) {
 	case 0:
 		/* Everything fine */
 		return 0;
@@ -443,6 +453,16 @@ enforced_fail:
 	return PAM_AUTH_ERR;
 }
 
+int ph_increment(pam_handle_t *pamh, const char *username, state *s)
+{
+	return _ph_load_error(pamh, username, ppp_increment(s));
+}
+
+int ph_window_load(pam_handle_t *pamh, const char *username, state *s)
+{
+	return _ph_load_error(pamh, username, ppp_window_load(s));
+}
+
 struct pam_response *ph_query_user(
 	pam_handle_t *pamh, int show, const char *prompt)
 {
@@ -468,8 +488,10 @@ struct pam_response *ph_query_user(
 
 	message.msg = prompt;
 
+	trace_enter(TRACE_PROMPT);
 	conversation->conv(1, (const struct pam_message **)&pmessage,
 			   &resp, conversation->appdata_ptr);
+	trace_leave(TRACE_PROMPT);
 
 	return resp;
 }
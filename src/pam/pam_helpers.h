@@ -42,6 +42,10 @@ extern void ph_show_message(pam_handle_t *pamh,
 extern int ph_increment(pam_handle_t *pamh,
                         const char *username, state *s);
 
+/* Load state for look-ahead window authentication; handle errors like ph_increment */
+extern int ph_window_load(pam_handle_t *pamh,
+                          const char *username, state *s);
+
 /* Function which automates a bit talking with a user */
 extern struct pam_response *ph_query_user(
 	pam_handle_t *pamh, int show, const char *prompt);
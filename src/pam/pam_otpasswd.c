@@ -27,6 +27,7 @@
 
 /* libotp interface */
 #include "ppp.h"
+#include "trace.h"
 
 /* PAM declarations */
 #include <pam_modules.h>
@@ -68,6 +69,9 @@ PAM_EXTERN int pam_sm_authenticate(
 	int dont_increment = 0; /* Do not increment if previous prompt was for OOB */
 	int tries;
 
+	/* Time phases of this authentication */
+	trace_start();
+
 	/* Perform initialization:
 	 * parse options, start logging, initialize state,
 	 */
@@ -94,7 +98,8 @@ PAM_EXTERN int pam_sm_authenticate(
 
 		if (ph_validate_spass(pamh, loaded ? s : NULL, username) != 0) {
 			sleep(spass_delay);
-			return PAM_AUTH_ERR;
+			retval = PAM_AUTH_ERR;
+			goto cleanup;
 		}
 	}
 
@@ -108,7 +113,11 @@ PAM_EXTERN int pam_sm_authenticate(
 			if (dont_increment) 
 				dont_increment = 0;
 			else {
-				retval = ph_increment(pamh, username, s);
+				/* With look-ahead window nothing is reserved */
+				if (cfg->pam_window)
+					retval = ph_window_load(pamh, username, s);
+				else
+					retval = ph_increment(pamh, username, s);
 				if (retval != 0)
 					goto cleanup;
 
@@ -198,7 +207,12 @@ PAM_EXTERN int pam_sm_authenticate(
 		/* Count this try */
 		tries++;
 
-		if (ppp_authenticate(s, resp[0].resp) == 0) {
+		if (cfg->pam_window)
+			retval = ppp_window_authenticate(s, resp[0].resp, cfg->pam_window);
+		else
+			retval = ppp_authenticate(s, resp[0].resp);
+
+		if (retval == 0) {
 			/* Authenticated */
 			ph_drop_response(resp);
 
@@ -228,6 +242,7 @@ PAM_EXTERN int pam_sm_authenticate(
 	}
 
 cleanup:
+	(void) trace_finish(cfg->trace_file, username, retval);
 	ph_fini(s);
 	return retval;
 }
@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h> /* getuid */
 
 #include <assert.h>
 
@@ -786,3 +787,83 @@ int action_skip(const options_t *options, agent *a)
 }
 
 
+
+/* Administrator without --user transfers whole database */
+static int _transfer_all(const options_t *options)
+{
+	return getuid() == 0 && options->username == NULL;
+}
+
+int action_export(const options_t *options, agent *a)
+{
+	const int all = _transfer_all(options);
+	unsigned long entries;
+	int ret;
+
+	/* Standard output holds exported data */
+	if (!all && options->user_has_state == 0) {
+		fprintf(stderr, _("You've got no state to export.\n"));
+		return 1;
+	}
+
+	ret = agent_state_export(a, all, stdout, &entries);
+	if (fflush(stdout) != 0 && ret == 0)
+		ret = 1;
+
+	switch (ret) {
+	case 0:
+		if (all)
+			fprintf(stderr, _("Exported %lu states.\n"), entries);
+		break;
+
+	case AGENT_ERR_POLICY:
+		fprintf(stderr, _("State export denied by the policy.\n"));
+		break;
+
+	default:
+		fprintf(stderr, _("Error while exporting state: %s\n"),
+		        agent_strerror(ret));
+		break;
+	}
+	return ret;
+}
+
+int action_import(const options_t *options, agent *a)
+{
+	const int all = _transfer_all(options);
+	unsigned long entries;
+	int ret;
+
+	/* State is imported in place of the loaded one */
+	if (options->user_has_state) {
+		ret = agent_state_drop(a);
+		if (ret != 0) {
+			printf(_("Error while dropping state! %s (%d)\n"),
+			       agent_strerror(ret), ret);
+			return ret;
+		}
+	}
+
+	ret = agent_state_import(a, all, stdin, &entries);
+
+	switch (ret) {
+	case 0:
+		if (all)
+			printf(_("Imported %lu states.\n"), entries);
+		else
+			printf(_("State imported.\n"));
+		break;
+
+	case AGENT_ERR_POLICY:
+	case PPP_ERROR_POLICY:
+	case AGENT_ERR_POLICY_REGENERATION:
+		printf(_("State import denied by the policy.\n"));
+		break;
+
+	default:
+		printf(_("Error while importing state: %s\n"),
+		       agent_strerror(ret));
+		break;
+	}
+	return ret;
+}
@@ -42,6 +42,8 @@ enum {
 	OPTION_INFO_KEY = 'I',
 	OPTION_CONFIG   = 'c',
 	OPTION_SPASS    = 'p',
+	OPTION_EXPORT   = 'E',
+	OPTION_IMPORT   = 'M',
 	OPTION_USER     = 'u',
 	OPTION_VERBOSE  = 'v',
 	OPTION_CHECK    = 'x',
@@ -105,4 +107,10 @@ extern int action_skip(const options_t *options, agent *a);
 /** Display any state related warnings */
 extern int action_warnings(const options_t *options, agent *a);
 
+/** Writes state, or as administrator whole database, to stdout (--export) */
+extern int action_export(const options_t *options, agent *a);
+
+/** Reads state written by --export from stdin (--import) */
+extern int action_import(const options_t *options, agent *a);
+
 #endif
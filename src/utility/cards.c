@@ -53,6 +53,7 @@ char *card_ascii(agent *a, const num_t passcard)
 
 	num_t tmp = num_i(0);
 	char *whole_card = NULL;
+	char *passcodes = NULL;
 	num_t code_num;
 
 	/* Get code length */
@@ -154,29 +155,37 @@ char *card_ascii(agent *a, const num_t passcard)
 	card -= whitespace - 1;
 	*(card-1) = '\n';
 
-	/* Passcodes */
+	/* Passcodes; all codes of a card are read with a single request */
 	code_num = num_sub_i(passcard, 1);
 	code_num = num_mul_i(code_num, codes_on_card);
 
+	passcodes = malloc(codes_on_card * 17);
+	if (passcodes == NULL) {
+		printf(_("You've run out of memory. Unable to print passcards\n"));
+		goto error;
+	}
+
+	ret = agent_get_passcodes(a, code_num, codes_on_card, passcodes);
+	switch (ret) {
+	case AGENT_ERR_POLICY:
+		printf(_("Passcode printing is denied by policy.\n"));
+		goto error;
+	default:
+		print(PRINT_ERROR, _("Unable to read passcode: %s\n"), 
+		      agent_strerror(ret));
+		goto error;
+
+	case 0:
+		break;
+	}
+
 	for (i = 1; i < 1 + ROWS_PER_CARD; i++) {
 		int y;
 		sprintf(card, "%2d: ", i);
 		card += 4;
 		for (y=0; y < codes_in_row; y++) {
-			char passcode[17];
-			ret = agent_get_passcode(a, code_num, passcode);
-			switch (ret) {
-			case AGENT_ERR_POLICY:
-				printf(_("Passcode printing is denied by policy.\n"));
-				goto error;
-			default:
-				print(PRINT_ERROR, _("Unable to read passcode: %s\n"), 
-				      agent_strerror(ret));
-				goto error;
-
-			case 0:
-				break;
-			}
+			const char *passcode =
+				passcodes + ((i - 1) * codes_in_row + y) * 17;
 
 			memcpy(card, passcode, code_length);
 			if (y + 1 != codes_in_row) {
@@ -186,17 +195,20 @@ char *card_ascii(agent *a, const num_t passcard)
 				*card = '\n';
 				card++;
 			}
-			code_num = num_add_i(code_num, 1);
 		}
 	}
 	num_clear(code_num);
 
+	memset(passcodes, 0, codes_on_card * 17);
+	free(passcodes);
 	free(label);
 
 	whole_card[size-1] = '\0';
 	return whole_card;
 
 error:
+	if (passcodes)
+		free(passcodes);
 	if (label)
 		free(label);
 	if (whole_card)
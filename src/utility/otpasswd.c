@@ -178,6 +178,13 @@ static void _show_usage(int argc, const char **argv)
 		"\n"
 		"  -p, --password\n"
 		"           Set static password. (optionally: --password=<pass>)\n"
+		"      --export\n"
+		"           Write your state to standard output. Warning: This will\n"
+		"           print private data. Administrator without --user exports\n"
+		"           states of all users of the global database.\n"
+		"      --import\n"
+		"           Replace your state with one read from standard input.\n"
+		"           Administrator without --user replaces whole global database.\n"
 		"  -u, --user <username|UID>\n"
 		"           Operate on state of specified user. Administrator-only option.\n"
 		"  -v, --verbose\n"
@@ -317,6 +324,8 @@ int process_cmd_line(int argc, char **argv, options_t *options)
 		{"info-key",		no_argument,		0, OPTION_INFO_KEY},
 		{"config",		required_argument,	0, OPTION_CONFIG},
 		{"password",		optional_argument,	0, OPTION_SPASS},
+		{"export",		no_argument,		0, OPTION_EXPORT},
+		{"import",		no_argument,		0, OPTION_IMPORT},
 		{"user",		required_argument,	0, OPTION_USER},
 		{"verbose",		no_argument,		0, OPTION_VERBOSE},
 		{"check",		no_argument,		0, OPTION_CHECK},
@@ -363,6 +372,8 @@ int process_cmd_line(int argc, char **argv, options_t *options)
 		case OPTION_HELP:
 		case OPTION_INFO:
 		case OPTION_INFO_KEY:
+		case OPTION_EXPORT:
+		case OPTION_IMPORT:
 		case OPTION_SPASS:
 			/* Error unless there was flag defined for key generation */
 			if (options->action != 0 &&
@@ -492,6 +503,10 @@ static int perform_action(int argc, char **argv, options_t *options)
 		break; 
 	}
 
+	/* Exported state is written to stdout */
+	if (options->action == OPTION_EXPORT)
+		print_config(PRINT_STDOUT | PRINT_NONE);
+
 	/* Perform pre-action preparations (set user, check state existance) */
 	if (options->action != 0 && options->action != OPTION_HELP) {
 		retval = action_init(options, &a);
@@ -551,6 +566,14 @@ static int perform_action(int argc, char **argv, options_t *options)
 		retval = action_warnings(options, a);
 		break;
 
+	case OPTION_EXPORT:
+		retval = action_export(options, a);
+		break;
+
+	case OPTION_IMPORT:
+		retval = action_import(options, a);
+		break;
+
 	case OPTION_TEXT:
 	case OPTION_LATEX:
 	case OPTION_PROMPT:
@@ -6,9 +6,9 @@ INCLUDES="-Ilibotp -Icommon -Icrypto -Iagent -I/usr/include/security"
 SILENCE_ON_STRONG='-unqualifiedtrans -formatconst -nullpass -usereleased -compdef -mustfreefresh -predboolint -boolops'
 CHECKING="$SILENCE_ON_STRONG -fcnuse  +ignorequals -initallelements -unrecog -globs +posixlib +skip-posix-headers"
 
-AGENT="agent/agent.c agent/agent_private.c agent/security.c agent/agent_interface.c agent/request.c"
+AGENT="agent/agent.c agent/agent_private.c agent/security.c agent/agent_interface.c agent/request.c agent/daemon.c"
 PAM="pam/pam_helpers.c pam/pam_otpasswd.c"
-LIBOTP="libotp/config.c libotp/db_file.c libotp/db_ldap.c libotp/db_mysql.c libotp/ppp.c libotp/state.c"
+LIBOTP="libotp/config.c libotp/db_file.c libotp/db_index.c libotp/db_ldap.c libotp/db_mysql.c libotp/ppp.c libotp/state.c"
 UTILITY="utility/actions_helpers.c utility/actions.c utility/cards.c utility/otpasswd.c"
 COMMON=" common/crypto.c common/num.c common/print.c"
 